@@ -346,29 +346,32 @@ if (!defined $BaseName)
 
 my $FileName = $Step->FileName;
 my $TA = $VM->GetAgent();
-Debug(Elapsed($Start), " Sending '$StepDir/$FileName'\n");
-if (!$TA->SendFile("$StepDir/$FileName", "staging/patch.diff", 0))
-{
-  FatalTAError($TA, "Could not copy the patch to the VM");
-}
+Debug(Elapsed($Start), " Queuing '$StepDir/$FileName'\n");
 my $Script = "#!/bin/sh\n" .
              "rm -f Build.log\n" .
              "../bin/build/Build.pl patch.diff " . $Step->FileType .
              " $BaseName 32";
 $Script .= ",64"if ($Run64);
 $Script .= " >>Build.log 2>&1\n";
-Debug(Elapsed($Start), " Sending the script: [$Script]\n");
-if (!$TA->SendFileFromString($Script, "task", $TestAgent::SENDFILE_EXE))
+Debug(Elapsed($Start), " Queuing the script: [$Script]\n");
+# Do it all in one go, each operation coming with the message to use should
+# it fail
+my @Prologue = (
+  [["SendFile", "$StepDir/$FileName", "staging/patch.diff", 0],
+   "Could not copy the patch to the VM"],
+  [["SendFileFromString", $Script, "task", $TestAgent::SENDFILE_EXE],
+   "Could not send the build script to the VM"],
+  [["Run", ["./task"], 0], "Failed to start the build"],
+);
+Debug(Elapsed($Start), " Sending the files and starting the script\n");
+my @Results = $TA->Batch(map { $_->[0] } @Prologue);
+if (@Results < @Prologue or defined $Results[-1]->[1])
 {
-  FatalTAError($TA, "Could not send the build script to the VM");
-}
-
-Debug(Elapsed($Start), " Starting the script\n");
-my $Pid = $TA->Run(["./task"], 0);
-if (!$Pid)
-{
-  FatalTAError($TA, "Failed to start the build");
+  # Only blame an operation if it is the one that failed
+  my $Failed = @Results && defined $Results[-1]->[1];
+  FatalTAError($TA, $Failed ? $Prologue[$#Results]->[1] : "Batch failed");
 }
+my $Pid = $Results[-1]->[0];
 
 
 #
@@ -449,6 +452,8 @@ FatalTAError(undef, $TAError) if (defined $TAError);
 # Don't try copying the test executables if the build step failed
 if ($NewStatus eq "completed")
 {
+  # Retrieve them all in one go
+  my @Epilogue;
   foreach my $OtherStep (@{$Job->Steps->GetItems()})
   {
     next if ($OtherStep->No == $StepNo);
@@ -469,12 +474,22 @@ if ($NewStatus eq "completed")
     {
       $TestExecutable = "build-mingw$Bits/programs/$BaseName/tests/${BaseName}.exe_test.exe";
     }
-    Debug(Elapsed($Start), " Retrieving '$OtherFileName'\n");
-    if (!$TA->GetFile($TestExecutable, "$OtherStepDir/$OtherFileName"))
+    Debug(Elapsed($Start), " Queuing the retrieval of '$OtherFileName'\n");
+    push @Epilogue, [["GetFile", $TestExecutable, "$OtherStepDir/$OtherFileName"],
+                     $OtherFileName];
+  }
+  if (@Epilogue)
+  {
+    Debug(Elapsed($Start), " Retrieving the test executables\n");
+    my @Results = $TA->Batch(map { $_->[0] } @Epilogue);
+    if (@Results < @Epilogue or defined $Results[-1]->[1])
     {
-      FatalTAError($TA, "Could not retrieve '$OtherFileName'");
+      # Only blame a file if it is the one that failed
+      my $Failed = @Results && defined $Results[-1]->[1];
+      FatalTAError($TA, $Failed ? "Could not retrieve '$Epilogue[$#Results]->[1]'" :
+                                  "Could not retrieve the test executables");
     }
-    chmod 0664, "$OtherStepDir/$OtherFileName";
+    chmod 0664, map { $_->[0]->[2] } @Epilogue;
   }
 }
 $TA->Disconnect();
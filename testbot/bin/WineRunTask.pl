@@ -375,12 +375,12 @@ if ($FileType ne "exe32" && $FileType ne "exe64")
 {
   FatalError("Unexpected file type $FileType found\n");
 }
+# Send the files and start the test in one go, each operation coming with
+# the message to use should it fail
 my $FileName = $Step->FileName;
-Debug(Elapsed($Start), " Sending '$StepDir/$FileName'\n");
-if (!$TA->SendFile("$StepDir/$FileName", $FileName, 0))
-{
-  FatalTAError($TA, "Could not copy the test executable to the VM");
-}
+Debug(Elapsed($Start), " Queuing '$StepDir/$FileName'\n");
+my @Prologue = ([["SendFile", "$StepDir/$FileName", $FileName, 0],
+                 "Could not copy the test executable to the VM"]);
 
 my $Keepalive;
 my $Timeout = $Task->Timeout;
@@ -394,11 +394,9 @@ my $IsWineTest = 1;
 if ($Step->Type eq "single")
 {
   my $TestLauncher = "TestLauncher" . ($FileType eq "exe64" ? "64" : "32") . ".exe";
-  Debug(Elapsed($Start), " Sending 'latest/$TestLauncher'\n");
-  if (!$TA->SendFile("$DataDir/latest/$TestLauncher", $TestLauncher, 0))
-  {
-    FatalTAError($TA, "Could not copy TestLauncher to the VM");
-  }
+  Debug(Elapsed($Start), " Queuing 'latest/$TestLauncher'\n");
+  push @Prologue, [["SendFile", "$DataDir/latest/$TestLauncher", $TestLauncher, 0],
+                   "Could not copy TestLauncher to the VM"];
 
   $Script .= "$TestLauncher -t $Timeout $FileName ";
   # Add 1 second to the timeout so the client-side Wait() does not time out
@@ -449,23 +447,25 @@ elsif ($Step->Type eq "suite")
   $Script .= "-q -o $RptFileName -t $Tag -m \"$EMail\" -i \"$Info\"\r\n" .
              "$FileName -q -s $RptFileName\r\n";
 }
-Debug(Elapsed($Start), " Sending the script: [$Script]\n");
-if (!$TA->SendFileFromString($Script, "script.bat", $TestAgent::SENDFILE_EXE))
-{
-  FatalTAError($TA, "Could not send the script to the VM");
-}
+Debug(Elapsed($Start), " Queuing the script: [$Script]\n");
+push @Prologue, [["SendFileFromString", $Script, "script.bat", $TestAgent::SENDFILE_EXE],
+                 "Could not send the script to the VM"];
 
 
 #
 # Run the test
 #
 
-Debug(Elapsed($Start), " Starting the script\n");
-my $Pid = $TA->Run(["./script.bat"], 0);
-if (!$Pid)
+push @Prologue, [["Run", ["./script.bat"], 0], "Failed to start the test"];
+Debug(Elapsed($Start), " Sending the files and starting the script\n");
+my @Results = $TA->Batch(map { $_->[0] } @Prologue);
+if (@Results < @Prologue or defined $Results[-1]->[1])
 {
-  FatalTAError($TA, "Failed to start the test");
+  # Only blame an operation if it is the one that failed
+  my $Failed = @Results && defined $Results[-1]->[1];
+  FatalTAError($TA, $Failed ? $Prologue[$#Results]->[1] : "Batch failed");
 }
+my $Pid = $Results[-1]->[0];
 
 
 #
@@ -476,7 +476,8 @@ if (!$Pid)
 my $NewStatus = 'completed';
 my ($TaskFailures, $TaskTimedOut, $TAError, $PossibleCrash);
 Debug(Elapsed($Start), " Waiting for the script (", $Task->Timeout, "s timeout)\n");
-if (!defined $TA->Wait($Pid, $Timeout, $Keepalive))
+my %Usage;
+if (!defined $TA->Wait($Pid, $Timeout, $Keepalive, \%Usage))
 {
   my $ErrMessage = $TA->GetLastError();
   if ($ErrMessage =~ /timed out waiting for the child process/)
@@ -491,6 +492,10 @@ if (!defined $TA->Wait($Pid, $Timeout, $Keepalive))
     $TAError = "An error occurred while waiting for the test to complete: $ErrMessage";
   }
 }
+elsif (%Usage)
+{
+  Debug(Elapsed($Start), sprintf(" The script used %.1fs user %.1fs system, %d KiB, %d+%d I/O blocks, %.1fs\n", @Usage{qw(UserTime SysTime MaxRSS InBlocks OutBlocks WallTime)}));
+}
 
 Debug(Elapsed($Start), " Retrieving the report file to '$FullLogFileName'\n");
 if ($TA->GetFile($RptFileName, $FullLogFileName))
@@ -22,7 +22,13 @@
 package TestAgent;
 use strict;
 
-use vars qw (@ISA @EXPORT_OK $SENDFILE_EXE $RUN_DNT $RUN_DNTRUNC_OUT $RUN_DNTRUNC_ERR $RUN_DNTRUNC);
+use Socket qw(IPPROTO_TCP TCP_NODELAY);
+use Compress::Raw::Zlib qw(Z_OK Z_STREAM_END Z_BUF_ERROR);
+use Digest::SHA;
+use File::Path qw(make_path);
+use File::Temp;
+
+use vars qw (@ISA @EXPORT_OK $SENDFILE_EXE $RUN_DNT $RUN_DNTRUNC_OUT $RUN_DNTRUNC_ERR $RUN_DNTRUNC $RUN_STREAM);
 
 require Exporter;
 @ISA = qw(Exporter);
@@ -30,6 +36,15 @@ require Exporter;
 
 my $BLOCK_SIZE = 65536;
 
+# Don't bother compressing files smaller than this
+my $MIN_COMPRESS_SIZE = 512;
+
+# Only the files at least this big go through the server's file cache
+my $MIN_CACHE_SIZE = 65536;
+
+# Only try to send the differences for files at least this big
+my $MIN_DELTA_SIZE = 1048576;
+
 my $RPC_PING = 0;
 my $RPC_GETFILE = 1;
 my $RPC_SENDFILE = 2;
@@ -42,6 +57,15 @@ my $RPC_GETPROPERTIES = 8;
 my $RPC_UPGRADE = 9;
 my $RPC_RMCHILDPROC = 10;
 my $RPC_GETCWD = 11;
+my $RPC_BATCH = 12;
+my $RPC_HAVE = 13;
+my $RPC_MATCHBLOCKS = 14;
+my $RPC_GETOUTPUT = 15;
+my $RPC_SENDTREE = 16;
+my $RPC_GETTREE = 17;
+my $RPC_WAITMANY = 18;
+my $RPC_RUNBATCH = 19;
+my $RPC_GETSTATS = 20;
 
 my %RpcNames=(
     $RPC_PING => 'ping',
@@ -56,6 +80,15 @@ my %RpcNames=(
     $RPC_UPGRADE => 'upgrade',
     $RPC_RMCHILDPROC => 'rmchildproc',
     $RPC_GETCWD => 'getcwd',
+    $RPC_BATCH => 'batch',
+    $RPC_HAVE => 'have',
+    $RPC_MATCHBLOCKS => 'matchblocks',
+    $RPC_GETOUTPUT => 'getoutput',
+    $RPC_SENDTREE => 'sendtree',
+    $RPC_GETTREE => 'gettree',
+    $RPC_WAITMANY => 'waitmany',
+    $RPC_RUNBATCH => 'runbatch',
+    $RPC_GETSTATS => 'getstats',
 );
 
 my $Debug = 0;
@@ -107,6 +140,8 @@ sub new($$$;$)
     ctimeout   => 20,
     cattempts  => 3,
     timeout    => 0,
+    zlevel     => 1,
+    checksums  => 1,
     fd         => undef,
     deadline   => undef,
     err        => undef};
@@ -145,6 +180,8 @@ sub Disconnect($)
       $self->{fd} = undef;
   }
   $self->{agentversion} = undef;
+  # The server may not have the same files in its cache on reconnect
+  $self->{cached} = undef;
 }
 
 sub SetConnectTimeout($$;$)
@@ -172,6 +209,95 @@ sub SetTimeout($$)
   return $OldTimeout;
 }
 
+=pod
+=over 12
+
+=item C<SetCompression()>
+
+Sets the zlib compression level, from 1 to 9, to use for the file transfers
+if the server supports it. A level of 0 disables the compression. Returns
+the previous level.
+
+=back
+=cut
+
+sub SetCompression($$)
+{
+  my ($self, $Level) = @_;
+  my $OldLevel = $self->{zlevel};
+  $self->{zlevel} = $Level;
+  return $OldLevel;
+}
+
+=pod
+=over 12
+
+=item C<SetChecksums()>
+
+Enables or disables the CRC-32 checksums of the file transfers, which are
+used by default if the server supports them. They are computed as the data
+is sent or received, and a mismatch causes the transfer to fail. Returns the
+previous setting.
+
+=back
+=cut
+
+sub SetChecksums($$)
+{
+  my ($self, $Enable) = @_;
+  my $OldEnable = $self->{checksums};
+  $self->{checksums} = $Enable;
+  return $OldEnable;
+}
+
+sub _UseCompression($)
+{
+  my ($self) = @_;
+  # The 'z' entries were added in 1.9
+  return ($self->{zlevel} and $self->{agentversion} and
+          $self->{agentversion} !~ / 1\.[0-8]$/);
+}
+
+sub _UseChecksums($)
+{
+  my ($self) = @_;
+  # The transfer checksums were added in 1.19
+  return ($self->{checksums} and $self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[0-8])$/);
+}
+
+sub _UseCache($)
+{
+  my ($self) = @_;
+  # The file cache was added in 1.10
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.[0-9]$/);
+}
+
+# Returns the SHA-256 hash of the file if it should go through the server's
+# file cache, and undef otherwise.
+# The hashes are shared by all the TestAgent objects since the same files
+# typically get sent to many servers.
+my %FileHashes;
+sub _GetCacheHash($$)
+{
+  my ($self, $LocalPathName) = @_;
+
+  return undef if (!$self->_UseCache());
+  my ($Size, $MTime) = (stat($LocalPathName))[7, 9];
+  return undef if (!defined $Size or $Size < $MIN_CACHE_SIZE);
+
+  # Avoid hashing the same file over and over
+  my $Hash = $FileHashes{$LocalPathName};
+  if (!$Hash or $Hash->[0] != $Size or $Hash->[1] != $MTime)
+  {
+    my $Digest = Digest::SHA->new(256);
+    return undef if (!eval { $Digest->addfile($LocalPathName, "b"); 1 });
+    $Hash = $FileHashes{$LocalPathName} = [$Size, $MTime, $Digest->hexdigest()];
+  }
+  return $Hash->[2];
+}
+
 sub _SetAlarm($)
 {
   my ($self) = @_;
@@ -398,14 +524,17 @@ sub _RecvEntryHeader($)
   return ($Type, $High << 32 | $Low);
 }
 
+# $Types is the list of the acceptable entry types, typically just one.
+# In list context this also returns the actual entry type.
 sub _ExpectEntryHeader($$$;$)
 {
-  my ($self, $Name, $Type, $Size) = @_;
+  my ($self, $Name, $Types, $Size) = @_;
 
   my ($HType, $HSize) = $self->_RecvEntryHeader($Name);
   return undef if (!defined $HType);
-  if ($HType ne $Type)
+  if (index($Types, $HType) < 0)
   {
+    my $Type = join("/", split //, $Types);
     $self->_SetError($ERROR, "Expected $Name to be a $Type entry but got $HType instead");
   }
   elsif (defined $Size and $HSize != $Size)
@@ -414,7 +543,7 @@ sub _ExpectEntryHeader($$$;$)
   }
   else
   {
-    return $HSize;
+    return wantarray ? ($HSize, $HType) : $HSize;
   }
   if ($HType eq 'e')
   {
@@ -425,11 +554,28 @@ sub _ExpectEntryHeader($$$;$)
   }
   else
   {
-    $self->_SkipRawData($Name, $HSize);
+    $self->_SkipEntryData($Name, $HType, $HSize);
   }
   return undef;
 }
 
+# Skips the content of an entry whose header has already been received
+sub _SkipEntryData($$$$)
+{
+  my ($self, $Name, $Type, $Size) = @_;
+
+  return $self->_SkipRawData($Name, $Size) if ($Type ne 'z');
+
+  # The size of compressed entries is that of the uncompressed data
+  while (1)
+  {
+    my $ChunkSize = $self->_RecvRawUInt32("$Name.zsize");
+    return undef if (!defined $ChunkSize);
+    return 1 if (!$ChunkSize);
+    return undef if (!$self->_SkipRawData("$Name.z", $ChunkSize));
+  }
+}
+
 sub _ExpectEntry($$$$)
 {
   my ($self, $Name, $Type, $Size) = @_;
@@ -473,14 +619,16 @@ sub _RecvString($$;$)
   return $Str;
 }
 
-sub _RecvFile($$$$)
+# If $Crc is set, the CRC-32 of the data is computed in $$Crc as it arrives.
+sub _RecvFile($$$$;$)
 {
-  my ($self, $Name, $Dst, $Filename) = @_;
+  my ($self, $Name, $Dst, $Filename, $Crc) = @_;
   return undef if (!defined $self->{fd});
   debug("  RecvFile('$Name', '$Filename')\n");
 
-  my $Size = $self->_ExpectEntryHeader("$Name/Size", 'd');
+  my ($Size, $Type) = $self->_ExpectEntryHeader("$Name/Size", 'dz');
   return undef if (!defined $Size);
+  return $self->_RecvCompressedFile($Name, $Dst, $Filename, $Size, $Crc) if ($Type eq 'z');
 
   my $Success;
   my ($Start, $Pos, $Remaining) = (now(), 0, $Size);
@@ -507,6 +655,7 @@ sub _RecvFile($$$$)
         return; # out of eval
       }
       $Remaining -= $r;
+      $$Crc = Compress::Raw::Zlib::crc32($Buffer, $$Crc) if ($Crc);
       my $w = syswrite($Dst, $Buffer, $r, 0);
       $Pos += $w if (defined $w);
       if (!defined $w or $w != $r)
@@ -533,6 +682,91 @@ sub _RecvFile($$$$)
   return $Success;
 }
 
+sub _RecvCompressedFile($$$$$;$)
+{
+  my ($self, $Name, $Dst, $Filename, $Size, $Crc) = @_;
+
+  my ($Inflate, $Status) = Compress::Raw::Zlib::Inflate->new(-LimitOutput => 1);
+  my $Err = $Status == Z_OK ? undef : "could not initialize the decompression: $Status";
+  my ($Start, $Pos, $Wire) = (now(), 0, 0);
+  while (1)
+  {
+    my $ChunkSize = $self->_RecvRawUInt32("$Name.zsize");
+    return undef if (!defined $ChunkSize);
+    $Wire += 4 + $ChunkSize;
+    last if (!$ChunkSize);
+
+    my $Chunk = $self->_RecvRawData("$Name.z", $ChunkSize);
+    return undef if (!defined $Chunk);
+    # Keep going to the end of the entry even in case of error
+    next if (defined $Err);
+
+    # With LimitOutput inflate() may have to be called multiple times
+    # for each chunk
+    while (1)
+    {
+      my ($Data, $Left) = (undef, length($Chunk));
+      $Status = $Inflate->inflate($Chunk, $Data);
+      last if (!length($Data) and !length($Chunk));
+      if (($Status != Z_OK and $Status != Z_BUF_ERROR and
+           $Status != Z_STREAM_END) or
+          ($Status == Z_STREAM_END and length($Chunk)) or
+          (!length($Data) and length($Chunk) == $Left) or
+          $Pos + length($Data) > $Size)
+      {
+        $Err = "the compressed data for '$Filename' is corrupt ($self->{rpc}:$Name:$Pos/$Size): $Status";
+        last;
+      }
+      $$Crc = Compress::Raw::Zlib::crc32($Data, $$Crc) if ($Crc);
+      my $w = syswrite($Dst, $Data);
+      if (!defined $w or $w != length($Data))
+      {
+        $Err = "an error occurred while writing to '$Filename' ($self->{rpc}:$Name:$Pos/$Size): $!";
+        last;
+      }
+      $Pos += $w;
+      last if ($Status == Z_STREAM_END);
+    }
+  }
+  if (!defined $Err and ($Status != Z_STREAM_END or $Pos != $Size))
+  {
+    $Err = "the compressed data for '$Filename' is truncated ($self->{rpc}:$Name:$Pos/$Size)";
+  }
+  if (defined $Err)
+  {
+    $self->_SetError($ERROR, $Err);
+    return undef;
+  }
+
+  debug("  Received $Wire bytes on the wire\n");
+  trace_speed($Pos, now() - $Start);
+  return 1;
+}
+
+# Receives the file followed, if $Checksum is set, by its CRC-32 which is
+# checked against the one computed while receiving the data.
+sub _RecvCheckedFile($$$$$)
+{
+  my ($self, $Name, $Dst, $Filename, $Checksum) = @_;
+  return $self->_RecvFile($Name, $Dst, $Filename) if (!$Checksum);
+
+  my $Crc = 0;
+  if (!$self->_RecvFile($Name, $Dst, $Filename, \$Crc))
+  {
+    # The checksum is still sent unless the connection is lost
+    $self->_SkipEntries(1) if ($self->{fd});
+    return undef;
+  }
+  my $Expected = $self->_RecvUInt32("$Name.crc");
+  return undef if (!defined $Expected);
+  if ($Crc != $Expected)
+  {
+    $self->_SetError($ERROR, sprintf("the '%s' data is corrupt (got CRC-32 %08x instead of %08x)", $Filename, $Crc, $Expected));
+    return undef;
+  }
+  return 1;
+}
+
 sub _SkipEntries($$)
 {
   my ($self, $Count) = @_;
@@ -549,7 +783,7 @@ sub _SkipEntries($$)
       return undef if (!defined $Message);
       $self->_SetError($ERROR, $Message);
     }
-    elsif (!$self->_SkipRawData("Skip$i", $Size))
+    elsif (!$self->_SkipEntryData("Skip$i", $Type, $Size))
     {
       return undef;
     }
@@ -561,6 +795,9 @@ sub _RecvListSize($$)
 {
   my ($self, $Name) = @_;
 
+  # In batches each reply is a sublist preceded by its size
+  return $self->_RecvUInt32($Name) if ($self->{batch});
+
   my $Value = $self->_RecvRawUInt32($Name);
   debug("  RecvListSize('$Name') -> $Value\n") if (defined $Value);
   return $Value;
@@ -662,7 +899,7 @@ sub _RecvErrorList($)
     else
     {
       $self->_SetError($ERROR, "Expected an s, u or e entry but got $Type instead");
-      $self->_SkipRawData("Err$i.$Type", $Size);
+      $self->_SkipEntryData("Err$i.$Type", $Type, $Size);
       $self->_SkipEntries($Count);
       return $self->GetLastError();
     }
@@ -753,6 +990,9 @@ sub _SendListSize($$$)
 {
   my ($self, $Name, $Size) = @_;
 
+  # In batches each operation is a sublist preceded by its size
+  return $self->_SendUInt32($Name, $Size) if ($self->{batch});
+
   debug("  SendListSize('$Name', $Size)\n");
   return $self->_SendRawUInt32($Name, $Size);
 }
@@ -783,6 +1023,15 @@ sub _SendUInt64($$$)
          $self->_SendRawUInt64($Name, $Value);
 }
 
+sub _SendData($$$)
+{
+  my ($self, $Name, $Data) = @_;
+
+  debug("  SendData('$Name', ", length($Data), " bytes)\n");
+  return $self->_SendEntryHeader($Name, 'd', length($Data)) &&
+         $self->_SendRawData($Name, $Data);
+}
+
 sub _SendString($$$;$)
 {
   my ($self, $Name, $Str, $Type) = @_;
@@ -793,13 +1042,19 @@ sub _SendString($$$;$)
          $self->_SendRawData($Name, $Str);
 }
 
-sub _SendFile($$$$)
+# If $Crc is set, the CRC-32 of the data is computed in $$Crc as it is sent.
+sub _SendFile($$$$;$$)
 {
-  my ($self, $Name, $Src, $Filename) = @_;
+  my ($self, $Name, $Src, $Filename, $Size, $Crc) = @_;
   return undef if (!defined $self->{fd});
   debug("  SendFile('$Name', '$Filename')\n");
 
-  my $Size = -s $Filename;
+  # Send the rest of the file by default
+  $Size = -s $Filename if (!defined $Size);
+  if ($Size >= $MIN_COMPRESS_SIZE and $self->_UseCompression())
+  {
+    return $self->_SendCompressedFile($Name, $Src, $Filename, $Size, $Crc);
+  }
   return undef if (!$self->_SendEntryHeader("$Name/Size", 'd', $Size));
 
   my $Success;
@@ -827,6 +1082,7 @@ sub _SendFile($$$$)
         return; # out of eval
       }
       $Remaining -= $r;
+      $$Crc = Compress::Raw::Zlib::crc32($Buffer, $$Crc) if ($Crc);
       my $w = $self->_Write($Name, $Buffer);
       $Pos += $w if (defined $w);
       if (!defined $w or $w != $r)
@@ -853,6 +1109,78 @@ sub _SendFile($$$$)
   return $Success;
 }
 
+sub _SendCompressedFile($$$$$;$)
+{
+  my ($self, $Name, $Src, $Filename, $Size, $Crc) = @_;
+
+  my ($Deflate, $Status) = Compress::Raw::Zlib::Deflate->new(
+      -Level => $self->{zlevel}, -AppendOutput => 1);
+  if ($Status != Z_OK)
+  {
+    # The request cannot be completed anymore
+    $self->_SetError($FATAL, "could not initialize the compression: $Status");
+    return undef;
+  }
+  return undef if (!$self->_SendEntryHeader("$Name/Size", 'z', $Size));
+
+  my ($Start, $Pos, $Wire, $Remaining) = (now(), 0, 0, $Size);
+  my $ZData = "";
+  while (1)
+  {
+    my $Buffer;
+    my $s = $Remaining < $BLOCK_SIZE ? $Remaining : $BLOCK_SIZE;
+    my $r = $s ? sysread($Src, $Buffer, $s) : 0;
+    if (!defined $r)
+    {
+      $self->_SetError($FATAL, "an error occurred while reading from '$Filename' ($self->{rpc}:$Name:$Pos+$s/$Size): $!");
+      return undef;
+    }
+    if ($r == 0 and $Remaining)
+    {
+      $self->_SetError($FATAL, "got a premature EOF while reading from '$Filename' ($self->{rpc}:$Name:$Pos/$Size)");
+      return undef;
+    }
+    $Remaining -= $r;
+    $Pos += $r;
+    $$Crc = Compress::Raw::Zlib::crc32($Buffer, $$Crc) if ($Crc and $r);
+
+    $Status = $r ? $Deflate->deflate($Buffer, $ZData) : Z_OK;
+    $Status = $Deflate->flush($ZData) if ($Status == Z_OK and !$Remaining);
+    if ($Status != Z_OK)
+    {
+      $self->_SetError($FATAL, "could not compress '$Filename' ($self->{rpc}:$Name:$Pos/$Size): $Status");
+      return undef;
+    }
+
+    # Send the compressed data in big enough chunks, followed by the
+    # terminating empty chunk
+    if (length($ZData) >= $BLOCK_SIZE or !$Remaining)
+    {
+      my $Chunk = length($ZData) ? pack('N', length($ZData)) . $ZData : "";
+      $Chunk .= pack('N', 0) if (!$Remaining);
+      return undef if (!$self->_SendRawData($Name, $Chunk));
+      $Wire += length($Chunk);
+      $ZData = "";
+    }
+    last if (!$Remaining);
+  }
+
+  debug("  Sent $Wire bytes on the wire\n");
+  trace_speed($Pos, now() - $Start);
+  return 1;
+}
+
+# Sends the file followed, if $Checksum is set, by the CRC-32 of the data.
+sub _SendCheckedFile($$$$$;$)
+{
+  my ($self, $Name, $Src, $Filename, $Checksum, $Size) = @_;
+  return $self->_SendFile($Name, $Src, $Filename, $Size) if (!$Checksum);
+
+  my $Crc = 0;
+  return $self->_SendFile($Name, $Src, $Filename, $Size, \$Crc) &&
+         $self->_SendUInt32("$Name.crc", $Crc);
+}
+
 
 #
 # Connection management functions
@@ -910,6 +1238,8 @@ sub _Connect($)
         $self->_SetError($FATAL, $!);
         return; # out of eval
       }
+      # The RPCs are sent piecemeal so don't wait for the server's ACKs
+      $self->{fd}->setsockopt(IPPROTO_TCP, TCP_NODELAY, 1);
 
       if ($self->{tunnel})
       {
@@ -1036,6 +1366,13 @@ sub _StartRPC($$)
 {
   my ($self, $RpcId) = @_;
 
+  if ($self->{batch})
+  {
+    # The operation is just a parameter of the batch RPC
+    $self->{rpc} = $RpcNames{$RpcId} || $RpcId;
+    return $self->_SendUInt32('RpcId', $RpcId);
+  }
+
   # Set up the new RPC
   $self->{rpc} = $RpcNames{$RpcId} || $RpcId;
   $self->{err} = undef;
@@ -1044,6 +1381,13 @@ sub _StartRPC($$)
   $self->{deadline} = $self->{timeout} ? time() + $self->{timeout} : undef;
   if (!$self->_SendRawUInt32('RpcId.1', $RpcId))
   {
+    if ($self->_HasPipelinedReplies())
+    {
+      # Reconnecting would lose the replies of the pipelined RPCs
+      $self->_SetError($FATAL, "The connection was lost while pipelining RPCs");
+      return undef;
+    }
+
     # No dice, clean up whatever was left of the old connection
     $self->Disconnect();
 
@@ -1060,182 +1404,1626 @@ sub _StartRPC($$)
 
 
 #
-# Implement the high-level RPCs
+# RPC pipelining
 #
 
-sub Ping($)
-{
-  my ($self) = @_;
+=pod
+=over 12
 
-  # Send the RPC and get the reply
-  return $self->_StartRPC($RPC_PING) &&
-         $self->_SendListSize('ArgC', 0) &&
-         $self->_RecvList('');
-}
+=item C<StartPipeline()>
 
-sub GetVersion($)
+Starts sending the RPCs without waiting for their replies, thus saving one
+network round trip per RPC. The RPCs that can be pipelined are Ping(),
+SendFile(), SendFileFromString(), GetFile(), GetFileToString(), Run(), Rm(),
+SetTime(), GetProperties(), RemoveChildProcess() and GetCwd(). While the
+pipeline is active they only return whether the request could be sent, and
+Wait() and Upgrade() cannot be used.
+
+If the server does not support pipelining, the RPCs are performed right
+away but FinishPipeline() still returns their results.
+
+Note that the server stops reading new RPCs when too many replies are
+waiting to be collected, so the pipelines should remain reasonably short.
+
+=back
+=cut
+
+sub StartPipeline($)
 {
   my ($self) = @_;
+  debug("StartPipeline\n");
 
-  if (!$self->{agentversion})
-  {
-    # Retrieve the server version
-    $self->_Connect();
-  }
-  # And return the version we got.
-  # If the connection failed it will be undef as expected.
-  return $self->{agentversion};
+  # Make sure we have the server version
+  $self->_Connect() if (!$self->{agentversion});
+
+  # Up to 1.6 the server only reads the next RPC once the reply has been
+  # sent, which could deadlock.
+  my $Enabled = ($self->{agentversion} and
+                 $self->{agentversion} !~ / 1\.[0-6]$/);
+  $self->{pipeline} = { enabled => $Enabled, rpcs => [] };
+  return 1;
 }
 
-$SENDFILE_EXE = 1;
+=pod
+=over 12
 
-sub _SendStringOrFile($$$$$$)
-{
-  my ($self, $Data, $fh, $LocalPathName, $ServerPathName, $Flags) = @_;
+=item C<FinishPipeline()>
 
-  # Send the RPC and get the reply
-  return $self->_StartRPC($RPC_SENDFILE) &&
-         $self->_SendListSize('ArgC', 3) &&
-         $self->_SendString('ServerPathName', $ServerPathName) &&
-         $self->_SendUInt32('Flags', $Flags || 0) &&
-         ($fh ? $self->_SendFile('File', $fh, $LocalPathName) :
-                $self->_SendString('String', $Data, 'd')) &&
-         $self->_RecvList('');
-}
+Collects the replies of the RPCs sent since StartPipeline() and ends the
+pipeline. Returns a list containing a [Result, Error] array for each RPC,
+in the order they were issued, Result being what the method would have
+returned outside the pipeline and Error the corresponding GetLastError()
+message.
+
+=back
+=cut
 
-sub SendFile($$$;$)
+sub FinishPipeline($)
 {
-  my ($self, $LocalPathName, $ServerPathName, $Flags) = @_;
-  debug("SendFile '$LocalPathName' -> $self->{agenthost} '$ServerPathName' Flags=", $Flags || 0, "\n");
+  my ($self) = @_;
+  debug("FinishPipeline\n");
 
-  if (open(my $fh, "<", $LocalPathName))
+  my $Pipeline = $self->{pipeline};
+  return () if (!$Pipeline);
+  $self->{pipeline} = undef;
+
+  my @Results;
+  foreach my $Call (@{$Pipeline->{rpcs}})
   {
-    my $Success = $self->_SendStringOrFile(undef, $fh, $LocalPathName,
-                                           $ServerPathName, $Flags);
-    close($fh);
-    return $Success;
+    if ($Call->{reply})
+    {
+      $self->{rpc} = $Call->{rpc};
+      $self->{err} = $Call->{err};
+      $self->{deadline} = $self->{timeout} ? time() + $self->{timeout} : undef;
+      $Call->{result} = &{$Call->{reply}}($Call->{sent});
+      $Call->{err} = $self->{err};
+    }
+    push @Results, [$Call->{result}, $Call->{err}];
   }
-  $self->_SetError($ERROR, "Unable to open '$LocalPathName' for reading: $!");
-  return undef;
+  return @Results;
 }
 
-sub SendFileFromString($$$;$)
+sub _HasPipelinedReplies($)
 {
-  my ($self, $Data, $ServerPathName, $Flags) = @_;
-  debug("SendFile String -> $self->{agenthost} '$ServerPathName' Flags=", $Flags || 0, "\n");
-  return $self->_SendStringOrFile($Data, undef, undef, $ServerPathName, $Flags);
+  my ($self) = @_;
+  return $self->{pipeline} && grep { $_->{reply} } @{$self->{pipeline}->{rpcs}};
 }
 
-sub _GetStringOrFile($$$)
+sub _CheckNotPipelined($$)
 {
-  my ($self, $ServerPathName, $LocalPathName, $fh) = @_;
-
-  # Send the RPC and get the reply
-  return $self->_StartRPC($RPC_GETFILE) &&
-         $self->_SendListSize('ArgC', 1) &&
-         $self->_SendString('ServerPathName', $ServerPathName) &&
-         $self->_RecvList('.') &&
-         ($fh ? $self->_RecvFile('File', $fh, $LocalPathName) :
-                $self->_RecvString('String', 'd'));
+  my ($self, $Name) = @_;
+  return 1 if (!$self->{pipeline});
+  $self->{err} = undef;
+  $self->_SetError($ERROR, "$Name() cannot be pipelined");
+  return undef;
 }
 
-sub GetFile($$$)
+# Performs the RPC, or only sends the request while a pipeline or batch is
+# active. $Request sends the request and returns true if successful. $Reply
+# then receives the reply and returns the RPC result. It must also clean up
+# if the request could not be sent.
+sub _CallRPC($$$)
 {
-  my ($self, $ServerPathName, $LocalPathName) = @_;
-  debug("GetFile $self->{agenthost} '$ServerPathName' -> '$LocalPathName'\n");
+  my ($self, $Request, $Reply) = @_;
 
-  if (open(my $fh, ">", $LocalPathName))
+  my $Pipeline = $self->{pipeline};
+  my $Sent = &$Request();
+  if ($self->{batch})
   {
-    my $Success = $self->_GetStringOrFile($ServerPathName, $LocalPathName, $fh);
-    close($fh);
-    unlink $LocalPathName if (!$Success);
-    return $Success;
+    push @{$self->{batch}}, { rpc => $self->{rpc}, reply => $Reply };
+    return $Sent;
   }
-  $self->_SetError($ERROR, "Unable to open '$LocalPathName' for writing: $!");
-  return undef;
+  if (!$Pipeline)
+  {
+    return &$Reply($Sent);
+  }
+  if ($Pipeline->{enabled})
+  {
+    push @{$Pipeline->{rpcs}}, { rpc => $self->{rpc}, sent => $Sent,
+                                 err => $self->{err}, reply => $Reply };
+  }
+  else
+  {
+    my $Result = &$Reply($Sent);
+    push @{$Pipeline->{rpcs}}, { result => $Result, err => $self->{err} };
+  }
+  return $Sent;
 }
 
-sub GetFileToString($$)
+# Reports an error that prevented sending the request
+sub _FailRPC($$)
 {
-  my ($self, $ServerPathName) = @_;
-  debug("GetFile $self->{agenthost} '$ServerPathName' -> String\n");
-
-  return $self->_GetStringOrFile($ServerPathName, undef, undef);
+  my ($self, $Msg) = @_;
+  return $self->_CallRPC(sub {
+    # A partially sent batch cannot be salvaged
+    $self->_SetError($self->{batch} ? $FATAL : $ERROR, $Msg);
+    return undef;
+  }, sub {
+    return undef;
+  });
 }
 
-$RUN_DNT = 1;
-$RUN_DNTRUNC_OUT = 2;
-$RUN_DNTRUNC_ERR = 4;
-$RUN_DNTRUNC = $RUN_DNTRUNC_OUT | $RUN_DNTRUNC_ERR;
 
-sub Run($$$;$$$)
+#
+# Batches
+#
+
+# Returns the parameter count of each batch operation
+my %BatchArgC = (
+  SendFile => sub {
+    my ($self, $LocalPathName, $ServerPathName, $Flags, $Offset) = @_;
+    # The files sent through the cache are checked with their hash instead
+    my $Crc = $self->_UseChecksums() ? 1 : 0;
+    return 4 + $Crc if (defined $Offset);
+    my $Hash = $self->_GetCacheHash($LocalPathName);
+    return !$Hash ? 3 + $Crc : $self->{cached}->{$Hash} ? 3 : 4;
+  },
+  SendFileFromString => sub { defined $_[4] ? 4 : 3 },
+  Rm => sub { shift; scalar(@_) },
+  Run => sub { 4 + @{$_[1]} },
+  Wait => sub { 2 },
+  GetFile => sub { defined $_[3] ? 4 : ($_[0]->_UseCompression() or $_[0]->_UseChecksums()) ? 2 : 1 },
+  GetFileToString => sub { defined $_[2] ? 4 : 1 },
+  GetFileSize => sub { 4 },
+);
+
+# The index of the offset parameter of the batch operations that take one
+my %BatchOffsetArg = (
+  SendFile => 3,
+  SendFileFromString => 3,
+  GetFile => 2,
+  GetFileToString => 1,
+);
+
+sub _BatchOp($$$)
 {
-  my ($self, $Argv, $Flags, $ServerInPath, $ServerOutPath, $ServerErrPath) = @_;
-  debug("Run $self->{agenthost} '", join("' '", @$Argv), "'\n");
-  if ($Flags or $ServerInPath or $ServerOutPath or $ServerErrPath)
-  {
-    debug("  Flags=", $Flags || 0, " In='", $ServerInPath || "",
-          "' Out='", $ServerOutPath || "", "' Err='", $ServerErrPath || "",
-          "'\n");
-  }
+  my ($self, $Op, $LastPid) = @_;
+  my ($Name, @Args) = @$Op;
 
-  if (!$self->_StartRPC($RPC_RUN) or
-      !$self->_SendListSize('ArgC', 4 + @$Argv) or
-      !$self->_SendUInt32('Flags', $Flags) or
-      !$self->_SendString('ServerInPath', $ServerInPath || "") or
-      !$self->_SendString('ServerOutPath', $ServerOutPath || "") or
-      !$self->_SendString('ServerErrPath', $ServerErrPath || ""))
+  if ($Name eq "Wait")
   {
-    return undef;
+    my ($Pid, $WaitTimeout) = @Args;
+    $Pid ||= $LastPid;
+    return $self->Wait($Pid, $WaitTimeout) if (!$self->{batch});
+
+    # Here a zero Pid lets the server pick the last process
+    $WaitTimeout = 0xffffffff if (!defined $WaitTimeout);
+    return $self->_CallRPC(sub {
+      return $self->_StartRPC($RPC_WAIT2) &&
+             $self->_SendListSize('ArgC', 2) &&
+             $self->_SendUInt64('Pid', $Pid || 0) &&
+             $self->_SendUInt32('Timeout', $WaitTimeout);
+    }, sub {
+      my ($Sent) = @_;
+      return $Sent ? $self->_RecvList('I') : undef;
+    });
   }
-  my $i = 0;
-  foreach my $Arg (@$Argv)
+  return $self->SendFile(@Args) if ($Name eq "SendFile");
+  return $self->SendFileFromString(@Args) if ($Name eq "SendFileFromString");
+  return $self->Rm(@Args) if ($Name eq "Rm");
+  return $self->Run(@Args) if ($Name eq "Run");
+  return $self->GetFile(@Args) if ($Name eq "GetFile");
+  return $self->GetFileSize(@Args) if ($Name eq "GetFileSize");
+  return $self->GetFileToString(@Args);
+}
+
+# Returns the error message if the batch operation failed
+sub _GetBatchError($$$)
+{
+  my ($self, $RpcName, $Result) = @_;
+
+  return $self->{err} if (defined $self->{err});
+  # Rm() reports the files it could not delete instead
+  if ($RpcName eq "rm" and defined $Result)
   {
-      return undef if (!$self->_SendString("Cmd$i", $Arg));
-      $i++;
+    return ref($Result) ? (grep { defined } @$Result)[0] : $Result;
   }
-
-  # Get the reply
-  return $self->_RecvList('Q');
+  return undef;
 }
 
 =pod
 =over 12
 
-=item C<Wait()>
-
-Waits at most WaitTimeout seconds for the specified remote process to terminate.
-The Keepalive specifies how often, in seconds, to check that the remote end
-is still alive and reachable.
+=item C<Batch()>
+
+Performs a sequence of operations with a single RPC, stopping at the first
+one that fails. Each operation is an array containing the method name and
+its parameters:
+  ["SendFile", LocalPathName, ServerPathName, Flags, Offset]
+  ["SendFileFromString", Data, ServerPathName, Flags, Offset]
+  ["Rm", ServerPathName...]
+  ["Run", Argv, Flags, ServerInPath, ServerOutPath, ServerErrPath]
+  ["Wait", Pid, WaitTimeout]
+  ["GetFile", ServerPathName, LocalPathName, Offset]
+  ["GetFileToString", ServerPathName, Offset, Size]
+  ["GetFileSize", ServerPathName]
+A zero Wait Pid stands for the process started by the last Run operation.
+Also the files are only put in place once their SendFile operation is
+reached.
+
+Returns a list containing a [Result, Error] array for each operation that
+was performed, like FinishPipeline(). So the batch was successful if it
+returned one result per operation and the last one has no error.
+Returns an empty list if the batch could not be sent at all.
+
+If the server does not support batches the operations are performed one at
+a time.
 
 =back
 =cut
 
-sub Wait($$$;$)
+sub Batch($@)
 {
-  my ($self, $Pid, $WaitTimeout, $Keepalive) = @_;
-  debug("Wait $Pid, ", defined $WaitTimeout ? $WaitTimeout : "<undef>", ", ",
-        defined $Keepalive ? $Keepalive : "<undef>", "\n");
+  my $self = shift @_;
+  my @Ops = @_;
+  debug("Batch ", join(" ", map { $_->[0] } @Ops), "\n");
 
-  my $Result;
-  $Keepalive ||= 0xffffffff;
-  my $OldTimeout = $self->{timeout};
+  return () if (!$self->_CheckNotPipelined("Batch"));
 
-  my $WaitDeadline = $WaitTimeout ? time() + $WaitTimeout : undef;
-  while (1)
+  # Make sure we have the server version
+  return () if (!$self->{agentversion} and !$self->_Connect());
+
+  # Check the parameters first since the batch cannot be aborted midway
+  my ($ArgC, $WaitTime) = (0, 0);
+  foreach my $Op (@Ops)
   {
-    my $Remaining = $Keepalive;
-    if ($WaitDeadline)
+    my ($Name, @Args) = @$Op;
+    my $Msg;
+    if (!$BatchArgC{$Name})
     {
-      $Remaining = $WaitDeadline - time();
-      last if ($Remaining < 0);
-      $Remaining = $Keepalive if ($Keepalive < $Remaining);
+      $Msg = "$Name() cannot be batched";
     }
-    # Add a 5 second leeway to take into account network transmission delays
+    elsif ($Name eq "SendFile" and !-r $Args[0])
+    {
+      $Msg = "Unable to open '$Args[0]' for reading: $!";
+    }
+    elsif (!$self->_UseRanges() and
+           ($Name eq "GetFileSize" or
+            (exists $BatchOffsetArg{$Name} and
+             defined $Args[$BatchOffsetArg{$Name}])))
+    {
+      $Msg = "The server does not support byte ranges";
+    }
+    if ($Msg)
+    {
+      $self->{err} = undef;
+      $self->_SetError($ERROR, $Msg);
+      return ();
+    }
+  }
+
+  # Find out which files the server already has. This does not apply to the
+  # files sent at an offset.
+  my @Hashes = grep { defined $_ and !exists $self->{cached}->{$_} }
+               map { $self->_GetCacheHash($_->[1]) }
+               grep { $_->[0] eq "SendFile" and !defined $_->[4] } @Ops;
+  $self->Have(@Hashes) if (@Hashes);
+
+  # And prepare the deltas for the others
+  $self->{deltas} = {};
+  foreach my $Op (@Ops)
+  {
+    my ($Name, $LocalPathName, $ServerPathName, $Flags, $Offset) = @$Op;
+    next if ($Name ne "SendFile" or defined $Offset);
+    my $Hash = $self->_GetCacheHash($LocalPathName);
+    next if (!$Hash or $self->{cached}->{$Hash});
+    my $Delta = $self->_PrepareDelta($LocalPathName, $ServerPathName);
+    $self->{deltas}->{$ServerPathName} = [$Hash, $Delta] if ($Delta);
+  }
+
+  foreach my $Op (@Ops)
+  {
+    my ($Name, @Args) = @$Op;
+    $ArgC += 2 + &{$BatchArgC{$Name}}($self, @Args);
+    if ($Name eq "Wait" and defined $WaitTime)
+    {
+      $WaitTime = defined $Args[1] ? $WaitTime + $Args[1] : undef;
+    }
+  }
+
+  my @Results;
+  if ($self->{agentversion} =~ / 1\.[0-7]$/)
+  {
+    my $LastPid;
+    foreach my $Op (@Ops)
+    {
+      my $Result = $self->_BatchOp($Op, $LastPid);
+      my $Err = $self->_GetBatchError(lc($Op->[0]), $Result);
+      push @Results, [$Result, $Err];
+      last if (defined $Err);
+      $LastPid = $Result if ($Op->[0] eq "Run");
+    }
+    return @Results;
+  }
+
+  # Send the command
+  my $Sent = $self->_StartRPC($RPC_BATCH) &&
+             $self->_SendListSize('ArgC', $ArgC);
+  $self->{batch} = [];
+  foreach my $Op (@Ops)
+  {
+    last if (!$Sent);
+    $Sent = $self->_BatchOp($Op);
+  }
+
+  # Get the reply, which only comes once all the operations are done
+  $self->{rpc} = "batch";
+  if (!defined $WaitTime)
+  {
+    $self->{deadline} = undef;
+  }
+  elsif ($self->{deadline})
+  {
+    $self->{deadline} += $WaitTime;
+  }
+  my $Count = $Sent ? $self->_RecvRawUInt32('BatchSize') : undef;
+  my $Err = $self->{err};
+  foreach my $Call (@{$self->{batch}})
+  {
+    if (!defined $Count)
+    {
+      # Let the operation clean up
+      &{$Call->{reply}}(undef);
+      next;
+    }
+
+    $self->{rpc} = $Call->{rpc};
+    $self->{err} = undef;
+    $self->{deadline} = $self->{timeout} ? time() + $self->{timeout} : undef;
+    my $Result = &{$Call->{reply}}(1);
+    $Err = $self->_GetBatchError($Call->{rpc}, $Result);
+    push @Results, [$Result, $Err];
+    $Count = undef if (defined $Err);
+  }
+  $self->{batch} = undef;
+  $self->{deltas} = undef;
+  $self->{err} = $Err;
+  return @Results;
+}
+
+
+#
+# Implement the high-level RPCs
+#
+
+sub Ping($)
+{
+  my ($self) = @_;
+
+  # Send the RPC and get the reply
+  return $self->_CallRPC(sub {
+    return $self->_StartRPC($RPC_PING) &&
+           $self->_SendListSize('ArgC', 0);
+  }, sub {
+    my ($Sent) = @_;
+    return $Sent && $self->_RecvList('');
+  });
+}
+
+sub GetVersion($)
+{
+  my ($self) = @_;
+
+  if (!$self->{agentversion})
+  {
+    # Retrieve the server version
+    $self->_Connect();
+  }
+  # And return the version we got.
+  # If the connection failed it will be undef as expected.
+  return $self->{agentversion};
+}
+
+#
+# Delta transfers
+#
+
+sub _UseDelta($)
+{
+  my ($self) = @_;
+  # The matchblocks RPC was added in 1.11
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|10)$/);
+}
+
+sub _UseRanges($)
+{
+  my ($self) = @_;
+  # The byte ranges were added in 1.12
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[01])$/);
+}
+
+sub _UseStreaming($)
+{
+  my ($self) = @_;
+  # RUN_STREAM and the getoutput RPC were added in 1.13
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[0-2])$/);
+}
+
+sub _UseTrees($)
+{
+  my ($self) = @_;
+  # The sendtree and gettree RPCs were added in 1.14
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[0-3])$/);
+}
+
+sub _UseWaitMany($)
+{
+  my ($self) = @_;
+  # The waitmany RPC was added in 1.15
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[0-4])$/);
+}
+
+sub _UseRunBatch($)
+{
+  my ($self) = @_;
+  # The runbatch RPC was added in 1.16
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[0-5])$/);
+}
+
+sub _UseUsage($)
+{
+  my ($self) = @_;
+  # The wait2 RPC can return the resource usage since 1.17
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[0-6])$/);
+}
+
+sub _UseStats($)
+{
+  my ($self) = @_;
+  # The getstats RPC was added in 1.18
+  return ($self->{agentversion} and
+          $self->{agentversion} !~ / 1\.(?:[0-9]|1[0-7])$/);
+}
+
+# Makes sure the server supports the directory tree transfers
+sub _CheckTrees($)
+{
+  my ($self) = @_;
+
+  return undef if (!$self->{agentversion} and !$self->_Connect());
+  return 1 if ($self->_UseTrees());
+  $self->_SetError($ERROR, "The server does not support directory trees");
+  return undef;
+}
+
+# Makes sure the server supports the byte ranges
+sub _CheckRanges($)
+{
+  my ($self) = @_;
+
+  return undef if (!$self->{agentversion} and !$self->_Connect());
+  return 1 if ($self->_UseRanges());
+  $self->_SetError($ERROR, "The server does not support byte ranges");
+  return undef;
+}
+
+# Asks the server where the blocks of the local file are in its version of
+# the file. Returns the block size and a reference to the array of their
+# offsets, undef standing for the blocks it does not have.
+sub _MatchBlocks($$$)
+{
+  my ($self, $LocalPathName, $ServerPathName) = @_;
+
+  my $Size = -s $LocalPathName;
+  my $BlockSize = int(sqrt($Size) / 8) * 8;
+  # Keep the signatures and the offsets small
+  $BlockSize = 1024 if ($BlockSize < 1024);
+  $BlockSize = int(($Size + 65535) / 65536) if ($Size / $BlockSize > 65536);
+
+  # Only full blocks can be matched
+  my $Sigs = "";
+  if (open(my $fh, "<", $LocalPathName))
+  {
+    binmode($fh);
+    my $Block;
+    while ((sysread($fh, $Block, $BlockSize) || 0) == $BlockSize)
+    {
+      $Sigs .= pack("N", Compress::Raw::Zlib::adler32($Block)) .
+               substr(Digest::SHA::sha256($Block), 0, 8);
+    }
+    close($fh);
+  }
+  return undef if ($Sigs eq "");
+
+  my $Offsets = $self->_CallRPC(sub {
+    return $self->_StartRPC($RPC_MATCHBLOCKS) &&
+           $self->_SendListSize('ArgC', 3) &&
+           $self->_SendString('ServerPathName', $ServerPathName) &&
+           $self->_SendUInt32('BlockSize', $BlockSize) &&
+           $self->_SendData('Sigs', $Sigs);
+  }, sub {
+    my ($Sent) = @_;
+    return $Sent && $self->_RecvList('.') &&
+           $self->_ExpectEntry('Offsets', 'd');
+  });
+  return undef if (!$Offsets);
+
+  my @Offsets;
+  foreach my $Pair (unpack("(a8)*", $Offsets))
+  {
+    my ($High, $Low) = unpack("NN", $Pair);
+    push @Offsets, ($High == 0xffffffff and $Low == 0xffffffff) ? undef :
+                   $High * 4294967296 + $Low;
+  }
+  return ($BlockSize, \@Offsets);
+}
+
+# Writes the instructions to rebuild the local file from the server's
+# version of it to a temporary file. See apply_delta() in testagentd.c for
+# the format. Returns the File::Temp object.
+sub _BuildDelta($$$$)
+{
+  my ($self, $LocalPathName, $BlockSize, $Offsets) = @_;
+
+  my $Delta = File::Temp->new();
+  binmode($Delta);
+  open(my $fh, "<", $LocalPathName) or return undef;
+  binmode($fh);
+
+  my ($Literal, $CopyOffset, $CopySize) = ("", 0, 0);
+  my ($LiteralSize, $Success) = (0, 1);
+  my $Flush = sub {
+    if ($CopySize)
+    {
+      $Success &&= print $Delta pack("aNNN", "C", int($CopyOffset / 4294967296),
+                                     $CopyOffset % 4294967296, $CopySize);
+      $CopySize = 0;
+    }
+    if (length($Literal))
+    {
+      $Success &&= print $Delta pack("aN", "L", length($Literal)), $Literal;
+      $LiteralSize += length($Literal);
+      $Literal = "";
+    }
+  };
+
+  my ($Block, $i) = (undef, 0);
+  while (sysread($fh, $Block, $BlockSize))
+  {
+    my $Offset = $i < @$Offsets ? $Offsets->[$i] : undef;
+    if (!defined $Offset)
+    {
+      $Flush->() if ($CopySize);
+      $Literal .= $Block;
+      $Flush->() if (length($Literal) >= $BLOCK_SIZE);
+    }
+    elsif ($CopySize and $CopyOffset + $CopySize == $Offset)
+    {
+      $CopySize += $BlockSize;
+    }
+    else
+    {
+      $Flush->();
+      ($CopyOffset, $CopySize) = ($Offset, $BlockSize);
+    }
+    $i++;
+  }
+  $Flush->();
+  close($fh);
+  # Get ready for sending the delta
+  return undef if (!$Success or !$Delta->flush() or !sysseek($Delta, 0, 0));
+
+  debug("  Delta: $LiteralSize new bytes out of ", -s $LocalPathName, "\n");
+  return $Delta;
+}
+
+# Prepares the delta for sending the local file, returning undef if the
+# server does not have a version of the file worth using.
+sub _PrepareDelta($$$)
+{
+  my ($self, $LocalPathName, $ServerPathName) = @_;
+
+  return undef if (!$self->_UseDelta() or -s $LocalPathName < $MIN_DELTA_SIZE);
+
+  # The server may not have any version of the file so hide the error
+  my $Err = $self->{err};
+  my ($BlockSize, $Offsets) = $self->_MatchBlocks($LocalPathName, $ServerPathName);
+  $self->{err} = $Err;
+  return undef if (!$Offsets or !grep { defined } @$Offsets);
+
+  return $self->_BuildDelta($LocalPathName, $BlockSize, $Offsets);
+}
+
+=pod
+=over 12
+
+=item C<Have()>
+
+Checks which of the specified SHA-256 hashes match files in the server's
+file cache. Returns a reference to an array containing a boolean for each
+hash, or undef in case of error.
+
+Note that SendFile() and Batch() use the cache automatically.
+
+=back
+=cut
+
+sub Have($@)
+{
+  my $self = shift @_;
+  my @Hashes = @_;
+  debug("Have ", join(" ", @Hashes), "\n");
+
+  return $self->_CallRPC(sub {
+    # Make sure we have the server version
+    return undef if (!$self->{agentversion} and !$self->_Connect());
+    if (!$self->_UseCache())
+    {
+      $self->_SetError($ERROR, "The server does not have a file cache");
+      return undef;
+    }
+
+    return undef if (!$self->_StartRPC($RPC_HAVE) or
+                     !$self->_SendListSize('ArgC', scalar(@Hashes)));
+    my $i = 0;
+    foreach my $Hash (@Hashes)
+    {
+      return undef if (!$self->_SendString("Hash$i", $Hash));
+      $i++;
+    }
+    return 1;
+  }, sub {
+    my ($Sent) = @_;
+    return undef if (!$Sent);
+    my @Have = $self->_RecvList('I' x @Hashes);
+    return undef if (!defined $Have[0] or (!@Hashes and !$Have[0]));
+    @Have = () if (!@Hashes);
+
+    # Remember the answer for SendFile()
+    $self->{cached}->{$Hashes[$_]} = $Have[$_] for (0..$#Hashes);
+    return \@Have;
+  });
+}
+
+$SENDFILE_EXE = 1;
+my $SENDFILE_CACHE = 2;
+my $SENDFILE_DELTA = 4;
+my $SENDFILE_APPEND = 8;
+my $SENDFILE_CHECKSUM = 16;
+
+sub _SendStringOrFile($$$$$$;$$)
+{
+  my ($self, $Data, $fh, $LocalPathName, $ServerPathName, $Flags, $Hash, $Delta) = @_;
+
+  # Send the RPC and get the reply
+  my $FromCache = $Hash && $self->{cached}->{$Hash};
+  return $self->_CallRPC(sub {
+    if ($Delta)
+    {
+      # The server rebuilds the file from its current version and adds it
+      # to its cache
+      return $self->_StartRPC($RPC_SENDFILE) &&
+             $self->_SendListSize('ArgC', 4) &&
+             $self->_SendString('ServerPathName', $ServerPathName) &&
+             $self->_SendUInt32('Flags', ($Flags || 0) | $SENDFILE_DELTA | $SENDFILE_CACHE) &&
+             $self->_SendString('Hash', $Hash) &&
+             $self->_SendFile('Delta', $Delta, $Delta->filename);
+    }
+    if ($Hash)
+    {
+      # The server either copies the file from its cache or adds it to it
+      return $self->_StartRPC($RPC_SENDFILE) &&
+             $self->_SendListSize('ArgC', $FromCache ? 3 : 4) &&
+             $self->_SendString('ServerPathName', $ServerPathName) &&
+             $self->_SendUInt32('Flags', ($Flags || 0) | $SENDFILE_CACHE) &&
+             $self->_SendString('Hash', $Hash) &&
+             ($FromCache or $self->_SendFile('File', $fh, $LocalPathName));
+    }
+    if ($fh and $self->_UseChecksums())
+    {
+      return $self->_StartRPC($RPC_SENDFILE) &&
+             $self->_SendListSize('ArgC', 4) &&
+             $self->_SendString('ServerPathName', $ServerPathName) &&
+             $self->_SendUInt32('Flags', ($Flags || 0) | $SENDFILE_CHECKSUM) &&
+             $self->_SendCheckedFile('File', $fh, $LocalPathName, 1);
+    }
+    return $self->_StartRPC($RPC_SENDFILE) &&
+           $self->_SendListSize('ArgC', 3) &&
+           $self->_SendString('ServerPathName', $ServerPathName) &&
+           $self->_SendUInt32('Flags', $Flags || 0) &&
+           ($fh ? $self->_SendFile('File', $fh, $LocalPathName) :
+                  $self->_SendString('String', $Data, 'd'));
+  }, sub {
+    my ($Sent) = @_;
+    my $Result = $Sent && $self->_RecvList('');
+    $self->{cached}->{$Hash} = $Result ? 1 : 0 if ($Hash);
+    return $Result;
+  });
+}
+
+# Writes the string or the rest of the file at the specified offset of the
+# server file and returns its new size.
+sub _AppendStringOrFile($$$$$$$)
+{
+  my ($self, $Data, $fh, $LocalPathName, $ServerPathName, $Flags, $Offset) = @_;
+
+  # Send the RPC and get the reply
+  return $self->_CallRPC(sub {
+    return undef if (!$self->_CheckRanges());
+    my $Checksum = $fh && $self->_UseChecksums();
+    $Flags = ($Flags || 0) | $SENDFILE_APPEND;
+    $Flags |= $SENDFILE_CHECKSUM if ($Checksum);
+    return $self->_StartRPC($RPC_SENDFILE) &&
+           $self->_SendListSize('ArgC', $Checksum ? 5 : 4) &&
+           $self->_SendString('ServerPathName', $ServerPathName) &&
+           $self->_SendUInt32('Flags', $Flags) &&
+           $self->_SendUInt64('Offset', $Offset) &&
+           ($fh ? $self->_SendCheckedFile('File', $fh, $LocalPathName, $Checksum,
+                                          (-s $LocalPathName) - $Offset) :
+                  $self->_SendData('String', $Data));
+  }, sub {
+    my ($Sent) = @_;
+    return undef if (!$Sent);
+    my $Size = $self->_RecvList('Q');
+    # Return a true value even for empty files
+    return !defined $Size ? undef : $Size || "0E0";
+  });
+}
+
+=pod
+=over 12
+
+=item C<SendFile()>
+
+Sends the local file to the server. If an offset is specified, only the part
+of the file that follows it is sent and written at the same offset in the
+server file, which must be at least that long and is truncated to the new
+data. If the connection is lost in the middle of such a transfer the server
+keeps what it received so far so GetFileSize() tells where to resume.
+Returns the server file's new size in that case, and true otherwise, or
+undef on error.
+
+=back
+=cut
+
+sub SendFile($$$;$$)
+{
+  my ($self, $LocalPathName, $ServerPathName, $Flags, $Offset) = @_;
+  debug("SendFile '$LocalPathName' -> $self->{agenthost} '$ServerPathName' Flags=", $Flags || 0, defined $Offset ? " Offset=$Offset" : "", "\n");
+
+  if (defined $Offset)
+  {
+    my $fh;
+    if (!open($fh, "<", $LocalPathName))
+    {
+      return $self->_FailRPC("Unable to open '$LocalPathName' for reading: $!");
+    }
+    if ($Offset > -s $fh or !sysseek($fh, $Offset, 0))
+    {
+      close($fh);
+      return $self->_FailRPC("Unable to seek to $Offset in '$LocalPathName'");
+    }
+    my $Size = $self->_AppendStringOrFile(undef, $fh, $LocalPathName,
+                                          $ServerPathName, $Flags, $Offset);
+    close($fh);
+    return $Size;
+  }
+
+  if (open(my $fh, "<", $LocalPathName))
+  {
+    # Check whether the server already has the file, unless the RPC is only
+    # being queued
+    $self->_Connect() if (!$self->{agentversion});
+    my $Hash = $self->_GetCacheHash($LocalPathName);
+    my $Queued = $self->{batch} || $self->{pipeline};
+    if ($Hash and !$Queued and !exists $self->{cached}->{$Hash})
+    {
+      # If this fails the file will simply be sent
+      $self->Have($Hash);
+    }
+
+    my $FromCache = $Hash && $self->{cached}->{$Hash};
+
+    # Otherwise try to only send the differences with the server's version.
+    # Batch() prepares the deltas beforehand.
+    my $Delta;
+    if ($Hash and !$FromCache)
+    {
+      $Delta = $self->{deltas}->{$ServerPathName};
+      if ($Queued)
+      {
+        $Delta = undef if ($Delta and $Delta->[0] ne $Hash);
+        $Delta &&= $Delta->[1];
+      }
+      else
+      {
+        $Delta = $self->_PrepareDelta($LocalPathName, $ServerPathName);
+      }
+    }
+    delete $self->{deltas}->{$ServerPathName};
+
+    my $Success = $self->_SendStringOrFile(undef, $fh, $LocalPathName,
+                                           $ServerPathName, $Flags, $Hash,
+                                           $Delta);
+    if (!$Success and ($FromCache or $Delta) and !$Queued)
+    {
+      # The cached copy may have been removed or be corrupt, or the server's
+      # version of the file may have changed
+      $Success = $self->_SendStringOrFile(undef, $fh, $LocalPathName,
+                                          $ServerPathName, $Flags, $Hash);
+    }
+    close($fh);
+    return $Success;
+  }
+  return $self->_FailRPC("Unable to open '$LocalPathName' for reading: $!");
+}
+
+sub SendFileFromString($$$;$$)
+{
+  my ($self, $Data, $ServerPathName, $Flags, $Offset) = @_;
+  debug("SendFile String -> $self->{agenthost} '$ServerPathName' Flags=", $Flags || 0, defined $Offset ? " Offset=$Offset" : "", "\n");
+  if (defined $Offset)
+  {
+    # Unlike below, don't append a '\0' to the data
+    return $self->_AppendStringOrFile($Data, undef, undef, $ServerPathName,
+                                      $Flags, $Offset);
+  }
+  return $self->_SendStringOrFile($Data, undef, undef, $ServerPathName, $Flags);
+}
+
+my $GETFILE_COMPRESS = 1;
+my $GETFILE_CHECKSUM = 2;
+
+# Returns the getfile flags to use for receiving a file
+sub _GetFileFlags($)
+{
+  my ($self) = @_;
+  my $Flags = $self->_UseCompression() ? $GETFILE_COMPRESS : 0;
+  $Flags |= $GETFILE_CHECKSUM if ($self->_UseChecksums());
+  return $Flags;
+}
+
+sub _GetStringOrFile($$$)
+{
+  my ($self, $ServerPathName, $LocalPathName, $fh) = @_;
+
+  # Send the RPC and get the reply
+  my $Flags = 0;
+  return $self->_CallRPC(sub {
+    # Make sure we have the server version
+    return undef if (!$self->{agentversion} and !$self->_Connect());
+
+    # Only files can be received in compressed form or with a checksum
+    $Flags = $fh ? $self->_GetFileFlags() : 0;
+    if ($Flags)
+    {
+      return $self->_StartRPC($RPC_GETFILE) &&
+             $self->_SendListSize('ArgC', 2) &&
+             $self->_SendString('ServerPathName', $ServerPathName) &&
+             $self->_SendUInt32('Flags', $Flags);
+    }
+    return $self->_StartRPC($RPC_GETFILE) &&
+           $self->_SendListSize('ArgC', 1) &&
+           $self->_SendString('ServerPathName', $ServerPathName);
+  }, sub {
+    my ($Sent) = @_;
+    my $Checksum = $Flags & $GETFILE_CHECKSUM;
+    my $Result = $Sent && $self->_RecvList($Checksum ? '.I' : '.') &&
+                 ($fh ? $self->_RecvCheckedFile('File', $fh, $LocalPathName, $Checksum) :
+                        $self->_RecvString('String', 'd'));
+    if ($fh)
+    {
+      close($fh);
+      unlink $LocalPathName if (!$Result);
+    }
+    return $Result;
+  });
+}
+
+# Requests the specified byte range of the server file. The reply starts
+# with the size of the whole file.
+sub _SendGetFileRange($$$$$)
+{
+  my ($self, $ServerPathName, $Flags, $Offset, $Size) = @_;
+
+  return $self->_CheckRanges() &&
+         $self->_StartRPC($RPC_GETFILE) &&
+         $self->_SendListSize('ArgC', 4) &&
+         $self->_SendString('ServerPathName', $ServerPathName) &&
+         $self->_SendUInt32('Flags', $Flags) &&
+         $self->_SendUInt64('Offset', $Offset) &&
+         # All ones means up to the end of the file
+         $self->_SendUInt64('Size', defined $Size ? $Size : ~0);
+}
+
+=pod
+=over 12
+
+=item C<GetFile()>
+
+Retrieves the server file. If an offset is specified, only the part of the
+server file that follows it is retrieved and written at the same offset in
+the local file, which must be at least that long and is truncated to the new
+data. A partial local file is kept in that case so the transfer can be
+resumed from its size.
+
+=back
+=cut
+
+sub GetFile($$$;$)
+{
+  my ($self, $ServerPathName, $LocalPathName, $Offset) = @_;
+  debug("GetFile $self->{agenthost} '$ServerPathName' -> '$LocalPathName'", defined $Offset ? " Offset=$Offset" : "", "\n");
+
+  if (!defined $Offset)
+  {
+    if (open(my $fh, ">", $LocalPathName))
+    {
+      return $self->_GetStringOrFile($ServerPathName, $LocalPathName, $fh);
+    }
+    return $self->_FailRPC("Unable to open '$LocalPathName' for writing: $!");
+  }
+
+  my $fh;
+  if (!open($fh, "+<", $LocalPathName) and !open($fh, "+>", $LocalPathName))
+  {
+    return $self->_FailRPC("Unable to open '$LocalPathName' for writing: $!");
+  }
+  if ($Offset > -s $fh or !truncate($fh, $Offset) or !sysseek($fh, $Offset, 0))
+  {
+    close($fh);
+    return $self->_FailRPC("Unable to truncate '$LocalPathName' to $Offset bytes");
+  }
+
+  my $Flags = 0;
+  return $self->_CallRPC(sub {
+    $Flags = $self->_GetFileFlags();
+    return $self->_SendGetFileRange($ServerPathName, $Flags, $Offset, undef);
+  }, sub {
+    my ($Sent) = @_;
+    my $Checksum = $Flags & $GETFILE_CHECKSUM;
+    my $Result = $Sent && defined $self->_RecvList($Checksum ? 'Q.I' : 'Q.') &&
+                 $self->_RecvCheckedFile('File', $fh, $LocalPathName, $Checksum);
+    close($fh);
+    return $Result;
+  });
+}
+
+=pod
+=over 12
+
+=item C<GetFileToString()>
+
+Returns the content of the server file. An offset and a size can be
+specified to only retrieve that part of the file, for instance to follow a
+growing log file.
+
+=back
+=cut
+
+sub GetFileToString($$;$$)
+{
+  my ($self, $ServerPathName, $Offset, $Size) = @_;
+  debug("GetFile $self->{agenthost} '$ServerPathName' -> String", defined $Offset ? " Offset=$Offset" : "", "\n");
+
+  return $self->_GetStringOrFile($ServerPathName, undef, undef) if (!defined $Offset);
+
+  return $self->_CallRPC(sub {
+    return $self->_SendGetFileRange($ServerPathName, 0, $Offset, $Size);
+  }, sub {
+    my ($Sent) = @_;
+    return undef if (!$Sent or !defined $self->_RecvList('Q.'));
+    return $self->_ExpectEntry('String', 'd');
+  });
+}
+
+=pod
+=over 12
+
+=item C<GetFileSize()>
+
+Returns the size of the server file, or undef on error. Note that a size of
+zero is returned as "0E0" which is still true.
+
+=back
+=cut
+
+sub GetFileSize($$)
+{
+  my ($self, $ServerPathName) = @_;
+  debug("GetFileSize $self->{agenthost} '$ServerPathName'\n");
+
+  return $self->_CallRPC(sub {
+    return $self->_SendGetFileRange($ServerPathName, 0, 0, 0);
+  }, sub {
+    my ($Sent) = @_;
+    my $Size = $Sent ? $self->_RecvList('Q.') : undef;
+    return undef if (!defined $Size or !defined $self->_ExpectEntry('Data', 'd', 0));
+    return $Size || "0E0";
+  });
+}
+
+
+#
+# Directory tree transfers
+#
+
+my $TAR_BLOCK = 512;
+
+sub _GetTarPadding($)
+{
+  my ($Size) = @_;
+  return ($TAR_BLOCK - $Size % $TAR_BLOCK) % $TAR_BLOCK;
+}
+
+sub _PackTarHeader($$$$$)
+{
+  my ($Name, $Type, $Mode, $Size, $MTime) = @_;
+
+  my $Header = pack("a100a8a8a8a12a12a8a1a100a6a2a32a32a8a8a155a12",
+                    $Name, sprintf("%07o", $Mode), "0000000", "0000000",
+                    sprintf("%011o", $Size), sprintf("%011o", $MTime),
+                    " " x 8, $Type, "", "ustar ", " ", "", "", "", "", "", "");
+  substr($Header, 148, 8) = sprintf("%06o\0 ", unpack("%32C*", $Header));
+  return $Header;
+}
+
+# Returns the GNU tar headers for the specified entry, using a 'L' header
+# for the long names like testagentd does.
+sub _GetTarHeader($$$$$)
+{
+  my ($Name, $Type, $Mode, $Size, $MTime) = @_;
+
+  return _PackTarHeader($Name, $Type, $Mode, $Size, $MTime) if (length($Name) <= 100);
+  my $LongName = "$Name\0";
+  return _PackTarHeader("././\@LongLink", "L", 0, length($LongName), 0) .
+         $LongName . ("\0" x _GetTarPadding(length($LongName))) .
+         _PackTarHeader($Name, $Type, $Mode, $Size, $MTime);
+}
+
+# Appends the local file or directory to the tar archive, under the
+# specified name. Returns an error message in case of failure.
+sub _WriteTarEntry($$$);
+sub _WriteTarEntry($$$)
+{
+  my ($Dst, $Path, $Name) = @_;
+
+  my @St = stat($Path);
+  return "Unable to get information about '$Path': $!" if (!@St);
+  if (-d _)
+  {
+    # The top directory itself does not need an entry
+    if ($Name ne "" and !print $Dst _GetTarHeader("$Name/", "5", 0755, 0, $St[9]))
+    {
+      return "Unable to write the tar archive: $!";
+    }
+    my $dh;
+    return "Unable to open the '$Path' directory: $!" if (!opendir($dh, $Path));
+    my @Entries = sort grep { $_ ne "." and $_ ne ".." } readdir($dh);
+    closedir($dh);
+    foreach my $Entry (@Entries)
+    {
+      my $Err = _WriteTarEntry($Dst, "$Path/$Entry",
+                               $Name eq "" ? $Entry : "$Name/$Entry");
+      return $Err if (defined $Err);
+    }
+  }
+  elsif (-f _)
+  {
+    my $fh;
+    return "Unable to open '$Path' for reading: $!" if (!open($fh, "<", $Path));
+    binmode($fh);
+    my $Mode = ($St[2] & 0111) ? 0755 : 0644;
+    my ($Success, $Left) = (1, $St[7]);
+    $Success = print $Dst _GetTarHeader($Name, "0", $Mode, $Left, $St[9]);
+    while ($Success and $Left)
+    {
+      my $Buffer;
+      my $r = sysread($fh, $Buffer, $Left < $BLOCK_SIZE ? $Left : $BLOCK_SIZE);
+      if (!$r)
+      {
+        close($fh);
+        return "Unable to read '$Path': ". (defined $r ? "the file shrank" : $!);
+      }
+      $Success = print $Dst $Buffer;
+      $Left -= $r;
+    }
+    close($fh);
+    if (!$Success or !print $Dst "\0" x _GetTarPadding($St[7]))
+    {
+      return "Unable to write the tar archive: $!";
+    }
+  }
+  # Skip the other file types
+  return undef;
+}
+
+# Extracts the tar archive to the local directory, refusing the names that
+# would point outside of it. Returns an error message in case of failure.
+sub _ExtractTar($$)
+{
+  my ($Src, $LocalDir) = @_;
+
+  my $Read = sub {
+    my ($Size) = @_;
+    my $Data = "";
+    while (length($Data) < $Size)
+    {
+      my $r = sysread($Src, $Data, $Size - length($Data), length($Data));
+      return undef if (!$r);
+    }
+    return $Data;
+  };
+
+  my $LongName;
+  while (1)
+  {
+    my $Header = $Read->($TAR_BLOCK);
+    return "The tar archive is truncated" if (!defined $Header);
+    last if ($Header !~ /[^\0]/);
+
+    my ($Name, $Mode, $Size, $Sum, $Type, $Magic, $Prefix) =
+        unpack("Z100A8x8x8a12x12A8a1x100a6x2x32x32x8x8Z155", $Header);
+    substr($Header, 148, 8) = " " x 8;
+    if ($Sum !~ /^\s*[0-7]+/ or oct($Sum) != unpack("%32C*", $Header))
+    {
+      return "The tar header checksum is invalid";
+    }
+    return "'$Name' is too big" if (ord($Size) & 0x80);
+    ($Mode, $Size) = (oct($Mode), oct($Size));
+    my $Padding = _GetTarPadding($Size);
+
+    if ($Type eq "L" or $Type eq "x" or $Type eq "g")
+    {
+      return "The tar extended header is too big" if ($Size > 65536);
+      my $Data = $Read->($Size + $Padding);
+      return "The tar archive is truncated" if (!defined $Data);
+      if ($Type eq "L")
+      {
+        ($LongName) = unpack("Z*", $Data);
+      }
+      elsif ($Type eq "x" and
+             substr($Data, 0, $Size) =~ /(?:^|\n)\d+ path=([^\n]*)\n/)
+      {
+        $LongName = $1;
+      }
+      next;
+    }
+
+    if (defined $LongName)
+    {
+      $Name = $LongName;
+      $LongName = undef;
+    }
+    elsif ($Magic eq "ustar\0" and $Prefix ne "")
+    {
+      $Name = "$Prefix/$Name";
+    }
+    $Name =~ s~^(?:\./)+~~;
+    if ($Name =~ m~^/~ or $Name =~ m~(?:^|/)\.\.(?:/|$)~)
+    {
+      return "'$Name' is outside the target directory";
+    }
+    my $IsDir = ($Type eq "5" or $Name =~ m~/$~);
+    $Name =~ s~/+$~~;
+    my $Path = $Name eq "" ? $LocalDir : "$LocalDir/$Name";
+
+    if ($IsDir)
+    {
+      make_path($Path);
+      return "Unable to create the '$Path' directory: $!" if (!-d $Path);
+      $Padding += $Size;
+    }
+    elsif ($Type eq "0" or $Type eq "\0" or $Type eq "7")
+    {
+      my $Dir = $Path;
+      make_path($Dir) if ($Dir =~ s~/[^/]*$~~ and !-d $Dir);
+      my $fh;
+      return "Unable to open '$Path' for writing: $!" if (!open($fh, ">", $Path));
+      binmode($fh);
+      my $Left = $Size;
+      while ($Left)
+      {
+        my $Data = $Read->($Left < $BLOCK_SIZE ? $Left : $BLOCK_SIZE);
+        if (!defined $Data)
+        {
+          close($fh);
+          return "The tar archive is truncated";
+        }
+        my $w = syswrite($fh, $Data);
+        if (!defined $w or $w != length($Data))
+        {
+          close($fh);
+          return "Unable to write to '$Path': $!";
+        }
+        $Left -= $w;
+      }
+      return "Unable to write to '$Path': $!" if (!close($fh));
+      chmod(($Mode & 0111) ? 0755 : 0644, $Path);
+    }
+    else
+    {
+      return "'$Name' is of an unsupported type ($Type)";
+    }
+    return "The tar archive is truncated" if (!defined $Read->($Padding));
+  }
+  return undef;
+}
+
+=pod
+=over 12
+
+=item C<SendTree()>
+
+Sends the specified files and directories, which are relative to LocalDir,
+to the ServerDir directory on the server. The directories are sent
+recursively and, if no path is specified, the whole content of LocalDir is
+sent. Everything is sent as a single tar archive which the server extracts
+as it arrives.
+
+=back
+=cut
+
+sub SendTree($$$@)
+{
+  my ($self, $LocalDir, $ServerDir, @Paths) = @_;
+  @Paths = (".") if (!@Paths);
+  debug("SendTree '$LocalDir' -> $self->{agenthost} '$ServerDir' '", join("' '", @Paths), "'\n");
+
+  my $Tar = File::Temp->new();
+  binmode($Tar);
+  foreach my $Path (@Paths)
+  {
+    # The names in the archive are relative
+    my $Name = $Path;
+    $Name =~ s~^(?:\.?/)+~~;
+    $Name = "" if ($Name eq ".");
+    my $Err = _WriteTarEntry($Tar, "$LocalDir/$Path", $Name);
+    return $self->_FailRPC($Err) if (defined $Err);
+  }
+  if (!print $Tar "\0" x (2 * $TAR_BLOCK) or !$Tar->flush() or
+      !sysseek($Tar, 0, 0))
+  {
+    return $self->_FailRPC("Unable to write the tar archive: $!");
+  }
+
+  return $self->_CallRPC(sub {
+    return $self->_CheckTrees() &&
+           $self->_StartRPC($RPC_SENDTREE) &&
+           $self->_SendListSize('ArgC', 2) &&
+           $self->_SendString('ServerDir', $ServerDir) &&
+           $self->_SendFile('Tar', $Tar, $Tar->filename);
+  }, sub {
+    my ($Sent) = @_;
+    return $Sent && $self->_RecvList('');
+  });
+}
+
+=pod
+=over 12
+
+=item C<GetTree()>
+
+Retrieves the specified files and directories, which are relative to
+ServerDir, to the LocalDir directory. The directories are retrieved
+recursively and, if no path is specified, the whole content of ServerDir is
+retrieved. The server generates the tar archive as it sends it.
+
+=back
+=cut
+
+sub GetTree($$$@)
+{
+  my ($self, $ServerDir, $LocalDir, @Paths) = @_;
+  @Paths = (".") if (!@Paths);
+  debug("GetTree $self->{agenthost} '$ServerDir' '", join("' '", @Paths), "' -> '$LocalDir'\n");
+
+  my $Tar = File::Temp->new();
+  binmode($Tar);
+  return $self->_CallRPC(sub {
+    return undef if (!$self->_CheckTrees() or
+                     !$self->_StartRPC($RPC_GETTREE) or
+                     !$self->_SendListSize('ArgC', 2 + @Paths) or
+                     !$self->_SendString('ServerDir', $ServerDir) or
+                     !$self->_SendUInt32('Flags', $self->_UseCompression() ? $GETFILE_COMPRESS : 0));
+    foreach my $Path (@Paths)
+    {
+      return undef if (!$self->_SendString('Path', $Path));
+    }
+    return 1;
+  }, sub {
+    my ($Sent) = @_;
+    return undef if (!$Sent or !$self->_RecvList('.') or
+                     !$self->_RecvFile('Tar', $Tar, $Tar->filename));
+
+    my $Err = sysseek($Tar, 0, 0) ? _ExtractTar($Tar, $LocalDir) :
+                                    "Unable to read the tar archive: $!";
+    if (defined $Err)
+    {
+      $self->_SetError($ERROR, $Err);
+      return undef;
+    }
+    return 1;
+  });
+}
+
+$RUN_DNT = 1;
+$RUN_DNTRUNC_OUT = 2;
+$RUN_DNTRUNC_ERR = 4;
+$RUN_DNTRUNC = $RUN_DNTRUNC_OUT | $RUN_DNTRUNC_ERR;
+$RUN_STREAM = 8;
+
+sub Run($$$;$$$)
+{
+  my ($self, $Argv, $Flags, $ServerInPath, $ServerOutPath, $ServerErrPath) = @_;
+  debug("Run $self->{agenthost} '", join("' '", @$Argv), "'\n");
+  if ($Flags or $ServerInPath or $ServerOutPath or $ServerErrPath)
+  {
+    debug("  Flags=", $Flags || 0, " In='", $ServerInPath || "",
+          "' Out='", $ServerOutPath || "", "' Err='", $ServerErrPath || "",
+          "'\n");
+  }
+
+  return $self->_CallRPC(sub {
+    if (!$self->_StartRPC($RPC_RUN) or
+        !$self->_SendListSize('ArgC', 4 + @$Argv) or
+        !$self->_SendUInt32('Flags', $Flags) or
+        !$self->_SendString('ServerInPath', $ServerInPath || "") or
+        !$self->_SendString('ServerOutPath', $ServerOutPath || "") or
+        !$self->_SendString('ServerErrPath', $ServerErrPath || ""))
+    {
+      return undef;
+    }
+    my $i = 0;
+    foreach my $Arg (@$Argv)
+    {
+        return undef if (!$self->_SendString("Cmd$i", $Arg));
+        $i++;
+    }
+    return 1;
+  }, sub {
+    my ($Sent) = @_;
+
+    # Get the reply
+    return $Sent ? $self->_RecvList('Q') : undef;
+  });
+}
+
+=pod
+=over 12
+
+=item C<RunBatch()>
+
+Runs the specified commands on the server, at most Slots of them at a time,
+and waits at most WaitTimeout seconds for all of them to complete. If Slots
+is 0 the server runs as many as it has processors.
+
+Commands is a reference to an array of hashes, one per command, with the
+following fields:
+  Argv    A reference to the command line array.
+  Flags   The $RUN_DNTRUNC_OUT and $RUN_DNTRUNC_ERR flags, if any.
+  Timeout The number of seconds after which the command gets killed.
+  In, Out, Err The paths to redirect the standard streams to, if any.
+
+The commands are started in order. Returns a reference to an array containing
+a hash for each command, with the following fields:
+  Status   The command's exit status.
+  TimedOut True if the command got killed because of the timeout.
+  Error    Why the command could not be run, undef if it was run.
+  Start    When the command was started, in seconds since the first one was.
+  Elapsed  How long the command ran, in seconds.
+Returns undef in case of error.
+
+=back
+=cut
+
+sub RunBatch($$$;$)
+{
+  my ($self, $Commands, $Slots, $WaitTimeout) = @_;
+  debug("RunBatch ", scalar(@$Commands), " commands, ", $Slots || "auto",
+        " slots\n");
+
+  return undef if (!$self->_CheckNotPipelined("RunBatch"));
+  return undef if (!$self->{agentversion} and !$self->_Connect());
+  if (!$self->_UseRunBatch())
+  {
+    $self->_SetError($ERROR, "The server does not support running commands in parallel");
+    return undef;
+  }
+
+  my $OldTimeout = $self->{timeout};
+  # Add a 5 second leeway to take into account network transmission delays
+  $self->SetTimeout($WaitTimeout ? $WaitTimeout + 5 : 0xffffffff);
+
+  my $ArgC = 1;
+  $ArgC += 6 + @{$_->{Argv}} for (@$Commands);
+  my $Sent = $self->_StartRPC($RPC_RUNBATCH) &&
+             $self->_SendListSize('ArgC', $ArgC) &&
+             $self->_SendUInt32('Slots', $Slots || 0);
+  my $i = 0;
+  foreach my $Cmd (@$Commands)
+  {
+    last if (!$Sent);
+    my $Timeout = $Cmd->{Timeout} || 0xffffffff;
+    $Sent = $self->_SendUInt32("Cmd$i.ArgC", 5 + @{$Cmd->{Argv}}) &&
+            $self->_SendUInt32("Cmd$i.Flags", $Cmd->{Flags} || 0) &&
+            $self->_SendUInt32("Cmd$i.Timeout", $Timeout) &&
+            $self->_SendString("Cmd$i.In", $Cmd->{In} || "") &&
+            $self->_SendString("Cmd$i.Out", $Cmd->{Out} || "") &&
+            $self->_SendString("Cmd$i.Err", $Cmd->{Err} || "");
+    my $j = 0;
+    foreach my $Arg (@{$Cmd->{Argv}})
+    {
+      last if (!$Sent);
+      $Sent = $self->_SendString("Cmd$i.$j", $Arg);
+      $j++;
+    }
+    $i++;
+  }
+
+  my $Results;
+  if ($Sent and defined $self->_RecvList('.' x (5 * @$Commands)))
+  {
+    $Results = [];
+    for ($i = 0; $i < @$Commands; $i++)
+    {
+      my $Flags = $self->_RecvUInt32("Result$i.Flags");
+      my $Status = defined $Flags ? $self->_RecvUInt32("Result$i.Status") : undef;
+      my $Start = defined $Status ? $self->_RecvUInt64("Result$i.Start") : undef;
+      my $Elapsed = defined $Start ? $self->_RecvUInt64("Result$i.Elapsed") : undef;
+      my ($Size, $Type) = defined $Elapsed ? $self->_ExpectEntryHeader("Result$i.Error", "su") : ();
+      my $Error = ($Type || "") eq "s" ? $self->_RecvRawString("Result$i.Error", $Size) : undef;
+      if (!defined $Type or ($Type eq "s" and !defined $Error))
+      {
+        $self->_SkipEntries(5 * (@$Commands - $i - 1));
+        $Results = undef;
+        last;
+      }
+      push @$Results, { Status => $Status, TimedOut => ($Flags & 2) ? 1 : 0,
+                        Error => $Error, Start => $Start / 1000000,
+                        Elapsed => $Elapsed / 1000000 };
+    }
+  }
+  $self->SetTimeout($OldTimeout);
+  return $Results;
+}
+
+=pod
+=over 12
+
+=item C<GetOutput()>
+
+Waits at most Timeout seconds for the specified remote process, which must
+have been started with $RUN_STREAM, to produce some output. Returns a
+reference to an array containing the new standard output data, the new
+standard error data and a boolean which is true once both streams have
+ended. Either stream is empty if there is no new data for it. Returns undef
+on error.
+
+=back
+=cut
+
+sub GetOutput($$$)
+{
+  my ($self, $Pid, $Timeout) = @_;
+  debug("GetOutput $Pid, $Timeout\n");
+
+  return undef if (!$self->_CheckNotPipelined("GetOutput"));
+  return undef if (!$self->{agentversion} and !$self->_Connect());
+  if (!$self->_UseStreaming())
+  {
+    $self->_SetError($ERROR, "The server does not support streaming the output");
+    return undef;
+  }
+
+  # Add a 5 second leeway to take into account network transmission delays
+  my $OldTimeout = $self->{timeout};
+  $self->SetTimeout($Timeout + 5);
+
+  my ($Stdout, $Stderr, $EOF);
+  if ($self->_StartRPC($RPC_GETOUTPUT) and
+      $self->_SendListSize('ArgC', 2) and
+      $self->_SendUInt64('Pid', $Pid) and
+      $self->_SendUInt32('Timeout', $Timeout) and
+      defined $self->_RecvList('..I'))
+  {
+    $Stdout = $self->_ExpectEntry('Stdout', 'd');
+    $Stderr = $self->_ExpectEntry('Stderr', 'd') if (defined $Stdout);
+    $EOF = $self->_RecvUInt32('EOF') if (defined $Stderr);
+  }
+  $self->SetTimeout($OldTimeout);
+  return undef if (!defined $EOF);
+
+  # Both the standard output and error streams have ended
+  return [$Stdout, $Stderr, $EOF == 3];
+}
+
+=pod
+=over 12
+
+=item C<WaitWithOutput()>
+
+Like Wait() but for a process started with $RUN_STREAM. OnOutput is called
+with the new standard output and standard error data as soon as the process
+produces some.
+
+=back
+=cut
+
+sub WaitWithOutput($$$$$)
+{
+  my ($self, $Pid, $WaitTimeout, $Keepalive, $OnOutput) = @_;
+
+  $Keepalive ||= 0xffffffff;
+  my $WaitDeadline = $WaitTimeout ? time() + $WaitTimeout : undef;
+  while (1)
+  {
+    my $Remaining = $Keepalive;
+    if ($WaitDeadline)
+    {
+      $Remaining = $WaitDeadline - time();
+      $Remaining = 0 if ($Remaining < 0);
+      $Remaining = $Keepalive if ($Keepalive < $Remaining);
+    }
+    my $Output = $self->GetOutput($Pid, $Remaining);
+    return undef if (!$Output);
+    &$OnOutput($Output->[0], $Output->[1]) if ($Output->[0] ne "" or $Output->[1] ne "");
+    last if ($Output->[2]);
+    last if ($WaitDeadline and time() >= $WaitDeadline);
+  }
+
+  # The process closed its output streams but may still be running
+  if ($WaitDeadline)
+  {
+    $WaitTimeout = $WaitDeadline - time();
+    $WaitTimeout = 1 if ($WaitTimeout < 1);
+  }
+  return $self->Wait($Pid, $WaitTimeout, $Keepalive);
+}
+
+=pod
+=over 12
+
+=item C<Wait()>
+
+Waits at most WaitTimeout seconds for the specified remote process to terminate.
+The Keepalive specifies how often, in seconds, to check that the remote end
+is still alive and reachable.
+
+If Usage is a reference to a hash, and the server supports it, it receives
+the resources used by the process: UserTime and SysTime, the CPU time in
+seconds, MaxRSS, the peak memory usage in KiB, InBlocks and OutBlocks, the
+number of block input and output operations, and WallTime, how long the
+process ran in seconds.
+
+=back
+=cut
+
+sub Wait($$$;$$)
+{
+  my ($self, $Pid, $WaitTimeout, $Keepalive, $Usage) = @_;
+  debug("Wait $Pid, ", defined $WaitTimeout ? $WaitTimeout : "<undef>", ", ",
+        defined $Keepalive ? $Keepalive : "<undef>", "\n");
+
+  return undef if (!$self->_CheckNotPipelined("Wait"));
+
+  my $Result;
+  $Keepalive ||= 0xffffffff;
+  my $OldTimeout = $self->{timeout};
+
+  my $WaitDeadline = $WaitTimeout ? time() + $WaitTimeout : undef;
+  while (1)
+  {
+    my $Remaining = $Keepalive;
+    if ($WaitDeadline)
+    {
+      $Remaining = $WaitDeadline - time();
+      last if ($Remaining < 0);
+      $Remaining = $Keepalive if ($Keepalive < $Remaining);
+    }
+    # Add a 5 second leeway to take into account network transmission delays
     $self->SetTimeout($Remaining + 5);
 
     # Make sure we have the server version
     last if (!$self->{agentversion} and !$self->_Connect());
+    my $WithUsage = ($Usage and $self->_UseUsage());
 
     # Send the command
     if ($self->{agentversion} =~ / 1\.0$/)
@@ -1250,16 +3038,27 @@ sub Wait($$$;$)
     else
     {
       if (!$self->_StartRPC($RPC_WAIT2) or
-          !$self->_SendListSize('ArgC', 2) or
+          !$self->_SendListSize('ArgC', $WithUsage ? 3 : 2) or
           !$self->_SendUInt64('Pid', $Pid) or
-          !$self->_SendUInt32('Timeout', $Remaining))
+          !$self->_SendUInt32('Timeout', $Remaining) or
+          ($WithUsage and !$self->_SendUInt32('Flags', 1)))
       {
         last;
       }
     }
 
     # Get the reply
-    $Result = $self->_RecvList('I');
+    my @Reply = $self->_RecvList($WithUsage ? 'IQQQQQQ' : 'I');
+    $Result = $Reply[0];
+    if (defined $Result and $WithUsage)
+    {
+      %$Usage = (UserTime => $Reply[1] / 1000000,
+                 SysTime => $Reply[2] / 1000000,
+                 MaxRSS => $Reply[3],
+                 InBlocks => $Reply[4],
+                 OutBlocks => $Reply[5],
+                 WallTime => $Reply[6] / 1000000);
+    }
 
     # The process has quit
     last if (defined $Result);
@@ -1275,26 +3074,144 @@ sub Wait($$$;$)
   return $Result;
 }
 
-sub Rm($@)
+=pod
+=over 12
+
+=item C<WaitMany()>
+
+Waits at most WaitTimeout seconds for any of the specified remote processes
+to terminate or, if WaitAll is true, for all of them. Pids is a reference to
+the array of process ids. The Keepalive specifies how often, in seconds, to
+check that the remote end is still alive and reachable.
+
+Returns a reference to a hash mapping the pid of each process that
+terminated to its exit status, or undef in case of error. So if the timeout
+expires the hash only contains the processes that terminated in time, if
+any.
+
+=back
+=cut
+
+sub WaitMany($$$$;$)
 {
-  my $self = shift @_;
-  debug("Rm\n");
+  my ($self, $Pids, $WaitAll, $WaitTimeout, $Keepalive) = @_;
+  debug("WaitMany [@$Pids], ", $WaitAll ? "all" : "any", ", ",
+        defined $WaitTimeout ? $WaitTimeout : "<undef>", ", ",
+        defined $Keepalive ? $Keepalive : "<undef>", "\n");
 
-  # Send the command
-  if (!$self->_StartRPC($RPC_RM) or
-      !$self->_SendListSize('Count', scalar(@_)))
+  return undef if (!$self->_CheckNotPipelined("WaitMany"));
+  return undef if (!$self->{agentversion} and !$self->_Connect());
+  if (!$self->_UseWaitMany())
   {
-    return $self->GetLastError();
+    $self->_SetError($ERROR, "The server does not support waiting on multiple processes");
+    return undef;
   }
-  my $i = 0;
-  foreach my $Filename (@_)
+  if (!@$Pids)
   {
-    return $self->GetLastError() if (!$self->_SendString("File$i", $Filename));
-    $i++;
+    $self->_SetError($ERROR, "No process to wait for");
+    return undef;
   }
 
-  # Get the reply
-  return $self->_RecvErrorList();
+  my $Result;
+  $Keepalive ||= 0xffffffff;
+  my $OldTimeout = $self->{timeout};
+
+  my $WaitDeadline = $WaitTimeout ? time() + $WaitTimeout : undef;
+  while (1)
+  {
+    my $Remaining = $Keepalive;
+    if ($WaitDeadline)
+    {
+      $Remaining = $WaitDeadline - time();
+      $Remaining = 0 if ($Remaining < 0);
+      $Remaining = $Keepalive if ($Keepalive < $Remaining);
+    }
+    # Add a 5 second leeway to take into account network transmission delays
+    $self->SetTimeout($Remaining + 5);
+
+    # Send the command
+    if (!$self->_StartRPC($RPC_WAITMANY) or
+        !$self->_SendListSize('ArgC', 2 + @$Pids) or
+        !$self->_SendUInt32('Flags', $WaitAll ? 1 : 0) or
+        !$self->_SendUInt32('Timeout', $Remaining))
+    {
+      $Result = undef;
+      last;
+    }
+    my $i = 0;
+    foreach my $Pid (@$Pids)
+    {
+      last if (!$self->_SendUInt64("Pid$i", $Pid));
+      $i++;
+    }
+
+    # Get the reply
+    my $Count = $i == @$Pids ? $self->_RecvListSize('ListSize') : undef;
+    if (defined $Count)
+    {
+      $Result = {};
+      for ($i = 0; $i < $Count; $i += 2)
+      {
+        my $Pid = $self->_RecvUInt64("Pid$i");
+        my $Status = defined $Pid ? $self->_RecvUInt32("Status$i") : undef;
+        if (!defined $Status)
+        {
+          $self->_SkipEntries($Count - $i - (defined $Pid ? 2 : 1));
+          $Result = undef;
+          last;
+        }
+        $Result->{$Pid} = $Status;
+      }
+    }
+    else
+    {
+      $Result = undef;
+    }
+
+    # Unless interrupted by the network, check if the wait is over
+    if ($Result)
+    {
+      my $Exited = scalar(keys %$Result);
+      last if ($WaitAll ? $Exited == @$Pids : $Exited);
+      last if ($WaitDeadline and time() >= $WaitDeadline);
+      next;
+    }
+
+    # Flaky network connections like to break while we're waiting for the
+    # reply. So retry if that happens and let the automatic reconnection
+    # detect real network issues.
+    last if ($self->{err} !~ /network read timed out/);
+  }
+  $self->SetTimeout($OldTimeout);
+  return $Result;
+}
+
+sub Rm($@)
+{
+  my $self = shift @_;
+  debug("Rm\n");
+
+  my @Filenames = @_;
+  return $self->_CallRPC(sub {
+    # Send the command
+    if (!$self->_StartRPC($RPC_RM) or
+        !$self->_SendListSize('Count', scalar(@Filenames)))
+    {
+      return undef;
+    }
+    my $i = 0;
+    foreach my $Filename (@Filenames)
+    {
+      return undef if (!$self->_SendString("File$i", $Filename));
+      $i++;
+    }
+    return 1;
+  }, sub {
+    my ($Sent) = @_;
+
+    # Get the reply
+    return $Sent ? $self->_RecvErrorList() : $self->GetLastError();
+  });
 }
 
 sub SetTime($)
@@ -1302,32 +3219,25 @@ sub SetTime($)
   my ($self) = @_;
   debug("SetTime\n");
 
-  # Send the command
-  if (!$self->_StartRPC($RPC_SETTIME) or
-      !$self->_SendListSize('ArgC', 2) or
-      !$self->_SendUInt64('Time', time()) or
-      !$self->_SendUInt32('Leeway', 30))
-  {
-      return undef;
-  }
+  return $self->_CallRPC(sub {
+    # Send the command
+    return $self->_StartRPC($RPC_SETTIME) &&
+           $self->_SendListSize('ArgC', 2) &&
+           $self->_SendUInt64('Time', time()) &&
+           $self->_SendUInt32('Leeway', 30);
+  }, sub {
+    my ($Sent) = @_;
 
-  # Get the reply
-  return $self->_RecvList('');
+    # Get the reply
+    return $Sent ? $self->_RecvList('') : undef;
+  });
 }
 
-sub GetProperties($;$)
+# Receives a list of name=value strings and returns them as a hash reference
+sub _RecvProperties($)
 {
-  my ($self, $PropName) = @_;
-  debug("GetProperties ", $PropName || "", "\n");
-
-  # Send the command
-  if (!$self->_StartRPC($RPC_GETPROPERTIES) or
-      !$self->_SendListSize('ArgC', 0))
-  {
-    return undef;
-  }
+  my ($self) = @_;
 
-  # Get the reply
   my $Count = $self->_RecvListSize('PropertyCount');
   return undef if (!$Count);
 
@@ -1367,21 +3277,85 @@ sub GetProperties($;$)
     else
     {
       $self->_SetError($ERROR, "Expected an s entry but got $Type instead");
-      $self->_SkipRawData("Prop$i.$Type", $Size);
+      $self->_SkipEntryData("Prop$i.$Type", $Type, $Size);
       $self->_SkipEntries($Count);
       return undef;
     }
     $i++;
   }
-
-  return $Properties->{$PropName} if (defined $PropName);
   return $Properties;
 }
 
+sub GetProperties($;$)
+{
+  my ($self, $PropName) = @_;
+  debug("GetProperties ", $PropName || "", "\n");
+
+  return $self->_CallRPC(sub {
+    # Send the command
+    return $self->_StartRPC($RPC_GETPROPERTIES) &&
+           $self->_SendListSize('ArgC', 0);
+  }, sub {
+    my ($Sent) = @_;
+    return undef if (!$Sent);
+
+    # Get the reply
+    my $Properties = $self->_RecvProperties();
+    return undef if (!$Properties);
+
+    return $Properties->{$PropName} if (defined $PropName);
+    return $Properties;
+  });
+}
+
+=pod
+=over 12
+
+=item C<GetStats()>
+
+Returns a reference to a hash containing the server statistics, or undef in
+case of error. For each RPC type the server has seen this includes the
+following, in microseconds and bytes as appropriate:
+  rpc.NAME.calls, rpc.NAME.errors  The call and error counts.
+  rpc.NAME.in, rpc.NAME.out        The size of the requests and replies.
+  rpc.NAME.usecs                   The total time spent on the RPC.
+  rpc.NAME.latency.FLOOR           How many calls took at least FLOOR, and
+                                   less than the next FLOOR, microseconds.
+The xfer.DIRECTION.METHOD.* values describe the file transfers, and
+stats.uptime is how many seconds the statistics cover. If Reset is true the
+server starts over afterwards.
+
+=back
+=cut
+
+sub GetStats($;$)
+{
+  my ($self, $Reset) = @_;
+  debug("GetStats\n");
+
+  return $self->_CallRPC(sub {
+    # Make sure we have the server version
+    return undef if (!$self->{agentversion} and !$self->_Connect());
+    if (!$self->_UseStats())
+    {
+      $self->_SetError($ERROR, "The server does not support statistics");
+      return undef;
+    }
+
+    return $self->_StartRPC($RPC_GETSTATS) &&
+           $self->_SendListSize('ArgC', 1) &&
+           $self->_SendUInt32('Flags', $Reset ? 1 : 0);
+  }, sub {
+    my ($Sent) = @_;
+    return $Sent ? $self->_RecvProperties() : undef;
+  });
+}
+
 sub Upgrade($$)
 {
   my ($self, $Filename) = @_;
   debug("Upgrade $Filename\n");
+  return undef if (!$self->_CheckNotPipelined("Upgrade"));
 
   my $fh;
   if (!open($fh, "<", $Filename))
@@ -1416,23 +3390,26 @@ sub RemoveChildProcess($$)
   my ($self, $Pid) = @_;
   debug("RmChildProcess $Pid\n");
 
-  # Make sure we have the server version
-  return undef if (!$self->{agentversion} and !$self->_Connect());
+  my $NoOp;
+  return $self->_CallRPC(sub {
+    # Make sure we have the server version
+    return undef if (!$self->{agentversion} and !$self->_Connect());
 
-  # Up to 1.5 a seemingly successful Wait RPC automatically removes child
-  # processes.
-  return 1 if ($self->{agentversion} =~ / 1\.[0-5]$/);
+    # Up to 1.5 a seemingly successful Wait RPC automatically removes child
+    # processes.
+    return $NoOp = 1 if ($self->{agentversion} =~ / 1\.[0-5]$/);
 
-  # Send the command
-  if (!$self->_StartRPC($RPC_RMCHILDPROC) or
-      !$self->_SendListSize('ArgC', 1) or
-      !$self->_SendUInt64('Pid', $Pid))
-  {
-      return undef;
-  }
+    # Send the command
+    return $self->_StartRPC($RPC_RMCHILDPROC) &&
+           $self->_SendListSize('ArgC', 1) &&
+           $self->_SendUInt64('Pid', $Pid);
+  }, sub {
+    my ($Sent) = @_;
+    return 1 if ($NoOp);
 
-  # Get the reply
-  return $self->_RecvList('');
+    # Get the reply
+    return $Sent ? $self->_RecvList('') : undef;
+  });
 }
 
 sub GetCwd($)
@@ -1440,15 +3417,16 @@ sub GetCwd($)
   my ($self) = @_;
   debug("GetCwd\n");
 
-  # Send the command
-  if (!$self->_StartRPC($RPC_GETCWD) or
-      !$self->_SendListSize('ArgC', 0))
-  {
-    return undef;
-  }
+  return $self->_CallRPC(sub {
+    # Send the command
+    return $self->_StartRPC($RPC_GETCWD) &&
+           $self->_SendListSize('ArgC', 0);
+  }, sub {
+    my ($Sent) = @_;
 
-  # Get the reply
-  return $self->_RecvList('s');
+    # Get the reply
+    return $Sent ? $self->_RecvList('s') : undef;
+  });
 }
 
 1;
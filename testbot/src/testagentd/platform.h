@@ -22,6 +22,8 @@
  */
 
 #ifdef WIN32
+/* Allow select() to handle more than the default 64 sockets */
+# define FD_SETSIZE 256
 # include <ws2tcpip.h>
 # include <windows.h>
 
@@ -36,12 +38,14 @@ typedef ULONGLONG uint64_t;
 #else
 
 # include <arpa/inet.h>
+# include <netinet/tcp.h>
 # include <sys/types.h>
 # include <sys/socket.h>
 # include <sys/select.h>
 # include <netdb.h>
 
 typedef int SOCKET;
+# define INVALID_SOCKET (-1)
 # define closesocket(sock) close((sock))
 
 #define U64FMT "%lu"
@@ -51,6 +55,8 @@ typedef int SOCKET;
 # define O_BINARY 0
 #endif
 
+#include "protocol.h"
+
 
 /*
  * Platform-specific functions.
@@ -58,35 +64,143 @@ typedef int SOCKET;
 
 int platform_init(void);
 
-enum run_flags_t {
-    RUN_DNT = 1,
-    RUN_DNTRUNC_OUT = 2,
-    RUN_DNTRUNC_ERR = 4,
+/* Lets the server wait for activity on many sockets at once. Each socket is
+ * registered along with an opaque pointer which is returned in the matching
+ * poll_event_t structure when the socket becomes ready.
+ */
+enum poll_events_t {
+    POLLEV_IN = 1,
+    POLLEV_OUT = 2,
+    POLLEV_ERR = 4,
+};
+
+struct poll_event_t
+{
+    void* data;
+    int events;
 };
 
-#define RUN_NOTIMEOUT  ((uint32_t)0xffffffff)
+int platform_poll_add(SOCKET sock, int events, void* data);
+int platform_poll_mod(SOCKET sock, int events, void* data);
+void platform_poll_del(SOCKET sock);
+
+/* Waits at most timeout milliseconds for one of the registered sockets to
+ * become ready, -1 meaning no timeout. Returns the number of events stored
+ * in the events array, or -1 if an unrecoverable error occurred.
+ */
+int platform_poll(struct poll_event_t* events, int count, int timeout);
+
+/* Returns true, once, after the statistics were requested from outside the
+ * server, that is through SIGUSR1 on Unix.
+ */
+int platform_dump_requested(void);
+
+int platform_setnonblocking(SOCKET sock);
+
+/* Sends the content of all the buffers, in order, with a single system call.
+ * If more is set, the caller already knows that more data will follow so
+ * it's not worth sending a partial packet yet. Returns the number of bytes
+ * sent, or -1 if an error occurred.
+ */
+#define MAX_SEND_BUFFERS 64
+struct send_buffer_t
+{
+    const char* data;
+    unsigned len;
+};
+
+int platform_sendv(SOCKET sock, const struct send_buffer_t* bufs, int count, int more);
+
+/* Sends up to size bytes from the current position of the file to the
+ * socket without copying them through a userspace buffer. Returns the number
+ * of bytes sent, 0 if the end of the file was reached, -1 if an error
+ * occurred, and -2 if this is not supported for this file or platform, in
+ * which case the caller should use read() and send() instead.
+ */
+int platform_sendfile(SOCKET sock, int fd, uint64_t size);
+
+/* Receives up to size bytes from the socket and writes them to the file
+ * without copying them through a userspace buffer. Returns the number of
+ * bytes received, 0 if the connection was closed, -1 if a socket error
+ * occurred, and -2 if this is not supported, in which case the caller should
+ * use recv() and write() instead.
+ * If writing to the file fails, the data is still consumed and *werror is
+ * set to the corresponding errno value.
+ */
+int platform_recvfile(SOCKET sock, int fd, uint64_t size, int* werror);
+
+/* Switches platform_sendfile() and platform_recvfile() to the io_uring
+ * engine: each chunk then goes through a registered buffer as a linked file
+ * read and socket send, or socket receive and file write, submitted with a
+ * single system call. Returns 0 if io_uring is not available, in which case
+ * the default engine remains in use.
+ */
+int platform_init_uring(void);
+
+/* Returns the user and system CPU time used by the server so far, in
+ * microseconds.
+ */
+void platform_getcpu(uint64_t* utime, uint64_t* stime);
+
+/* Returns a monotonic time in microseconds */
+uint64_t platform_gettime(void);
 
 /* Starts the specified command in the background and reports the status to
  * the client.
+ * With RUN_STREAM the standard output and error that are not redirected to a
+ * file go to pipes instead, see platform_read_output().
  */
 uint64_t platform_run(char** argv, uint32_t flags, char** redirects);
 
-/* If a command was started in the background, waits until either that command
- * terminates, the specified timeout (in seconds) expires, or the client
- * disconnects (typically because it got tired of waiting).
+/* Reads up to size bytes of the standard output (stream 1) or error
+ * (stream 2) of a child process started with RUN_STREAM, without blocking.
+ * Returns the number of bytes read, 0 if there is no new output yet, -1 once
+ * the end of the output has been reached or if it is not being captured, and
+ * -2 if the process is unknown.
+ * platform_poll() returns early, or at least regularly, when a child process
+ * has new output. Calling this when there is none is cheap so it can be
+ * done on every loop iteration.
+ */
+int platform_read_output(uint64_t pid, int stream, char* buf, unsigned size);
+
+/* Checks whether a command that was started in the background has exited.
+ * Returns 1 and sets childstatus if it has, 2 if it is still running and 0
+ * if the process is unknown, for instance because it was not started by
+ * platform_run().
  * Note that this does not cause the child process to be forgotten, even if it
  * did exit. This is so that the client can retrieve the information again if
  * needed (e.g. in case it did not receive it due to a network issue).
- * If no command was started in the background, then reports an error
- * immediately.
+ * platform_poll() returns early when a child process exits so the server can
+ * check on its waiters.
+ */
+int platform_wait(uint64_t pid, uint32_t *childstatus);
+
+struct child_usage_t
+{
+    uint64_t utime, stime;     /* User and system CPU time in microseconds */
+    uint64_t maxrss;           /* Peak resident set size in KiB */
+    uint64_t inblock, oublock; /* Block input and output operation counts */
+    uint64_t wall;             /* Run time in microseconds */
+};
+
+/* Retrieves the resources used by the specified child process once it has
+ * exited. Returns the same values as platform_wait().
  */
-int platform_wait(SOCKET client, uint64_t pid, uint32_t timeout, uint32_t *childstatus);
+int platform_getusage(uint64_t pid, struct child_usage_t* usage);
 
 /* Causes the given child process to be forgotten, which means it will no longer
  * be possible to wait for it or retrieve its exit status.
  */
 int platform_rmchildproc(SOCKET client, uint64_t pid);
 
+/* Kills the specified child process. Its exit status can then be retrieved
+ * through platform_wait() as usual.
+ */
+int platform_kill(uint64_t pid);
+
+/* Returns the number of processors the child processes can run on. */
+uint32_t platform_getcpucount(void);
+
 /* Sets the system time to the specified Unix epoch. If the system time is
  * already within leeway seconds of the specified time, then consider that
  * the system clock is already correct.
@@ -102,6 +216,7 @@ int platform_upgrade_script(const char* script, const char* tmpserver, char** ar
 
 /* Returns a string describing the last socket-related error */
 int sockeintr(void);
+int sockewouldblock(void);
 const char* sockerror(void);
 
 /* Converts a socket address into a string stored in a static buffer. */
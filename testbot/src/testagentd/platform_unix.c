@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -27,84 +28,235 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/time.h>
 
+#ifdef __NR_io_uring_setup
+# include <linux/io_uring.h>
+#endif
+
 #include "platform.h"
 #include "list.h"
 
 
 struct child_t
 {
-    struct list entry;
+    struct list entry; /* In the children hash table */
     uint64_t pid;
     int reaped;
     uint32_t status;
+    struct rusage usage;
+    uint64_t start, end; /* For the run time */
+    int outfds[2]; /* The RUN_STREAM stdout and stderr pipes or -1 */
+    int readable[2]; /* Set when the pipe may have new output */
 };
 
-static struct list children = LIST_INIT(children);
+/* The child processes, hashed on their pid. The number of buckets is a power
+ * of two and grows with the number of children so lookups remain O(1) even
+ * when thousands of short-lived processes are being tracked.
+ */
+static struct list* children;
+static unsigned children_size, children_count;
+
+static int epfd = -1;
 
+/* SIGCHLD and SIGUSR1 are blocked and delivered through this file
+ * descriptor so they get handled from the main loop rather than from a signal
+ * handler.
+ */
+static int signal_fd = -1;
+
+/* Set when SIGUSR1 asks for the statistics */
+static int dump_requested;
 
-void reaper(int signum)
+/* The child process output pipes are in their own epoll set so
+ * platform_poll() can tell which one has new output. That set is itself in
+ * the main one with this marker.
+ */
+static int output_epfd = -1;
+static char output_marker;
+
+/* The signal mask to restore in the child processes */
+static sigset_t child_sigmask;
+
+
+static struct list* child_bucket(uint64_t pid)
+{
+    return &children[pid & (children_size - 1)];
+}
+
+static int grow_children(void)
+{
+    struct list *buckets, *old;
+    unsigned size, oldsize, i;
+
+    oldsize = children_size;
+    size = oldsize ? oldsize * 2 : 64;
+    buckets = malloc(size * sizeof(*buckets));
+    if (!buckets)
+        return 0;
+    for (i = 0; i < size; i++)
+        list_init(&buckets[i]);
+
+    old = children;
+    children = buckets;
+    children_size = size;
+    for (i = 0; i < oldsize; i++)
+    {
+        struct child_t *child, *next;
+        LIST_FOR_EACH_ENTRY_SAFE(child, next, &old[i], struct child_t, entry)
+        {
+            list_remove(&child->entry);
+            list_add_head(child_bucket(child->pid), &child->entry);
+        }
+    }
+    free(old);
+    return 1;
+}
+
+static struct child_t* find_child(uint64_t pid)
+{
+    struct child_t* child;
+
+    LIST_FOR_EACH_ENTRY(child, child_bucket(pid), struct child_t, entry)
+    {
+        if (child->pid == pid)
+            return child;
+    }
+    return NULL;
+}
+
+static void add_child(struct child_t* child)
+{
+    /* Keep the chains short but carry on if memory is tight */
+    if (children_count >= children_size * 2)
+        grow_children();
+    list_add_head(child_bucket(child->pid), &child->entry);
+    children_count++;
+}
+
+static void remove_child(struct child_t* child)
+{
+    list_remove(&child->entry);
+    children_count--;
+}
+
+/* Collects the exit status of all the child processes that have terminated.
+ * Since SIGCHLD signals get coalesced there may be any number of them, and
+ * the detached ones must be reaped too so they do not linger as zombies.
+ */
+static void reap_children(void)
 {
     struct child_t* child;
+    struct rusage usage;
     pid_t pid;
     int status;
 
-    pid = wait(&status);
-    debug("process %u returned %u\n", pid, status);
-
-    LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
     {
-        if (child->pid == pid)
+        debug("process %u returned %u\n", pid, status);
+        child = find_child(pid);
+        if (child)
         {
             child->status = status;
+            child->usage = usage;
+            child->end = platform_gettime();
             child->reaped = 1;
-            break;
         }
     }
 }
 
+/* Makes platform_poll() return and set readable when there is new output
+ * in the pipe.
+ */
+static void watch_output(int fd, int* readable)
+{
+    struct epoll_event ev;
+
+    /* Edge-triggered so unread output does not keep waking it up */
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = readable;
+    *readable = 1;
+    if (epoll_ctl(output_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        error("could not add %d to the epoll set: %s\n", fd, strerror(errno));
+}
+
+static void close_output(struct child_t* child, int i)
+{
+    struct epoll_event ev;
+
+    /* Make sure no event can refer to the child once freed */
+    epoll_ctl(output_epfd, EPOLL_CTL_DEL, child->outfds[i], &ev);
+    close(child->outfds[i]);
+    child->outfds[i] = -1;
+    child->readable[i] = 0;
+}
+
 uint64_t platform_run(char** argv, uint32_t flags, char** redirects)
 {
     pid_t pid;
     int fds[3] = {-1, -1, -1};
+    int outfds[2] = {-1, -1};
     int ofl, i;
 
+    if ((flags & RUN_STREAM) && (flags & RUN_DNT))
+    {
+        set_status(ST_ERROR, "the output of a detached process cannot be streamed");
+        return 0;
+    }
     for (i = 0; i < 3; i++)
     {
         if (redirects[i][0] == '\0')
+        {
+            if (i && (flags & RUN_STREAM))
+            {
+                int p[2];
+                if (pipe2(p, O_CLOEXEC) < 0)
+                {
+                    set_status(ST_ERROR, "could not create a pipe: %s", strerror(errno));
+                    pid = 0;
+                    goto done;
+                }
+                fcntl(p[0], F_SETFL, O_NONBLOCK);
+                outfds[i - 1] = p[0];
+                fds[i] = p[1];
+            }
             continue;
+        }
         switch (i)
         {
         case 0:
             ofl = O_RDONLY;
             break;
         case 1:
-            ofl = O_APPEND | O_CREAT | (flags & RUN_DNTRUNC_OUT ? 0 : O_TRUNC);
+            ofl = O_WRONLY | O_APPEND | O_CREAT | (flags & RUN_DNTRUNC_OUT ? 0 : O_TRUNC);
             break;
         case 2:
-            ofl = O_APPEND | O_CREAT | (flags & RUN_DNTRUNC_ERR ? 0 : O_TRUNC);
+            ofl = O_WRONLY | O_APPEND | O_CREAT | (flags & RUN_DNTRUNC_ERR ? 0 : O_TRUNC);
             break;
         }
         fds[i] = open(redirects[i], ofl, 0666);
         if (fds[i] < 0)
         {
             set_status(ST_ERROR, "unable to open '%s' for %s: %s", redirects[i], i ? "writing" : "reading", strerror(errno));
-            while (i > 0)
-            {
-                if (fds[i] != -1)
-                    close(fds[i]);
-                i--;
-            }
-            return 0;
+            pid = 0;
+            goto done;
         }
     }
 
     pid = fork();
     if (pid == 0)
     {
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
         for (i = 0; i < 3; i++)
         {
             if (fds[i] != -1)
@@ -124,98 +276,162 @@ uint64_t platform_run(char** argv, uint32_t flags, char** redirects)
     }
     else
     {
+        /* The child cannot be reaped before it has been added to the table
+         * since this only happens in platform_poll()
+         */
         if (!(flags & RUN_DNT))
         {
             struct child_t* child;
             child = malloc(sizeof(*child));
             child->pid = pid;
             child->reaped = 0;
-            list_add_head(&children, &child->entry);
+            child->start = platform_gettime();
+            for (i = 0; i < 2; i++)
+            {
+                child->outfds[i] = outfds[i];
+                child->readable[i] = 0;
+                if (outfds[i] != -1)
+                    watch_output(outfds[i], &child->readable[i]);
+                outfds[i] = -1;
+            }
+            add_child(child);
         }
     }
+
+ done:
     for (i = 0; i < 3; i++)
         if (fds[i] != -1)
             close(fds[i]);
+    for (i = 0; i < 2; i++)
+        if (outfds[i] != -1)
+            close(outfds[i]);
     return pid;
 }
 
-int platform_wait(SOCKET client, uint64_t pid, uint32_t timeout, uint32_t *childstatus)
+int platform_wait(uint64_t pid, uint32_t *childstatus)
 {
     struct child_t* child;
-    time_t deadline;
 
-    LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
+    child = find_child(pid);
+    if (!child)
     {
-        if (child->pid == pid)
-            break;
+        set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
+        return 0;
     }
-    if (!child || child->pid != pid)
+
+    if (!child->reaped)
+        return 2;
+    debug("process " U64FMT " returned status %u\n", pid, child->status);
+    *childstatus = child->status;
+    return 1;
+}
+
+int platform_getusage(uint64_t pid, struct child_usage_t* usage)
+{
+    struct child_t* child;
+
+    child = find_child(pid);
+    if (!child)
     {
         set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
         return 0;
     }
+    if (!child->reaped)
+        return 2;
+
+    usage->utime = (uint64_t)child->usage.ru_utime.tv_sec * 1000000 + child->usage.ru_utime.tv_usec;
+    usage->stime = (uint64_t)child->usage.ru_stime.tv_sec * 1000000 + child->usage.ru_stime.tv_usec;
+    /* Linux reports it in KiB already */
+    usage->maxrss = child->usage.ru_maxrss;
+    usage->inblock = child->usage.ru_inblock;
+    usage->oublock = child->usage.ru_oublock;
+    usage->wall = child->end - child->start;
+    return 1;
+}
+
+int platform_read_output(uint64_t pid, int stream, char* buf, unsigned size)
+{
+    struct child_t *child;
+    int fd, r;
 
-    if (timeout != RUN_NOTIMEOUT)
-        deadline = time(NULL) + timeout;
-    while (!child->reaped)
+    child = find_child(pid);
+    if (!child)
     {
-        fd_set rfds;
-        char buffer;
-        struct timeval tv;
-        int ready;
+        set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
+        return -2;
+    }
 
-        /* select() blocks until either the client disconnects, or
-         * the SIGCHLD signal indicates the child has exited. The recv() call
-         * tells us if it is the former.
-         */
-        debug("Waiting for " U64FMT "\n", pid);
-        FD_ZERO(&rfds);
-        FD_SET(client, &rfds);
-        if (timeout != RUN_NOTIMEOUT)
-        {
-            tv.tv_sec = deadline - time(NULL);
-            if (tv.tv_sec < 0)
-                tv.tv_sec = 0;
-            tv.tv_usec = 0;
-        }
-        ready = select(client+1, &rfds, NULL, NULL, timeout != RUN_NOTIMEOUT ? &tv : NULL);
-        if (ready == 0)
-        {
-            /* This is the timeout */
-            set_status(ST_ERROR, "timed out waiting for the child process");
-            return 0;
-        }
-        if (ready == 1 && FD_ISSET(client, &rfds) &&
-            recv(client, &buffer, 1, MSG_PEEK | MSG_DONTWAIT) <= 0)
-        {
-            set_status(ST_FATAL, "connection closed");
-            return 0;
-        }
+    fd = child->outfds[stream - 1];
+    if (fd == -1)
+        return -1;
+    /* Don't bother reading until the pipe gets new output */
+    if (!child->readable[stream - 1])
+        return 0;
+    r = read(fd, buf, size);
+    if (r > 0)
+    {
+        /* Any output arriving after this read will set readable again */
+        if (r < size)
+            child->readable[stream - 1] = 0;
+        return r;
     }
-    debug("process " U64FMT " returned status %u\n", pid, child->status);
-    *childstatus = child->status;
-    return 1;
+    if (r < 0 && errno == EAGAIN)
+    {
+        child->readable[stream - 1] = 0;
+        return 0;
+    }
+    if (r < 0 && errno == EINTR)
+        return 0;
+    if (r < 0)
+        debug("  could not read the output of " U64FMT ": %s\n", pid, strerror(errno));
+
+    close_output(child, stream - 1);
+    return -1;
 }
 
 int platform_rmchildproc(SOCKET client, uint64_t pid)
 {
     struct child_t *child;
+    int i;
 
-    LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
+    child = find_child(pid);
+    if (!child)
     {
-        if (child->pid == pid)
-            break;
+        set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
+        return 0;
     }
-    if (!child || child->pid != pid)
+    for (i = 0; i < 2; i++)
+        if (child->outfds[i] != -1)
+            close_output(child, i);
+    remove_child(child);
+    free(child);
+    return 1;
+}
+
+int platform_kill(uint64_t pid)
+{
+    struct child_t* child;
+
+    child = find_child(pid);
+    if (!child)
     {
         set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
         return 0;
     }
-    list_remove(&child->entry);
-    free(child);
+    if (!child->reaped && kill(pid, SIGKILL) < 0 && errno != ESRCH)
+    {
+        set_status(ST_ERROR, "could not kill the " U64FMT " process: %s", pid, strerror(errno));
+        return 0;
+    }
     return 1;
 }
 
+uint32_t platform_getcpucount(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
 int platform_settime(uint64_t epoch, uint32_t leeway)
 {
     struct timeval tv;
@@ -270,11 +486,538 @@ int platform_upgrade_script(const char* script, const char* tmpserver, char** ar
     return 1;
 }
 
+static uint32_t to_epoll_events(int events)
+{
+    return (events & POLLEV_IN ? EPOLLIN : 0) |
+           (events & POLLEV_OUT ? EPOLLOUT : 0);
+}
+
+int platform_poll_add(SOCKET sock, int events, void* data)
+{
+    struct epoll_event ev;
+
+    ev.events = to_epoll_events(events);
+    ev.data.ptr = data;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+    {
+        error("could not add %d to the epoll set: %s\n", sock, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+int platform_poll_mod(SOCKET sock, int events, void* data)
+{
+    struct epoll_event ev;
+
+    ev.events = to_epoll_events(events);
+    ev.data.ptr = data;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &ev) < 0)
+    {
+        error("could not modify %d in the epoll set: %s\n", sock, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+void platform_poll_del(SOCKET sock)
+{
+    /* Linux < 2.6.9 requires a non-NULL pointer even though it is unused */
+    struct epoll_event ev;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sock, &ev);
+}
+
+int platform_poll(struct poll_event_t* events, int count, int timeout)
+{
+    struct epoll_event evs[64];
+    int n, i;
+
+    if (count > sizeof(evs) / sizeof(*evs))
+        count = sizeof(evs) / sizeof(*evs);
+    n = epoll_wait(epfd, evs, count, timeout);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        error("epoll_wait() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    count = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (evs[i].data.ptr == &signal_fd)
+        {
+            struct signalfd_siginfo si;
+            while (read(signal_fd, &si, sizeof(si)) > 0)
+            {
+                if (si.ssi_signo == SIGUSR1)
+                    dump_requested = 1;
+            }
+            /* Child processes may have exited, the caller will check on them */
+            reap_children();
+            continue;
+        }
+        if (evs[i].data.ptr == &output_marker)
+        {
+            /* Flag the pipes that have new output, the caller will check
+             * them.
+             */
+            struct epoll_event outevs[64];
+            int j, m;
+            while ((m = epoll_wait(output_epfd, outevs, sizeof(outevs) / sizeof(*outevs), 0)) > 0)
+            {
+                for (j = 0; j < m; j++)
+                    *(int*)outevs[j].data.ptr = 1;
+                if (m < sizeof(outevs) / sizeof(*outevs))
+                    break;
+            }
+            continue;
+        }
+        events[count].data = evs[i].data.ptr;
+        events[count].events = (evs[i].events & EPOLLIN ? POLLEV_IN : 0) |
+                               (evs[i].events & EPOLLOUT ? POLLEV_OUT : 0) |
+                               (evs[i].events & (EPOLLERR | EPOLLHUP) ? POLLEV_ERR : 0);
+        count++;
+    }
+    return count;
+}
+
+int platform_dump_requested(void)
+{
+    int r = dump_requested;
+    dump_requested = 0;
+    return r;
+}
+
+int platform_setnonblocking(SOCKET sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        error("could not make %d non-blocking: %s\n", sock, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+int platform_sendv(SOCKET sock, const struct send_buffer_t* bufs, int count, int more)
+{
+    struct iovec iov[MAX_SEND_BUFFERS];
+    struct msghdr msg;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        iov[i].iov_base = (void*)bufs[i].data;
+        iov[i].iov_len = bufs[i].len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return sendmsg(sock, &msg, more ? MSG_MORE : 0);
+}
+
+
+/*
+ * The io_uring engine.
+ *
+ * The transfers are synchronous like with the default engine, but each
+ * chunk takes a single io_uring_enter() call for both the file and the socket
+ * operation. The chunks go through a single registered buffer which all the
+ * connections share since it is always unused between calls.
+ */
+
+#ifdef __NR_io_uring_setup
+
+#define URING_BUFFER_SIZE  1048576
+
+static struct
+{
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    char* buf;
+} uring = {-1};
+
+static int uring_has_ops(void)
+{
+    static const int ops[] = {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                              IORING_OP_SEND, IORING_OP_RECV};
+    struct io_uring_probe* probe;
+    unsigned i, size;
+    int supported = 1;
+
+    size = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, size);
+    if (!probe)
+        return 0;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PROBE,
+                probe, IORING_OP_LAST) < 0)
+        supported = 0;
+    for (i = 0; supported && i < sizeof(ops) / sizeof(*ops); i++)
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = 0;
+    free(probe);
+    return supported;
+}
+
+int platform_init_uring(void)
+{
+    struct io_uring_params params;
+    struct iovec iov;
+    size_t sqsize, cqsize;
+    char *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+    uring.fd = syscall(__NR_io_uring_setup, 4, &params);
+    if (uring.fd < 0)
+    {
+        error("io_uring_setup() failed: %s\n", strerror(errno));
+        return 0;
+    }
+    fcntl(uring.fd, F_SETFD, FD_CLOEXEC);
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_has_ops())
+    {
+        error("this kernel's io_uring implementation is too old\n");
+        goto failed;
+    }
+
+    sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqsize > sqsize)
+        sqsize = cqsize;
+    sq = cq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uring.fd, IORING_OFF_SQES);
+    uring.buf = mmap(NULL, URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sq == MAP_FAILED || uring.sqes == MAP_FAILED || uring.buf == MAP_FAILED)
+    {
+        error("could not map the io_uring rings: %s\n", strerror(errno));
+        goto failed;
+    }
+    uring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    /* Spare the kernel from mapping the buffer for every operation */
+    iov.iov_base = uring.buf;
+    iov.iov_len = URING_BUFFER_SIZE;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+    {
+        error("could not register the io_uring buffer: %s\n", strerror(errno));
+        goto failed;
+    }
+    return 1;
+
+ failed:
+    /* The mappings are not worth unmapping */
+    close(uring.fd);
+    uring.fd = -1;
+    return 0;
+}
+
+/* Queues an operation on the registered buffer. Its result goes to
+ * res[index].
+ */
+static void uring_queue(unsigned index, int op, int fd, unsigned len,
+                        int flags, int linked)
+{
+    unsigned tail = *uring.sq_tail + index;
+    struct io_uring_sqe* sqe = &uring.sqes[tail & *uring.sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)uring.buf;
+    sqe->len = len;
+    if (op == IORING_OP_READ_FIXED || op == IORING_OP_WRITE_FIXED)
+        sqe->off = (uint64_t)-1; /* Use the current file position */
+    else
+        sqe->msg_flags = flags;
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = index;
+    uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+}
+
+/* Submits the count queued operations and waits for their results, which
+ * are the values the matching system calls would return, or -errno.
+ */
+static int uring_run(unsigned count, int* res)
+{
+    unsigned submit = count, done = 0;
+
+    __atomic_store_n(uring.sq_tail, *uring.sq_tail + count, __ATOMIC_RELEASE);
+    while (done < count)
+    {
+        unsigned head = *uring.cq_head;
+        unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+            res[cqe->user_data] = cqe->res;
+            done++;
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        if (done < count)
+        {
+            int r = syscall(__NR_io_uring_enter, uring.fd, submit,
+                            count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (r < 0 && errno != EINTR)
+                return 0;
+            if (r > 0)
+                submit -= r;
+        }
+    }
+    return 1;
+}
+
+/* Writes the data that could not go through the linked write */
+static void uring_write(int fd, const char* data, size_t size, int* werror)
+{
+    while (size && !*werror)
+    {
+        ssize_t w = write(fd, data, size);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            *werror = w < 0 ? errno : ENOSPC;
+        else
+        {
+            data += w;
+            size -= w;
+        }
+    }
+}
+
+static int uring_recvfile(SOCKET sock, int fd, uint64_t size, int* werror)
+{
+    int avail, res[2];
+
+    /* Only receive what is already there, otherwise a short receive would
+     * cancel the write and leave the data to write in two calls anyway.
+     */
+    if (ioctl(sock, FIONREAD, &avail) < 0)
+        return -1;
+    if (avail <= 0)
+    {
+        /* Check for the end of the connection or an error */
+        char c;
+        int r = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (r > 0)
+        {
+            /* The data just arrived, let the caller try again */
+            errno = EAGAIN;
+            return -1;
+        }
+        return r;
+    }
+    if (size > avail)
+        size = avail;
+    if (size > URING_BUFFER_SIZE)
+        size = URING_BUFFER_SIZE;
+
+    uring_queue(0, IORING_OP_RECV, sock, size, MSG_DONTWAIT | MSG_WAITALL, 1);
+    uring_queue(1, IORING_OP_WRITE_FIXED, fd, size, 0, 0);
+    if (!uring_run(2, res))
+        return -1;
+    if (res[0] <= 0)
+    {
+        errno = -res[0];
+        return res[0] ? -1 : 0;
+    }
+
+    /* The data has been taken off the socket so it must be written, whether
+     * through the linked write or not.
+     */
+    if (res[1] < 0 && res[1] != -ECANCELED && res[1] != -EINVAL &&
+        res[1] != -EOPNOTSUPP)
+        *werror = -res[1];
+    else
+    {
+        int w = res[1] < 0 ? 0 : res[1];
+        uring_write(fd, uring.buf + w, res[0] - w, werror);
+    }
+    return res[0];
+}
+
+static int uring_sendfile(SOCKET sock, int fd, uint64_t size)
+{
+    int res[2];
+
+    if (size > URING_BUFFER_SIZE)
+        size = URING_BUFFER_SIZE;
+    uring_queue(0, IORING_OP_READ_FIXED, fd, size, 0, 1);
+    uring_queue(1, IORING_OP_SEND, sock, size, MSG_DONTWAIT, 0);
+    if (!uring_run(2, res))
+        return -1;
+    if (res[0] < 0)
+    {
+        errno = -res[0];
+        return res[0] == -EINVAL || res[0] == -EOPNOTSUPP ? -2 : -1;
+    }
+    if (res[0] == 0)
+        return 0;
+
+    /* A short read cancels the send */
+    if (res[1] == -ECANCELED)
+    {
+        uring_queue(0, IORING_OP_SEND, sock, res[0], MSG_DONTWAIT, 0);
+        if (!uring_run(1, res + 1))
+            return -1;
+    }
+
+    /* Put back what could not be sent, like sendfile() would */
+    if (res[1] < res[0] &&
+        lseek(fd, (res[1] < 0 ? 0 : res[1]) - res[0], SEEK_CUR) < 0)
+        return -1;
+    if (res[1] < 0)
+    {
+        errno = -res[1];
+        return -1;
+    }
+    return res[1];
+}
+
+#else
+
+int platform_init_uring(void)
+{
+    error("io_uring is not supported in this build\n");
+    return 0;
+}
+
+#endif
+
+int platform_sendfile(SOCKET sock, int fd, uint64_t size)
+{
+    ssize_t r;
+
+#ifdef __NR_io_uring_setup
+    if (uring.fd != -1)
+        return uring_sendfile(sock, fd, size);
+#endif
+
+    /* Linux never transfers more than this in one go anyway */
+    if (size > 0x7ffff000)
+        size = 0x7ffff000;
+    r = sendfile(sock, fd, NULL, size);
+    if (r < 0 && (errno == EINVAL || errno == ENOSYS))
+        return -2;
+    return r;
+}
+
+/* The pipe through which platform_recvfile() splices the data. It is always
+ * empty between calls so all connections can share it.
+ */
+static int splice_pipe[2] = {-1, -1};
+static size_t splice_size;
+
+int platform_recvfile(SOCKET sock, int fd, uint64_t size, int* werror)
+{
+    char buffer[65536];
+    ssize_t r, w;
+    size_t left;
+    int copy = 0;
+
+    *werror = 0;
+#ifdef __NR_io_uring_setup
+    if (uring.fd != -1)
+        return uring_recvfile(sock, fd, size, werror);
+#endif
+    if (splice_pipe[0] == -1)
+    {
+        int pipesize;
+        if (pipe2(splice_pipe, O_CLOEXEC) < 0)
+            return -2;
+        /* A bigger pipe means fewer round trips, but it is fine if the
+         * system refuses
+         */
+        fcntl(splice_pipe[1], F_SETPIPE_SZ, 1048576);
+        pipesize = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+        splice_size = pipesize > 0 ? pipesize : 65536;
+    }
+
+    if (size > splice_size)
+        size = splice_size;
+    r = splice(sock, NULL, splice_pipe[1], NULL, size,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (r < 0)
+        return (errno == EINVAL || errno == ENOSYS) ? -2 : -1;
+
+    /* The data has been taken off the socket so it must be moved out of the
+     * pipe, whether it can be written to the file or not.
+     */
+    left = r;
+    while (left)
+    {
+        if (!*werror && !copy)
+        {
+            w = splice(splice_pipe[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+            if (w > 0)
+                left -= w;
+            else if (w < 0 && errno == EINVAL)
+                copy = 1; /* Not supported for this file */
+            else if (w < 0 && errno != EINTR)
+                *werror = errno;
+            else if (w == 0)
+                *werror = EIO;
+            continue;
+        }
+
+        w = read(splice_pipe[0], buffer, left < sizeof(buffer) ? left : sizeof(buffer));
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+        {
+            /* This should not happen but the pipe is now out of sync */
+            errno = EIO;
+            return -1;
+        }
+        left -= w;
+        errno = 0;
+        if (!*werror && write(fd, buffer, w) != w)
+            *werror = errno ? errno : ENOSPC;
+    }
+    return r;
+}
+
+void platform_getcpu(uint64_t* utime, uint64_t* stime)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    *utime = (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+    *stime = (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+}
+
+uint64_t platform_gettime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 int sockeintr(void)
 {
     return errno == EINTR;
 }
 
+int sockewouldblock(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
 const char* sockerror(void)
 {
     return strerror(errno);
@@ -331,16 +1074,52 @@ void ta_freeaddrinfo(struct addrinfo *addresses)
 int platform_init(void)
 {
     struct sigaction sa, osa;
+    sigset_t mask;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        error("could not create the epoll set: %s\n", strerror(errno));
+        return 0;
+    }
+    output_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (output_epfd < 0)
+    {
+        error("could not create the output epoll set: %s\n", strerror(errno));
+        return 0;
+    }
+    if (!platform_poll_add(output_epfd, POLLEV_IN, &output_marker))
+        return 0;
+    if (!grow_children())
+    {
+        error("could not allocate the child process table\n");
+        return 0;
+    }
 
-    /* Catch SIGCHLD so we can keep track of child processes */
-    sa.sa_handler = reaper;
+    /* Make sure SIGCHLD is not ignored, otherwise the child processes would
+     * be reaped automatically. Then block it and SIGUSR1 so they are only
+     * delivered through signal_fd.
+     */
+    sa.sa_handler = SIG_DFL;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, &osa) < 0)
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, &osa);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, &child_sigmask) < 0)
     {
-        error("could not set up the SIGCHLD handler: %s\n", strerror(errno));
+        error("could not block the signals: %s\n", strerror(errno));
         return 0;
     }
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd < 0)
+    {
+        error("could not create the signalfd: %s\n", strerror(errno));
+        return 0;
+    }
+    if (!platform_poll_add(signal_fd, POLLEV_IN, &signal_fd))
+        return 0;
 
     /* Catch SIGPIPE so we don't die if the client disconnects at an
      * inconvenient time
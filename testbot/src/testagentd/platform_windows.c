@@ -23,26 +23,53 @@
 #include "platform.h"
 #include "list.h"
 
+/* This needs the windows.h definitions that platform.h provides */
+#include <psapi.h>
+
 struct child_t
 {
     struct list entry;
     DWORD pid;
     HANDLE handle;
+    HANDLE outpipes[2]; /* The RUN_STREAM stdout and stderr pipes */
 };
 
 static struct list children = LIST_INIT(children);
 
+struct pollsock_t
+{
+    SOCKET sock;
+    int events;
+    void* data;
+};
+
+static struct pollsock_t pollsocks[FD_SETSIZE];
+static unsigned npollsocks = 0;
+
+/* How often to check on the child processes and their output, in
+ * milliseconds.
+ */
+#define CHILD_POLL_INTERVAL 200
+
 
 uint64_t platform_run(char** argv, uint32_t flags, char** redirects)
 {
     DWORD stdhandles[3] = {STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE};
     HANDLE fhs[3] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
+    HANDLE outpipes[2] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
     SECURITY_ATTRIBUTES sa;
     STARTUPINFO si;
     PROCESS_INFORMATION pi;
+    uint64_t pid = 0;
     int has_redirects, i, cmdsize;
     char *cmdline, *d, **arg;
 
+    if ((flags & RUN_STREAM) && (flags & RUN_DNT))
+    {
+        set_status(ST_ERROR, "the output of a detached process cannot be streamed");
+        return 0;
+    }
+
     sa.nLength = sizeof(sa);
     sa.lpSecurityDescriptor = NULL;
     sa.bInheritHandle = TRUE;
@@ -83,6 +110,18 @@ uint64_t platform_run(char** argv, uint32_t flags, char** redirects)
     for (i = 0; i < 3; i++)
     {
         DWORD access, creation;
+        if (redirects[i][0] == '\0' && i && (flags & RUN_STREAM))
+        {
+            if (!CreatePipe(&outpipes[i - 1], &fhs[i], &sa, 0))
+            {
+                set_status(ST_ERROR, "could not create a pipe: %lu", GetLastError());
+                goto error;
+            }
+            /* Only the child process should inherit the write end */
+            SetHandleInformation(outpipes[i - 1], HANDLE_FLAG_INHERIT, 0);
+            has_redirects = 1;
+            continue;
+        }
         if (redirects[i][0] == '\0')
         {
             fhs[i] = GetStdHandle(stdhandles[i]);
@@ -109,14 +148,7 @@ uint64_t platform_run(char** argv, uint32_t flags, char** redirects)
         if (fhs[i] == INVALID_HANDLE_VALUE)
         {
             set_status(ST_ERROR, "unable to open '%s' for %s: %lu", redirects[i], i ? "writing" : "reading", GetLastError());
-            free(cmdline);
-            while (i > 0)
-            {
-                if (fhs[i] != INVALID_HANDLE_VALUE)
-                    CloseHandle(fhs[i]);
-                i--;
-            }
-            return 0;
+            goto error;
         }
     }
 
@@ -130,7 +162,7 @@ uint64_t platform_run(char** argv, uint32_t flags, char** redirects)
                         NULL, NULL, &si, &pi))
     {
         set_status(ST_ERROR, "could not run '%s': %lu", cmdline, GetLastError());
-        return 0;
+        goto error;
     }
     CloseHandle(pi.hThread);
 
@@ -142,23 +174,32 @@ uint64_t platform_run(char** argv, uint32_t flags, char** redirects)
         child = malloc(sizeof(*child));
         child->pid = pi.dwProcessId;
         child->handle = pi.hProcess;
+        for (i = 0; i < 2; i++)
+        {
+            child->outpipes[i] = outpipes[i];
+            outpipes[i] = INVALID_HANDLE_VALUE;
+        }
         list_add_head(&children, &child->entry);
     }
+    pid = pi.dwProcessId;
 
+ error:
     free(cmdline);
+    /* The child process has its own copy of the handles */
     for (i = 0; i < 3; i++)
-        if (redirects[i][0])
+    {
+        if (fhs[i] != INVALID_HANDLE_VALUE && fhs[i] != GetStdHandle(stdhandles[i]))
             CloseHandle(fhs[i]);
-
-    return pi.dwProcessId;
+        if (i && outpipes[i - 1] != INVALID_HANDLE_VALUE)
+            CloseHandle(outpipes[i - 1]);
+    }
+    return pid;
 }
 
-int platform_wait(SOCKET client, uint64_t pid, uint32_t timeout, uint32_t *childstatus)
+int platform_wait(uint64_t pid, uint32_t *childstatus)
 {
     struct child_t *child;
-    HANDLE handles[2];
-    u_long nbio;
-    DWORD r, success;
+    DWORD r;
 
     LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
     {
@@ -171,59 +212,106 @@ int platform_wait(SOCKET client, uint64_t pid, uint32_t timeout, uint32_t *child
         return 0;
     }
 
-    /* Wait for either the socket to be closed, indicating a client-side
-     * timeout, or for the child process to exit.
+    /* Don't close child->handle so we can retrieve the exit status again if
+     * needed.
      */
-    handles[0] = WSACreateEvent();
-    WSAEventSelect(client, handles[0], FD_CLOSE);
-    handles[1] = child->handle;
-    r = WaitForMultipleObjects(2, handles, FALSE, timeout == RUN_NOTIMEOUT ? INFINITE : timeout * 1000);
+    r = WaitForSingleObject(child->handle, 0);
+    if (r == WAIT_TIMEOUT)
+        return 2;
+    if (r != WAIT_OBJECT_0 || !GetExitCodeProcess(child->handle, &r))
+    {
+        set_status(ST_ERROR, "could not get the " U64FMT " process status (%lu)", pid, GetLastError());
+        return 0;
+    }
+    debug("  process %lu returned status %lu\n", child->pid, r);
+    *childstatus = r;
+    return 1;
+}
+
+static uint64_t filetime_to_usec(const FILETIME* ft)
+{
+    /* FILETIME is in 100 ns units */
+    return (((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime) / 10;
+}
 
-    success = 0;
-    switch (r)
+int platform_getusage(uint64_t pid, struct child_usage_t* usage)
+{
+    struct child_t *child;
+    FILETIME creation, exit, kernel, user;
+    PROCESS_MEMORY_COUNTERS mem;
+    IO_COUNTERS io;
+
+    LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
     {
-    case WAIT_OBJECT_0:
-        set_status(ST_ERROR, "connection closed");
-        break;
+        if (child->pid == pid)
+            break;
+    }
+    if (!child || child->pid != pid)
+    {
+        set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
+        return 0;
+    }
+    if (WaitForSingleObject(child->handle, 0) == WAIT_TIMEOUT)
+        return 2;
 
-    case WAIT_OBJECT_0 + 1:
-        if (GetExitCodeProcess(child->handle, &r))
-        {
-            debug("  process %lu returned status %lu\n", child->pid, r);
-            *childstatus = r;
-            success = 1;
-        }
-        else
-            debug("GetExitCodeProcess() failed (%lu). Giving up!\n", GetLastError());
-        break;
-    case WAIT_TIMEOUT:
-        set_status(ST_ERROR, "timed out waiting for the child process");
-        success = 0;
-        goto cleanup;
-    default:
-        debug("WaitForMultipleObjects() returned %lu (le=%lu). Giving up!\n", r, GetLastError());
-        break;
+    memset(usage, 0, sizeof(*usage));
+    if (GetProcessTimes(child->handle, &creation, &exit, &kernel, &user))
+    {
+        usage->utime = filetime_to_usec(&user);
+        usage->stime = filetime_to_usec(&kernel);
+        usage->wall = filetime_to_usec(&exit) - filetime_to_usec(&creation);
     }
-    /* Don't close child->handle so we can retrieve the exit status again if
-     * needed.
-     */
+    mem.cb = sizeof(mem);
+    if (GetProcessMemoryInfo(child->handle, &mem, sizeof(mem)))
+        usage->maxrss = mem.PeakWorkingSetSize / 1024;
+    /* Windows only counts the read and write operations, whatever the device */
+    if (GetProcessIoCounters(child->handle, &io))
+    {
+        usage->inblock = io.ReadOperationCount;
+        usage->oublock = io.WriteOperationCount;
+    }
+    return 1;
+}
 
- cleanup:
-    /* We must reset WSAEventSelect before we can make
-     * the socket blocking again.
-     */
-    WSAEventSelect(client, handles[0], 0);
-    CloseHandle(handles[0]);
-    nbio = 0;
-    if (WSAIoctl(client, FIONBIO, &nbio, sizeof(nbio), &nbio, sizeof(nbio), &r, NULL, NULL) == SOCKET_ERROR)
-        debug("WSAIoctl(FIONBIO) failed: %s\n", sockerror());
+int platform_read_output(uint64_t pid, int stream, char* buf, unsigned size)
+{
+    struct child_t *child;
+    HANDLE pipe;
+    DWORD avail, got;
+
+    LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
+    {
+        if (child->pid == pid)
+            break;
+    }
+    if (!child || child->pid != pid)
+    {
+        set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
+        return -2;
+    }
 
-    return success;
+    pipe = child->outpipes[stream - 1];
+    if (pipe == INVALID_HANDLE_VALUE)
+        return -1;
+    /* Only read what is available so this does not block */
+    if (PeekNamedPipe(pipe, NULL, 0, NULL, &avail, NULL))
+    {
+        if (!avail)
+            return 0;
+        if (ReadFile(pipe, buf, avail < size ? avail : size, &got, NULL))
+            return got;
+    }
+    /* Typically ERROR_BROKEN_PIPE once the child process closed its end */
+    debug("  the output of " U64FMT " is closed (%lu)\n", pid, GetLastError());
+    CloseHandle(pipe);
+    child->outpipes[stream - 1] = INVALID_HANDLE_VALUE;
+    return -1;
 }
 
 int platform_rmchildproc(SOCKET client, uint64_t pid)
 {
     struct child_t *child;
+    int i;
 
     LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
     {
@@ -237,11 +325,47 @@ int platform_rmchildproc(SOCKET client, uint64_t pid)
     }
 
     CloseHandle(child->handle);
+    for (i = 0; i < 2; i++)
+        if (child->outpipes[i] != INVALID_HANDLE_VALUE)
+            CloseHandle(child->outpipes[i]);
     list_remove(&child->entry);
     free(child);
     return 1;
 }
 
+int platform_kill(uint64_t pid)
+{
+    struct child_t *child;
+
+    LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
+    {
+        if (child->pid == pid)
+            break;
+    }
+    if (!child || child->pid != pid)
+    {
+        set_status(ST_ERROR, "the " U64FMT " process does not exist or is not a child process", pid);
+        return 0;
+    }
+
+    /* This fails if the process already exited, which is fine */
+    if (!TerminateProcess(child->handle, 1) &&
+        WaitForSingleObject(child->handle, 0) != WAIT_OBJECT_0)
+    {
+        set_status(ST_ERROR, "could not kill the " U64FMT " process (%lu)", pid, GetLastError());
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t platform_getcpucount(void)
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+}
+
 int platform_settime(uint64_t epoch, uint32_t leeway)
 {
     FILETIME filetime;
@@ -312,11 +436,203 @@ int platform_upgrade_script(const char* script, const char* tmpserver, char** ar
     return 1;
 }
 
-int sockretry(void)
+static struct pollsock_t* find_pollsock(SOCKET sock)
+{
+    unsigned i;
+    for (i = 0; i < npollsocks; i++)
+        if (pollsocks[i].sock == sock)
+            return &pollsocks[i];
+    return NULL;
+}
+
+int platform_poll_add(SOCKET sock, int events, void* data)
+{
+    if (npollsocks == FD_SETSIZE)
+    {
+        error("too many sockets to poll\n");
+        return 0;
+    }
+    pollsocks[npollsocks].sock = sock;
+    pollsocks[npollsocks].events = events;
+    pollsocks[npollsocks].data = data;
+    npollsocks++;
+    return 1;
+}
+
+int platform_poll_mod(SOCKET sock, int events, void* data)
+{
+    struct pollsock_t* ps = find_pollsock(sock);
+    if (!ps)
+    {
+        error("socket %u is not being polled\n", (unsigned)sock);
+        return 0;
+    }
+    ps->events = events;
+    ps->data = data;
+    return 1;
+}
+
+void platform_poll_del(SOCKET sock)
+{
+    struct pollsock_t* ps = find_pollsock(sock);
+    if (ps)
+        *ps = pollsocks[--npollsocks];
+}
+
+int platform_poll(struct poll_event_t* events, int count, int timeout)
+{
+    struct child_t *child;
+    fd_set rfds, wfds, efds;
+    struct timeval tv;
+    unsigned i;
+    int n;
+
+    /* select() cannot wait on processes or pipes so wake up regularly to
+     * let the caller check on its waiters.
+     */
+    LIST_FOR_EACH_ENTRY(child, &children, struct child_t, entry)
+    {
+        if (child->outpipes[0] != INVALID_HANDLE_VALUE ||
+            child->outpipes[1] != INVALID_HANDLE_VALUE ||
+            WaitForSingleObject(child->handle, 0) == WAIT_TIMEOUT)
+        {
+            if (timeout < 0 || timeout > CHILD_POLL_INTERVAL)
+                timeout = CHILD_POLL_INTERVAL;
+            break;
+        }
+    }
+
+    if (!npollsocks)
+    {
+        /* select() fails if there is no socket at all */
+        Sleep(timeout < 0 ? INFINITE : timeout);
+        return 0;
+    }
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    for (i = 0; i < npollsocks; i++)
+    {
+        if (pollsocks[i].events & POLLEV_IN)
+            FD_SET(pollsocks[i].sock, &rfds);
+        if (pollsocks[i].events & POLLEV_OUT)
+            FD_SET(pollsocks[i].sock, &wfds);
+        FD_SET(pollsocks[i].sock, &efds);
+    }
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (select(0, &rfds, &wfds, &efds, timeout < 0 ? NULL : &tv) == SOCKET_ERROR)
+    {
+        if (sockeintr())
+            return 0;
+        error("select() failed: %s\n", sockerror());
+        return -1;
+    }
+
+    n = 0;
+    for (i = 0; i < npollsocks && n < count; i++)
+    {
+        int ev = (FD_ISSET(pollsocks[i].sock, &rfds) ? POLLEV_IN : 0) |
+                 (FD_ISSET(pollsocks[i].sock, &wfds) ? POLLEV_OUT : 0) |
+                 (FD_ISSET(pollsocks[i].sock, &efds) ? POLLEV_ERR : 0);
+        if (ev)
+        {
+            events[n].data = pollsocks[i].data;
+            events[n].events = ev;
+            n++;
+        }
+    }
+    return n;
+}
+
+int platform_dump_requested(void)
+{
+    /* There is no SIGUSR1 equivalent */
+    return 0;
+}
+
+int platform_setnonblocking(SOCKET sock)
+{
+    u_long nbio = 1;
+    if (ioctlsocket(sock, FIONBIO, &nbio) == SOCKET_ERROR)
+    {
+        error("could not make the socket non-blocking: %s\n", sockerror());
+        return 0;
+    }
+    return 1;
+}
+
+int platform_sendv(SOCKET sock, const struct send_buffer_t* bufs, int count, int more)
+{
+    WSABUF wsabufs[MAX_SEND_BUFFERS];
+    DWORD sent;
+    int i;
+
+    /* There is no MSG_MORE equivalent but with Nagle's algorithm disabled
+     * sending everything in one go is what matters.
+     */
+    for (i = 0; i < count; i++)
+    {
+        wsabufs[i].buf = (char*)bufs[i].data;
+        wsabufs[i].len = bufs[i].len;
+    }
+    if (WSASend(sock, wsabufs, count, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+        return -1;
+    return sent;
+}
+
+int platform_sendfile(SOCKET sock, int fd, uint64_t size)
+{
+    /* TransmitFile() does not mix well with non-blocking sockets */
+    return -2;
+}
+
+int platform_recvfile(SOCKET sock, int fd, uint64_t size, int* werror)
+{
+    return -2;
+}
+
+int platform_init_uring(void)
+{
+    return 0;
+}
+
+void platform_getcpu(uint64_t* utime, uint64_t* stime)
+{
+    FILETIME creation, exit, kernel, user;
+
+    if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+    {
+        *utime = filetime_to_usec(&user);
+        *stime = filetime_to_usec(&kernel);
+    }
+    else
+        *utime = *stime = 0;
+}
+
+uint64_t platform_gettime(void)
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart / frequency.QuadPart * 1000000 +
+           counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+}
+
+int sockeintr(void)
 {
     return (WSAGetLastError() == WSAEINTR);
 }
 
+int sockewouldblock(void)
+{
+    return (WSAGetLastError() == WSAEWOULDBLOCK);
+}
+
 const char* sockerror(void)
 {
     static char msg[1024];
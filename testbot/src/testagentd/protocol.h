@@ -0,0 +1,149 @@
+/*
+ * The testagentd wire protocol, shared by the server and the client library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+/* The uint32_t and uint64_t types must be defined before including this
+ * header, see platform.h.
+ *
+ * Once connected the server sends its version as an 's' entry. Then the
+ * client sends RPCs, which are made of the RPC id and the parameter count as
+ * raw 32-bit integers, followed by the parameters. The replies are the
+ * number of values, also as a raw 32-bit integer, followed by the values.
+ * The parameters and values are entries made of a one byte type, the size of
+ * the data as a 64-bit integer, and the data proper:
+ *   'I'  A 32-bit integer.
+ *   'Q'  A 64-bit integer.
+ *   's'  A string, including the trailing '\0'.
+ *   'd'  Some data, typically the content of a file.
+ *   'z'  Some data compressed with zlib. The size is that of the uncompressed
+ *        data, and it is followed by a series of chunks, each made of its
+ *        size as a 32-bit integer and of that much compressed data. An
+ *        empty chunk terminates the entry.
+ *   'e'  An error message, in place of the reply values.
+ *   'u'  An undefined value.
+ * All the integers are in network byte order.
+ */
+#define ENTRY_HEADER_SIZE 9
+
+enum rpc_ids_t
+{
+    RPCID_PING = 0,
+    RPCID_GETFILE,
+    RPCID_SENDFILE,
+    RPCID_RUN,
+    RPCID_WAIT,
+    RPCID_RM,
+    RPCID_WAIT2,
+    RPCID_SETTIME,
+    RPCID_GETPROPERTIES,
+    RPCID_UPGRADE,
+    RPCID_RMCHILDPROC,
+    RPCID_GETCWD,
+    RPCID_BATCH,
+    RPCID_HAVE,
+    RPCID_MATCHBLOCKS,
+    RPCID_GETOUTPUT,
+    RPCID_SENDTREE,
+    RPCID_GETTREE,
+    RPCID_WAITMANY,
+    RPCID_RUNBATCH,
+    RPCID_GETSTATS,
+    RPCID_COUNT
+};
+
+#define NO_RPCID         (~((uint32_t)0))
+
+/* The RPC flags. See the matching RPC implementation for details. */
+enum getfile_flags_t {
+    GF_COMPRESS = 1,
+    GF_CHECKSUM = 2,
+};
+
+enum sendfile_flags_t {
+    SF_EXECUTABLE = 1,
+    SF_CACHE = 2,
+    SF_DELTA = 4,
+    SF_APPEND = 8,
+    SF_CHECKSUM = 16,
+};
+
+enum run_flags_t {
+    RUN_DNT = 1,
+    RUN_DNTRUNC_OUT = 2,
+    RUN_DNTRUNC_ERR = 4,
+    RUN_STREAM = 8,
+};
+
+#define RUN_NOTIMEOUT  ((uint32_t)0xffffffff)
+
+enum wait_flags_t {
+    WAIT_USAGE = 1,
+};
+
+enum output_flags_t {
+    OUT_STDOUT_EOF = 1,
+    OUT_STDERR_EOF = 2,
+};
+
+enum waitmany_flags_t {
+    WM_ALL = 1,
+};
+
+enum runbatch_result_t {
+    RB_NOTRUN = 1,
+    RB_TIMEDOUT = 2,
+};
+
+enum getstats_flags_t {
+    GS_RESET = 1,
+};
+
+static inline void put_uint32(unsigned char* buf, uint32_t u32)
+{
+    buf[0] = u32 >> 24;
+    buf[1] = u32 >> 16;
+    buf[2] = u32 >> 8;
+    buf[3] = u32;
+}
+
+static inline void put_uint64(unsigned char* buf, uint64_t u64)
+{
+    put_uint32(buf, u64 >> 32);
+    put_uint32(buf + 4, u64 & 0xffffffff);
+}
+
+static inline uint32_t get_uint32(const unsigned char* buf)
+{
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+           ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static inline uint64_t get_uint64(const unsigned char* buf)
+{
+    return ((uint64_t)get_uint32(buf) << 32) | get_uint32(buf + 4);
+}
+
+static inline void put_entry_header(unsigned char* buf, char type, uint64_t size)
+{
+    buf[0] = type;
+    put_uint64(buf + 1, size);
+}
+
+#endif /* __PROTOCOL_H */
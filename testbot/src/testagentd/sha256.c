@@ -0,0 +1,146 @@
+/*
+ * SHA-256 message digest, as described in FIPS 180-4.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <string.h>
+
+#include "platform.h"
+#include "sha256.h"
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform(uint32_t state[8], const unsigned char* block)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+                      ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(struct sha256_t* ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->size = 0;
+}
+
+void sha256_update(struct sha256_t* ctx, const void* data, unsigned size)
+{
+    const unsigned char* p = data;
+    unsigned used = ctx->size % sizeof(ctx->block);
+
+    ctx->size += size;
+    if (used)
+    {
+        unsigned count = sizeof(ctx->block) - used;
+        if (size < count)
+        {
+            memcpy(ctx->block + used, p, size);
+            return;
+        }
+        memcpy(ctx->block + used, p, count);
+        sha256_transform(ctx->state, ctx->block);
+        p += count;
+        size -= count;
+    }
+    while (size >= sizeof(ctx->block))
+    {
+        sha256_transform(ctx->state, p);
+        p += sizeof(ctx->block);
+        size -= sizeof(ctx->block);
+    }
+    memcpy(ctx->block, p, size);
+}
+
+void sha256_final(struct sha256_t* ctx, unsigned char digest[SHA256_SIZE])
+{
+    unsigned used = ctx->size % sizeof(ctx->block);
+    uint64_t bits = ctx->size * 8;
+    int i;
+
+    /* Append the 0x80 terminator and pad with zeroes so the size in bits
+     * fills the end of the last block.
+     */
+    ctx->block[used++] = 0x80;
+    if (used > sizeof(ctx->block) - 8)
+    {
+        memset(ctx->block + used, 0, sizeof(ctx->block) - used);
+        sha256_transform(ctx->state, ctx->block);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, sizeof(ctx->block) - 8 - used);
+    for (i = 0; i < 8; i++)
+        ctx->block[sizeof(ctx->block) - 1 - i] = bits >> (8 * i);
+    sha256_transform(ctx->state, ctx->block);
+
+    for (i = 0; i < SHA256_SIZE; i++)
+        digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void sha256_hex(struct sha256_t* ctx, char hex[SHA256_HEXSIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[SHA256_SIZE];
+    int i;
+
+    sha256_final(ctx, digest);
+    for (i = 0; i < SHA256_SIZE; i++)
+    {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    hex[2 * SHA256_SIZE] = '\0';
+}
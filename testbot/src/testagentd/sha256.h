@@ -0,0 +1,40 @@
+/*
+ * SHA-256 message digest.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#define SHA256_SIZE     32
+/* The size of the hexadecimal representation, including the trailing '\0' */
+#define SHA256_HEXSIZE  (2 * SHA256_SIZE + 1)
+
+struct sha256_t
+{
+    uint32_t state[8];
+    uint64_t size;
+    unsigned char block[64];
+};
+
+void sha256_init(struct sha256_t* ctx);
+void sha256_update(struct sha256_t* ctx, const void* data, unsigned size);
+void sha256_final(struct sha256_t* ctx, unsigned char digest[SHA256_SIZE]);
+
+/* Stores the lowercase hexadecimal representation of the digest in hex */
+void sha256_hex(struct sha256_t* ctx, char hex[SHA256_HEXSIZE]);
+
+#endif /* __SHA256_H */
@@ -0,0 +1,718 @@
+/*
+ * Generates load on a testagentd server to measure its throughput and
+ * latency.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "testagent.h"
+
+static const char *name0;
+
+static void error(const char* format, ...)
+{
+    va_list valist;
+    fprintf(stderr, "%s:error: ", name0);
+    va_start(valist, format);
+    vfprintf(stderr, format, valist);
+    va_end(valist);
+}
+
+static uint64_t gettime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * The operations and their statistics.
+ */
+
+enum op_t
+{
+    OP_PING,
+    OP_GETFILE,
+    OP_SENDFILE,
+    OP_RUN,
+    OP_RM,
+    OP_COUNT,
+    /* These prepare and clean up the server and are not counted */
+    OP_SETUP = OP_COUNT,
+    OP_CLEANUP,
+};
+
+struct op_stats_t
+{
+    const char* name;
+    unsigned weight;
+    uint64_t count, errors, bytes;
+    /* The latency of each operation in microseconds */
+    uint64_t* latencies;
+    uint64_t size;
+};
+
+static struct op_stats_t op_stats[OP_COUNT] = {
+    {"ping"}, {"getfile"}, {"sendfile"}, {"run"}, {"rm"}
+};
+
+static void record_op(enum op_t op, uint64_t latency, uint64_t bytes, int failed)
+{
+    struct op_stats_t* stats = &op_stats[op];
+
+    if (stats->count == stats->size)
+    {
+        uint64_t* latencies;
+        stats->size = stats->size ? stats->size * 2 : 4096;
+        latencies = realloc(stats->latencies, stats->size * sizeof(*latencies));
+        if (!latencies)
+        {
+            error("malloc() failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        stats->latencies = latencies;
+    }
+    stats->latencies[stats->count++] = latency;
+    stats->bytes += bytes;
+    if (failed)
+        stats->errors++;
+}
+
+static int compare_uint64(const void* a, const void* b)
+{
+    uint64_t ua = *(const uint64_t*)a, ub = *(const uint64_t*)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+/* Returns the latency below which the specified fraction of the operations
+ * completed. The latencies must have been sorted.
+ */
+static uint64_t get_percentile(const struct op_stats_t* stats, double fraction)
+{
+    uint64_t rank = fraction * stats->count;
+    return stats->latencies[rank < stats->count ? rank : stats->count - 1];
+}
+
+
+/*
+ * Connections.
+ */
+
+/* A request for which the connection is waiting for the reply */
+struct pending_t
+{
+    enum op_t op;
+    int waiting; /* Set once the run operation is waiting for its child */
+    uint64_t start;
+};
+
+struct bench_conn_t
+{
+    struct ta_conn_t* ta;
+    char sendname[32];
+
+    /* The requests in flight, in the order they were sent. The replies come
+     * in the same order so the library handler just uses the first one.
+     */
+    struct pending_t* pending;
+    unsigned pending_first, pending_count, pending_size;
+
+    /* The current reply */
+    uint64_t data_bytes, value;
+};
+
+static struct bench_conn_t* conns;
+static unsigned conn_count = 1;
+static unsigned depth = 1;
+static uint64_t file_size = 65536;
+static const char* run_cmd = "/bin/true";
+static const char* setup_name = "tabench.dat";
+static char* payload;
+
+/* The load generation state */
+static int setup_done, stopping, cleanup_sent, cleanup_done;
+static uint64_t ops_started, max_ops, deadline, load_start, load_end;
+static unsigned total_weight;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* The CPU time used by the server and by this process at the start and end
+ * of the load, in microseconds. The server only reports it since 1.18.
+ */
+struct cpu_usage_t
+{
+    uint64_t server, client;
+    int server_known;
+};
+static struct cpu_usage_t cpu_start, cpu_end;
+
+static uint64_t next_random(void)
+{
+    /* xorshift64 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void push_pending(struct bench_conn_t* conn, enum op_t op, uint64_t start, int waiting)
+{
+    struct pending_t* p;
+
+    if (conn->pending_first + conn->pending_count == conn->pending_size)
+    {
+        if (conn->pending_first)
+        {
+            memmove(conn->pending, conn->pending + conn->pending_first,
+                    conn->pending_count * sizeof(*conn->pending));
+            conn->pending_first = 0;
+        }
+        else
+        {
+            struct pending_t* pending;
+            conn->pending_size = conn->pending_size ? conn->pending_size * 2 : 16;
+            pending = realloc(conn->pending, conn->pending_size * sizeof(*pending));
+            if (!pending)
+            {
+                error("malloc() failed: %s\n", strerror(errno));
+                exit(1);
+            }
+            conn->pending = pending;
+        }
+    }
+    p = &conn->pending[conn->pending_first + conn->pending_count++];
+    p->op = op;
+    p->waiting = waiting;
+    p->start = start;
+}
+
+static const struct ta_handler_t bench_handler;
+
+static void cpu_stat_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct cpu_usage_t* usage = ctx;
+
+    if (type != 's')
+        return;
+    if (strncmp(data, "stats.cpu.user=", 15) == 0)
+        usage->server += strtoull(data + 15, NULL, 10);
+    else if (strncmp(data, "stats.cpu.system=", 17) == 0)
+        usage->server += strtoull(data + 17, NULL, 10);
+    else
+        return;
+    usage->server_known = 1;
+}
+
+static const struct ta_handler_t cpu_stat_handler = {cpu_stat_value, NULL, NULL};
+
+/* The getstats reply arrives before those of the RPCs queued after it so
+ * this does not disturb the load.
+ */
+static void get_cpu_usage(struct cpu_usage_t* usage)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    usage->client = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+                    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    ta_start_rpc(conns[0].ta, RPCID_GETSTATS, 1, &cpu_stat_handler, usage);
+    ta_put_uint32(conns[0].ta, 0);
+}
+
+static void start_load(uint64_t now)
+{
+    setup_done = 1;
+    load_start = now;
+    deadline += now;
+    get_cpu_usage(&cpu_start);
+}
+
+static void send_op(struct bench_conn_t* conn, enum op_t op)
+{
+    struct ta_conn_t* ta = conn->ta;
+    unsigned i;
+
+    switch (op)
+    {
+    case OP_PING:
+        ta_start_rpc(ta, RPCID_PING, 0, &bench_handler, conn);
+        break;
+    case OP_GETFILE:
+        ta_start_rpc(ta, RPCID_GETFILE, 1, &bench_handler, conn);
+        ta_put_string(ta, setup_name);
+        break;
+    case OP_SETUP:
+    case OP_SENDFILE:
+        ta_start_rpc(ta, RPCID_SENDFILE, 3, &bench_handler, conn);
+        ta_put_string(ta, op == OP_SETUP ? setup_name : conn->sendname);
+        ta_put_uint32(ta, 0);
+        /* All the connections send the same data so it is not copied */
+        ta_put_data_ref(ta, payload, file_size);
+        break;
+    case OP_RUN:
+        ta_start_rpc(ta, RPCID_RUN, 5, &bench_handler, conn);
+        ta_put_uint32(ta, 0);
+        ta_put_string(ta, "");
+        ta_put_string(ta, "");
+        ta_put_string(ta, "");
+        ta_put_string(ta, run_cmd);
+        break;
+    case OP_RM:
+        ta_start_rpc(ta, RPCID_RM, 1, &bench_handler, conn);
+        ta_put_string(ta, conn->sendname);
+        break;
+    case OP_CLEANUP:
+        ta_start_rpc(ta, RPCID_RM, 1 + conn_count, &bench_handler, conn);
+        ta_put_string(ta, setup_name);
+        for (i = 0; i < conn_count; i++)
+            ta_put_string(ta, conns[i].sendname);
+        break;
+    }
+    push_pending(conn, op, gettime(), 0);
+}
+
+static enum op_t pick_op(void)
+{
+    unsigned r = next_random() % total_weight;
+    enum op_t op;
+
+    for (op = 0; op < OP_COUNT - 1; op++)
+    {
+        if (r < op_stats[op].weight)
+            break;
+        r -= op_stats[op].weight;
+    }
+    return op;
+}
+
+/* Keeps depth operations in flight until it is time to stop */
+static void start_ops(struct bench_conn_t* conn)
+{
+    if (!setup_done)
+        return;
+    while (!stopping && conn->pending_count < depth)
+    {
+        if (max_ops ? ops_started >= max_ops : gettime() >= deadline)
+        {
+            stopping = 1;
+            break;
+        }
+        send_op(conn, pick_op());
+        ops_started++;
+    }
+}
+
+static void bench_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct bench_conn_t* conn = ctx;
+
+    if (type == 'd' || type == 'z')
+        conn->data_bytes += size;
+    else if (type == 'I' && size == 4)
+        conn->value = get_uint32((const unsigned char*)data);
+    else if (type == 'Q' && size == 8)
+        conn->value = get_uint64((const unsigned char*)data);
+}
+
+static void bench_done(void* ctx, const char* msg)
+{
+    struct bench_conn_t* conn = ctx;
+    struct pending_t p = conn->pending[conn->pending_first];
+    uint64_t now = gettime();
+    int failed = msg != NULL;
+
+    /* The main loop reports the connection errors */
+    if (ta_is_broken(conn->ta))
+        return;
+
+    conn->pending_first++;
+    conn->pending_count--;
+    if (p.op == OP_SETUP)
+    {
+        if (failed)
+        {
+            error("could not create the '%s' file on the server: %s\n", setup_name, msg);
+            exit(1);
+        }
+        start_load(now);
+    }
+    else if (p.op == OP_CLEANUP)
+        cleanup_done = 1;
+    else if (p.op == OP_RUN && !p.waiting && !failed)
+    {
+        /* Wait for the child process, counting both as one operation */
+        ta_start_rpc(conn->ta, RPCID_WAIT2, 2, &bench_handler, conn);
+        ta_put_uint64(conn->ta, conn->value);
+        ta_put_uint32(conn->ta, RUN_NOTIMEOUT);
+        push_pending(conn, OP_RUN, p.start, 1);
+    }
+    else
+    {
+        uint64_t bytes = p.op == OP_GETFILE ? conn->data_bytes :
+                         p.op == OP_SENDFILE ? file_size : 0;
+        record_op(p.op, now - p.start, bytes, failed ||
+                  (p.op == OP_RUN && conn->value != 0));
+        load_end = now;
+    }
+    conn->data_bytes = 0;
+}
+
+static const struct ta_handler_t bench_handler = {bench_value, NULL, bench_done};
+
+static int open_conn(struct bench_conn_t* conn, const char* host,
+                     const char* port, unsigned id)
+{
+    snprintf(conn->sendname, sizeof(conn->sendname), "tabench-%u.tmp", id);
+    conn->ta = ta_new();
+    if (!conn->ta)
+    {
+        error("malloc() failed: %s\n", strerror(errno));
+        return 0;
+    }
+    if (!ta_connect(conn->ta, host, port, 10000))
+    {
+        error("%s\n", ta_get_error(conn->ta));
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * The load generation proper.
+ */
+
+static int parse_mix(const char* mix)
+{
+    char* copy = strdup(mix);
+    char *item, *saveptr;
+    enum op_t op;
+
+    for (item = strtok_r(copy, ",", &saveptr); item;
+         item = strtok_r(NULL, ",", &saveptr))
+    {
+        char* value = strchr(item, '=');
+        if (value)
+            *value++ = '\0';
+        for (op = 0; op < OP_COUNT; op++)
+            if (strcmp(item, op_stats[op].name) == 0)
+                break;
+        if (op == OP_COUNT)
+        {
+            error("unknown operation '%s'\n", item);
+            free(copy);
+            return 0;
+        }
+        op_stats[op].weight = value ? atoi(value) : 1;
+        total_weight += op_stats[op].weight;
+    }
+    free(copy);
+    if (!total_weight)
+    {
+        error("the operation mix is empty\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void run_load(void)
+{
+    struct pollfd* fds;
+    unsigned i;
+
+    fds = malloc(conn_count * sizeof(*fds));
+    if (!fds)
+    {
+        error("malloc() failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    while (!cleanup_done)
+    {
+        int busy = 0;
+
+        for (i = 0; i < conn_count; i++)
+        {
+            struct bench_conn_t* conn = &conns[i];
+
+            if (!setup_done && i == 0 && !conn->pending_count)
+            {
+                if (!op_stats[OP_GETFILE].weight)
+                    start_load(gettime());
+                else
+                    send_op(conn, OP_SETUP);
+            }
+            start_ops(conn);
+            if (conn->pending_count || ta_get_queued(conn->ta))
+                busy = 1;
+        }
+        if (stopping && !busy && !cleanup_sent)
+        {
+            get_cpu_usage(&cpu_end);
+            send_op(&conns[0], OP_CLEANUP);
+            cleanup_sent = 1;
+        }
+
+        for (i = 0; i < conn_count; i++)
+        {
+            fds[i].fd = ta_get_fd(conns[i].ta);
+            fds[i].events = ta_get_events(conns[i].ta);
+        }
+        if (poll(fds, conn_count, -1) < 0 && errno != EINTR)
+        {
+            error("poll() failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (i = 0; i < conn_count; i++)
+        {
+            if (!ta_process(conns[i].ta, fds[i].revents))
+            {
+                error("%s\n", ta_get_error(conns[i].ta));
+                exit(1);
+            }
+        }
+    }
+    free(fds);
+}
+
+static void print_results(void)
+{
+    double elapsed = (load_end > load_start ? load_end - load_start : 1) / 1000000.0;
+    uint64_t ops = 0, errors = 0, bytes = 0;
+    enum op_t op;
+
+    printf("bench.connections=%u\n", conn_count);
+    printf("bench.depth=%u\n", depth);
+    printf("bench.size=%lu\n", (unsigned long)file_size);
+    printf("bench.elapsed=%.6f\n", elapsed);
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        struct op_stats_t* stats = &op_stats[op];
+
+        ops += stats->count;
+        errors += stats->errors;
+        bytes += stats->bytes;
+        if (!stats->count)
+            continue;
+
+        qsort(stats->latencies, stats->count, sizeof(*stats->latencies), compare_uint64);
+        printf("op.%s.count=%lu\n", stats->name, (unsigned long)stats->count);
+        printf("op.%s.errors=%lu\n", stats->name, (unsigned long)stats->errors);
+        printf("op.%s.ops_per_sec=%.1f\n", stats->name, stats->count / elapsed);
+        printf("op.%s.mb_per_sec=%.3f\n", stats->name, stats->bytes / elapsed / 1000000);
+        printf("op.%s.p50=%lu\n", stats->name, (unsigned long)get_percentile(stats, 0.5));
+        printf("op.%s.p99=%lu\n", stats->name, (unsigned long)get_percentile(stats, 0.99));
+        printf("op.%s.p999=%lu\n", stats->name, (unsigned long)get_percentile(stats, 0.999));
+        printf("op.%s.max=%lu\n", stats->name, (unsigned long)stats->latencies[stats->count - 1]);
+    }
+    printf("bench.ops=%lu\n", (unsigned long)ops);
+    printf("bench.errors=%lu\n", (unsigned long)errors);
+    printf("bench.ops_per_sec=%.1f\n", ops / elapsed);
+    printf("bench.mb_per_sec=%.3f\n", bytes / elapsed / 1000000);
+
+    /* The CPU cost of the transfers, in CPU seconds per GB */
+    printf("bench.client_cpu_usecs=%lu\n", (unsigned long)(cpu_end.client - cpu_start.client));
+    if (bytes)
+        printf("bench.client_cpu_per_gb=%.3f\n",
+               (cpu_end.client - cpu_start.client) / (bytes / 1000.0));
+    if (cpu_start.server_known && cpu_end.server_known)
+    {
+        printf("bench.server_cpu_usecs=%lu\n", (unsigned long)(cpu_end.server - cpu_start.server));
+        if (bytes)
+            printf("bench.server_cpu_per_gb=%.3f\n",
+                   (cpu_end.server - cpu_start.server) / (bytes / 1000.0));
+    }
+}
+
+static int parse_uint(const char* option, const char* value, uint64_t* result)
+{
+    char* end;
+
+    if (!value)
+    {
+        error("missing value for %s\n", option);
+        return 0;
+    }
+    *result = strtoull(value, &end, 10);
+    if (!*value || *end)
+    {
+        error("invalid value '%s' for %s\n", value, option);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    const char* p;
+    char** arg;
+    char* opt_host = NULL;
+    char* opt_port = NULL;
+    const char* opt_mix = "ping";
+    uint64_t opt_connections = 1, opt_depth = 1, opt_duration = 10, u64;
+    int opt_usage = 0;
+    unsigned i;
+
+    name0 = p = argv[0];
+    while (*p != '\0')
+    {
+        if (*p == '/')
+            name0 = p + 1;
+        p++;
+    }
+
+    arg = argv + 1;
+    while (*arg && !opt_usage)
+    {
+        const char* option = *arg;
+        uint64_t* value = NULL;
+
+        if (strcmp(option, "--help") == 0)
+            opt_usage = 1;
+        else if (strcmp(option, "--connections") == 0)
+            value = &opt_connections;
+        else if (strcmp(option, "--depth") == 0)
+            value = &opt_depth;
+        else if (strcmp(option, "--duration") == 0)
+            value = &opt_duration;
+        else if (strcmp(option, "--requests") == 0)
+            value = &max_ops;
+        else if (strcmp(option, "--size") == 0)
+            value = &file_size;
+        else if (strcmp(option, "--seed") == 0)
+            value = &rng_state;
+        else if (strcmp(option, "--mix") == 0 || strcmp(option, "--run") == 0)
+        {
+            if (!*++arg)
+            {
+                error("missing value for %s\n", option);
+                opt_usage = 2;
+                break;
+            }
+            if (strcmp(option, "--mix") == 0)
+                opt_mix = *arg;
+            else
+                run_cmd = *arg;
+        }
+        else if (*option == '-')
+        {
+            error("unknown option '%s'\n", option);
+            opt_usage = 2;
+        }
+        else if (!opt_host)
+            opt_host = *arg;
+        else if (!opt_port)
+            opt_port = *arg;
+        else
+        {
+            error("unexpected option '%s'\n", option);
+            opt_usage = 2;
+        }
+        if (value && !parse_uint(option, *++arg, value))
+        {
+            opt_usage = 2;
+            break;
+        }
+        arg++;
+    }
+    /* xorshift gets stuck on zero */
+    if (!rng_state)
+        rng_state = 1;
+    if (!opt_usage)
+    {
+        if (!opt_port)
+        {
+            error("you must specify the server host and port\n");
+            opt_usage = 2;
+        }
+        else if (!opt_connections || !opt_depth || opt_connections > 1024 ||
+                 opt_depth > 65536)
+        {
+            error("the connection count and depth must be in the 1-1024 and 1-65536 ranges\n");
+            opt_usage = 2;
+        }
+        else if (!parse_mix(opt_mix))
+            opt_usage = 2;
+    }
+    if (opt_usage == 2)
+    {
+        error("try '%s --help' for more information\n", name0);
+        exit(2);
+    }
+    if (opt_usage)
+    {
+        printf("Usage: %s [options] HOST PORT\n", name0);
+        printf("\n");
+        printf("Measures the throughput and latency of the testagentd server listening on\n");
+        printf("the specified host and port. The results are printed as name=value lines,\n");
+        printf("with the latencies in microseconds. The CPU cost of the transfers is given\n");
+        printf("in CPU seconds per GB for this process and for the server.\n");
+        printf("\n");
+        printf("Where:\n");
+        printf("  --connections N Uses N concurrent connections. The default is 1.\n");
+        printf("  --depth N       Keeps N operations in flight on each connection. The\n");
+        printf("                  default is 1, that is no pipelining.\n");
+        printf("  --duration S    Generates load for S seconds. The default is 10.\n");
+        printf("  --requests N    Stops after N operations instead.\n");
+        printf("  --mix OPS       A comma-separated list of NAME[=WEIGHT] operations to pick\n");
+        printf("                  from at random. The operations are ping, getfile, sendfile,\n");
+        printf("                  run (run followed by wait2) and rm. The default is ping.\n");
+        printf("  --size BYTES    The size of the files that are transferred. The default\n");
+        printf("                  is 65536.\n");
+        printf("  --run PATH      The command to run. The default is /bin/true.\n");
+        printf("  --seed N        Seeds the random operation picker.\n");
+        printf("  --help          Shows this usage message.\n");
+        printf("\n");
+        printf("The files are created in the server's current directory and deleted at\n");
+        printf("the end.\n");
+        exit(0);
+    }
+    conn_count = opt_connections;
+    depth = opt_depth;
+    deadline = opt_duration * 1000000;
+
+    payload = malloc(file_size ? file_size : 1);
+    if (!payload)
+    {
+        error("malloc() failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    /* Use pseudo-random data so compression does not skew the results */
+    for (u64 = 0; u64 < file_size; u64++)
+        payload[u64] = next_random() >> 56;
+
+    conns = calloc(conn_count, sizeof(*conns));
+    if (!conns)
+    {
+        error("malloc() failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < conn_count; i++)
+        if (!open_conn(&conns[i], opt_host, opt_port, i))
+            exit(1);
+
+    run_load();
+    print_results();
+    return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * A command line client for testagentd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testagent.h"
+
+static const char *name0;
+
+static void error(const char* format, ...)
+{
+    va_list valist;
+    fprintf(stderr, "%s:error: ", name0);
+    va_start(valist, format);
+    vfprintf(stderr, format, valist);
+    va_end(valist);
+}
+
+static int parse_uint(const char* option, const char* value, uint64_t* result)
+{
+    char* end;
+
+    if (!value)
+    {
+        error("missing value for %s\n", option);
+        return 0;
+    }
+    *result = strtoull(value, &end, 10);
+    if (!*value || *end)
+    {
+        error("invalid value '%s' for %s\n", value, option);
+        return 0;
+    }
+    return 1;
+}
+
+static void print_property(void* ctx, const char* name, const char* value)
+{
+    const char* wanted = ctx;
+
+    if (!wanted)
+        printf("%s=%s\n", name, value);
+    else if (strcmp(name, wanted) == 0)
+        printf("%s\n", value);
+}
+
+static void print_output(void* ctx, int stream, const char* buf, unsigned len)
+{
+    fwrite(buf, 1, len, stream == 1 ? stdout : stderr);
+}
+
+/* The status is the raw wait() status of the child process. Like the
+ * shell, report the processes killed by a signal as 128 + the signal number.
+ */
+static int get_exit_code(uint32_t status)
+{
+    if ((status & 0x7f) == 0)
+        return (status >> 8) & 0xff;
+    return 128 + (status & 0x7f);
+}
+
+static void usage(void)
+{
+    printf("Usage: %s [options] HOST PORT COMMAND [ARGS]\n", name0);
+    printf("\n");
+    printf("Sends the specified command to the testagentd server listening on the\n");
+    printf("specified host and port.\n");
+    printf("\n");
+    printf("Where COMMAND is one of:\n");
+    printf("  ping                   Checks that the server responds.\n");
+    printf("  version                Prints the server's protocol version.\n");
+    printf("  getfile SERVERPATH LOCALPATH\n");
+    printf("                         Retrieves the specified file.\n");
+    printf("  sendfile [--exe] LOCALPATH SERVERPATH\n");
+    printf("                         Sends the specified file, making it executable\n");
+    printf("                         with --exe.\n");
+    printf("  run [--no-wait] CMD [ARGS]\n");
+    printf("                         Runs the command on the server, prints its output\n");
+    printf("                         and exits with its status. With --no-wait it only\n");
+    printf("                         prints the child process id.\n");
+    printf("  wait PID               Waits for the child process and exits with its\n");
+    printf("                         status.\n");
+    printf("  rm SERVERPATH...       Deletes the specified files.\n");
+    printf("  getcwd                 Prints the server's current directory.\n");
+    printf("  getproperty [NAME]     Prints the specified property, or all of them.\n");
+    printf("  getstats [--reset]     Prints the server statistics, resetting them with\n");
+    printf("                         --reset.\n");
+    printf("  settime                Sets the server's clock to that of this machine.\n");
+    printf("  upgrade LOCALPATH      Replaces the server with the specified binary.\n");
+    printf("\n");
+    printf("Where the options are:\n");
+    printf("  --timeout S            How long to wait for the server in seconds. The\n");
+    printf("                         default is to wait forever.\n");
+    printf("  --connect-timeout S    How long to wait for the connection. The default\n");
+    printf("                         is 20 seconds.\n");
+    printf("  --help                 Shows this usage message.\n");
+}
+
+/* Runs the command, returning the exit code */
+static int run_command(struct ta_conn_t* conn, char** args)
+{
+    const char* cmd = args[0];
+    uint64_t u64;
+    uint32_t u32;
+    char* str;
+
+    if (strcmp(cmd, "ping") == 0 && !args[1])
+        return ta_ping(conn) ? 0 : 1;
+
+    if (strcmp(cmd, "version") == 0 && !args[1])
+    {
+        printf("%s\n", ta_get_version(conn));
+        return 0;
+    }
+
+    if (strcmp(cmd, "getfile") == 0 && args[1] && args[2] && !args[3])
+        return ta_getfile(conn, args[1], args[2]) ? 0 : 1;
+
+    if (strcmp(cmd, "sendfile") == 0)
+    {
+        uint32_t flags = 0;
+        if (args[1] && strcmp(args[1], "--exe") == 0)
+        {
+            flags = SF_EXECUTABLE;
+            args++;
+        }
+        if (args[1] && args[2] && !args[3])
+            return ta_sendfile(conn, args[1], args[2], flags) ? 0 : 1;
+    }
+
+    if (strcmp(cmd, "run") == 0)
+    {
+        int nowait = 0;
+        if (args[1] && strcmp(args[1], "--no-wait") == 0)
+        {
+            nowait = 1;
+            args++;
+        }
+        if (args[1])
+        {
+            u64 = ta_run(conn, args + 1, nowait ? 0 : RUN_STREAM, NULL, NULL, NULL);
+            if (!u64)
+                return 1;
+            if (nowait)
+            {
+                printf("%lu\n", (unsigned long)u64);
+                return 0;
+            }
+            do
+            {
+                if (!ta_getoutput(conn, u64, RUN_NOTIMEOUT, print_output, NULL, &u32))
+                    return 1;
+            }
+            while (u32 != (OUT_STDOUT_EOF | OUT_STDERR_EOF));
+            if (!ta_wait(conn, u64, RUN_NOTIMEOUT, &u32))
+                return 1;
+            return get_exit_code(u32);
+        }
+    }
+
+    if (strcmp(cmd, "wait") == 0 && args[1] && !args[2])
+    {
+        if (!parse_uint("wait", args[1], &u64))
+            return 2;
+        if (!ta_wait(conn, u64, RUN_NOTIMEOUT, &u32))
+            return 1;
+        return get_exit_code(u32);
+    }
+
+    if (strcmp(cmd, "rm") == 0 && args[1])
+    {
+        uint32_t count;
+        for (count = 0; args[count + 1]; count++)
+            ;
+        return ta_rm(conn, (const char**)args + 1, count) ? 0 : 1;
+    }
+
+    if (strcmp(cmd, "getcwd") == 0 && !args[1])
+    {
+        str = ta_getcwd(conn);
+        if (!str)
+            return 1;
+        printf("%s\n", str);
+        free(str);
+        return 0;
+    }
+
+    if (strcmp(cmd, "getproperty") == 0 && (!args[1] || !args[2]))
+        return ta_getproperties(conn, print_property, args[1]) ? 0 : 1;
+
+    if (strcmp(cmd, "getstats") == 0)
+    {
+        uint32_t flags = 0;
+        if (args[1] && strcmp(args[1], "--reset") == 0)
+        {
+            flags = GS_RESET;
+            args++;
+        }
+        if (!args[1])
+            return ta_getstats(conn, flags, print_property, NULL) ? 0 : 1;
+    }
+
+    if (strcmp(cmd, "settime") == 0 && !args[1])
+        return ta_settime(conn, 30) ? 0 : 1;
+
+    if (strcmp(cmd, "upgrade") == 0 && args[1] && !args[2])
+        return ta_upgrade(conn, args[1]) ? 0 : 1;
+
+    error("unknown command or invalid arguments for '%s'\n", cmd);
+    error("try '%s --help' for more information\n", name0);
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    const char* p;
+    char** arg;
+    char *opt_host, *opt_port;
+    uint64_t opt_timeout = 0, opt_connect_timeout = 20;
+    int has_timeout = 0, rc;
+    struct ta_conn_t* conn;
+
+    name0 = p = argv[0];
+    while (*p != '\0')
+    {
+        if (*p == '/')
+            name0 = p + 1;
+        p++;
+    }
+
+    arg = argv + 1;
+    while (*arg && **arg == '-')
+    {
+        const char* option = *arg;
+
+        if (strcmp(option, "--help") == 0)
+        {
+            usage();
+            exit(0);
+        }
+        else if (strcmp(option, "--timeout") == 0)
+        {
+            if (!parse_uint(option, *++arg, &opt_timeout))
+                exit(2);
+            has_timeout = 1;
+        }
+        else if (strcmp(option, "--connect-timeout") == 0)
+        {
+            if (!parse_uint(option, *++arg, &opt_connect_timeout))
+                exit(2);
+        }
+        else
+        {
+            error("unknown option '%s'\n", option);
+            error("try '%s --help' for more information\n", name0);
+            exit(2);
+        }
+        arg++;
+    }
+    if (!arg[0] || !arg[1] || !arg[2])
+    {
+        error("you must specify the server host and port, and a command\n");
+        error("try '%s --help' for more information\n", name0);
+        exit(2);
+    }
+    opt_host = *arg++;
+    opt_port = *arg++;
+
+    conn = ta_new();
+    if (!conn)
+    {
+        error("malloc() failed\n");
+        exit(1);
+    }
+    if (has_timeout)
+        ta_set_timeout(conn, opt_timeout < 2000000 ? opt_timeout * 1000 : 2000000000);
+    if (!ta_connect(conn, opt_host, opt_port,
+                    opt_connect_timeout < 2000000 ? opt_connect_timeout * 1000 : 2000000000))
+    {
+        error("%s\n", ta_get_error(conn));
+        exit(1);
+    }
+    rc = run_command(conn, arg);
+    if (rc == 1 && *ta_get_error(conn))
+        error("%s\n", ta_get_error(conn));
+    ta_free(conn);
+    return rc;
+}
@@ -0,0 +1,886 @@
+/*
+ * Streaming tar archives, in the GNU format so long names are supported.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "platform.h"
+#include "tar.h"
+
+#define TAR_BLOCK           512
+#define TAR_PADDING(size)   ((TAR_BLOCK - ((size) % TAR_BLOCK)) % TAR_BLOCK)
+
+/* The largest 'L' or pax extended header accepted */
+#define MAX_EXT_SIZE        65536
+
+/* Protects against symbolic link loops */
+#define MAX_DEPTH           64
+
+struct tar_header_t
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+#ifdef WIN32
+# define IS_SEP(c)  ((c) == '/' || (c) == '\\')
+#else
+# define IS_SEP(c)  ((c) == '/')
+#endif
+
+
+/*
+ * Helper functions
+ */
+
+static int make_dir(const char* path)
+{
+#ifdef WIN32
+    return mkdir(path);
+#else
+    return mkdir(path, 0700);
+#endif
+}
+
+/* Creates the missing parent directories of path, skipping the first start
+ * characters which are known to exist already.
+ */
+static void make_parent_dirs(char* path, unsigned start)
+{
+    char* p;
+
+    for (p = path + start; *p; p++)
+    {
+        if (IS_SEP(*p) && p != path && !IS_SEP(p[-1]))
+        {
+            char sep = *p;
+            *p = '\0';
+            make_dir(path);
+            *p = sep;
+        }
+    }
+}
+
+static char* join_path(const char* dir, const char* name)
+{
+    unsigned len = strlen(dir);
+    char* path;
+
+    path = malloc(len + 1 + strlen(name) + 1);
+    if (!path)
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+    else if (len && !IS_SEP(dir[len - 1]))
+        sprintf(path, "%s/%s", dir, name);
+    else
+        sprintf(path, "%s%s", dir, name);
+    return path;
+}
+
+static unsigned header_checksum(const struct tar_header_t* hdr)
+{
+    const unsigned char* data = (const unsigned char*)hdr;
+    unsigned i, sum = 0;
+
+    for (i = 0; i < TAR_BLOCK; i++)
+    {
+        /* The checksum field counts as spaces */
+        if (i >= offsetof(struct tar_header_t, chksum) &&
+            i < offsetof(struct tar_header_t, chksum) + sizeof(hdr->chksum))
+            sum += ' ';
+        else
+            sum += data[i];
+    }
+    return sum;
+}
+
+/* The numbers are normally in octal but the GNU format switches to base-256
+ * for those that don't fit, typically the size of files over 8 GB.
+ */
+static int parse_number(const char* field, unsigned len, uint64_t* value)
+{
+    *value = 0;
+    if (*field & 0x80)
+    {
+        unsigned i;
+
+        *value = *field & 0x3f;
+        for (i = 1; i < len; i++)
+        {
+            if (*value >> 56)
+                return 0;
+            *value = *value << 8 | (unsigned char)field[i];
+        }
+        return !(*field & 0x40);
+    }
+
+    while (len && *field == ' ')
+    {
+        field++;
+        len--;
+    }
+    while (len && *field >= '0' && *field <= '7')
+    {
+        *value = *value * 8 + (*field - '0');
+        field++;
+        len--;
+    }
+    return !len || *field == '\0' || *field == ' ';
+}
+
+static void set_number(char* field, unsigned len, uint64_t value)
+{
+    unsigned i;
+
+    if (value >> (3 * (len - 1)))
+    {
+        memset(field, 0, len);
+        field[0] = (char)0x80;
+        for (i = len - 1; i > 0 && value; i--)
+        {
+            field[i] = value & 0xff;
+            value >>= 8;
+        }
+    }
+    else
+    {
+        field[len - 1] = '\0';
+        for (i = len - 1; i > 0; i--)
+        {
+            field[i - 1] = '0' + (value & 7);
+            value >>= 3;
+        }
+    }
+}
+
+static void fill_header(struct tar_header_t* hdr, const char* name, char type,
+                        unsigned mode, uint64_t size, uint64_t mtime)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    strncpy(hdr->name, name, sizeof(hdr->name));
+    set_number(hdr->mode, sizeof(hdr->mode), mode);
+    set_number(hdr->uid, sizeof(hdr->uid), 0);
+    set_number(hdr->gid, sizeof(hdr->gid), 0);
+    set_number(hdr->size, sizeof(hdr->size), size);
+    set_number(hdr->mtime, sizeof(hdr->mtime), mtime);
+    hdr->typeflag = type;
+    memcpy(hdr->magic, "ustar ", sizeof(hdr->magic));
+    memcpy(hdr->version, " ", sizeof(hdr->version));
+    set_number(hdr->chksum, sizeof(hdr->chksum) - 1, header_checksum(hdr));
+    hdr->chksum[sizeof(hdr->chksum) - 1] = ' ';
+}
+
+
+/*
+ * Archive extraction
+ */
+
+enum untar_state_t
+{
+    UNTAR_HEADER,   /* Receiving an entry header */
+    UNTAR_DATA,     /* Receiving an entry's data and padding */
+    UNTAR_END,      /* Got the end of archive marker */
+};
+
+struct untar_t
+{
+    char* dir;
+    enum untar_state_t state;
+
+    /* The header block being received */
+    char header[TAR_BLOCK];
+    unsigned got;
+
+    /* The data and padding left to receive for the current entry */
+    uint64_t left, pad;
+
+    /* The file the data goes to, if any */
+    int fd;
+    char* path;
+
+    /* Or the content of the 'L' or 'x' extended header being received */
+    char type;
+    char* ext;
+    unsigned extlen;
+
+    /* The name of the next entry, as set by an extended header */
+    char* longname;
+};
+
+struct untar_t* untar_open(const char* dir)
+{
+    struct untar_t* untar;
+    char* path;
+
+    untar = calloc(1, sizeof(*untar));
+    if (!untar || !(untar->dir = strdup(dir)))
+    {
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        free(untar);
+        return NULL;
+    }
+    untar->fd = -1;
+
+    /* Create the target directory if needed */
+    path = join_path(dir, "");
+    if (!path)
+    {
+        untar_close(untar, 0);
+        return NULL;
+    }
+    make_parent_dirs(path, 0);
+    free(path);
+    return untar;
+}
+
+/* Returns the name relative to the target directory, or NULL if it would
+ * point outside of it.
+ */
+static char* check_name(char* name)
+{
+    char *c, *p;
+
+    while (name[0] == '.' && IS_SEP(name[1]))
+        name += 2;
+    /* Absolute paths are not allowed */
+    if (IS_SEP(*name))
+        return NULL;
+#ifdef WIN32
+    if (name[0] && name[1] == ':')
+        return NULL;
+#endif
+    for (c = name; *c; c = p)
+    {
+        for (p = c; *p && !IS_SEP(*p); p++)
+            ;
+        if (p - c == 2 && c[0] == '.' && c[1] == '.')
+            return NULL;
+        while (IS_SEP(*p))
+            p++;
+    }
+    return name;
+}
+
+/* Extracts the path from the pax extended header records, which are of the
+ * form "<length> <key>=<value>\n", and ignores the rest.
+ */
+static void parse_pax_header(struct untar_t* untar)
+{
+    char *rec = untar->ext, *end = untar->ext + untar->extlen;
+
+    while (rec < end)
+    {
+        char* key;
+        unsigned long len = strtoul(rec, &key, 10);
+
+        if (!len || len > end - rec || *key != ' ' || rec[len - 1] != '\n')
+            break;
+        key++;
+        if (!strncmp(key, "path=", 5))
+        {
+            char* value = key + 5;
+            free(untar->longname);
+            untar->longname = malloc(rec + len - value);
+            if (untar->longname)
+            {
+                memcpy(untar->longname, value, rec + len - 1 - value);
+                untar->longname[rec + len - 1 - value] = '\0';
+            }
+        }
+        rec += len;
+    }
+}
+
+static int untar_end_entry(struct untar_t* untar)
+{
+    int success = 1;
+
+    if (untar->fd != -1)
+    {
+        if (close(untar->fd) < 0)
+        {
+            set_status(ST_ERROR, "an error occurred while writing to '%s': %s", untar->path, strerror(errno));
+            success = 0;
+        }
+        untar->fd = -1;
+    }
+    if (untar->ext)
+    {
+        untar->ext[untar->extlen] = '\0';
+        if (untar->type == 'L')
+        {
+            free(untar->longname);
+            untar->longname = untar->ext;
+        }
+        else
+        {
+            parse_pax_header(untar);
+            free(untar->ext);
+        }
+        untar->ext = NULL;
+    }
+    free(untar->path);
+    untar->path = NULL;
+    return success;
+}
+
+static int untar_header(struct untar_t* untar)
+{
+    struct tar_header_t* hdr = (struct tar_header_t*)untar->header;
+    uint64_t sum, size, mode;
+    char *name, *relname;
+    unsigned i;
+    int isdir;
+
+    for (i = 0; i < TAR_BLOCK && !untar->header[i]; i++)
+        ;
+    if (i == TAR_BLOCK)
+    {
+        /* The end of archive marker is two empty blocks but one is enough */
+        untar->state = UNTAR_END;
+        return 1;
+    }
+
+    if (!parse_number(hdr->chksum, sizeof(hdr->chksum), &sum) ||
+        sum != header_checksum(hdr))
+    {
+        set_status(ST_ERROR, "the tar header checksum is invalid");
+        return 0;
+    }
+    if (!parse_number(hdr->size, sizeof(hdr->size), &size) ||
+        !parse_number(hdr->mode, sizeof(hdr->mode), &mode))
+    {
+        set_status(ST_ERROR, "the tar header is invalid");
+        return 0;
+    }
+    untar->type = hdr->typeflag;
+    untar->left = size;
+    untar->pad = TAR_PADDING(size);
+    untar->state = size ? UNTAR_DATA : UNTAR_HEADER;
+
+    if (hdr->typeflag == 'L' || hdr->typeflag == 'x')
+    {
+        if (size > MAX_EXT_SIZE)
+        {
+            set_status(ST_ERROR, "the tar extended header is too big (" U64FMT " bytes)", size);
+            return 0;
+        }
+        untar->ext = malloc(size + 1);
+        if (!untar->ext)
+        {
+            set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+            return 0;
+        }
+        untar->extlen = 0;
+        return size ? 1 : untar_end_entry(untar);
+    }
+    if (hdr->typeflag == 'g')
+    {
+        /* Skip the pax global header */
+        return 1;
+    }
+
+    if (untar->longname)
+    {
+        name = untar->longname;
+        untar->longname = NULL;
+    }
+    else
+    {
+        name = malloc(sizeof(hdr->prefix) + 1 + sizeof(hdr->name) + 1);
+        if (!name)
+        {
+            set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+            return 0;
+        }
+        if (!memcmp(hdr->magic, "ustar", 6) && hdr->prefix[0])
+            sprintf(name, "%.155s/%.100s", hdr->prefix, hdr->name);
+        else
+            sprintf(name, "%.100s", hdr->name);
+    }
+
+    relname = check_name(name);
+    if (!relname)
+    {
+        set_status(ST_ERROR, "'%s' is outside the target directory", name);
+        free(name);
+        return 0;
+    }
+    isdir = hdr->typeflag == '5';
+    i = strlen(relname);
+    if (i && IS_SEP(relname[i - 1]))
+    {
+        /* Old archives mark the directories with a trailing slash */
+        isdir |= hdr->typeflag == '0' || hdr->typeflag == '\0';
+        while (i && IS_SEP(relname[i - 1]))
+            relname[--i] = '\0';
+    }
+    untar->path = join_path(untar->dir, relname);
+    free(name);
+    if (!untar->path)
+        return 0;
+    make_parent_dirs(untar->path, strlen(untar->dir));
+
+    if (isdir)
+    {
+        debug("  untar: mkdir '%s'\n", untar->path);
+        if (i && make_dir(untar->path) < 0 && errno != EEXIST)
+        {
+            set_status(ST_ERROR, "unable to create the '%s' directory: %s", untar->path, strerror(errno));
+            return 0;
+        }
+    }
+    else if (hdr->typeflag == '0' || hdr->typeflag == '\0' ||
+             hdr->typeflag == '7')
+    {
+        debug("  untar: '%s' (" U64FMT " bytes)\n", untar->path, size);
+        unlink(untar->path); /* To force re-setting the mode */
+        untar->fd = open(untar->path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                         (mode & 0111) ? 0700 : 0600);
+        if (untar->fd < 0)
+        {
+            set_status(ST_ERROR, "unable to open '%s' for writing: %s", untar->path, strerror(errno));
+            return 0;
+        }
+    }
+    else
+    {
+        set_status(ST_ERROR, "'%s' is of an unsupported type (%c)", untar->path, hdr->typeflag);
+        return 0;
+    }
+    return size ? 1 : untar_end_entry(untar);
+}
+
+int untar_write(struct untar_t* untar, const char* data, unsigned size)
+{
+    while (size)
+    {
+        unsigned count = size;
+
+        switch (untar->state)
+        {
+        case UNTAR_HEADER:
+            if (count > TAR_BLOCK - untar->got)
+                count = TAR_BLOCK - untar->got;
+            memcpy(untar->header + untar->got, data, count);
+            untar->got += count;
+            if (untar->got == TAR_BLOCK)
+            {
+                untar->got = 0;
+                if (!untar_header(untar))
+                    return 0;
+            }
+            break;
+
+        case UNTAR_DATA:
+            if (untar->left)
+            {
+                if (count > untar->left)
+                    count = untar->left;
+                if (untar->fd != -1)
+                {
+                    int w;
+
+                    errno = 0;
+                    w = write(untar->fd, data, count);
+                    if (w != count)
+                    {
+                        set_status(ST_ERROR, "an error occurred while writing to '%s': %s", untar->path, strerror(errno ? errno : ENOSPC));
+                        return 0;
+                    }
+                }
+                else if (untar->ext)
+                {
+                    memcpy(untar->ext + untar->extlen, data, count);
+                    untar->extlen += count;
+                }
+                untar->left -= count;
+                if (!untar->left && !untar_end_entry(untar))
+                    return 0;
+            }
+            else
+            {
+                if (count > untar->pad)
+                    count = untar->pad;
+                untar->pad -= count;
+            }
+            if (!untar->left && !untar->pad)
+                untar->state = UNTAR_HEADER;
+            break;
+
+        case UNTAR_END:
+            /* Ignore the rest of the end of archive marker and the padding */
+            break;
+        }
+        data += count;
+        size -= count;
+    }
+    return 1;
+}
+
+int untar_close(struct untar_t* untar, int complete)
+{
+    int success = complete;
+
+    if (complete && (untar->state == UNTAR_DATA || untar->got))
+    {
+        set_status(ST_ERROR, "the tar archive is truncated");
+        success = 0;
+    }
+    if (untar->fd != -1)
+    {
+        /* Don't leave a partial file behind */
+        close(untar->fd);
+        unlink(untar->path);
+    }
+    free(untar->path);
+    free(untar->ext);
+    free(untar->longname);
+    free(untar->dir);
+    free(untar);
+    return success;
+}
+
+
+/*
+ * Archive generation
+ */
+
+struct mktar_entry_t
+{
+    char* path;     /* The path of the file on this system */
+    char* name;     /* Its name in the archive */
+    int isdir;
+    unsigned mode;
+    uint64_t size, mtime;
+};
+
+struct mktar_t
+{
+    struct mktar_entry_t* entries;
+    unsigned count, capacity;
+    uint64_t size;
+
+    /* The index of the next entry to send */
+    unsigned next;
+
+    /* The headers of the entry being sent */
+    char* header;
+    unsigned hlen, hpos;
+
+    /* Followed by its data and padding */
+    int fd;
+    uint64_t left, pad;
+
+    /* And finally the end of archive marker */
+    unsigned trailer;
+};
+
+/* Returns the size of the headers for the specified name */
+static unsigned get_header_size(const char* name)
+{
+    unsigned len = strlen(name);
+
+    if (len <= sizeof(((struct tar_header_t*)NULL)->name))
+        return TAR_BLOCK;
+    /* Use a 'L' header for the long names */
+    return 2 * TAR_BLOCK + len + 1 + TAR_PADDING(len + 1);
+}
+
+static int add_entry(struct mktar_t* mktar, const char* path, const char* name,
+                     unsigned depth)
+{
+    struct mktar_entry_t* entry;
+    struct stat st;
+    DIR* dir;
+    struct dirent* dirent;
+    char* p;
+    int success;
+
+    if (stat(path, &st))
+    {
+        set_status(ST_ERROR, "unable to get information about '%s': %s", path, strerror(errno));
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+    {
+        debug("  mktar: skipping '%s' which is neither a file nor a directory\n", path);
+        return 1;
+    }
+
+    /* The top directory itself does not need an entry */
+    if (*name)
+    {
+        if (mktar->count == mktar->capacity)
+        {
+            unsigned capacity = mktar->capacity ? 2 * mktar->capacity : 64;
+            entry = realloc(mktar->entries, capacity * sizeof(*entry));
+            if (!entry)
+            {
+                set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+                return 0;
+            }
+            mktar->entries = entry;
+            mktar->capacity = capacity;
+        }
+        entry = &mktar->entries[mktar->count];
+        entry->path = strdup(path);
+        entry->name = malloc(strlen(name) + 2);
+        if (!entry->path || !entry->name)
+        {
+            set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+            free(entry->path);
+            free(entry->name);
+            return 0;
+        }
+        strcpy(entry->name, name);
+        for (p = entry->name; *p; p++)
+            if (IS_SEP(*p))
+                *p = '/';
+        entry->isdir = S_ISDIR(st.st_mode);
+        if (entry->isdir)
+            strcat(entry->name, "/");
+        entry->mode = (st.st_mode & 0111) ? 0755 : 0644;
+        entry->size = entry->isdir ? 0 : st.st_size;
+        entry->mtime = st.st_mtime;
+        mktar->size += get_header_size(entry->name) + entry->size +
+                       TAR_PADDING(entry->size);
+        mktar->count++;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return 1;
+
+    if (depth == MAX_DEPTH)
+    {
+        set_status(ST_ERROR, "'%s' is nested too deeply", path);
+        return 0;
+    }
+    dir = opendir(path);
+    if (!dir)
+    {
+        set_status(ST_ERROR, "unable to open the '%s' directory: %s", path, strerror(errno));
+        return 0;
+    }
+    success = 1;
+    while (success && (dirent = readdir(dir)))
+    {
+        char *subpath, *subname;
+
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+            continue;
+        subpath = join_path(path, dirent->d_name);
+        subname = *name ? join_path(name, dirent->d_name) : strdup(dirent->d_name);
+        success = subpath && subname &&
+                  add_entry(mktar, subpath, subname, depth + 1);
+        free(subpath);
+        free(subname);
+    }
+    closedir(dir);
+    return success;
+}
+
+struct mktar_t* mktar_open(const char* dir, char** paths, unsigned count)
+{
+    struct mktar_t* mktar;
+    unsigned i;
+
+    mktar = calloc(1, sizeof(*mktar));
+    if (!mktar)
+    {
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        return NULL;
+    }
+    mktar->fd = -1;
+    mktar->trailer = 2 * TAR_BLOCK;
+    mktar->size = mktar->trailer;
+
+    for (i = 0; i < count; i++)
+    {
+        const char* name = paths[i];
+        char* path;
+        int success;
+
+        /* The names in the archive are relative */
+        while (IS_SEP(*name) || (name[0] == '.' && IS_SEP(name[1])))
+            name++;
+        if (!strcmp(name, "."))
+            name = "";
+
+        path = join_path(dir, paths[i]);
+        success = path && add_entry(mktar, path, name, 0);
+        free(path);
+        if (!success)
+        {
+            mktar_close(mktar);
+            return NULL;
+        }
+    }
+    debug("  mktar: %u entries, " U64FMT " bytes\n", mktar->count, mktar->size);
+    return mktar;
+}
+
+uint64_t mktar_size(struct mktar_t* mktar)
+{
+    return mktar->size;
+}
+
+/* Prepares the headers of the next entry and opens its file */
+static int mktar_next(struct mktar_t* mktar)
+{
+    struct mktar_entry_t* entry = &mktar->entries[mktar->next++];
+    struct tar_header_t* hdr;
+    unsigned len = strlen(entry->name);
+
+    free(mktar->header);
+    mktar->hlen = get_header_size(entry->name);
+    mktar->hpos = 0;
+    mktar->header = calloc(1, mktar->hlen);
+    if (!mktar->header)
+    {
+        set_status(ST_FATAL, "malloc() failed: %s", strerror(errno));
+        return 0;
+    }
+    hdr = (struct tar_header_t*)mktar->header;
+    if (mktar->hlen > TAR_BLOCK)
+    {
+        fill_header(hdr, "././@LongLink", 'L', 0, len + 1, 0);
+        memcpy(hdr + 1, entry->name, len + 1);
+        hdr = (struct tar_header_t*)(mktar->header + mktar->hlen - TAR_BLOCK);
+    }
+    fill_header(hdr, entry->name, entry->isdir ? '5' : '0', entry->mode,
+                entry->size, entry->mtime);
+
+    if (entry->size)
+    {
+        mktar->fd = open(entry->path, O_RDONLY | O_BINARY);
+        if (mktar->fd < 0)
+        {
+            set_status(ST_FATAL, "unable to open '%s' for reading: %s", entry->path, strerror(errno));
+            return 0;
+        }
+        mktar->left = entry->size;
+        mktar->pad = TAR_PADDING(entry->size);
+    }
+    return 1;
+}
+
+int mktar_read(struct mktar_t* mktar, char* buf, unsigned size)
+{
+    unsigned got = 0;
+
+    while (got < size)
+    {
+        unsigned count = size - got;
+
+        if (mktar->hpos < mktar->hlen)
+        {
+            if (count > mktar->hlen - mktar->hpos)
+                count = mktar->hlen - mktar->hpos;
+            memcpy(buf + got, mktar->header + mktar->hpos, count);
+            mktar->hpos += count;
+        }
+        else if (mktar->left)
+        {
+            const char* path = mktar->entries[mktar->next - 1].path;
+            int r;
+
+            if (count > mktar->left)
+                count = mktar->left;
+            r = read(mktar->fd, buf + got, count);
+            if (r == 0)
+            {
+                /* The file shrank since its size was collected */
+                set_status(ST_FATAL, "reached the '%s' EOF prematurely", path);
+                return -1;
+            }
+            if (r < 0)
+            {
+                set_status(ST_FATAL, "an error occurred while reading '%s': %s", path, strerror(errno));
+                return -1;
+            }
+            count = r;
+            mktar->left -= r;
+            if (!mktar->left)
+            {
+                close(mktar->fd);
+                mktar->fd = -1;
+            }
+        }
+        else if (mktar->pad)
+        {
+            if (count > mktar->pad)
+                count = mktar->pad;
+            memset(buf + got, 0, count);
+            mktar->pad -= count;
+        }
+        else if (mktar->next < mktar->count)
+        {
+            if (!mktar_next(mktar))
+                return -1;
+            continue;
+        }
+        else if (mktar->trailer)
+        {
+            if (count > mktar->trailer)
+                count = mktar->trailer;
+            memset(buf + got, 0, count);
+            mktar->trailer -= count;
+        }
+        else
+            break;
+        got += count;
+    }
+    return got;
+}
+
+void mktar_close(struct mktar_t* mktar)
+{
+    unsigned i;
+
+    if (mktar->fd != -1)
+        close(mktar->fd);
+    for (i = 0; i < mktar->count; i++)
+    {
+        free(mktar->entries[i].path);
+        free(mktar->entries[i].name);
+    }
+    free(mktar->entries);
+    free(mktar->header);
+    free(mktar);
+}
@@ -0,0 +1,48 @@
+/*
+ * Streaming tar archives.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __TAR_H
+#define __TAR_H
+
+/* Extracts a tar archive to the specified directory as its data arrives.
+ * untar_write() returns 0 and sets the status if the archive is invalid or
+ * cannot be extracted, after which the untar_t structure can only be closed.
+ * Unless complete is set, untar_close() removes the partially written file,
+ * otherwise it checks that the archive was not truncated.
+ */
+struct untar_t;
+
+struct untar_t* untar_open(const char* dir);
+int untar_write(struct untar_t* untar, const char* data, unsigned size);
+int untar_close(struct untar_t* untar, int complete);
+
+/* Generates a tar archive of the specified files and directories, relative
+ * to dir, as it is being read. The files are only opened as needed but their
+ * size is collected beforehand so that of the archive is known upfront.
+ * mktar_read() returns the number of bytes stored in buf, which is always
+ * size until the end of the archive, or -1 with a fatal status if a file
+ * cannot be read.
+ */
+struct mktar_t;
+
+struct mktar_t* mktar_open(const char* dir, char** paths, unsigned count);
+uint64_t mktar_size(struct mktar_t* mktar);
+int mktar_read(struct mktar_t* mktar, char* buf, unsigned size);
+void mktar_close(struct mktar_t* mktar);
+
+#endif /* __TAR_H */
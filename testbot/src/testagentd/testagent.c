@@ -0,0 +1,1347 @@
+/*
+ * A client library for the testagentd protocol.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <zlib.h>
+
+#include "testagent.h"
+
+#define BLOCK_SIZE 65536
+
+/* Refuse to buffer bigger non-data values, they can only come from a
+ * protocol error.
+ */
+#define MAX_VALUE_SIZE (16 * 1048576)
+
+/* This is a piece of the data to send. It is either in memory, and owned by
+ * the segment if buf is set, or is the next len bytes of the fd file.
+ */
+struct segment_t
+{
+    const char* data;
+    uint64_t len;
+    char* buf;
+    size_t size;
+    int fd;
+};
+
+/* An RPC awaiting its reply */
+struct pending_t
+{
+    const struct ta_handler_t* handler;
+    void* ctx;
+};
+
+enum in_state_t
+{
+    IN_LISTSIZE,
+    IN_HEADER,
+    IN_VALUE,
+    IN_DATA,
+    IN_ZCHUNK,      /* Receiving the size of a 'z' entry chunk */
+    IN_ZDATA,       /* Decompressing a 'z' entry chunk */
+};
+
+struct ta_conn_t
+{
+    int fd;
+    char* version;
+    char error[1024];
+    int broken;
+    int timeout;
+
+    /* The data to send */
+    struct segment_t* segs;
+    unsigned seg_first, seg_count, seg_size;
+    uint64_t queued;
+    char file_buf[BLOCK_SIZE];
+    unsigned file_pos, file_len;
+
+    /* The RPCs awaiting a reply, in the order they were sent */
+    struct pending_t* pending;
+    unsigned pending_first, pending_count, pending_size;
+
+    /* The reply parser state */
+    char in_buf[BLOCK_SIZE];
+    enum in_state_t in_state;
+    unsigned char in_raw[ENTRY_HEADER_SIZE];
+    unsigned in_got, in_need;
+    uint32_t entries;
+    char type;
+    uint64_t size, left;
+    char* value;
+    char* reply_error;
+
+    /* The decompression state of the 'z' entry being received. size is the
+     * uncompressed size and left the size of the rest of the current chunk.
+     */
+    z_stream zs;
+    int zs_init, zend;
+    uint64_t zsize;
+    char zbuf[BLOCK_SIZE];
+};
+
+
+/*
+ * Error handling.
+ */
+
+static void vset_error(struct ta_conn_t* conn, const char* format, va_list valist)
+{
+    vsnprintf(conn->error, sizeof(conn->error), format, valist);
+}
+
+static void set_error(struct ta_conn_t* conn, const char* format, ...)
+{
+    va_list valist;
+
+    va_start(valist, format);
+    vset_error(conn, format, valist);
+    va_end(valist);
+}
+
+static void free_segment(struct segment_t* seg)
+{
+    free(seg->buf);
+    if (seg->fd != -1)
+        close(seg->fd);
+}
+
+/* Marks the connection as broken and fails all the pending RPCs */
+static void set_fatal(struct ta_conn_t* conn, const char* format, ...)
+{
+    va_list valist;
+
+    va_start(valist, format);
+    vset_error(conn, format, valist);
+    va_end(valist);
+    if (conn->broken)
+        return;
+    conn->broken = 1;
+
+    while (conn->seg_count)
+    {
+        free_segment(&conn->segs[conn->seg_first++]);
+        conn->seg_count--;
+    }
+    conn->queued = 0;
+    while (conn->pending_count)
+    {
+        struct pending_t p = conn->pending[conn->pending_first++];
+        conn->pending_count--;
+        if (p.handler->done)
+            p.handler->done(p.ctx, conn->error);
+    }
+}
+
+const char* ta_get_error(struct ta_conn_t* conn)
+{
+    return conn->error;
+}
+
+int ta_is_broken(struct ta_conn_t* conn)
+{
+    return conn->broken;
+}
+
+
+/*
+ * Queuing the RPCs.
+ */
+
+static void* grow_array(struct ta_conn_t* conn, void* array, unsigned* size,
+                        unsigned* first, unsigned count, size_t itemsize)
+{
+    if (*first + count < *size)
+        return array;
+    if (*first)
+    {
+        memmove(array, (char*)array + *first * itemsize, count * itemsize);
+        *first = 0;
+    }
+    else
+    {
+        void* bigger = realloc(array, (*size ? *size * 2 : 16) * itemsize);
+        if (!bigger)
+        {
+            set_fatal(conn, "malloc() failed: %s", strerror(errno));
+            return NULL;
+        }
+        array = bigger;
+        *size = *size ? *size * 2 : 16;
+    }
+    return array;
+}
+
+static struct segment_t* new_segment(struct ta_conn_t* conn)
+{
+    struct segment_t* seg;
+    struct segment_t* segs;
+
+    segs = grow_array(conn, conn->segs, &conn->seg_size, &conn->seg_first,
+                      conn->seg_count, sizeof(*conn->segs));
+    if (!segs)
+        return NULL;
+    conn->segs = segs;
+    seg = &conn->segs[conn->seg_first + conn->seg_count++];
+    memset(seg, 0, sizeof(*seg));
+    seg->fd = -1;
+    return seg;
+}
+
+static void queue_raw(struct ta_conn_t* conn, const void* data, size_t len)
+{
+    struct segment_t* seg;
+
+    if (conn->broken)
+        return;
+    seg = conn->seg_count ? &conn->segs[conn->seg_first + conn->seg_count - 1] : NULL;
+
+    /* Only append to segments that have not been partially sent yet */
+    if (!seg || !seg->buf || seg->data != seg->buf || seg->size - seg->len < len)
+    {
+        seg = new_segment(conn);
+        if (!seg)
+            return;
+        seg->size = len < BLOCK_SIZE ? BLOCK_SIZE : len;
+        seg->buf = malloc(seg->size);
+        if (!seg->buf)
+        {
+            set_fatal(conn, "malloc() failed: %s", strerror(errno));
+            return;
+        }
+        seg->data = seg->buf;
+    }
+    memcpy(seg->buf + seg->len, data, len);
+    seg->len += len;
+    conn->queued += len;
+}
+
+static void queue_uint32(struct ta_conn_t* conn, uint32_t u32)
+{
+    unsigned char buf[4];
+    put_uint32(buf, u32);
+    queue_raw(conn, buf, sizeof(buf));
+}
+
+static void queue_entry_header(struct ta_conn_t* conn, char type, uint64_t size)
+{
+    unsigned char header[ENTRY_HEADER_SIZE];
+    put_entry_header(header, type, size);
+    queue_raw(conn, header, sizeof(header));
+}
+
+static int add_pending(struct ta_conn_t* conn, const struct ta_handler_t* handler,
+                       void* ctx)
+{
+    struct pending_t* pending;
+
+    if (!conn->broken)
+    {
+        pending = grow_array(conn, conn->pending, &conn->pending_size,
+                             &conn->pending_first, conn->pending_count,
+                             sizeof(*conn->pending));
+        if (pending)
+        {
+            conn->pending = pending;
+            pending = &conn->pending[conn->pending_first + conn->pending_count++];
+            pending->handler = handler;
+            pending->ctx = ctx;
+            return 1;
+        }
+    }
+    if (handler->done)
+        handler->done(ctx, conn->error);
+    return 0;
+}
+
+void ta_start_rpc(struct ta_conn_t* conn, uint32_t id, uint32_t argc,
+                  const struct ta_handler_t* handler, void* ctx)
+{
+    if (!add_pending(conn, handler, ctx))
+        return;
+    queue_uint32(conn, id);
+    queue_uint32(conn, argc);
+}
+
+void ta_put_uint32(struct ta_conn_t* conn, uint32_t u32)
+{
+    queue_entry_header(conn, 'I', sizeof(u32));
+    queue_uint32(conn, u32);
+}
+
+void ta_put_uint64(struct ta_conn_t* conn, uint64_t u64)
+{
+    unsigned char buf[8];
+
+    queue_entry_header(conn, 'Q', sizeof(u64));
+    put_uint64(buf, u64);
+    queue_raw(conn, buf, sizeof(buf));
+}
+
+void ta_put_string(struct ta_conn_t* conn, const char* str)
+{
+    size_t len = strlen(str) + 1;
+
+    queue_entry_header(conn, 's', len);
+    queue_raw(conn, str, len);
+}
+
+void ta_put_data(struct ta_conn_t* conn, const void* data, uint64_t size)
+{
+    queue_entry_header(conn, 'd', size);
+    queue_raw(conn, data, size);
+}
+
+void ta_put_data_ref(struct ta_conn_t* conn, const void* data, uint64_t size)
+{
+    struct segment_t* seg;
+
+    queue_entry_header(conn, 'd', size);
+    if (!size || conn->broken || !(seg = new_segment(conn)))
+        return;
+    seg->data = data;
+    seg->len = size;
+    conn->queued += size;
+}
+
+void ta_put_file(struct ta_conn_t* conn, int fd, uint64_t size)
+{
+    struct segment_t* seg;
+
+    queue_entry_header(conn, 'd', size);
+    if (!size || conn->broken || !(seg = new_segment(conn)))
+    {
+        close(fd);
+        return;
+    }
+    seg->fd = fd;
+    seg->len = size;
+    conn->queued += size;
+}
+
+
+/*
+ * Sending and receiving.
+ */
+
+/* Sends what it can without blocking */
+static void send_segments(struct ta_conn_t* conn)
+{
+    while (conn->seg_count && !conn->broken)
+    {
+        struct segment_t* seg = &conn->segs[conn->seg_first];
+        struct iovec iov[64];
+        struct msghdr msg;
+        unsigned count;
+        ssize_t w;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if (seg->fd != -1)
+        {
+            if (conn->file_pos == conn->file_len)
+            {
+                ssize_t r = read(seg->fd, conn->file_buf,
+                                 seg->len < BLOCK_SIZE ? seg->len : BLOCK_SIZE);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                {
+                    /* The size was announced already so this is fatal */
+                    set_fatal(conn, "could not read the file to send: %s",
+                              r ? strerror(errno) : "it got truncated");
+                    return;
+                }
+                conn->file_pos = 0;
+                conn->file_len = r;
+            }
+            iov[0].iov_base = conn->file_buf + conn->file_pos;
+            iov[0].iov_len = conn->file_len - conn->file_pos;
+            count = 1;
+        }
+        else
+        {
+            /* Send the memory segments up to the next file */
+            for (count = 0; count < 64 && count < conn->seg_count; count++)
+            {
+                if (seg[count].fd != -1)
+                    break;
+                iov[count].iov_base = (void*)seg[count].data;
+                iov[count].iov_len = seg[count].len;
+            }
+        }
+        msg.msg_iovlen = count;
+
+        /* Report the server disconnections as errors rather than SIGPIPE */
+        w = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                set_fatal(conn, "network write error: %s", strerror(errno));
+            return;
+        }
+        conn->queued -= w;
+
+        if (seg->fd != -1)
+        {
+            conn->file_pos += w;
+            seg->len -= w;
+            if (!seg->len)
+            {
+                free_segment(seg);
+                conn->seg_first++;
+                conn->seg_count--;
+            }
+            continue;
+        }
+        while (w > 0)
+        {
+            seg = &conn->segs[conn->seg_first];
+            if ((uint64_t)w < seg->len)
+            {
+                seg->data += w;
+                seg->len -= w;
+                break;
+            }
+            w -= seg->len;
+            free_segment(seg);
+            conn->seg_first++;
+            conn->seg_count--;
+        }
+    }
+}
+
+static void expect_input(struct ta_conn_t* conn, enum in_state_t state, unsigned size)
+{
+    conn->in_state = state;
+    conn->in_got = 0;
+    conn->in_need = size;
+}
+
+static void end_reply(struct ta_conn_t* conn)
+{
+    struct pending_t p = conn->pending[conn->pending_first++];
+    char* error = conn->reply_error;
+
+    conn->pending_count--;
+    conn->reply_error = NULL;
+    expect_input(conn, IN_LISTSIZE, sizeof(uint32_t));
+    if (p.handler->done)
+        p.handler->done(p.ctx, error);
+    free(error);
+}
+
+static void end_entry(struct ta_conn_t* conn)
+{
+    if (--conn->entries)
+        expect_input(conn, IN_HEADER, ENTRY_HEADER_SIZE);
+    else
+        end_reply(conn);
+}
+
+static void end_value(struct ta_conn_t* conn)
+{
+    const struct pending_t* p = &conn->pending[conn->pending_first];
+
+    conn->value[conn->size] = '\0';
+    if (conn->type == 'e')
+    {
+        /* Only keep the first error */
+        if (!conn->reply_error)
+        {
+            conn->reply_error = conn->value;
+            conn->value = NULL;
+        }
+    }
+    else if (p->handler->value)
+        p->handler->value(p->ctx, conn->type, conn->value, conn->size);
+    free(conn->value);
+    conn->value = NULL;
+    end_entry(conn);
+}
+
+/* Decompresses a chunk of the 'z' entry and passes the result to the
+ * data callback.
+ */
+static void inflate_data(struct ta_conn_t* conn, const char* buf, unsigned len)
+{
+    const struct pending_t* p = &conn->pending[conn->pending_first];
+    z_stream* zs = &conn->zs;
+
+    zs->next_in = (Bytef*)buf;
+    zs->avail_in = len;
+    do
+    {
+        unsigned count;
+        int r;
+
+        zs->next_out = (Bytef*)conn->zbuf;
+        zs->avail_out = sizeof(conn->zbuf);
+        r = inflate(zs, Z_NO_FLUSH);
+        count = sizeof(conn->zbuf) - zs->avail_out;
+        if (conn->zend || (r == Z_STREAM_END && zs->avail_in) ||
+            (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) ||
+            conn->zsize + count > conn->size)
+        {
+            set_fatal(conn, "the compressed data is corrupt");
+            return;
+        }
+        conn->zsize += count;
+        if (count && p->handler->data)
+            p->handler->data(p->ctx, conn->zbuf, count);
+        if (r == Z_STREAM_END)
+        {
+            conn->zend = 1;
+            return;
+        }
+    }
+    while (zs->avail_in || !zs->avail_out);
+}
+
+static void start_zentry(struct ta_conn_t* conn)
+{
+    int r = conn->zs_init ? inflateReset(&conn->zs) : inflateInit(&conn->zs);
+    if (r != Z_OK)
+    {
+        set_fatal(conn, "could not initialize the decompression: %s",
+                  conn->zs.msg ? conn->zs.msg : "unknown error");
+        return;
+    }
+    conn->zs_init = 1;
+    conn->zend = 0;
+    conn->zsize = 0;
+    expect_input(conn, IN_ZCHUNK, sizeof(uint32_t));
+}
+
+static void parse_input(struct ta_conn_t* conn, const char* buf, unsigned len)
+{
+    while (len && !conn->broken)
+    {
+        const struct pending_t* p;
+        unsigned count;
+
+        if (!conn->pending_count)
+        {
+            set_fatal(conn, "got an unexpected reply");
+            return;
+        }
+        p = &conn->pending[conn->pending_first];
+
+        if (conn->in_state == IN_DATA || conn->in_state == IN_VALUE ||
+            conn->in_state == IN_ZDATA)
+        {
+            count = conn->left < len ? conn->left : len;
+            if (conn->in_state == IN_VALUE)
+                memcpy(conn->value + conn->size - conn->left, buf, count);
+            else if (conn->in_state == IN_ZDATA)
+                inflate_data(conn, buf, count);
+            else if (p->handler->data)
+                p->handler->data(p->ctx, buf, count);
+            buf += count;
+            len -= count;
+            conn->left -= count;
+            if (conn->left)
+                continue;
+            if (conn->in_state == IN_VALUE)
+                end_value(conn);
+            else if (conn->in_state == IN_ZDATA)
+                expect_input(conn, IN_ZCHUNK, sizeof(uint32_t));
+            else
+                end_entry(conn);
+            continue;
+        }
+
+        count = conn->in_need - conn->in_got;
+        if (count > len)
+            count = len;
+        memcpy(conn->in_raw + conn->in_got, buf, count);
+        buf += count;
+        len -= count;
+        conn->in_got += count;
+        if (conn->in_got < conn->in_need)
+            break;
+
+        if (conn->in_state == IN_LISTSIZE)
+        {
+            conn->entries = get_uint32(conn->in_raw);
+            if (conn->entries)
+                expect_input(conn, IN_HEADER, ENTRY_HEADER_SIZE);
+            else
+                end_reply(conn);
+            continue;
+        }
+
+        if (conn->in_state == IN_ZCHUNK)
+        {
+            conn->left = get_uint32(conn->in_raw);
+            if (conn->left)
+                expect_input(conn, IN_ZDATA, 0);
+            else if (!conn->zend || conn->zsize != conn->size)
+                set_fatal(conn, "the compressed data is truncated");
+            else
+                end_entry(conn);
+            continue;
+        }
+
+        /* This is an entry header */
+        conn->type = conn->in_raw[0];
+        conn->size = conn->left = get_uint64(conn->in_raw + 1);
+        if (conn->type == 'd')
+        {
+            if (p->handler->value)
+                p->handler->value(p->ctx, conn->type, NULL, conn->size);
+            expect_input(conn, IN_DATA, 0);
+            if (!conn->left)
+                end_entry(conn);
+        }
+        else if (conn->type == 'z')
+        {
+            if (p->handler->value)
+                p->handler->value(p->ctx, conn->type, NULL, conn->size);
+            start_zentry(conn);
+        }
+        else if (!strchr("IQseu", conn->type))
+            set_fatal(conn, "got an unknown '%c' entry", conn->type);
+        else if (conn->size > MAX_VALUE_SIZE)
+            set_fatal(conn, "the '%c' entry is too big (%lu bytes)", conn->type,
+                      (unsigned long)conn->size);
+        else if (!(conn->value = malloc(conn->size + 1)))
+            set_fatal(conn, "malloc() failed: %s", strerror(errno));
+        else
+        {
+            expect_input(conn, IN_VALUE, 0);
+            if (!conn->left)
+                end_value(conn);
+        }
+    }
+}
+
+static void receive_replies(struct ta_conn_t* conn)
+{
+    while (!conn->broken && conn->pending_count)
+    {
+        ssize_t r = recv(conn->fd, conn->in_buf, sizeof(conn->in_buf), 0);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                set_fatal(conn, "network read error: %s", strerror(errno));
+            return;
+        }
+        if (r == 0)
+        {
+            set_fatal(conn, "the server closed the connection");
+            return;
+        }
+        parse_input(conn, conn->in_buf, r);
+        if (r < (ssize_t)sizeof(conn->in_buf))
+            return;
+    }
+}
+
+int ta_get_fd(struct ta_conn_t* conn)
+{
+    return conn->fd;
+}
+
+int ta_get_events(struct ta_conn_t* conn)
+{
+    if (conn->broken)
+        return 0;
+    return (conn->pending_count ? POLLIN : 0) | (conn->seg_count ? POLLOUT : 0);
+}
+
+int ta_process(struct ta_conn_t* conn, int revents)
+{
+    if (revents & (POLLOUT | POLLERR | POLLHUP))
+        send_segments(conn);
+    if (revents & (POLLIN | POLLERR | POLLHUP))
+        receive_replies(conn);
+    return !conn->broken;
+}
+
+uint64_t ta_get_queued(struct ta_conn_t* conn)
+{
+    return conn->queued;
+}
+
+unsigned ta_get_pending(struct ta_conn_t* conn)
+{
+    return conn->pending_count;
+}
+
+static int64_t get_msecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Processes the I/O until *done is set or the timeout expires */
+static int run_until(struct ta_conn_t* conn, const int* done, int timeout)
+{
+    int64_t deadline = get_msecs() + timeout;
+
+    while (!*done && !conn->broken)
+    {
+        struct pollfd pfd;
+        int remaining = -1;
+
+        if (timeout >= 0)
+        {
+            remaining = deadline - get_msecs();
+            if (remaining <= 0)
+            {
+                /* The reply may still come so the connection is unusable */
+                set_fatal(conn, "timed out waiting for the server");
+                break;
+            }
+        }
+        pfd.fd = conn->fd;
+        pfd.events = ta_get_events(conn);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, remaining) < 0)
+        {
+            if (errno != EINTR)
+                set_fatal(conn, "poll() failed: %s", strerror(errno));
+        }
+        else
+            ta_process(conn, pfd.revents);
+    }
+    return *done && !conn->broken;
+}
+
+struct complete_t
+{
+    int done;
+};
+
+static void complete_done(void* ctx, const char* error)
+{
+    ((struct complete_t*)ctx)->done = 1;
+}
+
+static const struct ta_handler_t complete_handler = {NULL, NULL, complete_done};
+
+int ta_complete(struct ta_conn_t* conn)
+{
+    struct complete_t complete = {0};
+
+    if (!conn->pending_count)
+        return !conn->broken;
+    /* The replies come in order so wait for a ping queued after the others */
+    ta_start_rpc(conn, RPCID_PING, 0, &complete_handler, &complete);
+    return run_until(conn, &complete.done, conn->timeout);
+}
+
+
+/*
+ * The connection.
+ */
+
+struct ta_conn_t* ta_new(void)
+{
+    struct ta_conn_t* conn = calloc(1, sizeof(*conn));
+
+    if (conn)
+    {
+        conn->fd = -1;
+        conn->timeout = -1;
+        set_error(conn, "not connected");
+        conn->broken = 1;
+    }
+    return conn;
+}
+
+void ta_free(struct ta_conn_t* conn)
+{
+    set_fatal(conn, "the connection was closed");
+    if (conn->fd != -1)
+        close(conn->fd);
+    free(conn->segs);
+    free(conn->pending);
+    free(conn->value);
+    free(conn->reply_error);
+    free(conn->version);
+    if (conn->zs_init)
+        inflateEnd(&conn->zs);
+    free(conn);
+}
+
+void ta_set_timeout(struct ta_conn_t* conn, int timeout)
+{
+    conn->timeout = timeout;
+}
+
+const char* ta_get_version(struct ta_conn_t* conn)
+{
+    return conn->version;
+}
+
+/* The generic state of a blocking call */
+struct call_t
+{
+    struct ta_conn_t* conn;
+    int done;
+    int failed;
+};
+
+static void call_done(void* ctx, const char* error)
+{
+    struct call_t* call = ctx;
+
+    call->done = 1;
+    if (error)
+    {
+        call->failed = 1;
+        if (error != call->conn->error)
+            set_error(call->conn, "%s", error);
+    }
+}
+
+static int run_call(struct call_t* call, int timeout)
+{
+    return run_until(call->conn, &call->done, timeout) && !call->failed;
+}
+
+static void version_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct call_t* call = ctx;
+
+    if (type == 's')
+        call->conn->version = strdup(data);
+}
+
+static const struct ta_handler_t version_handler = {version_value, NULL, call_done};
+
+static int connect_address(struct ta_conn_t* conn, struct addrinfo* addr,
+                           int timeout)
+{
+    struct pollfd pfd;
+    socklen_t len;
+    int err, on = 1;
+
+    conn->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC,
+                      addr->ai_protocol);
+    if (conn->fd < 0)
+    {
+        set_error(conn, "unable to create a socket: %s", strerror(errno));
+        return 0;
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(conn->fd, addr->ai_addr, addr->ai_addrlen) == 0)
+        return 1;
+    if (errno != EINPROGRESS)
+    {
+        err = errno;
+    }
+    else
+    {
+        pfd.fd = conn->fd;
+        pfd.events = POLLOUT;
+        do
+            err = poll(&pfd, 1, timeout);
+        while (err < 0 && errno == EINTR);
+        if (err == 0)
+            err = ETIMEDOUT;
+        else if (err < 0)
+            err = errno;
+        else
+        {
+            len = sizeof(err);
+            if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                err = errno;
+        }
+    }
+    if (!err)
+        return 1;
+    set_error(conn, "unable to connect: %s", strerror(err));
+    close(conn->fd);
+    conn->fd = -1;
+    return 0;
+}
+
+int ta_connect(struct ta_conn_t* conn, const char* host, const char* port,
+               int timeout)
+{
+    struct addrinfo hints, *addresses, *addr;
+    struct call_t call = {conn};
+    int rc;
+
+    if (conn->fd != -1)
+    {
+        set_error(conn, "already connected");
+        return 0;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rc = getaddrinfo(host, port, &hints, &addresses);
+    if (rc)
+    {
+        set_error(conn, "unable to resolve '%s': %s", host, gai_strerror(rc));
+        return 0;
+    }
+    for (addr = addresses; addr; addr = addr->ai_next)
+        if (connect_address(conn, addr, timeout))
+            break;
+    freeaddrinfo(addresses);
+    if (conn->fd == -1)
+        return 0;
+
+    /* The server starts by sending its version as a lone entry */
+    conn->broken = 0;
+    add_pending(conn, &version_handler, &call);
+    conn->entries = 1;
+    expect_input(conn, IN_HEADER, ENTRY_HEADER_SIZE);
+    if (!run_call(&call, timeout))
+        return 0;
+    if (!conn->version)
+    {
+        set_fatal(conn, "the server did not send its version");
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * The blocking RPCs.
+ */
+
+static const struct ta_handler_t simple_handler = {NULL, NULL, call_done};
+
+int ta_ping(struct ta_conn_t* conn)
+{
+    struct call_t call = {conn};
+
+    ta_start_rpc(conn, RPCID_PING, 0, &simple_handler, &call);
+    return run_call(&call, conn->timeout);
+}
+
+struct getfile_t
+{
+    struct call_t call;
+    int fd;
+    int err;
+};
+
+static void getfile_data(void* ctx, const char* buf, unsigned len)
+{
+    struct getfile_t* getfile = ctx;
+
+    while (len && !getfile->err)
+    {
+        ssize_t w = write(getfile->fd, buf, len);
+        if (w < 0)
+        {
+            if (errno != EINTR)
+                getfile->err = errno;
+            continue;
+        }
+        buf += w;
+        len -= w;
+    }
+}
+
+static const struct ta_handler_t getfile_handler = {NULL, getfile_data, call_done};
+
+int ta_getfile(struct ta_conn_t* conn, const char* serverpath,
+               const char* localpath)
+{
+    struct getfile_t getfile = {{conn}};
+    int success;
+
+    getfile.fd = open(localpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (getfile.fd < 0)
+    {
+        set_error(conn, "unable to open '%s' for writing: %s", localpath, strerror(errno));
+        return 0;
+    }
+    ta_start_rpc(conn, RPCID_GETFILE, 1, &getfile_handler, &getfile);
+    ta_put_string(conn, serverpath);
+    success = run_call(&getfile.call, conn->timeout);
+    if (success && getfile.err)
+    {
+        set_error(conn, "unable to write to '%s': %s", localpath, strerror(getfile.err));
+        success = 0;
+    }
+    if (close(getfile.fd) < 0 && success)
+    {
+        set_error(conn, "unable to write to '%s': %s", localpath, strerror(errno));
+        success = 0;
+    }
+    if (!success)
+        unlink(localpath);
+    return success;
+}
+
+/* Queues the local file as a 'd' entry */
+static int put_local_file(struct ta_conn_t* conn, const char* localpath)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(localpath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        /* The RPC has been started already so the connection is lost */
+        set_fatal(conn, "unable to open '%s' for reading: %s", localpath, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    ta_put_file(conn, fd, st.st_size);
+    return 1;
+}
+
+int ta_sendfile(struct ta_conn_t* conn, const char* localpath,
+                const char* serverpath, uint32_t flags)
+{
+    struct call_t call = {conn};
+
+    if (access(localpath, R_OK) < 0)
+    {
+        set_error(conn, "unable to open '%s' for reading: %s", localpath, strerror(errno));
+        return 0;
+    }
+    ta_start_rpc(conn, RPCID_SENDFILE, 3, &simple_handler, &call);
+    ta_put_string(conn, serverpath);
+    ta_put_uint32(conn, flags);
+    put_local_file(conn, localpath);
+    return run_call(&call, conn->timeout);
+}
+
+int ta_upgrade(struct ta_conn_t* conn, const char* localpath)
+{
+    struct call_t call = {conn};
+
+    if (access(localpath, R_OK) < 0)
+    {
+        set_error(conn, "unable to open '%s' for reading: %s", localpath, strerror(errno));
+        return 0;
+    }
+    ta_start_rpc(conn, RPCID_UPGRADE, 1, &simple_handler, &call);
+    put_local_file(conn, localpath);
+    return run_call(&call, conn->timeout);
+}
+
+/* Collects the integer values of the reply */
+struct values_t
+{
+    struct call_t call;
+    unsigned count, max;
+    uint64_t* values;
+};
+
+static void values_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct values_t* values = ctx;
+    uint64_t value;
+
+    if (type == 'I' && size == 4)
+        value = get_uint32((const unsigned char*)data);
+    else if (type == 'Q' && size == 8)
+        value = get_uint64((const unsigned char*)data);
+    else
+        return;
+    if (values->count < values->max)
+        values->values[values->count++] = value;
+}
+
+static const struct ta_handler_t values_handler = {values_value, NULL, call_done};
+
+static int run_values_call(struct values_t* values, unsigned min, int timeout)
+{
+    if (!run_call(&values->call, timeout))
+        return 0;
+    if (values->count < min)
+    {
+        set_error(values->call.conn, "the server returned too few values");
+        return 0;
+    }
+    return 1;
+}
+
+uint64_t ta_run(struct ta_conn_t* conn, char** argv, uint32_t flags,
+                const char* inpath, const char* outpath, const char* errpath)
+{
+    uint64_t pid;
+    struct values_t values = {{conn}, 0, 1, &pid};
+    uint32_t argc;
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+    ta_start_rpc(conn, RPCID_RUN, 4 + argc, &values_handler, &values);
+    ta_put_uint32(conn, flags);
+    ta_put_string(conn, inpath ? inpath : "");
+    ta_put_string(conn, outpath ? outpath : "");
+    ta_put_string(conn, errpath ? errpath : "");
+    for (argc = 0; argv[argc]; argc++)
+        ta_put_string(conn, argv[argc]);
+    return run_values_call(&values, 1, conn->timeout) ? pid : 0;
+}
+
+/* Waits for the server-side timeout plus some leeway for the network */
+static int get_wait_timeout(struct ta_conn_t* conn, uint32_t timeout)
+{
+    if (conn->timeout < 0 || timeout == RUN_NOTIMEOUT)
+        return -1;
+    if (timeout >= (0x7fffffff - conn->timeout) / 1000)
+        return -1;
+    return timeout * 1000 + conn->timeout;
+}
+
+int ta_wait(struct ta_conn_t* conn, uint64_t pid, uint32_t timeout,
+            uint32_t* status)
+{
+    uint64_t value;
+    struct values_t values = {{conn}, 0, 1, &value};
+
+    ta_start_rpc(conn, RPCID_WAIT2, 2, &values_handler, &values);
+    ta_put_uint64(conn, pid);
+    ta_put_uint32(conn, timeout);
+    if (!run_values_call(&values, 1, get_wait_timeout(conn, timeout)))
+        return 0;
+    *status = value;
+    return 1;
+}
+
+int ta_waitmany(struct ta_conn_t* conn, const uint64_t* pids, uint32_t count,
+                uint32_t flags, uint32_t timeout, uint64_t* exited,
+                uint32_t* statuses)
+{
+    struct values_t values = {{conn}, 0, 2 * count, NULL};
+    unsigned i;
+    int success;
+
+    values.values = malloc(2 * count * sizeof(*values.values));
+    if (!values.values)
+    {
+        set_error(conn, "malloc() failed: %s", strerror(errno));
+        return -1;
+    }
+    ta_start_rpc(conn, RPCID_WAITMANY, 2 + count, &values_handler, &values);
+    ta_put_uint32(conn, flags);
+    ta_put_uint32(conn, timeout);
+    for (i = 0; i < count; i++)
+        ta_put_uint64(conn, pids[i]);
+    success = run_values_call(&values, 0, get_wait_timeout(conn, timeout));
+    for (i = 0; success && i < values.count / 2; i++)
+    {
+        exited[i] = values.values[2 * i];
+        statuses[i] = values.values[2 * i + 1];
+    }
+    free(values.values);
+    return success ? values.count / 2 : -1;
+}
+
+struct getoutput_t
+{
+    struct values_t values;
+    int stream;
+    void (*output)(void* ctx, int stream, const char* buf, unsigned len);
+    void* ctx;
+};
+
+static void getoutput_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct getoutput_t* getoutput = ctx;
+
+    if (type == 'd')
+        getoutput->stream++;
+    else
+        values_value(&getoutput->values, type, data, size);
+}
+
+static void getoutput_data(void* ctx, const char* buf, unsigned len)
+{
+    struct getoutput_t* getoutput = ctx;
+    getoutput->output(getoutput->ctx, getoutput->stream, buf, len);
+}
+
+static const struct ta_handler_t getoutput_handler = {getoutput_value, getoutput_data, call_done};
+
+int ta_getoutput(struct ta_conn_t* conn, uint64_t pid, uint32_t timeout,
+                 void (*output)(void* ctx, int stream, const char* buf, unsigned len),
+                 void* ctx, uint32_t* flags)
+{
+    uint64_t value;
+    struct getoutput_t getoutput = {{{conn}, 0, 1, &value}, 0, output, ctx};
+
+    ta_start_rpc(conn, RPCID_GETOUTPUT, 2, &getoutput_handler, &getoutput);
+    ta_put_uint64(conn, pid);
+    ta_put_uint32(conn, timeout);
+    if (!run_values_call(&getoutput.values, 1, get_wait_timeout(conn, timeout)))
+        return 0;
+    *flags = value;
+    return 1;
+}
+
+/* Keeps the first error message of the per-file results */
+struct rm_t
+{
+    struct call_t call;
+    char* error;
+};
+
+static void rm_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct rm_t* rm = ctx;
+
+    if (type == 's' && !rm->error)
+        rm->error = strdup(data);
+}
+
+static const struct ta_handler_t rm_handler = {rm_value, NULL, call_done};
+
+int ta_rm(struct ta_conn_t* conn, const char** paths, uint32_t count)
+{
+    struct rm_t rm = {{conn}, NULL};
+    uint32_t i;
+    int success;
+
+    ta_start_rpc(conn, RPCID_RM, count, &rm_handler, &rm);
+    for (i = 0; i < count; i++)
+        ta_put_string(conn, paths[i]);
+    success = run_call(&rm.call, conn->timeout);
+    if (success && rm.error)
+    {
+        set_error(conn, "%s", rm.error);
+        success = 0;
+    }
+    free(rm.error);
+    return success;
+}
+
+int ta_rmchildproc(struct ta_conn_t* conn, uint64_t pid)
+{
+    struct call_t call = {conn};
+
+    ta_start_rpc(conn, RPCID_RMCHILDPROC, 1, &simple_handler, &call);
+    ta_put_uint64(conn, pid);
+    return run_call(&call, conn->timeout);
+}
+
+int ta_settime(struct ta_conn_t* conn, uint32_t leeway)
+{
+    struct call_t call = {conn};
+
+    ta_start_rpc(conn, RPCID_SETTIME, 2, &simple_handler, &call);
+    ta_put_uint64(conn, time(NULL));
+    ta_put_uint32(conn, leeway);
+    return run_call(&call, conn->timeout);
+}
+
+struct properties_t
+{
+    struct call_t call;
+    void (*property)(void* ctx, const char* name, const char* value);
+    void* ctx;
+};
+
+static void properties_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct properties_t* properties = ctx;
+    char* name;
+    char* value;
+
+    if (type != 's' || !(name = strdup(data)))
+        return;
+    value = strchr(name, '=');
+    if (value)
+    {
+        *value++ = '\0';
+        properties->property(properties->ctx, name, value);
+    }
+    free(name);
+}
+
+static const struct ta_handler_t properties_handler = {properties_value, NULL, call_done};
+
+int ta_getproperties(struct ta_conn_t* conn,
+                     void (*property)(void* ctx, const char* name, const char* value),
+                     void* ctx)
+{
+    struct properties_t properties = {{conn}, property, ctx};
+
+    ta_start_rpc(conn, RPCID_GETPROPERTIES, 0, &properties_handler, &properties);
+    return run_call(&properties.call, conn->timeout);
+}
+
+int ta_getstats(struct ta_conn_t* conn, uint32_t flags,
+                void (*stat)(void* ctx, const char* name, const char* value),
+                void* ctx)
+{
+    struct properties_t properties = {{conn}, stat, ctx};
+
+    ta_start_rpc(conn, RPCID_GETSTATS, 1, &properties_handler, &properties);
+    ta_put_uint32(conn, flags);
+    return run_call(&properties.call, conn->timeout);
+}
+
+struct string_t
+{
+    struct call_t call;
+    char* str;
+};
+
+static void string_value(void* ctx, char type, const char* data, uint64_t size)
+{
+    struct string_t* string = ctx;
+
+    if (type == 's' && !string->str)
+        string->str = strdup(data);
+}
+
+static const struct ta_handler_t string_handler = {string_value, NULL, call_done};
+
+char* ta_getcwd(struct ta_conn_t* conn)
+{
+    struct string_t string = {{conn}, NULL};
+
+    ta_start_rpc(conn, RPCID_GETCWD, 0, &string_handler, &string);
+    if (!run_call(&string.call, conn->timeout))
+    {
+        free(string.str);
+        return NULL;
+    }
+    if (!string.str)
+        set_error(conn, "the server did not return its current directory");
+    return string.str;
+}
@@ -0,0 +1,170 @@
+/*
+ * A client library for the testagentd protocol.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __TESTAGENT_H
+#define __TESTAGENT_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+/* A connection to a testagentd server.
+ * The functions that fail return 0 and set the message that ta_get_error()
+ * returns. Errors that leave the connection in an unknown state, such as
+ * network errors and timeouts, are fatal: the pending RPCs fail and the
+ * connection can only be freed after that.
+ */
+struct ta_conn_t;
+
+struct ta_conn_t* ta_new(void);
+void ta_free(struct ta_conn_t* conn);
+
+/* Connects to the server and retrieves its protocol version. The timeout
+ * is in milliseconds, -1 meaning none.
+ */
+int ta_connect(struct ta_conn_t* conn, const char* host, const char* port,
+               int timeout);
+const char* ta_get_version(struct ta_conn_t* conn);
+const char* ta_get_error(struct ta_conn_t* conn);
+int ta_is_broken(struct ta_conn_t* conn);
+
+/* Sets how long, in milliseconds, the blocking functions wait for the server
+ * before giving up, -1 meaning forever, which is the default.
+ */
+void ta_set_timeout(struct ta_conn_t* conn, int timeout);
+
+
+/*
+ * The non-blocking API.
+ *
+ * An RPC is queued with ta_start_rpc() followed by one ta_put_xxx() call per
+ * parameter. Any number of RPCs can be queued, and they are sent and their
+ * replies received whenever ta_process() is called, typically once the
+ * ta_get_fd() socket is ready for the ta_get_events() poll() events. The
+ * replies are passed to the RPC's handler as they arrive.
+ */
+struct ta_handler_t
+{
+    /* Called for each value of the reply. For the 'd' and 'z' values data
+     * is NULL and the content is passed to the data callback as it arrives,
+     * already decompressed for the 'z' ones.
+     */
+    void (*value)(void* ctx, char type, const char* data, uint64_t size);
+    void (*data)(void* ctx, const char* buf, unsigned len);
+
+    /* Called once the reply is complete with the error message if the
+     * server returned one, or if the connection failed, and NULL otherwise.
+     */
+    void (*done)(void* ctx, const char* error);
+};
+
+void ta_start_rpc(struct ta_conn_t* conn, uint32_t id, uint32_t argc,
+                  const struct ta_handler_t* handler, void* ctx);
+void ta_put_uint32(struct ta_conn_t* conn, uint32_t u32);
+void ta_put_uint64(struct ta_conn_t* conn, uint64_t u64);
+void ta_put_string(struct ta_conn_t* conn, const char* str);
+
+/* The data parameters are always sent as uncompressed 'd' entries: the
+ * library provides no way to send 'z' ones.
+ */
+
+/* Copies the data so it can be freed right away */
+void ta_put_data(struct ta_conn_t* conn, const void* data, uint64_t size);
+
+/* Sends the data without copying it, so it must remain valid until
+ * ta_get_queued() returns 0.
+ */
+void ta_put_data_ref(struct ta_conn_t* conn, const void* data, uint64_t size);
+
+/* Streams size bytes from the file, starting at its current position. The
+ * file descriptor is closed once sent or when the connection is freed.
+ */
+void ta_put_file(struct ta_conn_t* conn, int fd, uint64_t size);
+
+int ta_get_fd(struct ta_conn_t* conn);
+int ta_get_events(struct ta_conn_t* conn);
+
+/* Sends and receives what it can without blocking. revents are the poll()
+ * events that occurred. Returns 0 if the connection is broken.
+ */
+int ta_process(struct ta_conn_t* conn, int revents);
+
+/* The number of bytes waiting to be sent, and of RPCs awaiting a reply */
+uint64_t ta_get_queued(struct ta_conn_t* conn);
+unsigned ta_get_pending(struct ta_conn_t* conn);
+
+/* Blocks until all the pending RPCs have completed */
+int ta_complete(struct ta_conn_t* conn);
+
+
+/*
+ * The blocking API.
+ *
+ * These send the RPC and wait for the reply, but can still be mixed with
+ * pending non-blocking RPCs. The RPCs not listed here, such as batch and
+ * runbatch, are only available through the non-blocking API.
+ */
+int ta_ping(struct ta_conn_t* conn);
+int ta_getfile(struct ta_conn_t* conn, const char* serverpath,
+               const char* localpath);
+int ta_sendfile(struct ta_conn_t* conn, const char* localpath,
+                const char* serverpath, uint32_t flags);
+uint64_t ta_run(struct ta_conn_t* conn, char** argv, uint32_t flags,
+                const char* inpath, const char* outpath, const char* errpath);
+
+/* Waits for the child process and removes it. The timeout is in seconds,
+ * RUN_NOTIMEOUT meaning none.
+ */
+int ta_wait(struct ta_conn_t* conn, uint64_t pid, uint32_t timeout,
+            uint32_t* status);
+
+/* Waits for any or, with WM_ALL, all the child processes to exit and stores
+ * the pid and status of those that did in order in exited and statuses,
+ * which must have room for count entries. Returns the number of exited
+ * child processes, or -1 on error.
+ */
+int ta_waitmany(struct ta_conn_t* conn, const uint64_t* pids, uint32_t count,
+                uint32_t flags, uint32_t timeout, uint64_t* exited,
+                uint32_t* statuses);
+
+/* Retrieves the new output of a child process started with RUN_STREAM. The
+ * output is passed to the callback, stream being 1 for stdout and 2 for
+ * stderr, and *flags is set to the output_flags_t of the streams that
+ * ended.
+ */
+int ta_getoutput(struct ta_conn_t* conn, uint64_t pid, uint32_t timeout,
+                 void (*output)(void* ctx, int stream, const char* buf, unsigned len),
+                 void* ctx, uint32_t* flags);
+
+int ta_rm(struct ta_conn_t* conn, const char** paths, uint32_t count);
+int ta_rmchildproc(struct ta_conn_t* conn, uint64_t pid);
+int ta_settime(struct ta_conn_t* conn, uint32_t leeway);
+
+/* Passes each property or statistic to the callback */
+int ta_getproperties(struct ta_conn_t* conn,
+                     void (*property)(void* ctx, const char* name, const char* value),
+                     void* ctx);
+int ta_getstats(struct ta_conn_t* conn, uint32_t flags,
+                void (*stat)(void* ctx, const char* name, const char* value),
+                void* ctx);
+
+/* Returns the server's current directory, to be freed by the caller */
+char* ta_getcwd(struct ta_conn_t* conn);
+
+int ta_upgrade(struct ta_conn_t* conn, const char* localpath);
+
+#endif /* __TESTAGENT_H */
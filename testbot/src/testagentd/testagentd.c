@@ -21,13 +21,19 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
 
 #include "platform.h"
+#include "list.h"
+#include "sha256.h"
+#include "tar.h"
 
 /* Increase the major version number when making backward-incompatible changes.
  * Otherwise increase the minor version number:
@@ -38,14 +44,31 @@
  * 1.4:  Add the settime RPC.
  * 1.5:  Add support for upgrading the server.
  * 1.6:  Add support for the rmchildproc and getcwd RPC.
+ * 1.7:  The RPCs can be pipelined.
+ * 1.8:  Add the batch RPC.
+ * 1.9:  Add support for compressed 'z' entries.
+ * 1.10: Add the file cache and the have RPC.
+ * 1.11: Add the matchblocks RPC and delta sendfile.
+ * 1.12: Add byte ranges to getfile and SF_APPEND to sendfile.
+ * 1.13: Add RUN_STREAM and the getoutput RPC.
+ * 1.14: Add the sendtree and gettree RPCs.
+ * 1.15: Add the waitmany RPC.
+ * 1.16: Add the runbatch RPC.
+ * 1.17: The wait2 RPC can return the child process resource usage.
+ * 1.18: Add the getstats RPC.
+ * 1.19: Add the GF_CHECKSUM and SF_CHECKSUM transfer checksums.
  */
-#define PROTOCOL_VERSION "testagentd 1.6"
+#define PROTOCOL_VERSION "testagentd 1.19"
 
 #define BLOCK_SIZE       65536
 
 static char** server_argv;
 static const char *name0;
 static int opt_debug = 0;
+static int opt_zerocopy = 1;
+static int opt_uring = 0;
+static const char* opt_cache = "testagentd.cache";
+static const char* opt_trace = NULL;
 
 
 /*
@@ -77,26 +100,6 @@ void debug(const char* format, ...)
  * Functions related to the list of known RPCs.
  */
 
-enum rpc_ids_t
-{
-    RPCID_PING = 0,
-    RPCID_GETFILE,
-    RPCID_SENDFILE,
-    RPCID_RUN,
-    RPCID_WAIT,
-    RPCID_RM,
-    RPCID_WAIT2,
-    RPCID_SETTIME,
-    RPCID_GETPROPERTIES,
-    RPCID_UPGRADE,
-    RPCID_RMCHILDPROC,
-    RPCID_GETCWD,
-};
-
-/* This is the RPC currently being processed */
-#define NO_RPCID         (~((uint32_t)0))
-static uint32_t rpcid = NO_RPCID;
-
 static const char* rpc_name(uint32_t id)
 {
     static char unknown[11];
@@ -113,6 +116,15 @@ static const char* rpc_name(uint32_t id)
         "upgrade",
         "rmchildproc",
         "getcwd",
+        "batch",
+        "have",
+        "matchblocks",
+        "getoutput",
+        "sendtree",
+        "gettree",
+        "waitmany",
+        "runbatch",
+        "getstats",
     };
 
     if (id < sizeof(names) / sizeof(*names))
@@ -125,25 +137,279 @@ static const char* rpc_name(uint32_t id)
 
 
 /*
- * Functions to set the status of the last operation.
- * This is sort of like an errno variable which is meant to be sent to the
- * client to indicate the result of the last operation.
+ * Connection management.
  */
 
-/* status can take three values:
- * - ST_OK    indicates that the operation was successful
- * - ST_ERROR the operation failed but we can still perform other operations
- * - ST_FATAL the connection is in an undefined state and should be closed
+/* A 'z' entry is a compressed 'd' entry. Its header specifies the size of
+ * the uncompressed data but its content is a sequence of chunks, each made
+ * of its size as a uint32 followed by that much zlib-compressed data, and
+ * terminated by an empty chunk.
  */
-static int status = ST_OK;
-const char* status_names[] = {"ok:", "error:", "fatal:"};
+enum in_state_t
+{
+    IN_RPCID,       /* Receiving the RPC id */
+    IN_LISTSIZE,    /* Receiving the parameter count */
+    IN_HEADER,      /* Receiving a parameter's entry header */
+    IN_DATA,        /* Receiving a parameter into memory */
+    IN_FILE,        /* Streaming a 'd' parameter to a file */
+    IN_SKIP,        /* Discarding the rest of a parameter */
+    IN_ZCHUNK,      /* Receiving the size of a 'z' parameter chunk */
+    IN_ZDATA,       /* Decompressing a 'z' parameter chunk to a file */
+};
+
+enum arg_state_t
+{
+    ARG_INMEMORY,   /* The data is in arg_t.data */
+    ARG_STREAMED,   /* The data was successfully written to a file */
+    ARG_SKIPPED,    /* The data was discarded */
+};
+
+struct arg_t
+{
+    char type;
+    enum arg_state_t state;
+    uint64_t size;
+    char* data;
+    uint32_t crc; /* The CRC-32 of the checksummed streamed data */
+};
+
+/* This is a piece of a reply waiting to be sent. Small pieces are appended
+ * to the previous out_t while it has room so replies can be sent in as few
+ * system calls and packets as possible.
+ * If fd is not -1 then, once data has been sent, the next block is read
+ * from that file until left reaches zero. Where possible the file is sent
+ * with platform_sendfile() which bypasses the buffer entirely, so it is only
+ * allocated when needed.
+ * If tar is set the blocks are read from the archive it generates instead,
+ * and fd is not used.
+ * If zs is set the file is sent as a 'z' entry instead, the chunks being
+ * compressed from the zin buffer into buf, and zdone is set once the
+ * terminating chunk is in buf.
+ * If trailer is set, crc is updated with each block read from the file and
+ * is stored in that deferred out_t once the whole file has been read.
+ * A deferred out_t is a placeholder for the reply of an RPC which has not
+ * completed yet. The replies queued after it are held back until it is
+ * replaced with the real reply.
+ */
+struct out_t
+{
+    struct list entry;
+    int deferred;
+    int fd;
+    struct mktar_t* tar;
+    char* filename;
+    int nosendfile;
+    uint64_t left, size, start;
+    unsigned capacity, len, pos;
+    char* buf;
+    int compress, zdone;
+    z_stream* zs;
+    char* zin;
+    uint64_t wire;
+    struct out_t* trailer;
+    uLong crc;
+    char data[1];
+};
+
+/* The RPC parameters, and everything derived from them that does not
+ * outlive the RPC, are allocated from a per-connection arena which is reset
+ * once the RPC is done. So they need not be freed individually, even on the
+ * error paths. The RPCs whose processing continues past their reception,
+ * such as batch, take over the arena.
+ */
+struct arena_chunk_t
+{
+    struct arena_chunk_t* next;
+    size_t size, used;
+};
+
+struct arena_t
+{
+    /* The chunk being allocated from comes first */
+    struct arena_chunk_t* chunks;
+    size_t total;
+};
+
+struct batch_t;
+struct runbatch_t;
+
+struct connection_t
+{
+    struct list entry;
+    SOCKET sock;
+    int events;
+
+    /* Identifies the connection in the RPC trace */
+    uint32_t id;
+
+    /* The RPC currently being processed */
+    uint32_t rpcid;
+
+    /* When the current RPC started arriving, how many bytes it and its reply
+     * took, whether the reply got deferred, and whether it is an error, for
+     * the statistics and the RPC trace.
+     */
+    uint64_t rpc_start, rpc_in, rpc_out;
+    int rpc_deferred, rpc_error;
+
+    /* status can take three values:
+     * - ST_OK    indicates that the operation was successful
+     * - ST_ERROR the operation failed but we can still perform other
+     *            operations
+     * - ST_FATAL the connection is in an undefined state and should be closed
+     */
+    int status;
+
+    /* This is a message which indicates the reason for the status */
+    char* status_msg;
+    int status_size;
+
+    /* If true, then the connection is in a broken state and will be closed
+     * as soon as the pending replies have been sent.
+     */
+    int broken;
+
+    /* The state of the RPC parser. The RPC is only processed once all its
+     * parameters have been received, except for the 'd' entries which are
+     * written to the file as they arrive.
+     * The data is read in big chunks into in_buf and parsed from there, but
+     * the large parameters bypass it when it is empty.
+     */
+    char in_buf[BLOCK_SIZE];
+    unsigned in_pos, in_len;
+    enum in_state_t in_state;
+    uint64_t in_size, in_got;
+    char in_raw[9];
+    uint32_t argc, argn;
+    struct arg_t* args;
+    struct arena_t arena;
+    int data_fd;
+    struct untar_t* data_tar; /* Extracts the data instead of data_fd */
+    const char* data_name;
+    int data_keep; /* Keep the partial data if the connection is lost */
+    int data_checksum; /* Compute the CRC-32 of the data in data_crc */
+    uLong data_crc;
+    uint64_t data_start;
+    int nosplice;
+
+    /* The decompression state of the 'z' parameter being received.
+     * in_zinit is set while in_zs needs to be freed, and in_zend once the
+     * end of the compressed stream has been reached.
+     */
+    z_stream in_zs;
+    int in_zinit, in_zend;
+    char* in_zbuf;
+    uint64_t in_zsize, in_zwire;
+
+    /* The index of the next parameter for the recv_xxx() functions */
+    uint32_t argi;
+
+    /* The list of out_t structures to send, and where to insert new ones.
+     * out_size is the amount of memory they use and out_files the number of
+     * files they keep open.
+     */
+    struct list out;
+    struct list* out_at;
+    unsigned out_size, out_files;
+
+    /* The list of waiter_t structures for the pending wait RPCs */
+    struct list waiters;
+
+    /* The batch RPC whose operations are being run, if any */
+    struct batch_t* batch;
+};
+
+/* This is a wait RPC waiting for a child process to exit, a getoutput RPC
+ * waiting for it to produce some output, or a waitmany RPC waiting for any or
+ * all of a set of child processes to exit.
+ */
+struct waiter_t
+{
+    struct list entry;
+    struct out_t* reply;
+    uint32_t rpcid;
+    uint64_t pid;
+    uint64_t* pids;
+    uint32_t count, flags;
+    uint32_t timeout;
+    time_t deadline;
+    uint64_t start, in;
+
+    /* The runbatch RPC this waiter schedules the commands of, if any */
+    struct runbatch_t* runbatch;
+
+    /* The batch to resume once the wait completes, if any */
+    struct batch_t* batch;
+};
+
+/* This is one of the commands of a runbatch RPC. Its strings point to the
+ * RPC parameters.
+ */
+struct command_t
+{
+    uint32_t flags, timeout;
+    char* redirects[3];
+    char** argv;
+    uint64_t pid; /* Set while the command is running */
+    time_t deadline;
+    uint64_t start, end;
+    uint32_t status, result;
+    char* error;
+};
+
+/* This is a runbatch RPC. Its commands are started in order, at most slots
+ * at a time, and the reply is sent once they have all exited. deadline is
+ * when the next running command times out, or 0 if none can.
+ */
+struct runbatch_t
+{
+    struct arg_t* args;
+    uint32_t argc;
+    struct arena_t arena;
+    struct command_t* cmds;
+    uint32_t count, next, running, slots;
+    uint64_t start;
+    time_t deadline;
+};
+
+/* This is a batch RPC. Its parameters are a sequence of operations, each
+ * made of the RPC id, the parameter count and then the parameters proper,
+ * which are run one after the other until one fails.
+ * Each operation's reply is sent as a sublist, between the head placeholder
+ * which gets replaced with the total entry count once the batch is done,
+ * and the tail one which marks where the next sublist goes.
+ */
+struct batch_t
+{
+    struct arg_t* args;
+    uint32_t argc, argi;
+    struct arena_t arena;
+    struct out_t *head, *tail;
+    uint32_t entries;
+    uint64_t last_pid;
+    uint64_t start, in, out;
+    int waiting;
+    int failed;
+};
 
-/* If true, then the current connection is in a broken state */
-static int broken = 0;
+static struct list connections = LIST_INIT(connections);
+static uint32_t connection_count = 0;
+
+/* This is the connection currently being serviced */
+static struct connection_t* current = NULL;
 
 /* If true, then the server should exit */
 static int quit = 0;
 
+
+/*
+ * Functions to set the status of the last operation.
+ * This is sort of like an errno variable which is meant to be sent to the
+ * client to indicate the result of the last operation.
+ */
+
+const char* status_names[] = {"ok:", "error:", "fatal:"};
+
 static char* vformat_msg(char** buf, int* size, const char* format, va_list valist)
 {
     int len;
@@ -178,27 +444,25 @@ static char* format_msg(char** buf, int* size, const char* format, ...)
     return *buf;
 }
 
-/* This is a message which indicates the reason for the status */
-static char* status_msg = NULL;
-static int status_size = 0;
 static void vset_status_msg(const char* format, va_list valist)
 {
-    vformat_msg(&status_msg, &status_size, format, valist);
-    if (opt_debug || status != ST_OK)
-        fprintf(stderr, "%s%s: %s\n", status_names[status], rpc_name(rpcid), status_msg);
+    vformat_msg(&current->status_msg, &current->status_size, format, valist);
+    if (opt_debug || current->status != ST_OK)
+        fprintf(stderr, "%s%s: %s\n", status_names[current->status],
+                rpc_name(current->rpcid), current->status_msg);
 }
 
 void set_status(int newstatus, const char* format, ...)
 {
     va_list valist;
     /* Don't let an error erase a fatal error */
-    if (newstatus != ST_ERROR || status != ST_FATAL)
+    if (newstatus != ST_ERROR || current->status != ST_FATAL)
     {
-        status = newstatus;
+        current->status = newstatus;
         if (newstatus == ST_FATAL)
-            broken = 1;
+            current->broken = 1;
         else if (newstatus == ST_OK)
-            broken = 0;
+            current->broken = 0;
         va_start(valist, format);
         vset_status_msg(format, valist);
         va_end(valist);
@@ -207,931 +471,4045 @@ void set_status(int newstatus, const char* format, ...)
 
 
 /*
- * Low-level functions to receive raw data
+ * The per-RPC memory arena.
  */
 
-static int skip_raw_data(SOCKET client, uint64_t size)
-{
-    char buf[BLOCK_SIZE];
+#define ARENA_CHUNK_SIZE  16384
+#define ARENA_ALIGN       16
 
-    if (broken)
-        return 0;
+/* Bounds the memory an RPC can use */
+#define ARENA_MAX_SIZE    (64 * 1048576)
+
+#define ARENA_HEADER_SIZE ((sizeof(struct arena_chunk_t) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static void* arena_alloc(struct arena_t* arena, size_t size)
+{
+    struct arena_chunk_t* chunk = arena->chunks;
+    void* ptr;
 
-    while (size)
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!chunk || chunk->size - chunk->used < size)
     {
-        int s = size < sizeof(buf) ? size : sizeof(buf);
-        int r = recv(client, buf, s, 0);
-        if (r < 0)
+        /* Big blocks get a chunk of their own so the current one can still
+         * be used for the small ones.
+         */
+        size_t chunksize = size > ARENA_CHUNK_SIZE / 4 ? size : ARENA_CHUNK_SIZE;
+
+        if (arena->total + chunksize > ARENA_MAX_SIZE)
         {
-            set_status(ST_FATAL, "skip_raw_data() failed: %s", sockerror());
-            return 0;
+            set_status(ST_ERROR, "the RPC needs more than %u MB of memory", ARENA_MAX_SIZE / 1048576);
+            return NULL;
+        }
+        chunk = malloc(ARENA_HEADER_SIZE + chunksize);
+        if (!chunk)
+        {
+            set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+            return NULL;
+        }
+        chunk->size = chunksize;
+        chunk->used = 0;
+        arena->total += chunksize;
+        if (chunksize == size && arena->chunks)
+        {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        }
+        else
+        {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
         }
-        size -= r;
     }
-    return 1;
+    ptr = (char*)chunk + ARENA_HEADER_SIZE + chunk->used;
+    chunk->used += size;
+    return ptr;
 }
 
-static int recv_raw_data(SOCKET client, void* data, uint64_t size)
+static void* arena_calloc(struct arena_t* arena, size_t size)
 {
-    char* d = data;
+    void* ptr = arena_alloc(arena, size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
 
-    if (broken)
-        return 0;
+/* Frees everything but one regular chunk so the next RPC does not need to
+ * allocate memory in most cases.
+ */
+static void arena_reset(struct arena_t* arena)
+{
+    struct arena_chunk_t* chunk = arena->chunks;
+    struct arena_chunk_t* kept = NULL;
 
-    while (size)
+    while (chunk)
     {
-        int r = recv(client, d, size, 0);
-        if (r == 0)
-        {
-            set_status(ST_FATAL, "recv_raw_data() got a premature EOF");
-            return 0;
-        }
-        if (r < 0)
+        struct arena_chunk_t* next = chunk->next;
+        if (!kept && chunk->size == ARENA_CHUNK_SIZE)
         {
-            set_status(ST_FATAL, "recv_raw_data() failed: %s", sockerror());
-            return 0;
+            kept = chunk;
+            kept->used = 0;
+            kept->next = NULL;
         }
-        d += r;
-        size -= r;
+        else
+            free(chunk);
+        chunk = next;
     }
-    return 1;
+    arena->chunks = kept;
+    arena->total = kept ? kept->size : 0;
 }
 
-static int recv_raw_uint32(SOCKET client, uint32_t *u32)
+static void arena_free(struct arena_t* arena)
 {
-    if (!recv_raw_data(client, u32, sizeof(*u32)))
-        return 0;
-    *u32 = ntohl(*u32);
-    return 1;
+    while (arena->chunks)
+    {
+        struct arena_chunk_t* next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    arena->total = 0;
 }
 
-static int recv_raw_uint64(SOCKET client, uint64_t *u64)
+/* Hands the arena's memory over to dst, leaving src empty */
+static void arena_move(struct arena_t* dst, struct arena_t* src)
 {
-    uint32_t high, low;
-
-    if (!recv_raw_uint32(client, &high) || !recv_raw_uint32(client, &low))
-        return 0;
-    *u64 = ((uint64_t)high) << 32 | low;
-    return 1;
+    *dst = *src;
+    src->chunks = NULL;
+    src->total = 0;
 }
 
 
 /*
- * Functions to receive argument lists
+ * Functions to retrieve the RPC parameters
  */
 
-static int recv_entry_header(SOCKET client, char *type, uint64_t *size)
-{
-    return recv_raw_data(client, type, sizeof(*type)) &&
-           recv_raw_uint64(client, size);
-}
-
 #define ANY_SIZE   (~((uint64_t)0))
 
-static int expect_entry_header(SOCKET client, char type, uint64_t *size)
+static struct arg_t* expect_entry(struct connection_t* conn, char type, uint64_t size)
 {
-    char htype;
-    uint64_t hsize;
-    int success;
-
-    if (!recv_entry_header(client, &htype, &hsize))
-        return 0;
+    struct arg_t* arg;
 
-    if (type != htype)
+    if (conn->argi >= conn->argn)
     {
-        set_status(ST_ERROR, "Expected a parameter of type %c but got %c instead", type, htype);
-        success = 0;
+        set_status(ST_ERROR, "Missing parameter %u", conn->argi);
+        return NULL;
     }
-    else if (*size != ANY_SIZE && *size != hsize)
+    arg = &conn->args[conn->argi++];
+
+    if (type != arg->type)
+        set_status(ST_ERROR, "Expected a parameter of type %c but got %c instead", type, arg->type);
+    else if (size != ANY_SIZE && size != arg->size)
+        set_status(ST_ERROR, "Expected a parameter of size " U64FMT " but got " U64FMT " instead", size, arg->size);
+    else if (arg->state == ARG_SKIPPED)
     {
-        set_status(ST_ERROR, "Expected a parameter of size " U64FMT " but got " U64FMT " instead", *size, hsize);
-        success = 0;
+        /* The reason is already in status_msg */
+        return NULL;
     }
     else
-    {
-        *size = hsize;
-        success = 1;
-    }
-    if (!success)
-        skip_raw_data(client, hsize);
-    return success;
+        return arg;
+    return NULL;
 }
 
-static int recv_uint32(SOCKET client, uint32_t *u32)
+static int recv_uint32(struct connection_t* conn, uint32_t *u32)
 {
-    uint64_t size = sizeof(*u32);
-    int success = expect_entry_header(client, 'I', &size) &&
-                  recv_raw_uint32(client, u32);
-    if (success)
-        debug("  recv_uint32() -> %u\n", *u32);
-    return success;
+    struct arg_t* arg = expect_entry(conn, 'I', sizeof(*u32));
+    if (!arg)
+        return 0;
+    memcpy(u32, arg->data, sizeof(*u32));
+    *u32 = ntohl(*u32);
+    debug("  recv_uint32() -> %u\n", *u32);
+    return 1;
 }
 
-static int recv_uint64(SOCKET client, uint64_t *u64)
+static int recv_uint64(struct connection_t* conn, uint64_t *u64)
 {
-    uint64_t size = sizeof(*u64);
-    int success = expect_entry_header(client, 'Q', &size) &&
-                  recv_raw_uint64(client, u64);
-    if (success)
-        debug("  recv_uint64() -> " U64FMT "\n", *u64);
-    return success;
+    struct arg_t* arg = expect_entry(conn, 'Q', sizeof(*u64));
+    uint32_t high, low;
+
+    if (!arg)
+        return 0;
+    memcpy(&high, arg->data, sizeof(high));
+    memcpy(&low, arg->data + sizeof(high), sizeof(low));
+    *u64 = ((uint64_t)ntohl(high)) << 32 | ntohl(low);
+    debug("  recv_uint64() -> " U64FMT "\n", *u64);
+    return 1;
 }
 
-static int recv_string(SOCKET client, char* *str)
+/* The string remains valid until the end of the RPC */
+static int recv_string(struct connection_t* conn, char* *str)
 {
-    uint64_t size = ANY_SIZE;
-    int success;
+    struct arg_t* arg = expect_entry(conn, 's', ANY_SIZE);
 
     *str = NULL;
-    if (!expect_entry_header(client, 's', &size))
-        return 0;
-
-    *str = malloc(size);
-    if (!*str)
-    {
-        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
-        skip_raw_data(client, size);
+    if (!arg)
         return 0;
-    }
-    success = recv_raw_data(client, *str, size);
-    if (success)
-        debug("  recv_string() -> '%s'\n", *str);
-    else
-    {
-        free(*str);
-        *str = NULL;
-    }
-    return success;
+    *str = arg->data;
+    debug("  recv_string() -> '%s'\n", *str);
+    return 1;
 }
 
-static int recv_file(SOCKET client, int fd, const char* filename)
+/* This is for the rare 'd' entries that are received in memory.
+ * The data remains valid until the end of the RPC.
+ */
+static int recv_data(struct connection_t* conn, char** data, uint64_t* size)
 {
-    uint64_t size = ANY_SIZE;
+    struct arg_t* arg = expect_entry(conn, 'd', ANY_SIZE);
 
-    debug("  recv_file(%s)\n", filename);
-    if (!expect_entry_header(client, 'd', &size))
+    *data = NULL;
+    if (!arg)
         return 0;
-
-    while (size)
+    if (arg->state != ARG_INMEMORY)
     {
-        char buffer[BLOCK_SIZE];
-        int c, r, w;
-        c = size < sizeof(buffer) ? size : sizeof(buffer);
-        r = recv(client, buffer, c, 0);
-        if (r == 0)
-        {
-            debug("  got disconnected with " U64FMT " bytes still to be read!\n", size);
-            set_status(ST_FATAL, "got disconnected prematurely");
-            return 0;
-        }
-        if (r < 0)
-        {
-            set_status(ST_FATAL, "an error occurred while reading: %s", sockerror());
-            return 0;
-        }
-        size -= r;
-        w = write(fd, buffer, r);
-        if (w != r)
-        {
-            set_status(ST_ERROR, "an error occurred while writing to '%s': %s", filename, strerror(errno));
-            debug("  could only write %d bytes out of %d: %s\n", w, r, strerror(errno));
-            skip_raw_data(client, size);
-            return 0;
-        }
+        set_status(ST_ERROR, "the data parameter was not received");
+        return 0;
     }
-    debug("  File reception complete\n");
+    *data = arg->data;
+    *size = arg->size;
+    debug("  recv_data() -> " U64FMT " bytes\n", *size);
     return 1;
 }
 
-static int skip_entries(SOCKET client, uint32_t count)
+/* Checks that the data entry was successfully written to the file that
+ * open_data_file() provided for it.
+ */
+static int recv_file(struct connection_t* conn, const char* filename)
 {
-    while (count)
+    debug("  recv_file(%s)\n", filename);
+    if (!expect_entry(conn, 'd', ANY_SIZE))
+        return 0;
+    if (conn->args[conn->argi - 1].state != ARG_STREAMED)
     {
-        char type;
-        uint64_t size;
-        if (!recv_entry_header(client, &type, &size) ||
-            !skip_raw_data(client, size))
-            return 0;
-        count--;
+        set_status(ST_ERROR, "the data for '%s' was not received", filename);
+        return 0;
     }
+    debug("  File reception complete\n");
     return 1;
 }
 
-static int recv_list_size(SOCKET client, uint32_t *u32)
+static int recv_list_size(struct connection_t* conn, uint32_t *u32)
 {
-    if (!recv_raw_uint32(client, u32))
-        return 0;
+    *u32 = conn->argc;
     debug("  recv_list_size() -> %u\n", *u32);
-
-    if (*u32 >= 1048576)
-    {
-        /* The client is in fact most likely not speaking the right protocol */
-        set_status(ST_FATAL, "the list size is too big (%d)", *u32);
-        return 0;
-    }
     return 1;
 }
 
-static int expect_list_size(SOCKET client, uint32_t expected)
+static int expect_list_size(struct connection_t* conn, uint32_t expected)
 {
-    uint32_t size;
-
-    if (!recv_list_size(client, &size))
-        return 0;
-
-    if (size == expected)
+    if (conn->argc == expected)
         return 1;
 
-    set_status(ST_ERROR, "Invalid number of parameters (%u instead of %u)", size, expected);
-    skip_entries(client, size);
+    set_status(ST_ERROR, "Invalid number of parameters (%u instead of %u)", conn->argc, expected);
     return 0;
 }
 
-
-/*
- * Low-level functions to send raw data
+/* Deletes the temporary files of the parameters. Their memory belongs to
+ * the arena.
  */
-
-
-static int send_raw_data(SOCKET client, const void* data, uint64_t size)
+static void free_arg_list(struct arg_t* args, uint32_t argc)
 {
-    const char* d = data;
-
-    if (broken)
-        return 0;
+    uint32_t i;
 
-    while (size)
+    for (i = 0; args && i < argc; i++)
     {
-        int w = send(client, d, size, 0);
-        if (w < 0)
-        {
-            set_status(ST_FATAL, "send_raw_data() failed: %s", sockerror());
-            return 0;
-        }
-        d += w;
-        size -= w;
+        /* Unless received in memory, a 'd' entry only has data if it went
+         * to a temporary file.
+         */
+        if (args[i].type == 'd' && args[i].state != ARG_INMEMORY &&
+            args[i].data)
+            unlink(args[i].data);
     }
-    return 1;
-}
-
-static int send_raw_uint32(SOCKET client, uint32_t u32)
-{
-    u32 = htonl(u32);
-    return send_raw_data(client, &u32, sizeof(u32));
 }
 
-static int send_raw_uint64(SOCKET client, uint64_t u64)
+static void free_args(struct connection_t* conn)
 {
-    return send_raw_uint32(client, u64 >> 32) &&
-           send_raw_uint32(client, u64 & 0xffffffff);
+    /* The arg_t array is zero-initialized so this also covers the entry
+     * being received.
+     */
+    free_arg_list(conn->args, conn->argc);
+    arena_reset(&conn->arena);
+    conn->args = NULL;
+    conn->argc = conn->argn = conn->argi = 0;
 }
 
 
 /*
- * Functions to send argument lists
+ * Low-level functions to send raw data
  */
 
-static int send_list_size(SOCKET client, uint32_t u32)
+/* Returns true if the out_t streams a file or an archive */
+static int is_file_out(struct out_t* out)
 {
-    debug("  send_list_size(%u)\n", u32);
-    return send_raw_uint32(client, u32);
+    return out->fd != -1 || out->tar;
 }
 
-static int send_entry_header(SOCKET client, char type, uint64_t size)
+static struct out_t* alloc_out(struct connection_t* conn, unsigned size)
 {
-    return send_raw_data(client, &type, sizeof(type)) &&
-           send_raw_uint64(client, size);
+    struct out_t* out;
+
+    out = malloc(offsetof(struct out_t, data[size]));
+    if (!out)
+    {
+        set_status(ST_FATAL, "malloc() failed: %s", strerror(errno));
+        return NULL;
+    }
+    out->deferred = 0;
+    out->fd = -1;
+    out->tar = NULL;
+    out->filename = NULL;
+    out->nosendfile = 0;
+    out->left = out->size = out->start = 0;
+    out->capacity = size;
+    out->len = out->pos = 0;
+    out->buf = out->data;
+    out->compress = out->zdone = 0;
+    out->zs = NULL;
+    out->zin = NULL;
+    out->wire = 0;
+    out->trailer = NULL;
+    list_add_before(conn->out_at, &out->entry);
+    conn->out_size += size;
+    return out;
 }
 
-static int _send_status(SOCKET client, char type)
+static void free_out(struct connection_t* conn, struct out_t* out)
 {
-    int stlen, msglen;
-
-    msglen = strlen(status_msg);
-    if (status == ST_ERROR)
+    conn->out_size -= out->capacity;
+    list_remove(&out->entry);
+    if (out->fd != -1)
     {
-        /* Omit the 'error' prefix */
-        debug("  send_status('%c', '%s')\n", type, status_msg);
-        return send_entry_header(client, type, msglen + 1) &&
-               send_raw_data(client, status_msg, msglen + 1);
+        conn->out_files--;
+        close(out->fd);
     }
-    else
+    if (out->tar)
     {
-        /* Include the 'fatal' prefix for fatal errors */
-        stlen = strlen(status_names[status]);
-        debug("  send_status('%c', '%s %s')\n", type, status_names[status], status_msg);
-        return send_entry_header(client, type, stlen + 1 + msglen + 1) &&
-            send_raw_data(client, status_names[status], stlen) &&
-            send_raw_data(client, " ", 1) &&
-            send_raw_data(client, status_msg, msglen + 1);
+        conn->out_files--;
+        mktar_close(out->tar);
     }
+    if (out->buf != out->data)
+        free(out->buf);
+    if (out->zs)
+    {
+        deflateEnd(out->zs);
+        free(out->zs);
+    }
+    free(out->zin);
+    free(out->filename);
+    free(out);
 }
 
-static int send_status(SOCKET client)
+/* Keep track of how fast files get transferred in each direction, split by
+ * whether they bypassed the userspace buffers, went through io_uring or were
+ * compressed.
+ */
+enum xfer_method_t
 {
-    return _send_status(client, 's');
-}
+    XFER_COPY,
+    XFER_ZEROCOPY,
+    XFER_ZLIB,
+    XFER_URING,
+    XFER_METHODS
+};
 
-static int send_error(SOCKET client)
+struct transfer_stats_t
 {
-    /* We send only one result string */
-    return send_list_size(client, 1) &&
-           _send_status(client, 'e');
+    uint64_t count, bytes, wire, usecs;
+};
+static struct transfer_stats_t transfer_stats[2][XFER_METHODS];
+
+static void trace_transfer(int upload, enum xfer_method_t xfer, uint64_t size,
+                           uint64_t wire, uint64_t start)
+{
+    static const char* methods[2][XFER_METHODS] = {
+        {"read+send", "sendfile", "deflate", "io_uring read+send"},
+        {"recv+write", "splice", "inflate", "io_uring recv+write"}};
+    struct transfer_stats_t* stats = &transfer_stats[upload][xfer];
+    const char* method = methods[upload][xfer];
+    uint64_t elapsed = platform_gettime() - start;
+
+    stats->count++;
+    stats->bytes += size;
+    stats->wire += wire;
+    stats->usecs += elapsed;
+    if (opt_debug)
+    {
+        debug("  Transferred " U64FMT " bytes (" U64FMT " on the wire) in %.1f ms (%.1f MB/s) with %s\n",
+              size, wire, elapsed / 1000.0,
+              elapsed ? (double)size / elapsed : 0.0, method);
+        debug("  Totals for %s: " U64FMT " files, " U64FMT " bytes (" U64FMT " on the wire, %.1f MB/s)\n",
+              method, stats->count, stats->bytes, stats->wire,
+              stats->usecs ? (double)stats->bytes / stats->usecs : 0.0);
+    }
 }
 
-static int send_undef(SOCKET client)
+
+/*
+ * Per-RPC statistics.
+ */
+
+/* The latencies are counted in log-linear buckets, like HDR histograms: each
+ * power of two is split into LATENCY_SUBBUCKETS buckets so the relative error
+ * stays under 1/LATENCY_SUBBUCKETS whatever the magnitude. The last bucket
+ * starts at about 12 days.
+ */
+#define LATENCY_SUBBITS     3
+#define LATENCY_SUBBUCKETS  (1 << LATENCY_SUBBITS)
+#define LATENCY_BUCKETS     (38 * LATENCY_SUBBUCKETS)
+
+/* The byte counts are those of the protocol entries, so the compressed
+ * entries count for their uncompressed size. The latency goes from the
+ * arrival of the RPC to its reply being queued, so it includes the upload
+ * but not the download. See the transfer statistics for that.
+ */
+struct rpc_stats_t
 {
-    debug("  send_undef()\n");
-    return send_entry_header(client, 'u', 0);
+    uint64_t calls, errors, bytes_in, bytes_out, usecs;
+    uint64_t latency[LATENCY_BUCKETS];
+};
+
+/* The last slot is for the unknown RPCs */
+static struct rpc_stats_t rpc_stats[RPCID_COUNT + 1];
+static uint64_t stats_start;
+
+/* The server's CPU time at the start of the statistics, in microseconds */
+static uint64_t stats_utime, stats_stime;
+
+static struct rpc_stats_t* get_rpc_stats(uint32_t id)
+{
+    return &rpc_stats[id < RPCID_COUNT ? id : RPCID_COUNT];
 }
 
-static int send_uint32(SOCKET client, uint32_t u32)
+static unsigned latency_bucket(uint64_t usecs)
 {
-    debug("  send_uint32(%u)\n", u32);
-    return send_entry_header(client, 'I', sizeof(u32)) &&
-           send_raw_uint32(client, u32);
+    unsigned msb, bucket;
+
+    if (usecs < LATENCY_SUBBUCKETS)
+        return usecs;
+    msb = LATENCY_SUBBITS;
+    while (usecs >> (msb + 1))
+        msb++;
+    bucket = (msb - LATENCY_SUBBITS + 1) * LATENCY_SUBBUCKETS +
+             ((usecs >> (msb - LATENCY_SUBBITS)) & (LATENCY_SUBBUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
 }
 
-static int send_uint64(SOCKET client, uint64_t u64)
+/* Returns the smallest latency that goes in the specified bucket */
+static uint64_t latency_floor(unsigned bucket)
 {
-    debug("  send_uint64(" U64FMT ")\n", u64);
-    return send_entry_header(client, 'Q', sizeof(u64)) &&
-           send_raw_uint64(client, u64);
+    if (bucket < 2 * LATENCY_SUBBUCKETS)
+        return bucket;
+    return (uint64_t)(LATENCY_SUBBUCKETS + bucket % LATENCY_SUBBUCKETS)
+           << (bucket / LATENCY_SUBBUCKETS - 1);
 }
 
-static int send_string(SOCKET client, const char* str)
+static void trace_rpc(struct connection_t* conn, uint32_t id, uint64_t start,
+                      uint64_t elapsed, uint64_t in, uint32_t flags);
+
+/* Records that the RPC completed, start being when it arrived and in its
+ * size. The size of the reply and whether it is an error are taken from the
+ * connection.
+ */
+static void count_rpc(struct connection_t* conn, uint32_t id, uint64_t start,
+                      uint64_t in, uint32_t flags)
 {
-    uint64_t size;
+    struct rpc_stats_t* stats = get_rpc_stats(id);
+    uint64_t elapsed = platform_gettime() - start;
 
-    debug("  send_string(%s)\n", str);
-    size = strlen(str) + 1;
-    return send_entry_header(client, 's', size) &&
-           send_raw_data(client, str, size);
+    stats->calls++;
+    stats->usecs += elapsed;
+    stats->latency[latency_bucket(elapsed)]++;
+    trace_rpc(conn, id, start, elapsed, in, flags);
 }
 
-static int send_file(SOCKET client, int fd, const char* filename)
+static void count_rpc_out(struct connection_t* conn, uint64_t size)
 {
-    char buffer[BLOCK_SIZE];
-    struct stat st;
-    uint64_t size;
-
-    if (broken)
-        return 0;
+    if (conn->rpcid != NO_RPCID)
+        get_rpc_stats(conn->rpcid)->bytes_out += size;
+    conn->rpc_out += size;
+}
 
-    debug("  send_file(%s)\n", filename);
-    if (fstat(fd, &st))
+/* Calls emit() with each statistic as a name=value string and returns the
+ * number of statistics.
+ */
+static unsigned format_stats(void (*emit)(void* ctx, const char* str), void* ctx)
+{
+    static const char* xfer_names[2][XFER_METHODS] = {
+        {"send.copy", "send.zerocopy", "send.zlib", "send.uring"},
+        {"recv.copy", "recv.zerocopy", "recv.zlib", "recv.uring"}};
+    uint64_t utime, stime;
+    char *buf = NULL;
+    int size = 0;
+    unsigned count = 0, id, i, j;
+
+    format_msg(&buf, &size, "stats.uptime=" U64FMT, (platform_gettime() - stats_start) / 1000000);
+    emit(ctx, buf);
+    platform_getcpu(&utime, &stime);
+    format_msg(&buf, &size, "stats.cpu.user=" U64FMT, utime - stats_utime);
+    emit(ctx, buf);
+    format_msg(&buf, &size, "stats.cpu.system=" U64FMT, stime - stats_stime);
+    emit(ctx, buf);
+    count += 3;
+
+    for (id = 0; id <= RPCID_COUNT; id++)
     {
-        set_status(ST_ERROR, "unable to get the size of '%s': %s", filename, strerror(errno));
-        return 0;
-    }
-    size = st.st_size;
-    if (!send_entry_header(client, 'd', size))
-        return 0;
+        struct rpc_stats_t* stats = &rpc_stats[id];
+        const char* name = id < RPCID_COUNT ? rpc_name(id) : "unknown";
 
-    while (size)
-    {
-        int r, w;
-        int c;
-        c = size < sizeof(buffer) ? size : sizeof(buffer);
-        r = read(fd, buffer, c);
-        if (r == 0)
+        if (!stats->calls && !stats->errors)
+            continue;
+        format_msg(&buf, &size, "rpc.%s.calls=" U64FMT, name, stats->calls);
+        emit(ctx, buf);
+        format_msg(&buf, &size, "rpc.%s.errors=" U64FMT, name, stats->errors);
+        emit(ctx, buf);
+        format_msg(&buf, &size, "rpc.%s.in=" U64FMT, name, stats->bytes_in);
+        emit(ctx, buf);
+        format_msg(&buf, &size, "rpc.%s.out=" U64FMT, name, stats->bytes_out);
+        emit(ctx, buf);
+        format_msg(&buf, &size, "rpc.%s.usecs=" U64FMT, name, stats->usecs);
+        emit(ctx, buf);
+        count += 5;
+
+        /* Only send the histogram buckets that are in use */
+        for (i = 0; i < LATENCY_BUCKETS; i++)
         {
-            debug("  reached EOF with " U64FMT " bytes still to be read!\n", size);
-            set_status(ST_FATAL, "reached the '%s' EOF prematurely", filename);
-            return 0;
+            if (!stats->latency[i])
+                continue;
+            format_msg(&buf, &size, "rpc.%s.latency." U64FMT "=" U64FMT,
+                       name, latency_floor(i), stats->latency[i]);
+            emit(ctx, buf);
+            count++;
         }
-        if (r < 0)
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        for (j = 0; j < XFER_METHODS; j++)
         {
-            set_status(ST_FATAL, "an error occurred while reading '%s': %s", filename, strerror(errno));
-            return 0;
+            struct transfer_stats_t* stats = &transfer_stats[i][j];
+            if (!stats->count)
+                continue;
+            format_msg(&buf, &size, "xfer.%s.count=" U64FMT, xfer_names[i][j], stats->count);
+            emit(ctx, buf);
+            format_msg(&buf, &size, "xfer.%s.bytes=" U64FMT, xfer_names[i][j], stats->bytes);
+            emit(ctx, buf);
+            format_msg(&buf, &size, "xfer.%s.wire=" U64FMT, xfer_names[i][j], stats->wire);
+            emit(ctx, buf);
+            format_msg(&buf, &size, "xfer.%s.usecs=" U64FMT, xfer_names[i][j], stats->usecs);
+            emit(ctx, buf);
+            count += 4;
         }
-        size -= r;
-        w = send(client, buffer, r, 0);
-        if (w != r)
-        {
-            set_status(ST_FATAL, "an error occurred while sending: %s", sockerror());
-            debug("  could only send %d bytes out of %d: %s\n", w, r, sockerror());
+    }
+    free(buf);
+    return count;
+}
+
+static void reset_stats(void)
+{
+    memset(rpc_stats, 0, sizeof(rpc_stats));
+    memset(transfer_stats, 0, sizeof(transfer_stats));
+    stats_start = platform_gettime();
+    platform_getcpu(&stats_utime, &stats_stime);
+}
+
+static void print_stat(void* ctx, const char* str)
+{
+    fprintf(stderr, "%s\n", str);
+}
+
+
+/*
+ * RPC trace.
+ */
+
+/* If --trace is used, a record describing each RPC is appended to the trace
+ * file once it completes, so the traffic can be analyzed or replayed later.
+ * The records are accumulated in memory and written out in bulk at the end
+ * of each event loop iteration, or when the buffer is full, so tracing does
+ * not add a system call per RPC.
+ *
+ * The file starts with TRACE_MAGIC, the trace format version and the record
+ * size, followed by the records proper. All the integers are in network
+ * byte order and the records contain, in that order:
+ *   uint64_t start     When the RPC started arriving, in microseconds since
+ *                      the trace started.
+ *   uint64_t duration  How long it took, as in the statistics.
+ *   uint64_t in        The size of the RPC and its parameters.
+ *   uint64_t out       The size of the reply.
+ *   uint32_t conn      Identifies the connection the RPC came through.
+ *   uint32_t rpcid
+ *   uint32_t flags     See trace_flags_t.
+ * The operations of a batch RPC get their own records, flagged with
+ * TRACE_BATCHED, and precede that of the batch RPC.
+ */
+#define TRACE_MAGIC      "TATRACE"
+#define TRACE_VERSION    1
+#define TRACE_RECORDSIZE (4 * 8 + 3 * 4)
+#define TRACE_BUFSIZE    (1024 * TRACE_RECORDSIZE)
+
+enum trace_flags_t {
+    TRACE_ERROR    = 1, /* The reply is an error */
+    TRACE_DEFERRED = 2, /* The RPC waited for a child process */
+    TRACE_BATCHED  = 4, /* The RPC is an operation of a batch RPC */
+};
+
+static int trace_fd = -1;
+static unsigned char trace_buf[TRACE_BUFSIZE];
+static unsigned trace_len;
+static uint64_t trace_start;
+
+static void flush_trace(void)
+{
+    unsigned pos = 0;
+
+    while (pos < trace_len)
+    {
+        int w = write(trace_fd, trace_buf + pos, trace_len - pos);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error("unable to write to the '%s' trace file: %s\n", opt_trace, strerror(errno));
+            error("the RPC trace is disabled\n");
+            close(trace_fd);
+            trace_fd = -1;
+            break;
+        }
+        pos += w;
+    }
+    trace_len = 0;
+}
+
+static int open_trace(void)
+{
+    trace_fd = open(opt_trace, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (trace_fd < 0)
+    {
+        error("unable to open the '%s' trace file: %s\n", opt_trace, strerror(errno));
+        return 0;
+    }
+    memcpy(trace_buf, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    put_uint32(trace_buf + 8, TRACE_VERSION);
+    put_uint32(trace_buf + 12, TRACE_RECORDSIZE);
+    trace_len = 16;
+    trace_start = platform_gettime();
+    flush_trace();
+    return trace_fd != -1;
+}
+
+static void trace_rpc(struct connection_t* conn, uint32_t id, uint64_t start,
+                      uint64_t elapsed, uint64_t in, uint32_t flags)
+{
+    unsigned char* record;
+
+    if (trace_fd == -1)
+        return;
+    if (trace_len + TRACE_RECORDSIZE > sizeof(trace_buf))
+    {
+        flush_trace();
+        if (trace_fd == -1)
+            return;
+    }
+    if (conn->rpc_error)
+        flags |= TRACE_ERROR;
+
+    record = trace_buf + trace_len;
+    put_uint64(record, start - trace_start);
+    put_uint64(record + 8, elapsed);
+    put_uint64(record + 16, in);
+    put_uint64(record + 24, conn->rpc_out);
+    put_uint32(record + 32, conn->id);
+    put_uint32(record + 36, id);
+    put_uint32(record + 40, flags);
+    trace_len += TRACE_RECORDSIZE;
+}
+
+/* Stop reading new RPCs once their replies use this much memory or keep
+ * this many files open.
+ */
+#define MAX_PENDING_OUTPUT 1048576
+#define MAX_PENDING_FILES  64
+
+/* Keep running the pipelined RPCs while their replies are being sent, as
+ * long as they don't pile up. But always finish receiving the current RPC.
+ */
+static int wants_input(struct connection_t* conn)
+{
+    return !conn->broken && !quit &&
+           (conn->in_state != IN_RPCID ||
+            (conn->out_size < MAX_PENDING_OUTPUT &&
+             conn->out_files < MAX_PENDING_FILES));
+}
+
+static int has_ready_output(struct connection_t* conn)
+{
+    return !list_empty(&conn->out) &&
+           !LIST_ENTRY(list_head(&conn->out), struct out_t, entry)->deferred;
+}
+
+/* The minimum size of the reply buffers */
+#define OUT_CHUNK_SIZE   4096
+
+static int send_raw_data(struct connection_t* conn, const void* data, uint64_t size)
+{
+    struct list* prev;
+    struct out_t* out;
+
+    if (conn->broken)
+        return 0;
+
+    prev = list_prev(&conn->out, conn->out_at);
+    out = prev ? LIST_ENTRY(prev, struct out_t, entry) : NULL;
+    if (!out || out->deferred || is_file_out(out) ||
+        out->capacity - out->len < size)
+    {
+        out = alloc_out(conn, size < OUT_CHUNK_SIZE ? OUT_CHUNK_SIZE : size);
+        if (!out)
+            return 0;
+    }
+    memcpy(out->buf + out->len, data, size);
+    out->len += size;
+    return 1;
+}
+
+static int send_raw_uint32(struct connection_t* conn, uint32_t u32)
+{
+    u32 = htonl(u32);
+    return send_raw_data(conn, &u32, sizeof(u32));
+}
+
+static int send_raw_uint64(struct connection_t* conn, uint64_t u64)
+{
+    return send_raw_uint32(conn, u64 >> 32) &&
+           send_raw_uint32(conn, u64 & 0xffffffff);
+}
+
+/* Sends the buffered data of the ready replies with a single system call,
+ * stopping before the first file that still needs to be read.
+ */
+static int send_buffers(struct connection_t* conn)
+{
+    struct send_buffer_t bufs[MAX_SEND_BUFFERS];
+    struct out_t *out, *next;
+    int count, more, w, sent;
+
+    count = more = 0;
+    LIST_FOR_EACH_ENTRY(out, &conn->out, struct out_t, entry)
+    {
+        if (out->deferred)
+            break;
+        if (count == MAX_SEND_BUFFERS)
+        {
+            more = 1;
+            break;
+        }
+        bufs[count].data = out->buf + out->pos;
+        bufs[count].len = out->len - out->pos;
+        count++;
+        if (is_file_out(out))
+        {
+            more = out->zs ? !out->zdone : out->left != 0;
+            break;
+        }
+    }
+
+    w = platform_sendv(conn->sock, bufs, count, more);
+    if (w <= 0)
+        return w;
+
+    /* Free the buffers that have been sent, but not the files as
+     * flush_output() still has to deal with them.
+     */
+    sent = w;
+    LIST_FOR_EACH_ENTRY_SAFE(out, next, &conn->out, struct out_t, entry)
+    {
+        unsigned chunk = out->len - out->pos;
+        if (chunk > sent)
+            chunk = sent;
+        out->pos += chunk;
+        sent -= chunk;
+        if (out->pos < out->len || is_file_out(out))
+            break;
+        free_out(conn, out);
+        if (!sent)
+            break;
+    }
+    return w;
+}
+
+/* Reads the next block of the file or archive to send. Returns the number
+ * of bytes read, or 0 with a fatal status if that failed.
+ */
+static int read_out_block(struct out_t* out, char* buf, unsigned size)
+{
+    int r;
+
+    if (size > out->left)
+        size = out->left;
+    r = out->tar ? mktar_read(out->tar, buf, size) : read(out->fd, buf, size);
+    if (r == 0)
+    {
+        debug("  reached EOF with " U64FMT " bytes still to be read!\n", out->left);
+        set_status(ST_FATAL, "reached the '%s' EOF prematurely", out->filename);
+        return 0;
+    }
+    if (r < 0)
+    {
+        /* mktar_read() has already set the status */
+        if (!out->tar)
+            set_status(ST_FATAL, "an error occurred while reading '%s': %s", out->filename, strerror(errno));
+        return 0;
+    }
+    out->left -= r;
+    if (out->trailer)
+        out->crc = crc32(out->crc, (Bytef*)buf, r);
+    return r;
+}
+
+/* Releases the CRC-32 trailer now that the file has been read */
+static void end_file_out(struct out_t* out)
+{
+    if (out->trailer)
+    {
+        put_uint32((unsigned char*)out->trailer->buf + ENTRY_HEADER_SIZE, out->crc);
+        out->trailer->deferred = 0;
+    }
+}
+
+/* Reads and compresses the file until there is a chunk to send, followed
+ * by the terminating empty chunk once the end of the file is reached.
+ */
+static int compress_block(struct connection_t* conn, struct out_t* out)
+{
+    /* Leave room for the chunk size and the terminating chunk */
+    const unsigned room = BLOCK_SIZE - 2 * sizeof(uint32_t);
+    z_stream* zs = out->zs;
+    uint32_t chunk;
+
+    if (!zs)
+    {
+        out->buf = malloc(BLOCK_SIZE);
+        out->zin = malloc(BLOCK_SIZE);
+        zs = out->zs = calloc(1, sizeof(*zs));
+        if (!out->buf || !out->zin || !zs)
+        {
+            set_status(ST_FATAL, "malloc() failed: %s", strerror(errno));
             return 0;
         }
+        out->capacity = BLOCK_SIZE;
+        conn->out_size += BLOCK_SIZE;
+        if (deflateInit(zs, Z_BEST_SPEED) != Z_OK)
+        {
+            set_status(ST_FATAL, "could not initialize the compression: %s", zs->msg ? zs->msg : "unknown error");
+            return 0;
+        }
+    }
+
+    zs->next_out = (Bytef*)out->buf + sizeof(uint32_t);
+    zs->avail_out = room;
+    while (zs->avail_out == room)
+    {
+        int r;
+
+        if (!zs->avail_in && out->left)
+        {
+            r = read_out_block(out, out->zin, BLOCK_SIZE);
+            if (!r)
+                return 0;
+            zs->next_in = (Bytef*)out->zin;
+            zs->avail_in = r;
+        }
+        r = deflate(zs, out->left ? Z_NO_FLUSH : Z_FINISH);
+        if (r == Z_STREAM_END)
+        {
+            out->zdone = 1;
+            break;
+        }
+        if (r != Z_OK && r != Z_BUF_ERROR)
+        {
+            set_status(ST_FATAL, "could not compress '%s': %s", out->filename, zs->msg ? zs->msg : "unknown error");
+            return 0;
+        }
+    }
+
+    chunk = room - zs->avail_out;
+    out->len = 0;
+    if (chunk)
+    {
+        chunk = htonl(chunk);
+        memcpy(out->buf, &chunk, sizeof(chunk));
+        out->len = sizeof(chunk) + room - zs->avail_out;
+    }
+    if (out->zdone)
+    {
+        memset(out->buf + out->len, 0, sizeof(uint32_t));
+        out->len += sizeof(uint32_t);
+    }
+    out->pos = 0;
+    out->wire += out->len;
+    return 1;
+}
+
+/* Sends as much of the pending replies as possible without blocking */
+static void flush_output(struct connection_t* conn)
+{
+    while (has_ready_output(conn))
+    {
+        struct out_t* out = LIST_ENTRY(list_head(&conn->out), struct out_t, entry);
+        int w;
+
+        if (!is_file_out(out) && out->pos == out->len)
+        {
+            /* Nothing left to send */
+            free_out(conn, out);
+            continue;
+        }
+        if (out->pos == out->len && out->compress)
+        {
+            if (!out->start)
+                out->start = platform_gettime();
+            if (out->zdone)
+            {
+                debug("  File successfully sent\n");
+                trace_transfer(0, XFER_ZLIB, out->size, out->wire, out->start);
+                end_file_out(out);
+                free_out(conn, out);
+                continue;
+            }
+            if (!compress_block(conn, out))
+                return;
+        }
+        else if (out->pos == out->len)
+        {
+            int r;
+            if (!out->start)
+                out->start = platform_gettime();
+            if (!out->left)
+            {
+                debug("  File successfully sent\n");
+                trace_transfer(0, out->nosendfile ? XFER_COPY :
+                               opt_uring ? XFER_URING : XFER_ZEROCOPY,
+                               out->size, out->size, out->start);
+                end_file_out(out);
+                free_out(conn, out);
+                continue;
+            }
+
+            if (!out->nosendfile)
+            {
+                r = platform_sendfile(conn->sock, out->fd, out->left);
+                if (r > 0)
+                {
+                    out->left -= r;
+                    continue;
+                }
+                if (r == -2)
+                {
+                    debug("  sendfile is not supported for '%s'\n", out->filename);
+                    out->nosendfile = 1;
+                    continue;
+                }
+                if (r == 0)
+                {
+                    debug("  reached EOF with " U64FMT " bytes still to be read!\n", out->left);
+                    set_status(ST_FATAL, "reached the '%s' EOF prematurely", out->filename);
+                    return;
+                }
+                if (sockewouldblock())
+                    return;
+                if (sockeintr())
+                    continue;
+                set_status(ST_FATAL, "an error occurred while sending '%s': %s", out->filename, sockerror());
+                return;
+            }
+
+            if (!out->buf)
+            {
+                out->buf = malloc(BLOCK_SIZE);
+                if (!out->buf)
+                {
+                    set_status(ST_FATAL, "malloc() failed: %s", strerror(errno));
+                    return;
+                }
+                out->capacity = BLOCK_SIZE;
+                conn->out_size += BLOCK_SIZE;
+            }
+            r = read_out_block(out, out->buf, BLOCK_SIZE);
+            if (!r)
+                return;
+            out->len = r;
+            out->pos = 0;
+        }
+
+        w = send_buffers(conn);
+        if (w < 0)
+        {
+            if (sockewouldblock())
+                return;
+            if (sockeintr())
+                continue;
+            set_status(ST_FATAL, "an error occurred while sending: %s", sockerror());
+            return;
+        }
+    }
+}
+
+
+/*
+ * Functions to send argument lists
+ */
+
+static int send_entry_header(struct connection_t* conn, char type, uint64_t size)
+{
+    unsigned char header[ENTRY_HEADER_SIZE];
+
+    count_rpc_out(conn, ENTRY_HEADER_SIZE + size);
+    put_entry_header(header, type, size);
+    return send_raw_data(conn, header, sizeof(header));
+}
+
+static int send_list_size(struct connection_t* conn, uint32_t u32)
+{
+    debug("  send_list_size(%u)\n", u32);
+    if (conn->batch)
+    {
+        /* In batches each reply is a sublist preceded by its size */
+        conn->batch->entries += 1 + u32;
+        return send_entry_header(conn, 'I', sizeof(u32)) &&
+               send_raw_uint32(conn, u32);
+    }
+    count_rpc_out(conn, sizeof(u32));
+    return send_raw_uint32(conn, u32);
+}
+
+static int _send_status(struct connection_t* conn, char type)
+{
+    int stlen, msglen;
+
+    /* Any error stops the batch */
+    if (conn->batch)
+        conn->batch->failed = 1;
+    if (type == 'e')
+    {
+        if (conn->rpcid != NO_RPCID)
+            get_rpc_stats(conn->rpcid)->errors++;
+        conn->rpc_error = 1;
+    }
+
+    msglen = strlen(conn->status_msg);
+    if (conn->status == ST_ERROR)
+    {
+        /* Omit the 'error' prefix */
+        debug("  send_status('%c', '%s')\n", type, conn->status_msg);
+        return send_entry_header(conn, type, msglen + 1) &&
+               send_raw_data(conn, conn->status_msg, msglen + 1);
+    }
+    else
+    {
+        /* Include the 'fatal' prefix for fatal errors */
+        stlen = strlen(status_names[conn->status]);
+        debug("  send_status('%c', '%s %s')\n", type, status_names[conn->status], conn->status_msg);
+        return send_entry_header(conn, type, stlen + 1 + msglen + 1) &&
+            send_raw_data(conn, status_names[conn->status], stlen) &&
+            send_raw_data(conn, " ", 1) &&
+            send_raw_data(conn, conn->status_msg, msglen + 1);
+    }
+}
+
+static int send_status(struct connection_t* conn)
+{
+    return _send_status(conn, 's');
+}
+
+static int send_error(struct connection_t* conn)
+{
+    /* We send only one result string */
+    return send_list_size(conn, 1) &&
+           _send_status(conn, 'e');
+}
+
+static int send_undef(struct connection_t* conn)
+{
+    debug("  send_undef()\n");
+    return send_entry_header(conn, 'u', 0);
+}
+
+static int send_uint32(struct connection_t* conn, uint32_t u32)
+{
+    debug("  send_uint32(%u)\n", u32);
+    return send_entry_header(conn, 'I', sizeof(u32)) &&
+           send_raw_uint32(conn, u32);
+}
+
+static int send_uint64(struct connection_t* conn, uint64_t u64)
+{
+    debug("  send_uint64(" U64FMT ")\n", u64);
+    return send_entry_header(conn, 'Q', sizeof(u64)) &&
+           send_raw_uint64(conn, u64);
+}
+
+static int send_string(struct connection_t* conn, const char* str)
+{
+    uint64_t size;
+
+    debug("  send_string(%s)\n", str);
+    size = strlen(str) + 1;
+    return send_entry_header(conn, 's', size) &&
+           send_raw_data(conn, str, size);
+}
+
+/* Don't bother compressing files smaller than this */
+#define MIN_COMPRESS_SIZE 512
+
+/* Queues up to size bytes of the file content, starting at offset, to be
+ * sent as the event loop gets a chance to, compressing it if GF_COMPRESS is
+ * set and it is worth it. With GF_CHECKSUM the data is followed by its
+ * CRC-32 which is computed as the file is read, so the file cannot be sent
+ * with platform_sendfile() then.
+ * This takes ownership of fd, even in case of failure.
+ */
+static int send_file(struct connection_t* conn, int fd, const char* filename,
+                     uint64_t offset, uint64_t size, uint32_t flags)
+{
+    struct out_t* out;
+    struct stat st;
+    int compress;
+
+    if (conn->broken)
+    {
+        close(fd);
+        return 0;
+    }
+
+    debug("  send_file(%s)\n", filename);
+    if (fstat(fd, &st))
+    {
+        set_status(ST_ERROR, "unable to get the size of '%s': %s", filename, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    if (offset > (uint64_t)st.st_size)
+        offset = st.st_size;
+    if (size > st.st_size - offset)
+        size = st.st_size - offset;
+    if (offset && lseek(fd, offset, SEEK_SET) == (off_t)-1)
+    {
+        set_status(ST_ERROR, "unable to seek in '%s': %s", filename, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    compress = (flags & GF_COMPRESS) && size >= MIN_COMPRESS_SIZE;
+    if (!send_entry_header(conn, compress ? 'z' : 'd', size) ||
+        !(out = alloc_out(conn, 0)))
+    {
+        close(fd);
+        return 0;
+    }
+    conn->out_files++;
+    out->buf = NULL;
+    out->fd = fd;
+    out->filename = strdup(filename);
+    out->nosendfile = !opt_zerocopy;
+    out->compress = compress;
+    out->left = out->size = size;
+    out->len = out->pos = 0;
+    if (flags & GF_CHECKSUM)
+    {
+        /* The replies that follow must wait for the checksum */
+        if (!send_entry_header(conn, 'I', sizeof(uint32_t)) ||
+            !send_raw_uint32(conn, 0))
+            return 0;
+        out->trailer = LIST_ENTRY(list_prev(&conn->out, conn->out_at), struct out_t, entry);
+        out->trailer->deferred = 1;
+        out->crc = crc32(0L, Z_NULL, 0);
+        out->nosendfile = 1;
     }
-    debug("  File successfully sent\n");
     return 1;
 }
 
+/* Queues the archive to be sent as it is generated, like send_file().
+ * This takes ownership of tar, even in case of failure.
+ */
+static int send_tree(struct connection_t* conn, struct mktar_t* tar,
+                     const char* dirname, int compress)
+{
+    struct out_t* out;
+    uint64_t size = mktar_size(tar);
+
+    debug("  send_tree(%s)\n", dirname);
+    if (!send_entry_header(conn, compress ? 'z' : 'd', size) ||
+        !(out = alloc_out(conn, 0)))
+    {
+        mktar_close(tar);
+        return 0;
+    }
+    conn->out_files++;
+    out->buf = NULL;
+    out->tar = tar;
+    out->filename = strdup(dirname);
+    out->nosendfile = 1;
+    out->compress = compress;
+    out->left = out->size = size;
+    return 1;
+}
+
+
+/*
+ * High-level operations.
+ */
+
+static void do_ping(struct connection_t* conn)
+{
+    if (expect_list_size(conn, 0))
+        send_list_size(conn, 0);
+    else
+        send_error(conn);
+}
+
+/* Sends the size of the file followed by the requested byte range, so a
+ * client can resume an interrupted transfer or follow a growing file.
+ */
+static void send_file_range(struct connection_t* conn, int fd, const char* filename,
+                            uint64_t offset, uint64_t size, uint32_t flags)
+{
+    struct stat st;
+
+    if (fstat(fd, &st))
+    {
+        set_status(ST_ERROR, "unable to get the size of '%s': %s", filename, strerror(errno));
+        close(fd);
+        send_error(conn);
+    }
+    else if (offset > (uint64_t)st.st_size)
+    {
+        set_status(ST_ERROR, "offset " U64FMT " is beyond the end of '%s' (" U64FMT " bytes)", offset, filename, (uint64_t)st.st_size);
+        close(fd);
+        send_error(conn);
+    }
+    else if (!send_list_size(conn, (flags & GF_CHECKSUM) ? 3 : 2) ||
+             !send_uint64(conn, st.st_size) ||
+             !send_file(conn, fd, filename, offset, size, flags))
+        send_error(conn);
+}
+
+/* The getfile parameters are the filename and optionally the flags, which
+ * can then be followed by the offset and size of the byte range to send.
+ * With GF_CHECKSUM the reply ends with the CRC-32 of the file data.
+ */
+static void do_getfile(struct connection_t* conn)
+{
+    char* filename;
+    uint32_t flags = 0;
+    uint64_t offset, size;
+    int fd;
+
+    if ((conn->argc != 1 && conn->argc != 2 && !expect_list_size(conn, 4)) ||
+        !recv_string(conn, &filename) ||
+        (conn->argc >= 2 && !recv_uint32(conn, &flags)) ||
+        (conn->argc == 4 && (!recv_uint64(conn, &offset) ||
+                             !recv_uint64(conn, &size))))
+    {
+        send_error(conn);
+        return;
+    }
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+        set_status(ST_ERROR, "unable to open '%s' for reading: %s", filename, strerror(errno));
+        send_error(conn);
+    }
+    else if (conn->argc == 4)
+        send_file_range(conn, fd, filename, offset, size, flags);
+    else if (!send_list_size(conn, (flags & GF_CHECKSUM) ? 2 : 1) ||
+             !send_file(conn, fd, filename, 0, ANY_SIZE, flags))
+    {
+        /* If the file is not accessible then send_file() will fail and we
+         * can still salvage the connection by sending the error message
+         * in place of the file content. In all the other cases the
+         * connection is broken anyway which send_error() will deal with
+         * just fine.
+         */
+        send_error(conn);
+    }
+}
+
+/*
+ * The file cache.
+ *
+ * The files sent with the SF_CACHE flag are also copied to the cache
+ * directory, under their SHA-256 hash, so the next sendfile RPCs for the
+ * same content can copy them from there instead of receiving them.
+ * The copies are always checked against their hash so neither a corrupt
+ * transfer nor a corrupt cache entry can go unnoticed.
+ */
+
+static int recv_hash(struct connection_t* conn, char** hash)
+{
+    const char* h;
+
+    if (!recv_string(conn, hash))
+        return 0;
+    for (h = *hash; *h; h++)
+    {
+        if ((*h < '0' || *h > '9') && (*h < 'a' || *h > 'f'))
+            break;
+    }
+    if (*h || h - *hash != SHA256_HEXSIZE - 1)
+    {
+        set_status(ST_ERROR, "'%s' is not a valid SHA-256 hash", *hash);
+        return 0;
+    }
+    return 1;
+}
+
+static char* get_cache_path(const char* hash, const char* suffix)
+{
+    char* path;
+
+    path = malloc(strlen(opt_cache) + 1 + SHA256_HEXSIZE + strlen(suffix));
+    if (!path)
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+    else
+        sprintf(path, "%s/%s%s", opt_cache, hash, suffix);
+    return path;
+}
+
+static int is_cached(const char* hash)
+{
+    struct stat st;
+    char* path;
+    int cached;
+
+    if (!opt_cache || !(path = get_cache_path(hash, "")))
+        return 0;
+    cached = stat(path, &st) == 0;
+    free(path);
+    return cached;
+}
+
+enum copy_result_t {
+    COPY_OK,
+    COPY_EREAD,     /* Could not read the source file */
+    COPY_EWRITE,    /* Could not write the destination file */
+    COPY_EHASH,     /* The source file does not match the hash */
+};
+
+/* Copies src to dst, if not NULL, while checking the hash of its content.
+ * In case of failure dst is deleted.
+ */
+static enum copy_result_t copy_file(const char* src, const char* dst,
+                                    mode_t mode, const char* hash)
+{
+    char buf[BLOCK_SIZE];
+    char digest[SHA256_HEXSIZE];
+    struct sha256_t ctx;
+    enum copy_result_t rc;
+    int in, out = -1;
+
+    in = open(src, O_RDONLY | O_BINARY);
+    if (in < 0)
+    {
+        set_status(ST_ERROR, "unable to open '%s' for reading: %s", src, strerror(errno));
+        return COPY_EREAD;
+    }
+    if (dst)
+    {
+        unlink(dst); /* To force re-setting the mode */
+        out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode);
+        if (out < 0)
+        {
+            set_status(ST_ERROR, "unable to open '%s' for writing: %s", dst, strerror(errno));
+            close(in);
+            return COPY_EWRITE;
+        }
+    }
+
+    sha256_init(&ctx);
+    rc = COPY_OK;
+    while (1)
+    {
+        int r = read(in, buf, sizeof(buf));
+        if (r == 0)
+            break;
+        if (r < 0)
+        {
+            set_status(ST_ERROR, "an error occurred while reading '%s': %s", src, strerror(errno));
+            rc = COPY_EREAD;
+            break;
+        }
+        sha256_update(&ctx, buf, r);
+        if (out >= 0 && write(out, buf, r) != r)
+        {
+            set_status(ST_ERROR, "an error occurred while writing to '%s': %s", dst, strerror(errno));
+            rc = COPY_EWRITE;
+            break;
+        }
+    }
+    close(in);
+    if (rc == COPY_OK)
+    {
+        sha256_hex(&ctx, digest);
+        if (strcmp(digest, hash))
+        {
+            set_status(ST_ERROR, "the content of '%s' does not match its hash (%s instead of %s)", src, digest, hash);
+            rc = COPY_EHASH;
+        }
+    }
+    if (out >= 0)
+    {
+        if (close(out) < 0 && rc == COPY_OK)
+        {
+            set_status(ST_ERROR, "an error occurred while writing to '%s': %s", dst, strerror(errno));
+            rc = COPY_EWRITE;
+        }
+        if (rc != COPY_OK)
+            unlink(dst);
+    }
+    return rc;
+}
+
+/* Checks that the file matches the hash and adds it to the cache.
+ * Failing to update the cache is not an error.
+ */
+static int cache_store(const char* hash, const char* filename)
+{
+    char *path, *tmp;
+    enum copy_result_t rc;
+
+    if (!opt_cache)
+        return copy_file(filename, NULL, 0, hash) == COPY_OK;
+
+    path = get_cache_path(hash, "");
+    tmp = get_cache_path(hash, ".tmp");
+    if (!path || !tmp)
+    {
+        free(path);
+        return 0;
+    }
+#ifdef WIN32
+    mkdir(opt_cache);
+#else
+    mkdir(opt_cache, 0700);
+#endif
+    debug("  caching '%s' as '%s'\n", filename, path);
+    rc = copy_file(filename, tmp, 0600, hash);
+    if (rc == COPY_EWRITE)
+    {
+        /* Just verify the file */
+        debug("  could not cache '%s': %s\n", filename, current->status_msg);
+        rc = copy_file(filename, NULL, 0, hash);
+    }
+    else if (rc == COPY_OK)
+    {
+#ifdef WIN32
+        /* rename() does not replace existing files on Windows */
+        unlink(path);
+#endif
+        if (rename(tmp, path) < 0)
+        {
+            debug("  could not rename '%s' to '%s': %s\n", tmp, path, strerror(errno));
+            unlink(tmp);
+        }
+    }
+    free(path);
+    free(tmp);
+    return rc == COPY_OK;
+}
+
+/* Copies the file from the cache to filename */
+static int cache_fetch(const char* hash, const char* filename, mode_t mode)
+{
+    enum copy_result_t rc;
+    char* path;
+
+    if (!opt_cache)
+    {
+        set_status(ST_ERROR, "the '%s' data is not in the cache (the cache is disabled)", filename);
+        return 0;
+    }
+    if (!(path = get_cache_path(hash, "")))
+        return 0;
+    debug("  getting '%s' from the cache\n", filename);
+    rc = copy_file(path, filename, mode, hash);
+    if (rc == COPY_EREAD)
+        set_status(ST_ERROR, "the '%s' data is not in the cache", filename);
+    else if (rc == COPY_EHASH)
+    {
+        /* Make sure the corrupt entry does not get used again */
+        unlink(path);
+        set_status(ST_ERROR, "the cached '%s' data is corrupt", filename);
+    }
+    free(path);
+    return rc == COPY_OK;
+}
+
+static void do_have(struct connection_t* conn)
+{
+    uint32_t argc, i;
+    char* hash;
+
+    /* Check all the parameters before sending the reply */
+    recv_list_size(conn, &argc);
+    for (i = 0; i < argc; i++)
+    {
+        if (!recv_hash(conn, &hash))
+        {
+            send_error(conn);
+            return;
+        }
+    }
+
+    conn->argi = 0;
+    send_list_size(conn, argc);
+    for (i = 0; i < argc; i++)
+    {
+        recv_string(conn, &hash);
+        if (!send_uint32(conn, is_cached(hash)))
+            break;
+    }
+}
+
+/* The sendfile parameters are the filename, the flags, the SHA-256 hash of
+ * the file if SF_CACHE or SF_DELTA is set, the offset at which to write the
+ * data if SF_APPEND is set, and the file data unless it is to be taken from
+ * the cache. With SF_DELTA the data is the delta to apply to the current
+ * file. With SF_CHECKSUM the data is followed by its CRC-32.
+ */
+static int recv_sendfile_params(struct connection_t* conn, char** filename,
+                                uint32_t* flags, char** hash, uint64_t* offset)
+{
+    uint32_t crc;
+
+    *hash = NULL;
+    *offset = 0;
+    if ((conn->argc != 3 && conn->argc != 4 && !expect_list_size(conn, 5)) ||
+        !recv_string(conn, filename) ||
+        !recv_uint32(conn, flags))
+        return 0;
+    crc = (*flags & SF_CHECKSUM) ? 1 : 0;
+    if (*flags & SF_APPEND)
+    {
+        if (*flags & (SF_CACHE | SF_DELTA))
+        {
+            set_status(ST_ERROR, "SF_APPEND cannot be combined with SF_CACHE or SF_DELTA");
+            return 0;
+        }
+        return expect_list_size(conn, 4 + crc) && recv_uint64(conn, offset);
+    }
+    if (!(*flags & (SF_CACHE | SF_DELTA)))
+        return expect_list_size(conn, 3 + crc);
+    /* Without data there is no checksum either */
+    if ((*flags & SF_DELTA || conn->argc != 3) &&
+        !expect_list_size(conn, 4 + crc))
+        return 0;
+    return recv_hash(conn, hash);
+}
+
+/* Checks the CRC-32 that follows the data against the one computed as it
+ * was received.
+ */
+static int recv_checksum(struct connection_t* conn, struct arg_t* arg,
+                         const char* filename)
+{
+    uint32_t crc;
+
+    if (!recv_uint32(conn, &crc))
+        return 0;
+    if (crc != arg->crc)
+    {
+        set_status(ST_ERROR, "the '%s' data is corrupt (got CRC-32 %08x instead of %08x)", filename, arg->crc, crc);
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns a new temporary filename for filename */
+static char* get_tmp_name(struct connection_t* conn, const char* filename)
+{
+    static unsigned tmp_count = 0;
+    char* tmp;
+
+    tmp = arena_alloc(&conn->arena, strlen(filename) + 16);
+    if (tmp)
+        sprintf(tmp, "%s.tmp%u", filename, ++tmp_count);
+    return tmp;
+}
+
+static int open_data_file(struct connection_t* conn, const char* filename, mode_t mode)
+{
+    int fd;
+
+    unlink(filename); /* To force re-setting the mode */
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode);
+    if (fd < 0)
+        set_status(ST_ERROR, "unable to open '%s' for writing: %s", filename, strerror(errno));
+    else
+        conn->data_name = filename;
+    return fd;
+}
+
+/* Opens filename for writing at the specified offset, discarding anything
+ * beyond it. The offset cannot be past the end of the file as that would
+ * leave a hole. Note that the mode is only used if the file is created.
+ */
+static int open_append_file(const char* filename, mode_t mode, uint64_t offset)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_BINARY, mode);
+    if (fd < 0)
+    {
+        set_status(ST_ERROR, "unable to open '%s' for writing: %s", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st))
+        set_status(ST_ERROR, "unable to get the size of '%s': %s", filename, strerror(errno));
+    else if (offset > (uint64_t)st.st_size)
+        set_status(ST_ERROR, "cannot write at offset " U64FMT " of '%s' which only has " U64FMT " bytes", offset, filename, (uint64_t)st.st_size);
+    else if (ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) == (off_t)-1)
+        set_status(ST_ERROR, "unable to truncate '%s' to " U64FMT " bytes: %s", filename, offset, strerror(errno));
+    else
+        return fd;
+    close(fd);
+    return -1;
+}
+
+/* For batches and deltas the data goes to a temporary file instead, and its
+ * name is stored in arg->data.
+ */
+static int sendfile_data_file(struct connection_t* conn, struct arg_t* arg, int batched)
+{
+    char *filename, *hash;
+    uint32_t flags;
+    uint64_t offset;
+    mode_t mode;
+    int fd;
+
+    if (!recv_sendfile_params(conn, &filename, &flags, &hash, &offset))
+        return -1;
+    if (hash && conn->argc == 3)
+    {
+        set_status(ST_ERROR, "the '%s' data should be taken from the cache", filename);
+        return -1;
+    }
+    if (flags & SF_CHECKSUM)
+    {
+        conn->data_checksum = 1;
+        conn->data_crc = crc32(0L, Z_NULL, 0);
+    }
+    mode = (flags & SF_EXECUTABLE) ? 0700 : 0600;
+    if (!batched && (flags & SF_APPEND))
+    {
+        /* Keep what was received so the client can resume the transfer */
+        fd = open_append_file(filename, mode, offset);
+        if (fd >= 0)
+        {
+            conn->data_name = filename;
+            conn->data_keep = 1;
+        }
+        return fd;
+    }
+    if (!batched && !(flags & SF_DELTA))
+        return open_data_file(conn, filename, mode);
+
+    if (!(arg->data = get_tmp_name(conn, filename)))
+        return -1;
+    fd = open_data_file(conn, arg->data, mode);
+    if (fd < 0)
+        arg->data = NULL;
+    return fd;
+}
+
+/* Writes the data of a batched SF_APPEND sendfile from its temporary file at
+ * the specified offset.
+ */
+static int append_data_file(struct arg_t* arg, const char* filename,
+                            mode_t mode, uint64_t offset)
+{
+    char buf[BLOCK_SIZE];
+    int in, out, r, success = 0;
+
+    in = open(arg->data, O_RDONLY | O_BINARY);
+    if (in < 0)
+    {
+        set_status(ST_ERROR, "unable to open '%s' for reading: %s", arg->data, strerror(errno));
+        return 0;
+    }
+    out = open_append_file(filename, mode, offset);
+    if (out >= 0)
+    {
+        while ((r = read(in, buf, sizeof(buf))) > 0)
+        {
+            if (write(out, buf, r) != r)
+                break;
+        }
+        if (r < 0)
+            set_status(ST_ERROR, "an error occurred while reading '%s': %s", arg->data, strerror(errno));
+        else if (r > 0)
+            set_status(ST_ERROR, "an error occurred while writing to '%s': %s", filename, strerror(errno));
+        if (close(out) < 0 && r == 0)
+            set_status(ST_ERROR, "an error occurred while writing to '%s': %s", filename, strerror(errno));
+        else if (r == 0)
+            success = 1;
+    }
+    close(in);
+    return success;
+}
+
+/* Moves the data of a batched sendfile from its temporary file into place */
+static int commit_data_file(struct arg_t* arg, const char* filename)
+{
+#ifdef WIN32
+    /* rename() does not replace existing files on Windows */
+    unlink(filename);
+#endif
+    if (rename(arg->data, filename) < 0)
+    {
+        set_status(ST_ERROR, "unable to rename '%s' to '%s': %s", arg->data, filename, strerror(errno));
+        return 0;
+    }
+    /* There is no temporary file to delete anymore */
+    arg->data = NULL;
+    return 1;
+}
+
+/*
+ * Delta transfers.
+ *
+ * To send a new version of a file, the client first uses the matchblocks
+ * RPC to find which of its blocks the server already has in the current
+ * version. Then it sends only the missing data as a delta which the server
+ * applies to a copy of the current file.
+ * Note that it is the server that searches for the blocks at every offset
+ * so the client, which may be handling many servers, does not have to.
+ */
+
+/* Adler-32 is easy to roll and is provided by zlib on both ends */
+#define ADLER_BASE  65521
+
+/* Each block signature is made of the block's Adler-32 checksum, followed by
+ * the first 8 bytes of its SHA-256 hash.
+ */
+#define SIG_SIZE    12
+#define SIG_STRONG  8
+#define NO_MATCH    (~((uint64_t)0))
+
+#define MAX_DELTA_BLOCK_SIZE (16 * BLOCK_SIZE)
+
+static void get_strong_sig(const char* data, unsigned size, unsigned char sig[SIG_STRONG])
+{
+    unsigned char digest[SHA256_SIZE];
+    struct sha256_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, size);
+    sha256_final(&ctx, digest);
+    memcpy(sig, digest, SIG_STRONG);
+}
+
+/* Records the offset of the blocks matching the window, if any.
+ * Returns true if a new block was matched.
+ */
+static int match_window(uint32_t* table, unsigned mask, const char* sigs,
+                        uint64_t* offsets, uint32_t weak, const char* window,
+                        unsigned blocksize, uint64_t offset)
+{
+    unsigned char strong[SIG_STRONG];
+    int have_strong = 0, matched = 0;
+    unsigned h;
+
+    for (h = weak & mask; table[h]; h = (h + 1) & mask)
+    {
+        uint32_t b = table[h] - 1, bweak;
+
+        memcpy(&bweak, sigs + b * SIG_SIZE, sizeof(bweak));
+        if (ntohl(bweak) != weak || offsets[b] != NO_MATCH)
+            continue;
+        if (!have_strong)
+        {
+            get_strong_sig(window, blocksize, strong);
+            have_strong = 1;
+        }
+        if (memcmp(sigs + b * SIG_SIZE + sizeof(bweak), strong, SIG_STRONG) == 0)
+        {
+            /* Identical blocks all match here */
+            offsets[b] = offset;
+            matched = 1;
+        }
+    }
+    return matched;
+}
+
+/* Searches the file for the blocks with the specified signatures.
+ * offsets receives the offset where each block was found, or NO_MATCH.
+ */
+static int match_blocks(const char* filename, unsigned blocksize,
+                        const char* sigs, uint32_t count, uint64_t* offsets)
+{
+    uint32_t *table, b, a, s, weak;
+    unsigned mask, bufsize, start, end, i;
+    unsigned char in, out;
+    uint64_t offset;
+    char* buf;
+    int fd, eof, valid, success = 0;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+        set_status(ST_ERROR, "unable to open '%s' for reading: %s", filename, strerror(errno));
+        return 0;
+    }
+
+    /* Index the blocks by their weak checksum */
+    for (mask = 1; mask < 2 * count; mask <<= 1);
+    table = calloc(mask, sizeof(*table));
+    mask--;
+    bufsize = blocksize < BLOCK_SIZE ? 2 * BLOCK_SIZE : 2 * blocksize;
+    buf = malloc(bufsize);
+    if (!table || !buf)
+    {
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        goto done;
+    }
+    for (b = 0; b < count; b++)
+    {
+        memcpy(&weak, sigs + b * SIG_SIZE, sizeof(weak));
+        for (i = ntohl(weak) & mask; table[i]; i = (i + 1) & mask);
+        table[i] = b + 1;
+        offsets[b] = NO_MATCH;
+    }
+
+    /* Then roll the checksum over the file, buf[start..end] being the part
+     * of the file that has been read and not yet checked.
+     */
+    offset = 0;
+    start = end = 0;
+    a = s = 0;
+    eof = valid = 0;
+    while (1)
+    {
+        /* Try to have at least the window and the next byte */
+        if (!eof && end - start <= blocksize)
+        {
+            int r;
+
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+            r = read(fd, buf + end, bufsize - end);
+            if (r < 0)
+            {
+                set_status(ST_ERROR, "an error occurred while reading '%s': %s", filename, strerror(errno));
+                goto done;
+            }
+            end += r;
+            eof = (r == 0);
+        }
+        if (end - start < blocksize)
+            break;
+
+        if (!valid)
+        {
+            a = 1;
+            s = 0;
+            for (i = 0; i < blocksize; i++)
+            {
+                a = (a + (unsigned char)buf[start + i]) % ADLER_BASE;
+                s = (s + a) % ADLER_BASE;
+            }
+            valid = 1;
+        }
+        if (match_window(table, mask, sigs, offsets, s << 16 | a,
+                         buf + start, blocksize, offset))
+        {
+            /* The next block likely follows so jump ahead */
+            start += blocksize;
+            offset += blocksize;
+            valid = 0;
+            continue;
+        }
+
+        if (end - start == blocksize)
+        {
+            if (eof)
+                break;
+            continue; /* Get the next byte first */
+        }
+        /* Roll the window by one byte */
+        out = buf[start];
+        in = buf[start + blocksize];
+        a = (a + ADLER_BASE - out + in) % ADLER_BASE;
+        s = (s + ADLER_BASE - (uint32_t)((uint64_t)blocksize * out % ADLER_BASE) +
+             a + ADLER_BASE - 1) % ADLER_BASE;
+        start++;
+        offset++;
+    }
+    success = 1;
+
+ done:
+    close(fd);
+    free(table);
+    free(buf);
+    return success;
+}
+
+static void do_matchblocks(struct connection_t* conn)
+{
+    char *filename, *sigs;
+    uint32_t blocksize, count, i;
+    uint64_t size, *offsets;
+
+    if (!expect_list_size(conn, 3) ||
+        !recv_string(conn, &filename) ||
+        !recv_uint32(conn, &blocksize) ||
+        !recv_data(conn, &sigs, &size))
+    {
+        send_error(conn);
+        return;
+    }
+    if (!blocksize || blocksize > MAX_DELTA_BLOCK_SIZE)
+    {
+        set_status(ST_ERROR, "invalid block size %u", blocksize);
+        send_error(conn);
+        return;
+    }
+    if (size % SIG_SIZE)
+    {
+        set_status(ST_ERROR, "the size of the signatures should be a multiple of %u", SIG_SIZE);
+        send_error(conn);
+        return;
+    }
+    count = size / SIG_SIZE;
+    if (count > ARENA_MAX_SIZE / sizeof(*offsets))
+    {
+        set_status(ST_ERROR, "too many blocks to match (%u)", count);
+        send_error(conn);
+        return;
+    }
+
+    /* Even for zero blocks this returns a valid pointer */
+    offsets = arena_alloc(&conn->arena, count * sizeof(*offsets));
+    if (!offsets)
+        send_error(conn);
+    else if (!match_blocks(filename, blocksize, sigs, count, offsets))
+        send_error(conn);
+    else
+    {
+        uint32_t matched = 0;
+
+        /* Send the offsets as uint64 values in network order */
+        for (i = 0; i < count; i++)
+        {
+            uint32_t be[2];
+            matched += offsets[i] != NO_MATCH;
+            be[0] = htonl(offsets[i] >> 32);
+            be[1] = htonl(offsets[i] & 0xffffffff);
+            memcpy(&offsets[i], be, sizeof(be));
+        }
+        debug("  matched %u of %u blocks\n", matched, count);
+        send_list_size(conn, 1);
+        if (send_entry_header(conn, 'd', count * sizeof(*offsets)))
+            send_raw_data(conn, offsets, count * sizeof(*offsets));
+    }
+}
+
+/* Reads up to size bytes, only stopping short at the end of the file.
+ * Returns the number of bytes read or -1 in case of error.
+ */
+static int read_full(int fd, char* buf, unsigned size)
+{
+    unsigned got = 0;
+
+    while (got < size)
+    {
+        int r = read(fd, buf + got, size - got);
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        got += r;
+    }
+    return got;
+}
+
+/* Rebuilds the file from the delta and its current content, checks it
+ * against its hash, and then puts it in place.
+ * The delta is a sequence of records, each starting with a type byte:
+ * - 'C', a uint64 offset and a uint32 size: Copies size bytes of the
+ *   current file, starting at the specified offset.
+ * - 'L' and a uint32 size: Is followed by that many bytes of new data.
+ */
+static int apply_delta(struct connection_t* conn, const char* deltaname,
+                       const char* filename, mode_t mode, const char* hash)
+{
+    char buf[BLOCK_SIZE];
+    char digest[SHA256_HEXSIZE];
+    struct sha256_t ctx;
+    int delta, basis = -1, out = -1, r, success = 0;
+    char* tmp = NULL;
+
+    debug("  applying '%s' to '%s'\n", deltaname, filename);
+    delta = open(deltaname, O_RDONLY | O_BINARY);
+    if (delta < 0)
+    {
+        set_status(ST_ERROR, "unable to open '%s' for reading: %s", deltaname, strerror(errno));
+        return 0;
+    }
+    if (!(tmp = get_tmp_name(conn, filename)))
+        goto done;
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode);
+    if (out < 0)
+    {
+        set_status(ST_ERROR, "unable to open '%s' for writing: %s", tmp, strerror(errno));
+        goto done;
+    }
+
+    sha256_init(&ctx);
+    while (1)
+    {
+        uint32_t be[3], size;
+        int src;
+
+        /* So read_error can tell errors from a truncated delta */
+        errno = 0;
+        r = read_full(delta, buf, 1);
+        if (r == 0)
+            break;
+        if (r < 0)
+            goto read_error;
+        if (buf[0] == 'C')
+        {
+            uint64_t offset;
+
+            if (read_full(delta, (char*)be, 12) != 12)
+                goto read_error;
+            offset = ((uint64_t)ntohl(be[0])) << 32 | ntohl(be[1]);
+            size = ntohl(be[2]);
+            if (basis < 0 && (basis = open(filename, O_RDONLY | O_BINARY)) < 0)
+            {
+                set_status(ST_ERROR, "unable to open '%s' for reading: %s", filename, strerror(errno));
+                goto done;
+            }
+            if (lseek(basis, offset, SEEK_SET) == (off_t)-1)
+            {
+                set_status(ST_ERROR, "unable to seek in '%s': %s", filename, strerror(errno));
+                goto done;
+            }
+            src = basis;
+        }
+        else if (buf[0] == 'L')
+        {
+            if (read_full(delta, (char*)be, 4) != 4)
+                goto read_error;
+            size = ntohl(be[0]);
+            src = delta;
+        }
+        else
+        {
+            set_status(ST_ERROR, "the '%s' delta is corrupt", filename);
+            goto done;
+        }
+
+        while (size)
+        {
+            int count = size < sizeof(buf) ? size : sizeof(buf);
+            if (read_full(src, buf, count) != count)
+            {
+                if (src == delta)
+                    goto read_error;
+                set_status(ST_ERROR, "the '%s' delta goes beyond the end of the file", filename);
+                goto done;
+            }
+            sha256_update(&ctx, buf, count);
+            if (write(out, buf, count) != count)
+            {
+                set_status(ST_ERROR, "an error occurred while writing to '%s': %s", tmp, strerror(errno));
+                goto done;
+            }
+            size -= count;
+        }
+    }
+
+    sha256_hex(&ctx, digest);
+    if (strcmp(digest, hash))
+    {
+        set_status(ST_ERROR, "the rebuilt '%s' file does not match its hash (%s instead of %s)", filename, digest, hash);
+        goto done;
+    }
+    r = close(out);
+    out = -1;
+    if (r < 0)
+    {
+        set_status(ST_ERROR, "an error occurred while writing to '%s': %s", tmp, strerror(errno));
+        goto done;
+    }
+    if (basis >= 0)
+    {
+        close(basis);
+        basis = -1;
+    }
+#ifdef WIN32
+    /* rename() does not replace existing files on Windows */
+    unlink(filename);
+#endif
+    if (rename(tmp, filename) < 0)
+    {
+        set_status(ST_ERROR, "unable to rename '%s' to '%s': %s", tmp, filename, strerror(errno));
+        goto done;
+    }
+    success = 1;
+    goto done;
+
+ read_error:
+    if (errno)
+        set_status(ST_ERROR, "an error occurred while reading '%s': %s", deltaname, strerror(errno));
+    else
+        set_status(ST_ERROR, "the '%s' delta is truncated", filename);
+
+ done:
+    close(delta);
+    if (basis >= 0)
+        close(basis);
+    if (out >= 0)
+        close(out);
+    if (!success && tmp)
+        unlink(tmp);
+    return success;
+}
+
+/* Replies with the new size of the file written with SF_APPEND */
+static void send_append_result(struct connection_t* conn, const char* filename)
+{
+    struct stat st;
+
+    if (stat(filename, &st))
+    {
+        set_status(ST_ERROR, "unable to get the size of '%s': %s", filename, strerror(errno));
+        send_error(conn);
+    }
+    else
+    {
+        send_list_size(conn, 1);
+        send_uint64(conn, st.st_size);
+    }
+}
+
+static void do_sendfile(struct connection_t* conn)
+{
+    char *filename, *hash;
+    uint32_t flags;
+    uint64_t offset;
+    struct arg_t* data;
+
+    if (!recv_sendfile_params(conn, &filename, &flags, &hash, &offset))
+    {
+        send_error(conn);
+        return;
+    }
+    /* The data is the last parameter, but for the checksum */
+    data = &conn->args[conn->argc - ((flags & SF_CHECKSUM) ? 2 : 1)];
+
+    if (hash && conn->argc == 3)
+    {
+        if (cache_fetch(hash, filename, (flags & SF_EXECUTABLE) ? 0700 : 0600))
+            send_list_size(conn, 0);
+        else
+            send_error(conn);
+    }
+    else if (!recv_file(conn, filename))
+    {
+        /* In batches and for deltas the partial file is a temporary one,
+         * and with SF_APPEND it is kept so the transfer can be resumed.
+         */
+        if (!conn->batch && !(flags & (SF_DELTA | SF_APPEND)))
+            unlink(filename);
+        send_error(conn);
+    }
+    else if ((flags & SF_CHECKSUM) && !recv_checksum(conn, data, filename))
+    {
+        /* As above, but don't let a resumed transfer build on the corrupt
+         * data either.
+         */
+        if (!conn->batch && (flags & SF_APPEND))
+        {
+            int fd = open_append_file(filename, 0600, offset);
+            if (fd >= 0)
+                close(fd);
+        }
+        else if (!conn->batch && !(flags & SF_DELTA))
+            unlink(filename);
+        send_error(conn);
+    }
+    else if (flags & SF_APPEND)
+    {
+        if (!conn->batch ||
+            append_data_file(data, filename, (flags & SF_EXECUTABLE) ? 0700 : 0600, offset))
+            send_append_result(conn, filename);
+        else
+            send_error(conn);
+    }
+    else if (flags & SF_DELTA)
+    {
+        if (apply_delta(conn, data->data, filename, (flags & SF_EXECUTABLE) ? 0700 : 0600, hash) &&
+            (!(flags & SF_CACHE) || cache_store(hash, filename)))
+            send_list_size(conn, 0);
+        else
+            send_error(conn);
+    }
+    else if (conn->batch && !commit_data_file(data, filename))
+        send_error(conn);
+    else if ((flags & SF_CACHE) && !cache_store(hash, filename))
+    {
+        unlink(filename);
+        send_error(conn);
+    }
+    else
+        send_list_size(conn, 0);
+}
+
+/*
+ * Directory tree transfers.
+ *
+ * The sendtree and gettree RPCs transfer whole directory trees as a single
+ * tar archive which is extracted or generated on the fly, so the archive is
+ * never stored on disk and, unlike with one RPC per file, the transfer does
+ * not stall between the files.
+ */
+
+/* The sendtree parameters are the directory to extract the archive to and
+ * the archive data. The archive is extracted as it arrives so the directory
+ * is left in an unspecified state if that fails.
+ */
+static int sendtree_data_file(struct connection_t* conn)
+{
+    char* dirname;
+
+    if (!expect_list_size(conn, 2) ||
+        !recv_string(conn, &dirname))
+        return -1;
+    conn->data_tar = untar_open(dirname);
+    if (conn->data_tar)
+        conn->data_name = dirname;
+    /* The data goes to data_tar rather than to a file */
+    return -1;
+}
+
+static void do_sendtree(struct connection_t* conn)
+{
+    char* dirname;
+
+    if (!expect_list_size(conn, 2) ||
+        !recv_string(conn, &dirname) ||
+        !recv_file(conn, dirname))
+        send_error(conn);
+    else
+        send_list_size(conn, 0);
+}
+
+/* The gettree parameters are the directory, the getfile flags and the paths
+ * of the files and directories to put in the archive, relative to that
+ * directory. The directories are archived recursively.
+ */
+static void do_gettree(struct connection_t* conn)
+{
+    char *dirname, **paths;
+    uint32_t flags, i, count;
+    struct mktar_t* tar;
+
+    if (conn->argc < 3)
+    {
+        set_status(ST_ERROR, "Invalid number of parameters (%u instead of 3 or more)", conn->argc);
+        send_error(conn);
+        return;
+    }
+    if (!recv_string(conn, &dirname) ||
+        !recv_uint32(conn, &flags))
+    {
+        send_error(conn);
+        return;
+    }
+
+    count = conn->argc - 2;
+    paths = arena_alloc(&conn->arena, count * sizeof(*paths));
+    if (!paths)
+    {
+        send_error(conn);
+        return;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (!recv_string(conn, &paths[i]))
+            break;
+    }
+    tar = i == count ? mktar_open(dirname, paths, count) : NULL;
+
+    if (!tar)
+        send_error(conn);
+    else if (!send_list_size(conn, 1) ||
+             !send_tree(conn, tar, dirname, flags & GF_COMPRESS))
+        send_error(conn);
+}
+
+static void do_run(struct connection_t* conn)
+{
+    uint32_t argc, i;
+    char** argv;
+    uint32_t flags;
+    char *redirects[3];
+    uint64_t pid;
+
+    /* Get and check argc */
+    recv_list_size(conn, &argc);
+    if (argc < 5)
+    {
+        set_status(ST_ERROR, "expected 5 or more parameters");
+        send_error(conn);
+        return;
+    }
+
+    /* Allocate an extra entry for the trailing NULL pointer */
+    argv = arena_alloc(&conn->arena, (argc - 4 + 1) * sizeof(*argv));
+    if (!argv)
+    {
+        send_error(conn);
+        return;
+    }
+    argc -= 4;
+
+    /* Retrieve the parameters */
+    pid = 0;
+    if (recv_uint32(conn, &flags) &&
+        recv_string(conn, &redirects[0]) &&
+        recv_string(conn, &redirects[1]) &&
+        recv_string(conn, &redirects[2]))
+    {
+        for (i = 0; i < argc; i++)
+            if (!recv_string(conn, &argv[i]))
+                break;
+        argv[i] = NULL;
+
+        if (i == argc)
+        {
+            debug("  run '%s", argv[0]);
+            for (i = 1; i < argc; i++)
+                debug("' '%s", argv[i]);
+            debug("'%s%s%s%s%s%s\n",
+                  !redirects[0][0] ? "" : " <", redirects[0],
+                  !redirects[1][0] ? "" : (flags & RUN_DNTRUNC_OUT) ? " >>" : " >", redirects[1],
+                  !redirects[2][0] ? "" : (flags & RUN_DNTRUNC_ERR) ? " 2>>" : " 2>", redirects[2]);
+
+            pid = platform_run(argv, flags, redirects);
+        }
+    }
+
+    if (!pid)
+        send_error(conn);
+    else
+    {
+        if (conn->batch)
+            conn->batch->last_pid = pid;
+        send_list_size(conn, 1);
+        send_uint64(conn, pid);
+    }
+}
+
+static void send_wait_result(struct connection_t* conn, int success, uint32_t childstatus, const struct child_usage_t* usage)
+{
+    if (!success)
+        send_error(conn);
+    else if (usage)
+    {
+        send_list_size(conn, 7);
+        send_uint32(conn, childstatus);
+        send_uint64(conn, usage->utime);
+        send_uint64(conn, usage->stime);
+        send_uint64(conn, usage->maxrss);
+        send_uint64(conn, usage->inblock);
+        send_uint64(conn, usage->oublock);
+        send_uint64(conn, usage->wall);
+    }
+    else
+    {
+        send_list_size(conn, 1);
+        send_uint32(conn, childstatus);
+    }
+}
+
+/* Sends the child process status, and its resource usage if WAIT_USAGE is
+ * set, if it has exited, or an error if the timeout expired.
+ * Returns 0 if the reply must wait.
+ */
+static int send_child_status(struct connection_t* conn, uint64_t pid, uint32_t flags, int expired)
+{
+    uint32_t childstatus;
+    struct child_usage_t usage;
+    int r;
+
+    r = platform_wait(pid, &childstatus);
+    if (r == 2)
+    {
+        if (!expired)
+            return 0;
+        set_status(ST_ERROR, "timed out waiting for the child process");
+        r = 0;
+    }
+    if (r && (flags & WAIT_USAGE))
+        r = platform_getusage(pid, &usage);
+    send_wait_result(conn, r, childstatus, flags & WAIT_USAGE ? &usage : NULL);
+    return 1;
+}
+
+/* The largest chunk of each output stream sent in one getoutput reply */
+#define MAX_OUTPUT_CHUNK BLOCK_SIZE
+
+/* Sends the new output of the child process, if any. The reply is the new
+ * standard output data, the new standard error data, and flags telling
+ * which streams have ended. Returns 0 if the reply must wait for the child
+ * process to produce output, unless the timeout expired.
+ */
+static int send_output(struct connection_t* conn, uint64_t pid, int expired)
+{
+    /* The getoutput waiters are rechecked on every loop iteration so avoid
+     * allocating a buffer each time.
+     */
+    static char buf[2][MAX_OUTPUT_CHUNK];
+    int len[2], i;
+    uint32_t flags = 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        len[i] = platform_read_output(pid, i + 1, buf[i], MAX_OUTPUT_CHUNK);
+        if (len[i] == -2)
+        {
+            send_error(conn);
+            return 1;
+        }
+        if (len[i] < 0)
+        {
+            flags |= i ? OUT_STDERR_EOF : OUT_STDOUT_EOF;
+            len[i] = 0;
+        }
+    }
+
+    if (!len[0] && !len[1] && !expired &&
+        flags != (OUT_STDOUT_EOF | OUT_STDERR_EOF))
+        return 0;
+    send_list_size(conn, 3);
+    for (i = 0; i < 2; i++)
+    {
+        if (send_entry_header(conn, 'd', len[i]))
+            send_raw_data(conn, buf[i], len[i]);
+    }
+    send_uint32(conn, flags);
+    return 1;
+}
+
+/* Sends the pid and status of each child process of the set that has exited,
+ * once any of them has or, with WM_ALL, once all of them have. If the timeout
+ * expired the reply only lists those that have exited so far.
+ * Returns 0 if the reply must wait.
+ */
+static int send_children_status(struct connection_t* conn, uint64_t* pids, uint32_t count, uint32_t flags, int expired)
+{
+    uint32_t *statuses, i, exited;
+    char* done;
+    int r;
+
+    statuses = malloc(count * (sizeof(*statuses) + sizeof(*done)));
+    if (!statuses)
+    {
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        send_error(conn);
+        return 1;
+    }
+    done = (char*)(statuses + count);
+    exited = 0;
+    for (i = 0; i < count; i++)
+    {
+        r = platform_wait(pids[i], &statuses[i]);
+        if (!r)
+        {
+            free(statuses);
+            send_error(conn);
+            return 1;
+        }
+        done[i] = (r == 1);
+        if (done[i])
+            exited++;
+    }
+
+    if (!expired && (!exited || ((flags & WM_ALL) && exited < count)))
+    {
+        free(statuses);
+        return 0;
+    }
+    send_list_size(conn, 2 * exited);
+    for (i = 0; i < count; i++)
+    {
+        if (done[i])
+        {
+            send_uint64(conn, pids[i]);
+            send_uint32(conn, statuses[i]);
+        }
+    }
+    free(statuses);
+    return 1;
+}
+
+/* Defers the reply until either the wait condition is met, the specified
+ * timeout (in seconds) expires, or the client disconnects (typically because
+ * it got tired of waiting). In the meantime the other RPCs can still be
+ * processed.
+ * Returns the waiter, or NULL if an error was sent instead.
+ */
+static struct waiter_t* defer_reply(struct connection_t* conn, uint64_t pid, uint32_t timeout)
+{
+    struct waiter_t* waiter;
+
+    debug("Waiting for " U64FMT "\n", pid);
+    waiter = malloc(sizeof(*waiter));
+    if (!waiter || !(waiter->reply = alloc_out(conn, 0)))
+    {
+        free(waiter);
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        send_error(conn);
+        return NULL;
+    }
+    waiter->reply->deferred = 1;
+    waiter->rpcid = conn->rpcid;
+    waiter->pid = pid;
+    waiter->pids = NULL;
+    waiter->count = waiter->flags = 0;
+    waiter->runbatch = NULL;
+    waiter->start = conn->rpc_start;
+    waiter->in = conn->rpc_in;
+    waiter->timeout = timeout;
+    if (timeout != RUN_NOTIMEOUT)
+        waiter->deadline = time(NULL) + timeout;
+    waiter->batch = conn->batch;
+    if (conn->batch)
+        conn->batch->waiting = 1;
+    else
+        conn->rpc_deferred = 1;
+    list_add_tail(&conn->waiters, &waiter->entry);
+    return waiter;
+}
+
+/* Sends the child process status right away if it has already exited, and
+ * defers the reply otherwise.
+ */
+static void wait_child(struct connection_t* conn, uint64_t pid, uint32_t timeout, uint32_t flags)
+{
+    struct waiter_t* waiter;
+
+    if (!send_child_status(conn, pid, flags, timeout == 0))
+    {
+        waiter = defer_reply(conn, pid, timeout);
+        if (waiter)
+            waiter->flags = flags;
+    }
+}
+
+static void free_runbatch(struct connection_t* conn, struct runbatch_t* rb)
+{
+    uint32_t i;
+
+    for (i = 0; i < rb->count; i++)
+    {
+        struct command_t* cmd = &rb->cmds[i];
+        if (cmd->pid)
+        {
+            /* The client is gone so nobody will get the results */
+            platform_kill(cmd->pid);
+            platform_rmchildproc(conn->sock, cmd->pid);
+        }
+        free(cmd->error);
+    }
+    free(rb->cmds);
+    free_arg_list(rb->args, rb->argc);
+    arena_free(&rb->arena);
+    free(rb);
+}
+
+/* Collects the exit status of the commands that are done, kills those that
+ * ran past their timeout and starts new ones as slots free up. Once all the
+ * commands have exited, sends the reply and returns 1.
+ * The reply is made of the result flags, exit status, start time and run
+ * time of each command, both times being in microseconds, and a string
+ * explaining why the command could not be run, or undef.
+ */
+static int run_commands(struct connection_t* conn, struct runbatch_t* rb)
+{
+    time_t now = time(NULL);
+    uint32_t i;
+
+    rb->deadline = 0;
+    for (i = 0; i < rb->next && rb->running; i++)
+    {
+        struct command_t* cmd = &rb->cmds[i];
+        int r;
+
+        if (!cmd->pid)
+            continue;
+        r = platform_wait(cmd->pid, &cmd->status);
+        if (r == 2)
+        {
+            if (cmd->timeout == RUN_NOTIMEOUT || (cmd->result & RB_TIMEDOUT))
+                continue;
+            if (now >= cmd->deadline)
+            {
+                debug("  killing " U64FMT " (timeout)\n", cmd->pid);
+                cmd->result |= RB_TIMEDOUT;
+                platform_kill(cmd->pid);
+            }
+            else if (!rb->deadline || cmd->deadline < rb->deadline)
+                rb->deadline = cmd->deadline;
+            continue;
+        }
+        cmd->end = platform_gettime();
+        if (!r)
+            cmd->error = strdup(conn->status_msg);
+        platform_rmchildproc(conn->sock, cmd->pid);
+        cmd->pid = 0;
+        rb->running--;
+    }
+
+    while (rb->running < rb->slots && rb->next < rb->count)
+    {
+        struct command_t* cmd = &rb->cmds[rb->next++];
+
+        cmd->start = platform_gettime();
+        cmd->pid = platform_run(cmd->argv, cmd->flags, cmd->redirects);
+        if (!cmd->pid)
+        {
+            cmd->end = cmd->start;
+            cmd->result = RB_NOTRUN;
+            cmd->error = strdup(conn->status_msg);
+            continue;
+        }
+        debug("  started '%s' as " U64FMT "\n", cmd->argv[0], cmd->pid);
+        rb->running++;
+        if (cmd->timeout != RUN_NOTIMEOUT)
+        {
+            cmd->deadline = now + cmd->timeout;
+            if (!rb->deadline || cmd->deadline < rb->deadline)
+                rb->deadline = cmd->deadline;
+        }
+    }
+    if (rb->running)
+        return 0;
+
+    send_list_size(conn, 5 * rb->count);
+    for (i = 0; i < rb->count; i++)
+    {
+        struct command_t* cmd = &rb->cmds[i];
+        send_uint32(conn, cmd->result);
+        send_uint32(conn, cmd->status);
+        send_uint64(conn, cmd->start - rb->start);
+        send_uint64(conn, cmd->end - cmd->start);
+        if (cmd->error)
+            send_string(conn, cmd->error);
+        else
+            send_undef(conn);
+    }
+    return 1;
+}
+
+static void run_batch(struct connection_t* conn, struct batch_t* batch);
+
+/* Sends the reply of the waiter if the child process exited or produced
+ * output, or if the timeout expired, and resumes its batch if any.
+ * Returns 1 if the waiter is done, 0 otherwise.
+ */
+static int check_waiter(struct connection_t* conn, struct waiter_t* waiter, time_t now)
+{
+    uint32_t rpcid;
+    uint64_t rpc_out;
+    int rpc_error, expired, done;
+
+    /* Make sure the errors and the reply are counted against the wait RPC */
+    rpcid = conn->rpcid;
+    conn->rpcid = waiter->rpcid;
+    rpc_out = conn->rpc_out;
+    rpc_error = conn->rpc_error;
+    conn->rpc_out = conn->rpc_error = 0;
+
+    /* Put the reply, if any, in place of the placeholder */
+    conn->out_at = &waiter->reply->entry;
+    conn->batch = waiter->batch;
+    expired = waiter->timeout != RUN_NOTIMEOUT && now >= waiter->deadline;
+    if (waiter->rpcid == RPCID_GETOUTPUT)
+        done = send_output(conn, waiter->pid, expired);
+    else if (waiter->rpcid == RPCID_WAITMANY)
+        done = send_children_status(conn, waiter->pids, waiter->count, waiter->flags, expired);
+    else if (waiter->rpcid == RPCID_RUNBATCH)
+    {
+        done = run_commands(conn, waiter->runbatch);
+        /* Wake up for the next command timeout */
+        waiter->timeout = waiter->runbatch->deadline ? 0 : RUN_NOTIMEOUT;
+        waiter->deadline = waiter->runbatch->deadline;
+    }
+    else
+        done = send_child_status(conn, waiter->pid, waiter->flags, expired);
+    conn->batch = NULL;
+    conn->out_at = &conn->out;
+
+    if (done)
+    {
+        struct batch_t* batch = waiter->batch;
+
+        count_rpc(conn, waiter->rpcid, waiter->start, waiter->in,
+                  TRACE_DEFERRED | (batch ? TRACE_BATCHED : 0));
+        if (batch)
+            batch->out += conn->rpc_out;
+        free_out(conn, waiter->reply);
+        list_remove(&waiter->entry);
+        free(waiter->pids);
+        if (waiter->runbatch)
+            free_runbatch(conn, waiter->runbatch);
+        free(waiter);
+
+        if (batch)
+        {
+            batch->waiting = 0;
+            run_batch(conn, batch);
+        }
+    }
+    conn->rpcid = rpcid;
+    conn->rpc_out = rpc_out;
+    conn->rpc_error = rpc_error;
+    return done;
+}
+
+static void do_wait(struct connection_t* conn)
+{
+    uint64_t pid;
+
+    if (!expect_list_size(conn, 1) ||
+        !recv_uint64(conn, &pid))
+    {
+        send_error(conn);
+        return;
+    }
+
+    wait_child(conn, pid, RUN_NOTIMEOUT, 0);
+}
+
+static void do_wait2(struct connection_t* conn)
+{
+    uint64_t pid;
+    uint32_t timeout, flags = 0;
+
+    /* The flags are optional */
+    if ((conn->argc != 2 && !expect_list_size(conn, 3)) ||
+        !recv_uint64(conn, &pid) ||
+        !recv_uint32(conn, &timeout) ||
+        (conn->argc == 3 && !recv_uint32(conn, &flags)))
+    {
+        send_error(conn);
+        return;
+    }
+
+    /* In batches 0 stands for the last process started */
+    if (!pid && conn->batch)
+        pid = conn->batch->last_pid;
+    wait_child(conn, pid, timeout, flags);
+}
+
+static void do_waitmany(struct connection_t* conn)
+{
+    uint32_t flags, timeout, i, count;
+    uint64_t* pids;
+    struct waiter_t* waiter;
+
+    if (conn->argc < 3)
+    {
+        set_status(ST_ERROR, "Invalid number of parameters (%u instead of 3 or more)", conn->argc);
+        send_error(conn);
+        return;
+    }
+    if (!recv_uint32(conn, &flags) ||
+        !recv_uint32(conn, &timeout))
+    {
+        send_error(conn);
+        return;
+    }
+
+    count = conn->argc - 2;
+    pids = malloc(count * sizeof(*pids));
+    if (!pids)
+    {
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        send_error(conn);
+        return;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (!recv_uint64(conn, &pids[i]))
+        {
+            free(pids);
+            send_error(conn);
+            return;
+        }
+    }
+
+    if (send_children_status(conn, pids, count, flags, timeout == 0))
+    {
+        free(pids);
+        return;
+    }
+    waiter = defer_reply(conn, pids[0], timeout);
+    if (!waiter)
+    {
+        free(pids);
+        return;
+    }
+    /* The waiter takes over the pid set */
+    waiter->pids = pids;
+    waiter->count = count;
+    waiter->flags = flags;
+}
+
+/* The parameters of the runbatch RPC are the number of slots, 0 standing for
+ * the number of processors, followed by the commands. Each command is made of
+ * its parameter count and then, as for the run RPC, the run flags, the
+ * timeout, the three redirections and the command line.
+ */
+static void do_runbatch(struct connection_t* conn)
+{
+    struct runbatch_t* rb;
+    struct waiter_t* waiter;
+    uint32_t size = 0;
+
+    rb = calloc(1, sizeof(*rb));
+    if (!rb)
+    {
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        send_error(conn);
+        return;
+    }
+    if (!recv_uint32(conn, &rb->slots))
+        goto error;
+    if (!rb->slots)
+        rb->slots = platform_getcpucount();
+
+    while (conn->argi < conn->argc)
+    {
+        struct command_t* cmd;
+        uint32_t argc, i;
+
+        if (!recv_uint32(conn, &argc))
+            goto error;
+        if (argc < 6 || argc > conn->argc - conn->argi)
+        {
+            set_status(ST_ERROR, "invalid parameter count %u for command %u", argc, rb->count);
+            goto error;
+        }
+        if (rb->count == size)
+        {
+            struct command_t* cmds;
+            size = size ? size * 2 : 16;
+            cmds = realloc(rb->cmds, size * sizeof(*cmds));
+            if (!cmds)
+            {
+                set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+                goto error;
+            }
+            rb->cmds = cmds;
+        }
+        cmd = &rb->cmds[rb->count++];
+        memset(cmd, 0, sizeof(*cmd));
+
+        /* Allocate an extra entry for the trailing NULL pointer */
+        argc -= 5;
+        cmd->argv = arena_alloc(&conn->arena, (argc + 1) * sizeof(*cmd->argv));
+        if (!cmd->argv)
+            goto error;
+        if (!recv_uint32(conn, &cmd->flags) ||
+            !recv_uint32(conn, &cmd->timeout) ||
+            !recv_string(conn, &cmd->redirects[0]) ||
+            !recv_string(conn, &cmd->redirects[1]) ||
+            !recv_string(conn, &cmd->redirects[2]))
+            goto error;
+        for (i = 0; i < argc; i++)
+            if (!recv_string(conn, &cmd->argv[i]))
+                goto error;
+        cmd->argv[argc] = NULL;
+        if (cmd->flags & (RUN_DNT | RUN_STREAM))
+        {
+            set_status(ST_ERROR, "command %u cannot be detached or streamed", rb->count - 1);
+            goto error;
+        }
+    }
+    debug("  runbatch %u commands over %u slots\n", rb->count, rb->slots);
+
+    /* The commands outlive the RPC so it takes over the parameters */
+    rb->args = conn->args;
+    rb->argc = conn->argc;
+    arena_move(&rb->arena, &conn->arena);
+    conn->args = NULL;
+    conn->argc = conn->argn = 0;
+
+    rb->start = platform_gettime();
+    if (run_commands(conn, rb))
+    {
+        free_runbatch(conn, rb);
+        return;
+    }
+    waiter = defer_reply(conn, 0, rb->deadline ? 0 : RUN_NOTIMEOUT);
+    if (!waiter)
+    {
+        free_runbatch(conn, rb);
+        return;
+    }
+    waiter->runbatch = rb;
+    waiter->deadline = rb->deadline;
+    return;
+
+ error:
+    send_error(conn);
+    free_runbatch(conn, rb);
+}
+
+static void do_getoutput(struct connection_t* conn)
+{
+    uint64_t pid;
+    uint32_t timeout;
+
+    if (!expect_list_size(conn, 2) ||
+        !recv_uint64(conn, &pid) ||
+        !recv_uint32(conn, &timeout))
+    {
+        send_error(conn);
+        return;
+    }
+
+    if (!send_output(conn, pid, timeout == 0))
+        defer_reply(conn, pid, timeout);
+}
+
+static void do_rmchildproc(struct connection_t* conn)
+{
+    uint64_t pid;
+
+    if (!expect_list_size(conn, 1) ||
+        !recv_uint64(conn, &pid))
+    {
+        send_error(conn);
+        return;
+    }
+
+    if (platform_rmchildproc(conn->sock, pid))
+        send_list_size(conn, 0);
+    else
+        send_error(conn);
+}
+
+static void do_rm(struct connection_t* conn)
+{
+    int got_errors;
+    uint32_t argc, i;
+    char** filenames;
+
+    /* Get and check the parameter count */
+    recv_list_size(conn, &argc);
+
+    filenames = arena_alloc(&conn->arena, argc * sizeof(*filenames));
+    if (!filenames)
+    {
+        send_error(conn);
+        return;
+    }
+
+    /* Retrieve the parameters */
+    got_errors = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (!recv_string(conn, &filenames[i]))
+        {
+            got_errors = 1;
+            send_error(conn);
+            break;
+        }
+    }
+
+    if (!got_errors)
+    {
+        for (i = 0; i < argc; i++)
+        {
+            debug("rm '%s'\n", filenames[i]);
+            if (unlink(filenames[i]) < 0 && errno != ENOENT && errno != ENOTDIR)
+            {
+                int err = errno;
+                if (!got_errors)
+                {
+                    int f;
+                    got_errors = 1;
+                    /* In case of error report on the success / failure
+                     * for each file.
+                     */
+                    send_list_size(conn, argc);
+                    for (f = 0; f < i; f++)
+                        if (!send_undef(conn))
+                            break;
+                }
+                set_status(ST_ERROR, "Could not delete '%s': %s", filenames[i], strerror(err));
+                if (!send_status(conn))
+                    break;
+            }
+            else if (got_errors)
+            {
+                if (!send_undef(conn))
+                    break;
+            }
+        }
+    }
+
+    if (!got_errors)
+    {
+        /* If all the deletions succeeded, then return an empty list to mean
+         * nothing to report
+         */
+        send_list_size(conn, 0);
+    }
+}
+
+static void do_settime(struct connection_t* conn)
+{
+    uint64_t epoch;
+    uint32_t leeway;
+
+    if (!expect_list_size(conn, 2) ||
+        !recv_uint64(conn, &epoch) ||
+        !recv_uint32(conn, &leeway))
+    {
+        send_error(conn);
+        return;
+    }
+    if (platform_settime(epoch, leeway))
+        send_list_size(conn, 0);
+    else
+        send_error(conn);
+}
+
+static void do_getproperties(struct connection_t* conn)
+{
+    const char* arch;
+    char* buf = NULL;
+    int size = 0;
+
+    if (!expect_list_size(conn, 0))
+    {
+        send_error(conn);
+        return;
+    }
+    send_list_size(conn, 2);
+
+    format_msg(&buf, &size, "protocol.version=%s", PROTOCOL_VERSION);
+    send_string(conn, buf);
+
+#ifdef WIN32
+    arch = "win32";
+#else
+    if (sizeof(void*) == 4)
+        arch = "linux32";
+    else
+        arch = "linux64";
+#endif
+    format_msg(&buf, &size, "server.arch=%s", arch);
+    send_string(conn, buf);
+    free(buf);
+}
+
+static void count_stat(void* ctx, const char* str)
+{
+}
 
-/*
- * High-level operations.
- */
-
-static void do_ping(SOCKET client)
+static void send_stat(void* ctx, const char* str)
 {
-    if (expect_list_size(client, 0))
-        send_list_size(client, 0);
-    else
-        send_error(client);
+    send_string(ctx, str);
 }
 
-static void do_getfile(SOCKET client)
+static void do_getstats(struct connection_t* conn)
 {
-    char* filename;
-    int fd;
+    uint32_t flags = 0;
 
-    if (!expect_list_size(client, 1) ||
-        !recv_string(client, &filename))
+    /* The flags are optional */
+    if ((conn->argc != 0 && !expect_list_size(conn, 1)) ||
+        (conn->argc == 1 && !recv_uint32(conn, &flags)))
     {
-        send_error(client);
+        send_error(conn);
         return;
     }
 
-    fd = open(filename, O_RDONLY | O_BINARY);
-    if (fd < 0)
-    {
-        set_status(ST_ERROR, "unable to open '%s' for reading: %s", filename, strerror(errno));
-        send_error(client);
-    }
-    else
-    {
-        if (!send_list_size(client, 1) ||
-            !send_file(client, fd, filename))
-        {
-            /* If the file is not accessible then send_file() will fail and we
-             * can still salvage the connection by sending the error message
-             * in place of the file content. In all the other cases the
-             * connection is broken anyway which send_error() will deal with
-             * just fine.
-             */
-            send_error(client);
-        }
-        close(fd);
-    }
-    free(filename);
+    /* The list size goes first so count the statistics beforehand */
+    send_list_size(conn, format_stats(count_stat, NULL));
+    format_stats(send_stat, conn);
+    if (flags & GS_RESET)
+        reset_stats();
 }
 
-enum sendfile_flags_t {
-    SF_EXECUTABLE = 1,
-};
+static const char *upgrade_filename = "testagentd.tmp";
 
-static void do_sendfile(SOCKET client)
+static int upgrade_data_file(struct connection_t* conn)
 {
-    char *filename;
-    uint32_t flags;
-    mode_t mode;
-    int fd, success;
+    if (!expect_list_size(conn, 1))
+        return -1;
+    return open_data_file(conn, upgrade_filename, 0700);
+}
 
-    if (!expect_list_size(client, 3) ||
-        !recv_string(client, &filename) ||
-        !recv_uint32(client, &flags)
-        /* Next entry is the file data */
-        )
-    {
-        free(filename); /* filename is either NULL or malloc()-ed here */
-        send_error(client);
-        return;
-    }
+static void do_upgrade(struct connection_t* conn)
+{
+    static const char* upgrade_script = "./replace.bat";
+    int success;
 
-    unlink(filename); /* To force re-setting the mode */
-    mode = (flags & SF_EXECUTABLE) ? 0700 : 0600;
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode);
-    if (fd < 0)
-    {
-        skip_entries(client, 1);
-        set_status(ST_ERROR, "unable to open '%s' for writing: %s", filename, strerror(errno));
-        success = 0;
-    }
+    success = expect_list_size(conn, 1) &&
+              recv_file(conn, upgrade_filename);
+    if (!success)
+        unlink(upgrade_filename);
     else
+        success = platform_upgrade_script(upgrade_script, upgrade_filename, server_argv);
+
+    if (success)
     {
-        success = recv_file(client, fd, filename);
-        close(fd);
-    }
+        char* args[2];
+        char* redirects[3] = {"", "", ""};
 
-    if (!success)
-        unlink(filename);
-    free(filename);
+        send_list_size(conn, 0);
 
-    if (success)
-        send_list_size(client, 0);
+        args[0] = strdup(upgrade_script);
+        args[1] = NULL;
+        success = platform_run(args, RUN_DNT, redirects);
+        free(args[0]);
+        if (success)
+        {
+            conn->broken = 1;
+            quit = 1;
+        }
+    }
     else
-        send_error(client);
+        send_error(conn);
 }
 
-static void do_run(SOCKET client)
+static void do_getcwd(struct connection_t* conn)
 {
-    uint32_t argc, i;
-    char** argv;
-    uint32_t flags;
-    int failed;
-    char *redirects[3];
-    uint64_t pid;
+    char curdir[261];
 
-    /* Get and check argc */
-    if (!recv_list_size(client, &argc))
+    if (expect_list_size(conn, 0))
     {
-        send_error(client);
-        return;
+        send_list_size(conn, 1);
+        send_string(conn, getcwd(curdir, sizeof(curdir)));
     }
-    argv = NULL;
-    if (argc < 5)
-        set_status(ST_ERROR, "expected 5 or more parameters");
     else
+        send_error(conn);
+}
+
+static void free_batch(struct batch_t* batch)
+{
+    /* This also deletes the unused temporary files */
+    free_arg_list(batch->args, batch->argc);
+    arena_free(&batch->arena);
+    free(batch);
+}
+
+/* Replaces the head placeholder with the batch reply's list size */
+static void finish_batch(struct connection_t* conn, struct batch_t* batch)
+{
+    debug("  batch done (%s)\n", batch->failed ? "failed" : "ok");
+    conn->out_at = &batch->head->entry;
+    conn->rpc_out = batch->out;
+    send_list_size(conn, batch->entries);
+    conn->out_at = &conn->out;
+    conn->rpc_error = batch->failed;
+    count_rpc(conn, RPCID_BATCH, batch->start, batch->in, 0);
+    free_out(conn, batch->head);
+    free_out(conn, batch->tail);
+    free_batch(batch);
+}
+
+/* Runs the batch operations until one fails or has to wait for a child
+ * process. In the latter case check_waiter() resumes it later on, possibly
+ * while another RPC is being received, hence the save and restore of the
+ * parameter state.
+ */
+static void run_batch(struct connection_t* conn, struct batch_t* batch)
+{
+    struct arg_t* args = conn->args;
+    uint32_t argc = conn->argc, argn = conn->argn, argi = conn->argi;
+    uint32_t rpcid = conn->rpcid;
+    uint64_t rpc_start = conn->rpc_start, rpc_in = conn->rpc_in;
+    uint64_t rpc_out = conn->rpc_out;
+    int rpc_error = conn->rpc_error;
+
+    conn->batch = batch;
+    conn->out_at = &batch->tail->entry;
+    while (!batch->failed && !batch->waiting && !conn->broken &&
+           batch->argi < batch->argc)
     {
-        /* Allocate an extra entry for the trailing NULL pointer */
-        argv = malloc((argc - 4 + 1) * sizeof(*argv));
-        if (!argv)
-            set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        uint32_t subid, subargc, i;
+
+        /* Only let the recv_xxx() functions see the current operation */
+        conn->args = batch->args + batch->argi;
+        conn->argc = conn->argn = batch->argc - batch->argi;
+        conn->argi = 0;
+        if (!recv_uint32(conn, &subid) ||
+            !recv_uint32(conn, &subargc))
+        {
+            send_error(conn);
+            break;
+        }
+        if (subargc > conn->argc - 2)
+        {
+            set_status(ST_ERROR, "the batch is missing %u parameters", subargc - (conn->argc - 2));
+            send_error(conn);
+            break;
+        }
+        conn->args += 2;
+        conn->argc = conn->argn = subargc;
+        conn->argi = 0;
+        batch->argi += 2 + subargc;
+
+        conn->rpcid = subid;
+        conn->rpc_start = platform_gettime();
+        /* Count the operation's id and parameter count entries too */
+        conn->rpc_in = 2 * (1 + sizeof(uint64_t) + sizeof(uint32_t));
+        for (i = 0; i < subargc; i++)
+            conn->rpc_in += 1 + sizeof(uint64_t) + conn->args[i].size;
+        conn->rpc_out = conn->rpc_error = 0;
+        debug("-> batch %s\n", rpc_name(subid));
+        switch (subid)
+        {
+        case RPCID_GETFILE:
+            do_getfile(conn);
+            break;
+        case RPCID_SENDFILE:
+            do_sendfile(conn);
+            break;
+        case RPCID_RUN:
+            do_run(conn);
+            break;
+        case RPCID_WAIT2:
+            do_wait2(conn);
+            break;
+        case RPCID_RM:
+            do_rm(conn);
+            break;
+        default:
+            set_status(ST_ERROR, "the %s RPC cannot be batched", rpc_name(subid));
+            send_error(conn);
+        }
+        batch->out += conn->rpc_out;
+        if (!batch->waiting)
+            count_rpc(conn, subid, conn->rpc_start, conn->rpc_in, TRACE_BATCHED);
+        conn->rpcid = rpcid;
     }
-    if (!argv)
+    conn->rpc_start = rpc_start;
+    conn->rpc_in = rpc_in;
+    conn->args = args;
+    conn->argc = argc;
+    conn->argn = argn;
+    conn->argi = argi;
+    conn->batch = NULL;
+    conn->out_at = &conn->out;
+
+    if (!batch->waiting)
+        finish_batch(conn, batch);
+    conn->rpc_out = rpc_out;
+    conn->rpc_error = rpc_error;
+}
+
+static void do_batch(struct connection_t* conn)
+{
+    struct batch_t* batch;
+
+    batch = calloc(1, sizeof(*batch));
+    if (!batch)
     {
-        skip_entries(client, argc);
-        send_error(client);
+        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+        send_error(conn);
         return;
     }
-    argc -= 4;
-
-    /* Retrieve the parameters */
-    failed = 0;
-    memset(redirects, 0, sizeof(redirects));
-    memset(argv, 0, (argc + 1) * sizeof(*argv));
-    if (recv_uint32(client, &flags) &&
-        recv_string(client, &redirects[0]) &&
-        recv_string(client, &redirects[1]) &&
-        recv_string(client, &redirects[2]))
+    batch->head = alloc_out(conn, 0);
+    batch->tail = batch->head ? alloc_out(conn, 0) : NULL;
+    if (!batch->tail)
     {
-        for (i = 0; i < argc; i++)
-            if (!recv_string(client, &argv[i]))
-            {
-                failed = 1;
-                break;
-            }
+        /* The connection is broken anyway */
+        free(batch);
+        return;
     }
-    else
-        failed = 1;
+    batch->head->deferred = batch->tail->deferred = 1;
+    batch->start = conn->rpc_start;
+    batch->in = conn->rpc_in;
 
-    if (!failed)
-    {
-        debug("  run '%s", argv[0]);
-        for (i = 1; i < argc; i++)
-            debug("' '%s", argv[i]);
-        debug("'%s%s%s%s%s%s\n",
-              !redirects[0][0] ? "" : " <", redirects[0],
-              !redirects[1][0] ? "" : (flags & RUN_DNTRUNC_OUT) ? " >>" : " >", redirects[1],
-              !redirects[2][0] ? "" : (flags & RUN_DNTRUNC_ERR) ? " 2>>" : " 2>", redirects[2]);
+    /* The batch statistics are updated once it is done */
+    conn->rpc_deferred = 1;
 
-        pid = platform_run(argv, flags, redirects);
-        if (!pid)
-            failed = 1;
-    }
+    /* The batch may outlive the RPC so it takes over the parameters */
+    batch->args = conn->args;
+    batch->argc = conn->argc;
+    arena_move(&batch->arena, &conn->arena);
+    conn->args = NULL;
+    conn->argc = conn->argn = 0;
 
-    /* Free all the memory */
-    free(redirects[0]);
-    free(redirects[1]);
-    free(redirects[2]);
-    for (i = 0; i < argc; i++)
-        free(argv[i]);
-    free(argv);
+    run_batch(conn, batch);
+}
 
-    if (failed)
-        send_error(client);
-    else
+static void do_unknown(struct connection_t* conn, uint32_t id)
+{
+    set_status(ST_ERROR, "unknown RPC %s", rpc_name(id));
+    send_error(conn);
+}
+
+static void process_rpc(struct connection_t* conn)
+{
+    debug("-> %s\n", rpc_name(conn->rpcid));
+    switch (conn->rpcid)
     {
-        send_list_size(client, 1);
-        send_uint64(client, pid);
+    case RPCID_PING:
+        do_ping(conn);
+        break;
+    case RPCID_GETFILE:
+        do_getfile(conn);
+        break;
+    case RPCID_SENDFILE:
+        do_sendfile(conn);
+        break;
+    case RPCID_RUN:
+        do_run(conn);
+        break;
+    case RPCID_WAIT:
+        do_wait(conn);
+        break;
+    case RPCID_WAIT2:
+        do_wait2(conn);
+        break;
+    case RPCID_RM:
+        do_rm(conn);
+        break;
+    case RPCID_SETTIME:
+        do_settime(conn);
+        break;
+    case RPCID_GETPROPERTIES:
+        do_getproperties(conn);
+        break;
+    case RPCID_UPGRADE:
+        do_upgrade(conn);
+        break;
+    case RPCID_GETCWD:
+        do_getcwd(conn);
+        break;
+    case RPCID_RMCHILDPROC:
+        do_rmchildproc(conn);
+        break;
+    case RPCID_BATCH:
+        do_batch(conn);
+        break;
+    case RPCID_HAVE:
+        do_have(conn);
+        break;
+    case RPCID_MATCHBLOCKS:
+        do_matchblocks(conn);
+        break;
+    case RPCID_GETOUTPUT:
+        do_getoutput(conn);
+        break;
+    case RPCID_SENDTREE:
+        do_sendtree(conn);
+        break;
+    case RPCID_GETTREE:
+        do_gettree(conn);
+        break;
+    case RPCID_WAITMANY:
+        do_waitmany(conn);
+        break;
+    case RPCID_RUNBATCH:
+        do_runbatch(conn);
+        break;
+    case RPCID_GETSTATS:
+        do_getstats(conn);
+        break;
+    default:
+        do_unknown(conn, conn->rpcid);
     }
 }
 
-static void do_wait(SOCKET client)
+/* In batches only the sendfile operations take a 'd' entry. So find the
+ * operation it belongs to and, if appropriate, have it go to a temporary
+ * file so the target is left untouched should an earlier operation fail.
+ */
+static int batch_data_file(struct connection_t* conn)
 {
-    uint64_t pid;
-    uint32_t childstatus;
+    struct arg_t* args = conn->args;
+    uint32_t argc = conn->argc, argn = conn->argn;
+    uint32_t start, subid, subargc;
+    int fd = -1;
 
-    if (!expect_list_size(client, 1) ||
-        !recv_uint64(client, &pid))
+    start = 0;
+    while (1)
     {
-        send_error(client);
-        return;
+        conn->args = args + start;
+        conn->argc = argc - start;
+        conn->argn = argn - start;
+        conn->argi = 0;
+        if (!recv_uint32(conn, &subid) ||
+            !recv_uint32(conn, &subargc))
+            break;
+        if ((uint64_t)argn < (uint64_t)start + 2 + subargc)
+        {
+            conn->args += 2;
+            conn->argc = subargc;
+            conn->argn -= 2;
+            conn->argi = 0;
+            if (subid == RPCID_SENDFILE)
+                fd = sendfile_data_file(conn, &args[argn], 1);
+            else
+                set_status(ST_ERROR, "unexpected data for the batched %s RPC", rpc_name(subid));
+            break;
+        }
+        start += 2 + subargc;
     }
+    conn->args = args;
+    conn->argc = argc;
+    conn->argn = argn;
+    return fd;
+}
+
+/* Returns true if the 'd' entry that is about to be received should be
+ * stored in memory like the other entries, rather than in a file.
+ */
+static int is_data_in_memory(struct connection_t* conn)
+{
+    return conn->rpcid == RPCID_MATCHBLOCKS;
+}
+
+/* Returns a file descriptor to write the 'd' entry that is about to be
+ * received to, or -1 if it should be skipped or be extracted by data_tar.
+ */
+static int get_data_file(struct connection_t* conn)
+{
+    int fd;
 
-    if (platform_wait(client, pid, RUN_NOTIMEOUT, &childstatus))
+    conn->argi = 0;
+    conn->data_keep = conn->data_checksum = 0;
+    switch (conn->rpcid)
     {
-        send_list_size(client, 1);
-        send_uint32(client, childstatus);
+    case RPCID_SENDFILE:
+        fd = sendfile_data_file(conn, &conn->args[conn->argn], 0);
+        break;
+    case RPCID_UPGRADE:
+        fd = upgrade_data_file(conn);
+        break;
+    case RPCID_SENDTREE:
+        fd = sendtree_data_file(conn);
+        break;
+    case RPCID_BATCH:
+        fd = batch_data_file(conn);
+        break;
+    default:
+        fd = -1;
     }
-    else
-        send_error(client);
+    conn->argi = 0;
+    return fd;
 }
 
-static void do_wait2(SOCKET client)
+
+/*
+ * The RPC parser.
+ */
+
+/* The largest parameter to receive in memory */
+#define MAX_ARG_SIZE     1048576
+
+static void expect_input(struct connection_t* conn, enum in_state_t state, uint64_t size)
 {
-    uint64_t pid;
-    uint32_t timeout;
-    uint32_t childstatus;
+    conn->in_state = state;
+    conn->in_size = size;
+    conn->in_got = 0;
+}
+
+static void run_rpc(struct connection_t* conn)
+{
+    uint32_t rpcid = conn->rpcid;
+
+    conn->argi = 0;
+    conn->rpc_out = 0;
+    conn->rpc_deferred = conn->rpc_error = 0;
+    process_rpc(conn);
+    get_rpc_stats(rpcid)->bytes_in += conn->rpc_in;
+    if (!conn->rpc_deferred)
+        count_rpc(conn, rpcid, conn->rpc_start, conn->rpc_in, 0);
+    free_args(conn);
+    expect_input(conn, IN_RPCID, sizeof(uint32_t));
+}
 
-    if (!expect_list_size(client, 2) ||
-        !recv_uint64(client, &pid) ||
-        !recv_uint32(client, &timeout))
+static void end_zstream(struct connection_t* conn)
+{
+    if (conn->in_zinit)
     {
-        send_error(client);
-        return;
+        inflateEnd(&conn->in_zs);
+        conn->in_zinit = 0;
     }
+}
 
-    if (platform_wait(client, pid, timeout, &childstatus))
+/* Discards the rest of the 'd' or 'z' entry being received, the RPC will
+ * then delete the partial file.
+ */
+static void skip_data_file(struct connection_t* conn)
+{
+    if (conn->data_tar)
     {
-        send_list_size(client, 1);
-        send_uint32(client, childstatus);
+        untar_close(conn->data_tar, 0);
+        conn->data_tar = NULL;
     }
     else
-        send_error(client);
+        close(conn->data_fd);
+    conn->data_fd = -1;
+    conn->data_name = NULL;
+    conn->args[conn->argn].state = ARG_SKIPPED;
+    end_zstream(conn);
+    if (conn->in_state == IN_FILE)
+        conn->in_state = IN_SKIP;
 }
 
-static void do_rmchildproc(SOCKET client)
+/* Returns true if the 'd' or 'z' entry being received is being written
+ * to a file or extracted.
+ */
+static int is_data_streamed(struct connection_t* conn)
 {
-    uint64_t pid;
+    return conn->data_fd != -1 || conn->data_tar;
+}
 
-    if (!expect_list_size(client, 1) ||
-        !recv_uint64(client, &pid))
+static void end_entry(struct connection_t* conn)
+{
+    if (conn->data_tar)
     {
-        send_error(client);
-        return;
+        uint64_t size = conn->args[conn->argn].size;
+        trace_transfer(1, conn->in_zinit ? XFER_ZLIB : XFER_COPY, size,
+                       conn->in_zinit ? conn->in_zwire : size, conn->data_start);
+        /* Check that the archive is complete */
+        if (!untar_close(conn->data_tar, 1))
+            conn->args[conn->argn].state = ARG_SKIPPED;
+        conn->data_tar = NULL;
+        conn->data_name = NULL;
     }
-
-    if (platform_rmchildproc(client, pid))
-        send_list_size(client, 0);
+    else if (conn->data_fd != -1)
+    {
+        uint64_t size = conn->args[conn->argn].size;
+        if (conn->in_zinit)
+            trace_transfer(1, XFER_ZLIB, size, conn->in_zwire, conn->data_start);
+        else
+            trace_transfer(1, conn->nosplice || conn->data_checksum ? XFER_COPY :
+                           opt_uring ? XFER_URING : XFER_ZEROCOPY,
+                           size, size, conn->data_start);
+        conn->args[conn->argn].crc = conn->data_crc;
+        close(conn->data_fd);
+        conn->data_fd = -1;
+        conn->data_name = NULL;
+    }
+    end_zstream(conn);
+    conn->argn++;
+    if (conn->argn < conn->argc)
+        expect_input(conn, IN_HEADER, 9);
     else
-        send_error(client);
+        run_rpc(conn);
 }
 
-static void do_rm(SOCKET client)
+static void start_entry(struct connection_t* conn, char type, uint64_t size)
 {
-    int got_errors;
-    uint32_t argc, i;
-    char** filenames;
+    struct arg_t* arg = &conn->args[conn->argn];
 
-    /* Get and check the parameter count */
-    if (!recv_list_size(client, &argc))
+    conn->rpc_in += 1 + sizeof(size) + size;
+    arg->type = type;
+    arg->size = size;
+    arg->data = NULL;
+    if (type == 'z')
     {
-        send_error(client);
+        /* For the RPCs this is just another 'd' entry */
+        arg->type = 'd';
+        conn->data_fd = get_data_file(conn);
+        conn->data_start = platform_gettime();
+        arg->state = is_data_streamed(conn) ? ARG_STREAMED : ARG_SKIPPED;
+        conn->in_zend = 0;
+        conn->in_zsize = conn->in_zwire = 0;
+        if (is_data_streamed(conn))
+        {
+            memset(&conn->in_zs, 0, sizeof(conn->in_zs));
+            if (!conn->in_zbuf)
+                conn->in_zbuf = malloc(BLOCK_SIZE);
+            if (!conn->in_zbuf)
+            {
+                set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
+                skip_data_file(conn);
+            }
+            else if (inflateInit(&conn->in_zs) != Z_OK)
+            {
+                set_status(ST_ERROR, "could not initialize the decompression: %s", conn->in_zs.msg ? conn->in_zs.msg : "unknown error");
+                skip_data_file(conn);
+            }
+            else
+                conn->in_zinit = 1;
+        }
+        /* Even empty files have a terminating chunk */
+        expect_input(conn, IN_ZCHUNK, sizeof(uint32_t));
         return;
     }
-
-    filenames = malloc(argc * sizeof(*filenames));
-    if (!filenames)
+    if (type == 'd' && !is_data_in_memory(conn))
     {
-        set_status(ST_ERROR, "malloc() failed: %s", strerror(errno));
-        skip_entries(client, argc);
-        send_error(client);
-        return;
+        conn->data_fd = get_data_file(conn);
+        conn->data_start = platform_gettime();
+        arg->state = is_data_streamed(conn) ? ARG_STREAMED : ARG_SKIPPED;
+        expect_input(conn, is_data_streamed(conn) ? IN_FILE : IN_SKIP, size);
     }
-
-    /* Retrieve the parameters */
-    memset(filenames, 0, argc * sizeof(*filenames));
-    got_errors = 0;
-    for (i = 0; i < argc; i++)
+    else if (size > MAX_ARG_SIZE)
+    {
+        set_status(ST_ERROR, "parameter %u is too big (" U64FMT " bytes)", conn->argn, size);
+        arg->state = ARG_SKIPPED;
+        expect_input(conn, IN_SKIP, size);
+    }
+    else
     {
-        if (!recv_string(client, &filenames[i]))
+        /* Add a trailing '\0' to protect against malformed strings */
+        arg->data = arena_alloc(&conn->arena, size + 1);
+        if (!arg->data)
         {
-            got_errors = 1;
-            send_error(client);
-            break;
+            arg->state = ARG_SKIPPED;
+            expect_input(conn, IN_SKIP, size);
+        }
+        else
+        {
+            arg->data[size] = '\0';
+            arg->state = ARG_INMEMORY;
+            expect_input(conn, IN_DATA, size);
         }
     }
+    if (!size)
+        end_entry(conn);
+}
 
-    if (!got_errors)
+static void end_field(struct connection_t* conn)
+{
+    uint32_t u32;
+    uint64_t size;
+
+    switch (conn->in_state)
     {
-        for (i = 0; i < argc; i++)
-        {
-            debug("rm '%s'\n", filenames[i]);
-            if (unlink(filenames[i]) < 0 && errno != ENOENT && errno != ENOTDIR)
-            {
-                int err = errno;
-                if (!got_errors)
-                {
-                    int f;
-                    got_errors = 1;
-                    /* In case of error report on the success / failure
-                     * for each file.
-                     */
-                    send_list_size(client, argc);
-                    for (f = 0; f < i; f++)
-                        if (!send_undef(client))
-                            break;
-                }
-                set_status(ST_ERROR, "Could not delete '%s': %s", filenames[i], strerror(err));
-                if (!send_status(client))
-                    break;
-            }
-            else if (got_errors)
+    case IN_RPCID:
+        memcpy(&u32, conn->in_raw, sizeof(u32));
+        conn->rpcid = ntohl(u32);
+        conn->rpc_start = platform_gettime();
+        /* Count the RPC id and the parameter count */
+        conn->rpc_in = 2 * sizeof(uint32_t);
+        expect_input(conn, IN_LISTSIZE, sizeof(uint32_t));
+        break;
+
+    case IN_LISTSIZE:
+        memcpy(&u32, conn->in_raw, sizeof(u32));
+        conn->argc = ntohl(u32);
+        debug("  recv_list_size() -> %u\n", conn->argc);
+        if (conn->argc >= 1048576)
+        {
+            /* The client is in fact most likely not speaking the right protocol */
+            set_status(ST_FATAL, "the list size is too big (%d)", conn->argc);
+            break;
+        }
+        conn->args = arena_calloc(&conn->arena, (conn->argc ? conn->argc : 1) * sizeof(*conn->args));
+        if (!conn->args)
+        {
+            /* The parameters cannot be skipped without their array */
+            set_status(ST_FATAL, "could not allocate the %u parameters", conn->argc);
+            break;
+        }
+        if (conn->argc)
+            expect_input(conn, IN_HEADER, 9);
+        else
+            run_rpc(conn);
+        break;
+
+    case IN_HEADER:
+        memcpy(&u32, conn->in_raw + 1, sizeof(u32));
+        size = ntohl(u32);
+        memcpy(&u32, conn->in_raw + 5, sizeof(u32));
+        size = size << 32 | ntohl(u32);
+        start_entry(conn, conn->in_raw[0], size);
+        break;
+
+    case IN_ZCHUNK:
+        memcpy(&u32, conn->in_raw, sizeof(u32));
+        u32 = ntohl(u32);
+        conn->in_zwire += sizeof(u32) + u32;
+        if (u32)
+            expect_input(conn, IN_ZDATA, u32);
+        else
+        {
+            /* This is the terminating chunk */
+            if (is_data_streamed(conn) &&
+                (!conn->in_zend || conn->in_zsize != conn->args[conn->argn].size))
             {
-                if (!send_undef(client))
-                    break;
+                set_status(ST_ERROR, "the compressed data for '%s' is truncated", conn->data_name);
+                skip_data_file(conn);
             }
+            end_entry(conn);
         }
-    }
+        break;
 
-    /* Free all the memory */
-    for (i = 0; i < argc; i++)
-        free(filenames[i]);
-    free(filenames);
+    case IN_ZDATA:
+        expect_input(conn, IN_ZCHUNK, sizeof(uint32_t));
+        break;
 
-    if (!got_errors)
-    {
-        /* If all the deletions succeeded, then return an empty list to mean
-         * nothing to report
-         */
-        send_list_size(client, 0);
+    default:
+        /* Nothing to do */
+        break;
     }
 }
 
-static void do_settime(SOCKET client)
+static int has_buffered_input(struct connection_t* conn)
 {
-    uint64_t epoch;
-    uint32_t leeway;
-
-    if (!expect_list_size(client, 2) ||
-        !recv_uint64(client, &epoch) ||
-        !recv_uint32(client, &leeway))
-    {
-        send_error(client);
-        return;
-    }
-    if (platform_settime(epoch, leeway))
-        send_list_size(client, 0);
-    else
-        send_error(client);
+    return conn->in_pos < conn->in_len;
 }
 
-static void do_getproperties(SOCKET client)
+/* Writes the data to the file or extracts it. Returns 0 if that failed,
+ * setting err if the failure was a write error.
+ */
+static int write_data(struct connection_t* conn, const char* data, unsigned size, int* err)
 {
-    const char* arch;
-    char* buf = NULL;
-    int size = 0;
+    int w;
 
-    if (!expect_list_size(client, 0))
+    if (conn->data_tar)
     {
-        send_error(client);
-        return;
+        if (untar_write(conn->data_tar, data, size))
+            return 1;
+        /* untar_write() has already set the status */
+        skip_data_file(conn);
+        return 0;
     }
-    send_list_size(client, 2);
-
-    format_msg(&buf, &size, "protocol.version=%s", PROTOCOL_VERSION);
-    send_string(client, buf);
 
-#ifdef WIN32
-    arch = "win32";
-#else
-    if (sizeof(void*) == 4)
-        arch = "linux32";
-    else
-        arch = "linux64";
-#endif
-    format_msg(&buf, &size, "server.arch=%s", arch);
-    send_string(client, buf);
-    free(buf);
+    if (conn->data_checksum)
+        conn->data_crc = crc32(conn->data_crc, (const Bytef*)data, size);
+    errno = 0;
+    w = write(conn->data_fd, data, size);
+    if (w != size)
+    {
+        debug("  could only write %d bytes out of %u\n", w, size);
+        *err = errno ? errno : ENOSPC;
+        return 0;
+    }
+    return 1;
 }
 
-static void do_upgrade(SOCKET client)
+/* Decompresses the data to the file, setting err if writing failed */
+static void inflate_data(struct connection_t* conn, const char* data, unsigned size, int* err)
 {
-    static const char *filename = "testagentd.tmp";
-    static const char* upgrade_script = "./replace.bat";
-    int fd, success;
+    z_stream* zs = &conn->in_zs;
 
-    if (!expect_list_size(client, 1)
-        /* Next entry is the file data */
-        )
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = size;
+    do
     {
-        send_error(client);
-        return;
+        unsigned len;
+        int r;
+
+        zs->next_out = (Bytef*)conn->in_zbuf;
+        zs->avail_out = BLOCK_SIZE;
+        r = inflate(zs, Z_NO_FLUSH);
+        len = BLOCK_SIZE - zs->avail_out;
+        if ((r == Z_STREAM_END && zs->avail_in) ||
+            (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) ||
+            conn->in_zsize + len > conn->args[conn->argn].size)
+        {
+            set_status(ST_ERROR, "the compressed data for '%s' is corrupt", conn->data_name);
+            skip_data_file(conn);
+            return;
+        }
+        conn->in_zsize += len;
+
+        if (!write_data(conn, conn->in_zbuf, len, err))
+            return;
+        if (r == Z_STREAM_END)
+        {
+            conn->in_zend = 1;
+            return;
+        }
     }
+    while (zs->avail_in || !zs->avail_out);
+}
 
-    unlink(filename); /* To force re-setting the mode */
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0700);
-    if (fd < 0)
+/* Moves up to left bytes of the current field out of the input buffer.
+ * Returns the number of bytes consumed.
+ */
+static unsigned parse_buffered_input(struct connection_t* conn, uint64_t left, int* err)
+{
+    const char* src = conn->in_buf + conn->in_pos;
+    unsigned count = conn->in_len - conn->in_pos;
+
+    if (count > left)
+        count = left;
+    switch (conn->in_state)
     {
-        skip_entries(client, 1);
-        set_status(ST_ERROR, "unable to open '%s' for writing: %s", filename, strerror(errno));
-        success = 0;
+    case IN_RPCID:
+    case IN_LISTSIZE:
+    case IN_HEADER:
+    case IN_ZCHUNK:
+        memcpy(conn->in_raw + conn->in_got, src, count);
+        break;
+    case IN_DATA:
+        memcpy(conn->args[conn->argn].data + conn->in_got, src, count);
+        break;
+    case IN_FILE:
+        write_data(conn, src, count, err);
+        break;
+    case IN_ZDATA:
+        if (is_data_streamed(conn))
+            inflate_data(conn, src, count, err);
+        break;
+    case IN_SKIP:
+        break;
     }
-    else
+    conn->in_pos += count;
+    return count;
+}
+
+/* Receives as much data as is available without blocking and runs the RPCs
+ * as soon as all their parameters have been received.
+ */
+static void handle_input(struct connection_t* conn)
+{
+    while (wants_input(conn))
     {
-        success = recv_file(client, fd, filename);
-        close(fd);
-    }
+        uint64_t left = conn->in_size - conn->in_got;
+        int r, err = 0;
 
-    if (!success)
-        unlink(filename);
-    else
-        success = platform_upgrade_script(upgrade_script, filename, server_argv);
+        if (has_buffered_input(conn))
+            r = parse_buffered_input(conn, left, &err);
+        else
+        {
+            int buffered = 0;
 
-    if (success)
-    {
-        char* args[2];
-        char* redirects[3] = {"", "", ""};
+            if (conn->in_state == IN_DATA && left >= sizeof(conn->in_buf))
+            {
+                /* No need to go through the input buffer */
+                r = recv(conn->sock, conn->args[conn->argn].data + conn->in_got, left, 0);
+            }
+            else if (conn->in_state == IN_FILE && !conn->nosplice &&
+                     !conn->data_tar && !conn->data_checksum)
+            {
+                r = platform_recvfile(conn->sock, conn->data_fd, left, &err);
+                if (r == -2)
+                {
+                    debug("  splice is not supported for '%s'\n", conn->data_name);
+                    conn->nosplice = 1;
+                    continue;
+                }
+            }
+            else
+            {
+                r = recv(conn->sock, conn->in_buf, sizeof(conn->in_buf), 0);
+                buffered = 1;
+            }
+
+            if (r == 0)
+            {
+                if (conn->in_state == IN_RPCID && conn->in_got == 0)
+                {
+                    /* The client disconnected normally */
+                    debug("The client disconnected\n");
+                    conn->broken = 1;
+                }
+                else
+                {
+                    debug("  got disconnected with " U64FMT " bytes still to be read!\n", left);
+                    set_status(ST_FATAL, "got disconnected prematurely");
+                }
+                return;
+            }
+            if (r < 0)
+            {
+                if (sockewouldblock())
+                    return;
+                if (sockeintr())
+                    continue;
+                set_status(ST_FATAL, "an error occurred while reading: %s", sockerror());
+                return;
+            }
+            if (buffered)
+            {
+                conn->in_pos = 0;
+                conn->in_len = r;
+                continue;
+            }
+        }
+        conn->in_got += r;
 
-        send_list_size(client, 0);
+        if (err)
+        {
+            set_status(ST_ERROR, "an error occurred while writing to '%s': %s", conn->data_name, strerror(err));
+            skip_data_file(conn);
+        }
 
-        args[0] = strdup(upgrade_script);
-        args[1] = NULL;
-        success = platform_run(args, RUN_DNT, redirects);
-        free(args[0]);
-        if (success)
+        if (conn->in_got == conn->in_size)
         {
-            broken = 1;
-            quit = 1;
+            if (conn->in_state == IN_DATA || conn->in_state == IN_FILE ||
+                conn->in_state == IN_SKIP)
+                end_entry(conn);
+            else
+                end_field(conn);
         }
     }
-    else
-        send_error(client);
 }
 
-static void do_getcwd(SOCKET client)
-{
-    char curdir[261];
 
-    if (expect_list_size(client, 0))
+/*
+ * Connection handling.
+ */
+
+static struct connection_t* create_connection(SOCKET sock)
+{
+    struct connection_t* conn;
+
+    conn = calloc(1, sizeof(*conn));
+    if (!conn)
+        return NULL;
+    conn->sock = sock;
+    conn->id = ++connection_count;
+    conn->rpcid = NO_RPCID;
+    conn->status = ST_OK;
+    conn->data_fd = -1;
+    conn->nosplice = !opt_zerocopy;
+    list_init(&conn->out);
+    conn->out_at = &conn->out;
+    list_init(&conn->waiters);
+    expect_input(conn, IN_RPCID, sizeof(uint32_t));
+
+    conn->events = POLLEV_IN | POLLEV_OUT;
+    if (!platform_poll_add(sock, conn->events, conn))
     {
-        send_list_size(client, 1);
-        send_string(client, getcwd(curdir, sizeof(curdir)));
+        free(conn);
+        return NULL;
     }
-    else
-        send_error(client);
+    list_add_tail(&connections, &conn->entry);
+    return conn;
 }
 
-static void do_unknown(SOCKET client, uint32_t id)
+static void close_connection(struct connection_t* conn)
 {
-    uint32_t argc;
-
-    if (recv_list_size(client, &argc) &&
-        skip_entries(client, argc))
+    debug("closing client socket\n");
+    platform_poll_del(conn->sock);
+    closesocket(conn->sock);
+    if (conn->data_tar)
+        untar_close(conn->data_tar, 0);
+    else if (conn->data_fd != -1)
+    {
+        /* Don't leave a partial file behind, unless the transfer can be
+         * resumed.
+         */
+        close(conn->data_fd);
+        if (!conn->data_keep)
+            unlink(conn->data_name);
+    }
+    end_zstream(conn);
+    free(conn->in_zbuf);
+    free_args(conn);
+    arena_free(&conn->arena);
+    while (!list_empty(&conn->waiters))
     {
-        set_status(ST_ERROR, "unknown RPC %s", rpc_name(id));
-        send_error(client);
+        struct waiter_t* waiter = LIST_ENTRY(list_head(&conn->waiters), struct waiter_t, entry);
+        list_remove(&waiter->entry);
+        if (waiter->batch)
+            free_batch(waiter->batch);
+        if (waiter->runbatch)
+            free_runbatch(conn, waiter->runbatch);
+        free(waiter->pids);
+        free(waiter);
     }
+    while (!list_empty(&conn->out))
+        free_out(conn, LIST_ENTRY(list_head(&conn->out), struct out_t, entry));
+    free(conn->status_msg);
+    list_remove(&conn->entry);
+    free(conn);
 }
 
-static void process_rpc(SOCKET client)
+/* Sends what can be sent, then either closes the connection or updates the
+ * events it needs to be notified of.
+ */
+static void update_connection(struct connection_t* conn)
 {
-    int r;
+    int wanted;
 
-    debug("Waiting for an RPC\n");
-    r = recv(client, (void*)&rpcid, 1, MSG_PEEK);
-    if (r == 0)
+    flush_output(conn);
+
+    /* The socket will not signal the RPCs that have already been received */
+    while (has_buffered_input(conn) && wants_input(conn))
     {
-        /* The client disconnected normally */
-        broken = 1;
-        return;
+        handle_input(conn);
+        flush_output(conn);
     }
-    else if (r < 0)
+
+    /* Pending waits are pointless if the client is gone */
+    if (conn->broken &&
+        (!has_ready_output(conn) || conn->status == ST_FATAL))
     {
-        /* Some error occurred */
-        debug("No RPC: %s\n", sockerror());
-        broken = 1;
+        close_connection(conn);
         return;
     }
-    if (!recv_raw_uint32(client, &rpcid))
+
+    wanted = 0;
+    if (has_ready_output(conn))
+        wanted |= POLLEV_OUT;
+    if (wants_input(conn))
+        wanted |= POLLEV_IN;
+    if (wanted != conn->events && platform_poll_mod(conn->sock, wanted, conn))
+        conn->events = wanted;
+}
+
+static void service_connection(struct connection_t* conn, int events)
+{
+    current = conn;
+    if (events & (POLLEV_IN | POLLEV_ERR))
+        handle_input(conn);
+    update_connection(conn);
+    current = NULL;
+}
+
+/* Completes the wait RPCs that can be and returns how long platform_poll()
+ * can wait before the next timeout, in milliseconds.
+ */
+static int check_waiters(void)
+{
+    struct connection_t *conn, *next_conn;
+    time_t now = time(NULL);
+    int timeout = -1;
+
+    LIST_FOR_EACH_ENTRY_SAFE(conn, next_conn, &connections, struct connection_t, entry)
     {
-        set_status(ST_FATAL, "no RPC id");
-        return;
+        struct waiter_t *waiter, *next;
+        int completed = 0;
+
+        current = conn;
+        LIST_FOR_EACH_ENTRY_SAFE(waiter, next, &conn->waiters, struct waiter_t, entry)
+        {
+            if (check_waiter(conn, waiter, now))
+                completed = 1;
+        }
+        if (completed)
+            update_connection(conn);
+        current = NULL;
     }
 
-    debug("-> %s\n", rpc_name(rpcid));
-    switch (rpcid)
+    /* The resumed batches may have started new waits so only look at the
+     * deadlines now.
+     */
+    LIST_FOR_EACH_ENTRY(conn, &connections, struct connection_t, entry)
     {
-    case RPCID_PING:
-        do_ping(client);
-        break;
-    case RPCID_GETFILE:
-        do_getfile(client);
-        break;
-    case RPCID_SENDFILE:
-        do_sendfile(client);
-        break;
-    case RPCID_RUN:
-        do_run(client);
-        break;
-    case RPCID_WAIT:
-        do_wait(client);
-        break;
-    case RPCID_WAIT2:
-        do_wait2(client);
-        break;
-    case RPCID_RM:
-        do_rm(client);
-        break;
-    case RPCID_SETTIME:
-        do_settime(client);
-        break;
-    case RPCID_GETPROPERTIES:
-        do_getproperties(client);
-        break;
-    case RPCID_UPGRADE:
-        do_upgrade(client);
-    case RPCID_GETCWD:
-        do_getcwd(client);
-        break;
-    case RPCID_RMCHILDPROC:
-        do_rmchildproc(client);
-        break;
-    default:
-        do_unknown(client, rpcid);
+        struct waiter_t* waiter;
+        LIST_FOR_EACH_ENTRY(waiter, &conn->waiters, struct waiter_t, entry)
+        {
+            if (waiter->timeout != RUN_NOTIMEOUT)
+            {
+                int ms = (waiter->deadline - now) * 1000;
+                if (timeout < 0 || ms < timeout)
+                    timeout = ms;
+            }
+        }
     }
+    return timeout;
 }
 
 void* sockaddr_getaddr(const struct sockaddr* sa, socklen_t* len)
@@ -1214,6 +4592,50 @@ static int is_host_allowed(SOCKET client, const char* srchost, int addrlen)
     return 0;
 }
 
+static void accept_connections(SOCKET master, const char* srchost, int addrlen)
+{
+    int on = 1;
+
+    while (1)
+    {
+        struct connection_t* conn;
+        SOCKET client;
+
+        client = accept(master, NULL, NULL);
+        if (client == INVALID_SOCKET)
+        {
+            if (sockewouldblock() || sockeintr())
+                return;
+            error("accept() failed: %s\n", sockerror());
+            exit(1);
+        }
+#ifdef FD_CLOEXEC
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+#endif
+#ifdef HANDLE_FLAG_INHERIT
+        SetHandleInformation((HANDLE)client, HANDLE_FLAG_INHERIT, 0);
+#endif
+        /* The replies are sent in one go so don't delay them */
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on));
+        if (!is_host_allowed(client, srchost, addrlen) ||
+            !platform_setnonblocking(client) ||
+            !(conn = create_connection(client)))
+        {
+            debug("closing client socket\n");
+            closesocket(client);
+            continue;
+        }
+
+        /* Reset the status so new non-fatal errors can be set */
+        current = conn;
+        set_status(ST_OK, "ok");
+
+        /* Send the version right away */
+        send_string(conn, PROTOCOL_VERSION);
+        service_connection(conn, 0);
+    }
+}
+
 int main(int argc, char** argv)
 {
     const char* p;
@@ -1246,6 +4668,40 @@ int main(int argc, char** argv)
         {
             opt_usage = 1;
         }
+        else if (strcmp(*arg, "--no-zerocopy") == 0)
+        {
+            opt_zerocopy = 0;
+        }
+        else if (strcmp(*arg, "--io-uring") == 0)
+        {
+            opt_uring = 1;
+        }
+        else if (strcmp(*arg, "--cache") == 0)
+        {
+            arg++;
+            if (!*arg)
+            {
+                error("missing value for --cache\n");
+                opt_usage = 2;
+                break;
+            }
+            opt_cache = *arg;
+        }
+        else if (strcmp(*arg, "--no-cache") == 0)
+        {
+            opt_cache = NULL;
+        }
+        else if (strcmp(*arg, "--trace") == 0)
+        {
+            arg++;
+            if (!*arg)
+            {
+                error("missing value for --trace\n");
+                opt_usage = 2;
+                break;
+            }
+            opt_trace = *arg;
+        }
         else if (**arg == '-')
         {
             error("unknown option '%s'\n", *arg);
@@ -1282,27 +4738,35 @@ int main(int argc, char** argv)
                 exit(1);
             /* else opt_usage will force us to exit early anyway */
         }
-        else if (opt_srchost)
+        else
         {
-            /* Verify that the specified source host is valid */
-            rc = ta_getaddrinfo(opt_srchost, NULL, &addresses);
-            if (rc)
+            if (opt_uring && (!opt_zerocopy || !platform_init_uring()))
             {
-                error("unable to resolve '%s': %s\n", opt_srchost, gai_strerror(rc));
-                opt_usage = 2;
+                error("not using io_uring\n");
+                opt_uring = 0;
             }
-            else
+            if (opt_srchost)
             {
-                if (opt_debug)
+                /* Verify that the specified source host is valid */
+                rc = ta_getaddrinfo(opt_srchost, NULL, &addresses);
+                if (rc)
+                {
+                    error("unable to resolve '%s': %s\n", opt_srchost, gai_strerror(rc));
+                    opt_usage = 2;
+                }
+                else
                 {
-                    addrp = addresses;
-                    do
+                    if (opt_debug)
                     {
-                        debug("Accepting connections from %s\n", sockaddr_to_string(addrp->ai_addr, addrp->ai_addrlen));
+                        addrp = addresses;
+                        do
+                        {
+                            debug("Accepting connections from %s\n", sockaddr_to_string(addrp->ai_addr, addrp->ai_addrlen));
+                        }
+                        while ((addrp = addrp->ai_next) != NULL);
                     }
-                    while ((addrp = addrp->ai_next) != NULL);
+                    ta_freeaddrinfo(addresses);
                 }
-                ta_freeaddrinfo(addresses);
             }
         }
     }
@@ -1313,7 +4777,7 @@ int main(int argc, char** argv)
     }
     if (opt_usage)
     {
-        printf("Usage: %s [--debug] [--help] PORT [SRCHOST]\n", name0);
+        printf("Usage: %s [--debug] [--help] [--no-zerocopy|--io-uring] [--cache DIR|--no-cache] [--trace FILE] PORT [SRCHOST]\n", name0);
         printf("\n");
         printf("Provides a simple way to send/receive files and to run scripts on this host.\n");
         printf("\n");
@@ -1322,6 +4786,19 @@ int main(int argc, char** argv)
         printf("  SRCHOST  If specified, only connections from this host will be accepted.\n");
         printf("  --debug  Prints detailed information about what happens.\n");
         printf("  --help   Shows this usage message.\n");
+        printf("  --no-zerocopy Always copy the file data through a userspace buffer\n");
+        printf("           instead of using sendfile() and splice(). This is mostly\n");
+        printf("           useful to compare their performance.\n");
+        printf("  --io-uring Transfers the file data with io_uring instead of sendfile()\n");
+        printf("           and splice(), if the system supports it.\n");
+        printf("  --cache DIR Keeps a copy of the files sent with the cache flag in the DIR\n");
+        printf("           directory so they do not have to be sent again. The default is\n");
+        printf("           'testagentd.cache' in the current directory.\n");
+        printf("  --no-cache Disables the file cache.\n");
+        printf("  --trace FILE Records the timing and size of every RPC in the FILE binary\n");
+        printf("           trace so the traffic can be analyzed or replayed later.\n");
+        printf("\n");
+        printf("On Unix, SIGUSR1 prints the RPC statistics on stderr.\n");
         exit(0);
     }
 
@@ -1365,47 +4842,64 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    if (listen(master, 1) < 0)
+    if (listen(master, SOMAXCONN) < 0 ||
+        !platform_setnonblocking(master) ||
+        !platform_poll_add(master, POLLEV_IN, NULL))
     {
         error("listen() failed: %s\n", sockerror());
         exit(1);
     }
+    if (opt_trace && !open_trace())
+        exit(1);
     printf("Starting %s\n", PROTOCOL_VERSION);
-    while (!quit)
+    reset_stats();
+    while (!quit || !list_empty(&connections))
     {
-        SOCKET client;
-        debug("Waiting in accept()\n");
-        client = accept(master, NULL, NULL);
-#ifdef O_CLOEXEC
-        fcntl(client, F_SETFL, fcntl(client, F_GETFL, 0) | O_CLOEXEC);
-#endif
-#ifdef HANDLE_FLAG_INHERIT
-        SetHandleInformation((HANDLE)client, HANDLE_FLAG_INHERIT, 0);
-#endif
-        if (client >= 0)
+        struct poll_event_t events[64];
+        int count, i;
+
+        debug("Waiting for an event\n");
+        count = platform_poll(events, sizeof(events) / sizeof(*events), check_waiters());
+        if (count < 0)
+            exit(1);
+        if (platform_dump_requested())
+            format_stats(print_stat, NULL);
+        for (i = 0; i < count; i++)
         {
-            if (is_host_allowed(client, opt_srchost, addrlen))
-            {
-                /* Reset the status so new non-fatal errors can be set */
-                set_status(ST_OK, "ok");
+            if (events[i].data)
+                service_connection(events[i].data, events[i].events);
+            else if (!quit)
+                accept_connections(master, opt_srchost, addrlen);
+        }
+        if (trace_len)
+            flush_trace();
 
-                /* Send the version right away */
-                send_string(client, PROTOCOL_VERSION);
+        if (quit)
+        {
+            struct connection_t *conn, *next;
 
-                while (!broken)
-                    process_rpc(client);
+            if (master != INVALID_SOCKET)
+            {
+                platform_poll_del(master);
+                closesocket(master);
+                master = INVALID_SOCKET;
+            }
+            /* Only wait for the pending replies to be sent */
+            LIST_FOR_EACH_ENTRY_SAFE(conn, next, &connections, struct connection_t, entry)
+            {
+                if (!has_ready_output(conn))
+                    close_connection(conn);
             }
-            debug("closing client socket\n");
-            closesocket(client);
-        }
-        else if (!sockeintr())
-        {
-            error("accept() failed: %s\n", sockerror());
-            exit(1);
         }
     }
     debug("stopping\n");
-    closesocket(master);
+    if (master != INVALID_SOCKET)
+        closesocket(master);
+    if (trace_fd != -1)
+    {
+        flush_trace();
+        close(trace_fd);
+    }
 
     return 0;
 }